@@ -32,6 +32,7 @@
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>   /* UDP_SEGMENT, see -G */
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -44,12 +45,16 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <sys/ioctl.h>
 #include <syslog.h>
 #include <net/if.h> 
 #include <math.h> 
 #include <curl/curl.h>
 #include <sys/utsname.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 
 #ifdef HAVE_LINUX_SOCKIOS_H
 #include <linux/sockios.h> /* Dont remove: SIOCGIFADDR will be undefined below */
@@ -57,11 +62,34 @@
 #include <sys/sockio.h> /* Dont remove: SIOCGIFADDR will be undefined below */
 #endif
 
+#if defined(HAVE_LINUX_NET_TSTAMP_H) && defined(HAVE_LINUX_ERRQUEUE_H)
+#include <linux/net_tstamp.h> /* SOF_TIMESTAMPING_*, see -T */
+#include <linux/errqueue.h>   /* sock_extended_err, scm_timestamping */
+#define HAVE_TXSTAMP 1
+#endif
+
 #include <cligen/cligen.h>     /* cbuf */
 #include <clixon/clixon.h>     /* xml, xpath, log, err */
 
 #include "grideye_agent.h"     /* lib */
+#include "grideye_reactor.h"   /* lib: event loop */
+#include "grideye_arena.h"     /* lib: per-packet memory */
+#include "grideye_uring.h"     /* lib: io_uring, see -U */
+#include "grideye_json.h"      /* lib: data packet json */
+#include "grideye_cbor.h"      /* lib: data packet cbor */
+#include "grideye_compress.h"  /* lib: result compression, see -Z */
 #include "grideye_plugin_v2.h" /* plugin C API */
+#include "grideye_plugin_v3.h" /* plugin C API with writer */
+#ifdef GRIDEYE_STATIC
+#include "grideye_static.h"    /* plugins linked into the agent, see make static */
+#endif
+#include "grideye_agent_int.h" /* shared by modules of the agent */
+#include "grideye_worker.h"    /* plugin worker and fan-out threads */
+#include "grideye_async.h"     /* non-blocking plugin tests */
+#include "grideye_cache.h"     /* results of plugins with gp_cache_ms */
+#include "grideye_sample.h"    /* background sampler */
+#include "grideye_isolate.h"   /* plugin worker processes, see -O */
+#include "grideye_reload.h"    /* plugin reload, see plugin_watch */
 
 /*
  * Global variables generated by Makefile
@@ -83,12 +111,46 @@ extern const char GRIDEYE_VERSION[];
 /* Set this to a file (prefix) and this will dump incoming binary messages */
 //#define DUMPMSGFILE "grideyedump"
 
-#define GRIDEYE_AGENT_OPTS "hDFvtqe:f:i:a:l:W:u:I:N:p:rLdw:P:zk:"
+#define GRIDEYE_AGENT_OPTS "hDFvt:qe:f:i:a:l:W:u:I:N:p:rLdw:P:zk:b:Tn:j:E:UC:R:B:GZ:J:X:O"
 
 #define DISKIO_DIR        "/var/tmp"  /* in current dir */
 #define DISKIO_LARGEFILE  "GRIDEYE_LARGEFILE" /* To use for random read ops */ 
 #define DISKIO_WRITEFILE  "GRIDEYE_WRITEFILE" /* To use for trunc writing */
-#define BUFSIZE           8*1024
+
+/* Datagram length of fragments of results larger than BUFSIZE, so that
+ * they fit in an ethernet frame, see result_send_frags */
+#define FRAG_DGRAMLEN     1472
+#define FRAG_DATALEN      (FRAG_DGRAMLEN-TWOWAY_HDRLEN-FRAG_HDRLEN)
+
+/* Max fragments per send with -G, the kernel takes 64 segments and 64KB */
+#define FRAG_GSO_MAX      44
+
+/* Max number of packets received/sent per syscall with -b, see echo_batch */
+#define ECHO_BATCH_MAX    64
+
+/* Control message buffer per received packet: ttl and rx timestamp(s) */
+#define ECHO_CMSGLEN      256
+
+/* Default min length of results to compress, see -Z */
+#define COMPRESS_MIN      512
+
+/* Receives in flight per reflector with -U, unless set with -b */
+#define URING_SLOTS       32
+
+/* Sent replies remembered while waiting for their tx timestamp, see -T */
+#define TXPENDING_LEN     256
+
+/* Spins of a -C reflector between reads of tx timestamps, see -T */
+#define TXSTAMP_SPINS     64
+
+/* Buckets in sender hash table, power of two */
+#define SENDER_HASHLEN    4096
+
+/* Expire senders not seen for this many seconds, see -E */
+#define SENDER_IDLE_DEFAULT 300
+
+/* Max number of reflector threads, see -n */
+#define REFLECTOR_MAX     256
 
 #define GRIDEYE_AGENT_PIDFILE "/var/run/grideye_agent.pidfile"
 
@@ -115,13 +177,82 @@ extern const char GRIDEYE_VERSION[];
  * Local types 
  */
 struct sender {
-    struct sender  *s_next;    /* linked list */
+    struct sender  *s_next;    /* hash bucket list */
     void           *s_sname;   /* socket name, eg sockaddr */
     socklen_t       s_snamelen;
+    uint32_t        s_hash;    /* hash of s_sname, see s_hashfn */
     char           *s_name;    /* name given by sender */
     uint32_t        s_seq;
+    time_t          s_lastseen;/* Registered or last data packet, see -E */
     cxobj          *s_xml;     /* XML control tree with config info received in
 			        * most recdetn callhome reply */
+    struct timeval  s_t3;      /* Kernel tx time of reply s_t3seq, see -T */
+    uint32_t        s_t3seq;   /* Reply sequence number (seq1) of s_t3 */
+    int             s_t3ok;    /* s_t3 is set */
+    int             s_enc;     /* Result encoding ENC_*, see callhome_http */
+};
+
+/* A sent reply waiting for its kernel transmit timestamp, see txstamp_recv 
+ * Indexed by SOF_TIMESTAMPING_OPT_ID key modulo TXPENDING_LEN
+ */
+struct txpending{
+    uint32_t           tp_key;   /* OPT_ID key of the send */
+    uint32_t           tp_seq1;  /* Reply sequence number */
+    struct sockaddr_in tp_addr;  /* Destination, ie sender */
+};
+
+/* A receive buffer of a reflector io_uring, see -U. Either a receive or
+ * the sends of its reply are in flight, see reflector_uring.
+ */
+struct uslot{
+    struct msghdr      us_msg;      /* Receive */
+    struct iovec       us_iov;
+    struct sockaddr_in us_from;
+    char               us_cmsg[ECHO_CMSGLEN];
+    struct msghdr      us_smsg;     /* Send */
+    struct iovec       us_siov[TWOWAY_IOVLEN];
+    int                us_sending;  /* Sends in flight */
+};
+
+/* A reflector is a socket and the thread serving it. 
+ * Reflector 0 is served by the main loop, the others (-n) by their own 
+ * threads, each with its own SO_REUSEPORT socket bound to the same port.
+ * Since the kernel hashes a sender to one of the sockets, all packets from
+ * one sender are handled by the same reflector.
+ */
+struct reflector{
+    int               r_id;       /* Index in reflectors vector */
+    int               r_s;        /* Socket */
+    int               r_cpu;      /* CPU thread is pinned to, or -1 */
+    pthread_t         r_thread;   /* Not used by reflector 0 */
+    int               r_started;  /* r_thread was created */
+    char             *r_bufs;     /* batch buffers of BUFSIZE each */
+    int               r_pkts;     /* packets received counter */
+    struct timeval    r_firstpkt;
+    struct timeval    r_lastpkt;
+    pthread_mutex_t   r_txlock;   /* Serializes sends with plugin workers */
+    uint32_t          r_txkey;    /* OPT_ID key of next datagram sent */
+    struct txpending  r_txpending[TXPENDING_LEN];
+    struct arena     *r_arena;    /* Reply payloads, reset when sent */
+    struct plan      *r_plans;    /* Plan cache, PLAN_SLOTS */
+    struct uring     *r_ring;     /* io_uring if -U, else NULL */
+    struct uslot     *r_slots;    /* batch receive slots of r_ring */
+};
+
+/* Callhome and nat traversal state, argument of the callhome timer */
+struct callhome_state{
+    struct reactor      *cs_re;
+    struct reactor_timer cs_timer;
+    struct reflector    *cs_r;        /* Reflector 0, for nat traversal */
+    char                *cs_url;      /* Callhome url, -u */
+    char                *cs_userid;   /* -I */
+    enum grideye_proto   cs_proto;
+    int                 *cs_natstate; /* 0:none 1:enabled 2:addr&port defined */
+    struct sockaddr_in  *cs_myaddr;
+    char                *cs_eid64str;
+    char                *cs_info;
+    int                  cs_timeout;  /* Callhome if idle for this many s, -t */
+    int                  cs_tcpreg;   /* Tcp socket registered in reactor */
 };
 
 /*
@@ -132,33 +263,64 @@ struct curlbuf{
     char  *b_buf;
 };
 
-/* Info of a plugin. Make a vector of these for all plugins */
-struct plugin{
-    void                         *p_handle;
-    int                           p_version;
-    char                         *p_filename; /* Actual filename */
-    char                         *p_name;     /* Name corresponds to yang spec */
-    int                           p_disable; /* something failed */
-    struct grideye_plugin_api_v2 *p_api;
+/* A thread that calls plugins, see plugin_enter. Padded to a cache line,
+ * as it is written for each data packet */
+struct plugin_reader{
+    struct plugin_reader *pr_next;
+    struct plugin_gen    *pr_pg;    /* Generation in use */
+    volatile unsigned     pr_gen;   /* Its number, 0: none */
+    char                  pr_pad[64-2*sizeof(void *)-sizeof(unsigned)];
 };
 
 /*
  * Local variables
  */
-static struct sender *s_list = NULL;
+/* Senders hashed on socket name. Senders are registered (callhome) and 
+ * expired by main thread and looked up by all reflectors */
+static struct sender *s_hashtab[SENDER_HASHLEN] = {NULL,};
+static int            s_count = 0;
+static struct sender *s_newest = NULL; /* Most recently registered, nat probes */
+static int            s_idle = SENDER_IDLE_DEFAULT; /* -E */
+static pthread_rwlock_t s_lock = PTHREAD_RWLOCK_INITIALIZER;
 /* XXX: should be moved as doexit code is moved */
-static char hostname[128] = {0,};/* name of this host, -N or gethostname */
-static int  pkts = 0;		 /* packets received counter */
+char hostname[128] = {0,};/* name of this host, -N or gethostname */
+/* Shared counters, update with __sync builtins. Packets are counted per 
+ * reflector, see r_pkts */
 static int  errpkts = 0;	 /* dropped packets received counter */
 static int  nr_nobufs = 0;       /* global variable to log of buf overflows */
-struct timeval firstpkt, lastpkt;
 static int     quiet = 0;
-static struct plugin *plugins = NULL;
+/* Current plugins, read with plugin_enter, replaced by plugin_reload */
+struct plugin_gen *volatile plugin_cur = NULL;
+struct plugin_gen      *plugin_retired = NULL; /* Main thread */
+static struct plugin_reader *plugin_readers = NULL;
+static pthread_mutex_t plugin_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t   plugin_key;    /* struct plugin_reader of thread */
+char                  *plugin_dir = PLUGINDIR; /* -P */
+static int             plugin_changed = 0; /* Not yet in a callhome */
+/* Plugin options, see plugin_setopt */
+char                  *diskio_largefile = NULL;
+char                  *diskio_writefile = NULL;
+char                  *wlan_device = NULL; /* -w */
 static char    *pidfile = GRIDEYE_AGENT_PIDFILE;
+static int      txstamp = 0;     /* Report kernel tx timestamps in t3, -T */
+static int      batch = 1;       /* Max packets per syscall, -b */
+static int      use_uring = 0;   /* Reflect with io_uring, -U */
+static int      lowlat_cpu = -1; /* Spinning reflectors from this core, -C */
+static int      lowlat_prio = 0; /* SCHED_FIFO priority of them, -R */
+static int      busy_poll = 0;   /* SO_BUSY_POLL us, -B */
+static int      gso = 0;         /* Send fragments with UDP GSO, -G */
+static int      compress_min = COMPRESS_MIN; /* Compress results of at least
+						this many bytes, -Z */
+static int      loss = 0;        /* Synthetic loss of this seq, -L */
+static int      reorder = 0;     /* Synthetic reorder of this seq, -r */
+static int      duplicate = 0;   /* Synthetic duplicate of this seq, -d */
+static struct reflector *reflectors = NULL;
+static int      nreflectors = 0; /* Number of reflectors, -n */
+static volatile time_t rx_last = 0; /* When a known sender was last seen */
 
 /*! Return number of plugins in plugins vector. This is one less than vectorlen
  */
-static int
+int
 plugins_len(struct plugin *plugins)
 {
     int            i=0;
@@ -169,55 +331,212 @@ plugins_len(struct plugin *plugins)
     return i;
 }
 
-/*! helper function */
-static struct plugin *
+/*! Find a plugin by name, of the generation the calling thread uses
+ * That is the current generation in the main thread, see plugin_enter.
+ */
+struct plugin *
 plugin_find(char *name)
 {
-    struct plugin *p;
+    struct plugin_reader *pr;
+    struct plugin_gen    *pg = plugin_cur;
+    struct plugin        *p;
 
-    for (p = plugins; p&&p->p_api!=NULL; p++)
+    if ((pr = pthread_getspecific(plugin_key)) != NULL && pr->pr_gen)
+	pg = pr->pr_pg;
+    for (p = pg->pg_plugins; p&&p->p_api!=NULL; p++)
 	if (strcmp(p->p_name, name) == 0)
 	    return p;
     return NULL;
 }
 
+/*! Get the reader of the calling thread, create it on first use
+ */
+static struct plugin_reader *
+plugin_reader(void)
+{
+    struct plugin_reader *pr;
 
-/*! Load a specific plugin, call its init function and add it to plugins list
- * If init function fails (not found, wrong version, etc) print a log and dont
- * add it.
+    if ((pr = pthread_getspecific(plugin_key)) != NULL)
+	return pr;
+    if ((pr = calloc(1, sizeof(*pr))) == NULL){
+	clicon_err(OE_UNIX, errno, "calloc");
+	return NULL;
+    }
+    pthread_mutex_lock(&plugin_mutex);
+    pr->pr_next = plugin_readers;
+    plugin_readers = pr;
+    pthread_mutex_unlock(&plugin_mutex);
+    pthread_setspecific(plugin_key, pr);
+    return pr;
+}
+
+/*! Use the current generation of plugins until plugin_leave
+ * Its plugins, and those of later generations, are not freed meanwhile. The
+ * generation is published before it is read again, so either a reload sees
+ * it or it is read again, see plugin_in_use.
+ * @retval  pg    Current generation
+ * @retval  NULL  Error
+ */
+struct plugin_gen *
+plugin_enter(void)
+{
+    struct plugin_reader *pr;
+    struct plugin_gen    *pg;
+
+    if ((pr = plugin_reader()) == NULL)
+	return NULL;
+    do {
+	pg = plugin_cur;
+	pr->pr_pg = pg;
+	pr->pr_gen = pg->pg_gen;
+	__sync_synchronize();
+    } while (pg != plugin_cur);
+    return pg;
+}
+
+/*! Use a generation of plugins that another thread uses, until plugin_leave
+ * @param[in]  pg  Generation, in use by another thread until this returns
+ */
+int
+plugin_pin(struct plugin_gen *pg)
+{
+    struct plugin_reader *pr;
+
+    if ((pr = plugin_reader()) == NULL)
+	return -1;
+    pr->pr_pg = pg;
+    pr->pr_gen = pg->pg_gen;
+    __sync_synchronize();
+    return 0;
+}
+
+/*! Done with the plugins of plugin_enter or plugin_pin
+ */
+void
+plugin_leave(void)
+{
+    struct plugin_reader *pr;
+
+    if ((pr = pthread_getspecific(plugin_key)) == NULL)
+	return;
+    __sync_synchronize();
+    pr->pr_gen = 0;
+}
+
+#ifdef PLUGIN_RELOAD
+/*! Check if a thread uses a generation of plugins
+ * @param[in]  gen  Generation, not the current one
+ * @retval     1    In use
+ * @retval     0    Not in use, and will not be
+ */
+int
+plugin_in_use(unsigned gen)
+{
+    struct plugin_reader *pr;
+    unsigned              g;
+    int                   used = 0;
+
+    __sync_synchronize();
+    pthread_mutex_lock(&plugin_mutex);
+    for (pr = plugin_readers; pr && !used; pr = pr->pr_next)
+	if ((g = pr->pr_gen) != 0 && g <= gen)
+	    used = 1;
+    pthread_mutex_unlock(&plugin_mutex);
+    return used;
+}
+#endif /* PLUGIN_RELOAD */
+
+/*! Adapt the api of a v2 plugin to v3
+ * The test function is left NULL, v2 tests are called with plugin_test_v2.
+ * @param[in]  api2  API of v2 plugin
+ * @retval     api   Allocated v3 API, free with free
+ * @retval     NULL  Error
+ */
+static struct grideye_plugin_api_v3 *
+plugin_adapt_v2(struct grideye_plugin_api_v2 *api2)
+{
+    struct grideye_plugin_api_v3 *api;
+
+    if ((api = calloc(1, sizeof(*api))) == NULL){
+	clicon_err(OE_UNIX, errno, "calloc");
+	return NULL;
+    }
+    api->gp_version = api2->gp_version;
+    api->gp_magic = api2->gp_magic;
+    api->gp_name = api2->gp_name;
+    api->gp_input_format = api2->gp_input_format;
+    api->gp_setopt_fn = api2->gp_setopt_fn;
+    api->gp_exit_fn = api2->gp_exit_fn;
+    return api;
+}
+
+/*! Call the init function of a plugin and add it to plugins list
+ * If init function fails (wrong version, etc) print a log and dont add it.
+ * v2 plugins are adapted to v3, see plugin_adapt_v2.
+ * @param[in]  handle   Of dlopen, or NULL if linked into the agent
+ * @param[in]  init3    Init function of v3 plugin, or NULL
+ * @param[in]  init2    Init function of v2 plugin, used if init3 is NULL
+ * @param[in]  name     Filename, without directory
+ * @param[in]  filename Where it was loaded from, for logs
+ * @param[in,out] plugins  Null-terminated vector of plugins
  */
 static int 
-grideye_plugin_load(void          *handle,
-		    char          *name,
-		    char          *filename,
-		    struct plugin *plugins[]
-		    )
+plugin_register(void                  *handle,
+		grideye_plugin_init_t *init3,
+		grideye_plugin_init_t *init2,
+		char                  *name,
+		char                  *filename,
+		struct plugin         *plugins[])
 {
     int                           retval = -1;
-    char                         *dlerrcode;
     grideye_plugin_init_t        *initfun;
-    struct grideye_plugin_api_v2 *api;
+    struct grideye_plugin_api_v3 *api = NULL;
+    struct grideye_plugin_api_v2 *api2 = NULL;
     int                           len;
 
-    /* Try v2 */
-    initfun = dlsym(handle, PLUGIN_INIT_FN_V2);
-    if ((dlerrcode = (char*)dlerror()) != NULL) {
-	clicon_log(LOG_WARNING, "%s Skipping %s", __FUNCTION__, dlerrcode); 
-	goto fail;
-    }
-    if ((api = initfun(GRIDEYE_PLUGIN_VERSION)) == NULL) {
-	clicon_log(LOG_WARNING, "grideye_agent: %s: failed when running init function %s: %s", 
-		   filename, PLUGIN_INIT_FN_V2, errno?strerror(errno):"");
-	goto fail;
+    if ((initfun = init3) != NULL){
+	if ((api = initfun(GRIDEYE_PLUGIN_VERSION_V3)) == NULL) {
+	    clicon_log(LOG_WARNING, "grideye_agent: %s: failed when running init function %s: %s", 
+		       filename, PLUGIN_INIT_FN_V3, errno?strerror(errno):"");
+	    goto fail;
+	}
+	if (api->gp_version != GRIDEYE_PLUGIN_VERSION_V3){
+	    clicon_log(LOG_WARNING, "grideye_agent: %s Unexpected plugin version number: %d", 
+		       filename, api->gp_version);
+	    api = NULL;
+	    goto fail;
+	}
+	if (api->gp_magic != GRIDEYE_PLUGIN_MAGIC){
+	    clicon_log(LOG_WARNING, "grideye_agent: %s: Wrong plugin magic number: %x", 
+		       filename, api->gp_magic);
+	    api = NULL;
+	    goto fail;
+	}
     }
-    if (api->gp_version != GRIDEYE_PLUGIN_VERSION){
-	clicon_log(LOG_WARNING, "grideye_agent: %s Unexpected plugin version number: %d", 
-		   filename, api->gp_version);
-	goto fail;
+    else{
+	initfun = init2;
+	if ((api2 = initfun(GRIDEYE_PLUGIN_VERSION)) == NULL) {
+	    clicon_log(LOG_WARNING, "grideye_agent: %s: failed when running init function %s: %s", 
+		       filename, PLUGIN_INIT_FN_V2, errno?strerror(errno):"");
+	    goto fail;
+	}
+	if (api2->gp_version != GRIDEYE_PLUGIN_VERSION){
+	    clicon_log(LOG_WARNING, "grideye_agent: %s Unexpected plugin version number: %d", 
+		       filename, api2->gp_version);
+	    goto fail;
+	}
+	if (api2->gp_magic != GRIDEYE_PLUGIN_MAGIC){
+	    clicon_log(LOG_WARNING, "grideye_agent: %s: Wrong plugin magic number: %x", 
+		       filename, api2->gp_magic);
+	    goto fail;
+	}
+	if ((api = plugin_adapt_v2(api2)) == NULL)
+	    goto done;
     }
-    if (api->gp_magic != GRIDEYE_PLUGIN_MAGIC){
-	clicon_log(LOG_WARNING, "grideye_agent: %s: Wrong plugin magic number: %x", 
-		   filename, api->gp_magic);
+    if (api->gp_start_fn &&
+	(api->gp_poll_fn == NULL || api->gp_collect_fn == NULL)){
+	clicon_log(LOG_WARNING, "grideye_agent: %s: start function without poll and collect", 
+		   filename);
 	goto fail;
     }
     len = plugins_len(*plugins);
@@ -227,6 +546,7 @@ grideye_plugin_load(void          *handle,
     }
     memcpy(&(*plugins)[len+1], &(*plugins)[len], sizeof(struct plugin));
     (*plugins)[len].p_handle = handle;
+    (*plugins)[len].p_version = api2 ? GRIDEYE_PLUGIN_VERSION : GRIDEYE_PLUGIN_VERSION_V3;
     if (((*plugins)[len].p_filename = strdup(name)) == NULL){
 	clicon_err(OE_UNIX, errno, "strdup");
 	goto done;
@@ -237,23 +557,193 @@ grideye_plugin_load(void          *handle,
 	goto done;
     }
     (*plugins)[len].p_api = api;
+    (*plugins)[len].p_api2 = api2;
+    if (api->gp_cache_ms > 0 &&
+	((*plugins)[len].p_cache = cache_new(api->gp_name)) == NULL)
+	goto done;
     clicon_log(LOG_WARNING, "grideye_agent: Plugin %s loaded from %s", name, filename);
     retval = 0;
  done:
-    if (retval < 0)
-	dlclose(handle);
+    if (retval < 0){
+	if (api2 && api)
+	    free(api);
+	if (handle)
+	    dlclose(handle);
+    }
     return retval;
  fail: /* plugin load failed, continue */
     retval = 0;
     goto done;
 }
 
+#ifndef GRIDEYE_STATIC
+/*! Load a specific plugin, call its init function and add it to plugins list
+ * If init function fails (not found, wrong version, etc) print a log and dont
+ * add it.
+ * v3 plugins are tried first, then v2 plugins, see plugin_register.
+ */
+static int 
+grideye_plugin_load(void          *handle,
+		    char          *name,
+		    char          *filename,
+		    struct plugin *plugins[]
+		    )
+{
+    char                  *dlerrcode;
+    grideye_plugin_init_t *init3;
+    grideye_plugin_init_t *init2 = NULL;
+
+    /* Try v3 */
+    if ((init3 = dlsym(handle, PLUGIN_INIT_FN_V3)) == NULL){
+	dlerror(); /* clear */
+	/* Try v2 */
+	init2 = dlsym(handle, PLUGIN_INIT_FN_V2);
+	if ((dlerrcode = (char*)dlerror()) != NULL) {
+	    clicon_log(LOG_WARNING, "%s Skipping %s", __FUNCTION__, dlerrcode); 
+	    return 0;
+	}
+    }
+    return plugin_register(handle, init3, init2, name, filename, plugins);
+}
+#endif /* GRIDEYE_STATIC */
+
+/*! Set the options of a loaded plugin: disk i/o files and wireless device
+ * A plugin is disabled if an option fails.
+ * @param[in]  p   Plugin
+ */
+static void
+plugin_setopt(struct plugin *p)
+{
+    grideye_plugin_setopt_t *setopt = p->p_api->gp_setopt_fn;
+
+    if (setopt == NULL)
+	return;
+    /* XXX rewrite these file/device setopts */
+    if (setopt("writefile", diskio_writefile) < 0){
+	p->p_disable++;
+	clicon_log(LOG_NOTICE, "plugin setopt(writefile):%s",
+		   diskio_writefile);
+	clicon_log(LOG_NOTICE, "Disable plugin %s: %s", 
+		   p->p_filename, strerror(errno));
+    }
+    if (setopt("largefile", diskio_largefile) < 0){
+	clicon_log(LOG_NOTICE, "plugin setopt(largefile):%s",
+		   diskio_largefile);
+	clicon_log(LOG_NOTICE, "Disable plugin %s: %s", 
+		   p->p_filename, strerror(errno));
+    }
+    if (setopt("device", wlan_device) < 0){
+	p->p_disable++;
+	clicon_log(LOG_NOTICE, "plugin setopt(device):%s",
+		   diskio_largefile);
+	clicon_log(LOG_NOTICE, "Disable plugin %s: %s", 
+		   p->p_filename, strerror(errno));
+    }
+}
+
+#ifdef GRIDEYE_STATIC
+/*! Register the plugins linked into the agent, see make static
+ * The table is generated from the plugins selected when building, it
+ * replaces plugin_load_dir and the plugin directory is not read.
+ * @param[out] plugins  Null-terminated vector of plugins
+ */
+int
+plugin_load_static(struct plugin *plugins[])
+{
+    struct grideye_static_plugin *gs;
+    struct plugin                *p;
+    int                           len;
+
+    for (gs = grideye_static_plugins; gs->gs_name != NULL; gs++){
+	len = plugins_len(*plugins);
+	if (plugin_register(NULL, 
+			    gs->gs_version == 3 ? gs->gs_init : NULL,
+			    gs->gs_version == 3 ? NULL : gs->gs_init,
+			    gs->gs_name, gs->gs_name, plugins) < 0)
+	    return -1;
+	if (plugins_len(*plugins) == len) /* Skipped */
+	    continue;
+	p = &(*plugins)[len];
+	p->p_fd = -1;
+	plugin_setopt(p);
+    }
+    return 0;
+}
+#else /* GRIDEYE_STATIC */
+/*! Find an unchanged plugin of the current generation, see plugin_load_dir
+ * @param[in]  old   Plugins of current generation
+ * @param[in]  name  Filename, without directory
+ * @param[in]  st    Status of file
+ */
+static struct plugin *
+plugin_unchanged(struct plugin *old,
+		 char          *name,
+		 struct stat   *st)
+{
+    struct plugin *p;
+
+    for (p = old; p->p_api!=NULL; p++)
+	if (strcmp(p->p_filename, name) == 0 &&
+	    p->p_dev == st->st_dev && p->p_ino == st->st_ino &&
+	    p->p_mtime == st->st_mtime)
+	    return p;
+    return NULL;
+}
+
+/*! Find a plugin of the current generation whose file was overwritten in place
+ * dlopen finds a loaded object by device and inode, so the new version
+ * would not be loaded, and the text of the loaded version is the changed
+ * file. Plugins must be installed by rename, which creates a new inode.
+ * @param[in]  old   Plugins of current generation
+ * @param[in]  st    Status of file
+ */
+static struct plugin *
+plugin_overwritten(struct plugin *old,
+		   struct stat   *st)
+{
+    struct plugin *p;
+
+    for (p = old; p->p_api!=NULL; p++)
+	if (p->p_dev == st->st_dev && p->p_ino == st->st_ino &&
+	    p->p_mtime != st->st_mtime)
+	    return p;
+    return NULL;
+}
+
+/*! Add an unchanged plugin to the plugins of the next generation
+ * @param[in]     p        Plugin of current generation
+ * @param[in,out] plugins  Null-terminated vector of next generation
+ */
+static int
+plugin_keep(struct plugin *p,
+	    struct plugin *plugins[])
+{
+    int len;
+
+    len = plugins_len(*plugins);
+    if ((*plugins = realloc(*plugins, (len+2)*sizeof(struct plugin))) == NULL){
+	clicon_err(OE_UNIX, errno, "realloc");
+	return -1;
+    }
+    memcpy(&(*plugins)[len+1], &(*plugins)[len], sizeof(struct plugin));
+    memcpy(&(*plugins)[len], p, sizeof(struct plugin));
+    return 0;
+}
+
 /*! Load grideye agent plugins from directory, call init and return handles in vector
+ * On reload, plugins whose file has not changed are moved from the current
+ * generation, and changed plugins are loaded from an open file. The name of
+ * that file, /proc/self/fd/<fd>, differs from the name of the loaded version,
+ * which is kept open meanwhile. dlopen also matches loaded objects on device
+ * and inode, so a file that was overwritten in place is not loaded, the
+ * loaded version is kept and an error is logged, see plugin_overwritten.
  * @param[in]  dir      name of directory where grideye .so plugins reside
+ * @param[in]  old      Plugins of current generation on reload, else NULL
  * @param[out] plugins  Null-terminated vector of plugin handles.
  */
-static int
+int
 plugin_load_dir(char          *dir,
+		struct plugin *old,
 		struct plugin *plugins[])
 {
     int            retval = -1;
@@ -264,8 +754,12 @@ plugin_load_dir(char          *dir,
     int            res;
     char          *name;
     int            off;
-    char          *filename;
+    char          *filename = NULL;
     int            len;
+    struct stat    st;
+    struct plugin *p;
+    int            fd = -1;
+    char           fdname[64];
 
     if ((dirp = opendir(dir)) == NULL) {
 	clicon_err(OE_PLUGIN, errno, "opendir(%s)", dir);
@@ -296,41 +790,129 @@ plugin_load_dir(char          *dir,
 	   goto done;
        }
        snprintf(filename, len, "%s/%s", dir, name);
-
+       if (stat(filename, &st) < 0){ /* Removed meanwhile */
+	   free(filename);
+	   filename = NULL;
+	   continue;
+       }
+       if (old && (p = plugin_unchanged(old, name, &st)) != NULL){
+	   if (plugin_keep(p, plugins) < 0)
+	       goto done;
+	   free(filename);
+	   filename = NULL;
+	   continue;
+       }
+       if (old && (p = plugin_overwritten(old, &st)) != NULL){
+	   clicon_log(LOG_ERR, "grideye_agent: %s was overwritten in place, not reloaded: install plugins by rename (mv, install)", 
+		      filename);
+	   p->p_mtime = st.st_mtime; /* Log once, only read on reload */
+	   if (plugin_keep(p, plugins) < 0)
+	       goto done;
+	   free(filename);
+	   filename = NULL;
+	   continue;
+       }
        dlerror();    /* Clear any existing error */
-       if ((handle = dlopen(filename, RTLD_NOW)) == NULL) {
+       if (old){
+	   if ((fd = open(filename, O_RDONLY)) < 0){
+	       clicon_log(LOG_WARNING, "grideye_agent: %s: %s", 
+			  filename, strerror(errno));
+	       free(filename);
+	       filename = NULL;
+	       continue;
+	   }
+	   fcntl(fd, F_SETFD, FD_CLOEXEC);
+	   snprintf(fdname, sizeof(fdname), "/proc/self/fd/%d", fd);
+	   handle = dlopen(fdname, RTLD_NOW);
+       }
+       else
+	   handle = dlopen(filename, RTLD_NOW);
+       if (handle == NULL) {
+	   if (old){ /* Eg partly written, wait for the next change */
+	       clicon_log(LOG_WARNING, "grideye_agent: dlopen: %s", 
+			  (char*)dlerror());
+	       close(fd);
+	       fd = -1;
+	       free(filename);
+	       filename = NULL;
+	       continue;
+	   }
 	   clicon_err(OE_UNIX, 0, "dlopen: %s", (char*)dlerror());
 	   goto done;
        }
-       if (grideye_plugin_load(handle, name, filename, plugins) < 0){
-	   free(filename);
+       len = plugins_len(*plugins);
+       if (grideye_plugin_load(handle, name, filename, plugins) < 0)
 	   goto done;
-       }
        free(filename);
+       filename = NULL;
+       if (plugins_len(*plugins) == len){ /* Skipped */
+	   if (fd != -1)
+	       close(fd);
+	   fd = -1;
+	   continue;
+       }
+       p = &(*plugins)[len];
+       p->p_fd = fd;
+       fd = -1;
+       p->p_dev = st.st_dev;
+       p->p_ino = st.st_ino;
+       p->p_mtime = st.st_mtime;
+       plugin_setopt(p);
    }
     retval = 0;
  done:
+    if (fd != -1)
+	close(fd);
+    if (filename)
+	free(filename);
     if (dirp)
 	closedir(dirp);
     return retval;
 }
+#endif /* GRIDEYE_STATIC */
 
-#ifdef notyet
-static int
-plugin_unload (void)
+/*! Unload a plugin and free it
+ * @param[in]  p       Plugin
+ * @param[in]  exitfn  Call its exit function, not from a signal handler
+ */
+void
+plugin_free(struct plugin *p,
+	    int            exitfn)
 {
-    int   retval = -1;
-
+    if (exitfn && p->p_api->gp_exit_fn)
+	p->p_api->gp_exit_fn();
+    if (p->p_api2) /* adapted */
+	free(p->p_api);
+    if (p->p_cache)
+	cache_free(p->p_cache);
+    sample_free(p->p_samples);
+    if (p->p_filename)
+	free(p->p_filename);
+    if (p->p_name)
+	free(p->p_name);
     dlerror();    /* Clear any existing error */
-    if (dlclose(plg->p_handle) != 0) {
-	clicon_err(OE_PLUGIN, errno, "dlclose");
-	goto done;
-    }
-    retval = 0;
- done:
-    return retval;
+    if (p->p_handle && dlclose(p->p_handle) != 0)
+	clicon_log(LOG_WARNING, "dlclose: %s", (char*)dlerror());
+    if (p->p_fd != -1)
+	close(p->p_fd);
+}
+
+/*! Free a generation of plugins, and the plugins not moved to the next
+ * @param[in]  pg      Generation, not used by any thread
+ * @param[in]  exitfn  Call exit functions of plugins, see plugin_free
+ */
+void
+plugin_gen_free(struct plugin_gen *pg,
+		int                exitfn)
+{
+    struct plugin *p;
+
+    for (p = pg->pg_plugins; p->p_api!=NULL; p++)
+	if (!p->p_kept)
+	    plugin_free(p, exitfn);
+    free(pg->pg_plugins);
+    free(pg);
 }
-#endif /* notyet */
 
 /*! Get (reply) data from server
  */
@@ -462,13 +1044,33 @@ url_post(char *url,
 }
 
 
+/*! Hash of a socket name (FNV-1a)
+ */
+static uint32_t
+s_hashfn(void      *sname, 
+	 socklen_t  snamelen)
+{
+    uint8_t  *b = (uint8_t *)sname;
+    uint32_t  h = 2166136261U;
+    int       i;
+
+    for (i=0; i<snamelen; i++){
+	h ^= b[i];
+	h *= 16777619U;
+    }
+    return h;
+}
+
+/*! Remove and free a sender
+ * @note Caller must hold s_lock for writing
+ */
 static int
 s_rm(struct sender *s)
 {
     struct sender   *c;
     struct sender  **s_prev;
 
-    s_prev = &s_list;
+    s_prev = &s_hashtab[s->s_hash & (SENDER_HASHLEN-1)];
     for (c = *s_prev; c; c = c->s_next){
 	if (c == s){
 	    if (s->s_sname)
@@ -478,6 +1080,9 @@ s_rm(struct sender *s)
 	    if (s->s_name)
 		free(s->s_name);
 	    *s_prev = c->s_next;
+	    if (s_newest == s)
+		s_newest = NULL;
+	    s_count--;
 	    free(s);
 	    break;
 	}
@@ -487,6 +1092,10 @@ s_rm(struct sender *s)
 }
 
 /*! Register a sender, lock enum and source from this sender 
+ * Several senders may be registered at once, each with its own sequence 
+ * numbers and control tree.
+ * @note Caller must hold s_lock for writing and check that it is not 
+ *       already registered with s_find
  */
 static struct sender *
 s_add(void      *sname, 
@@ -494,6 +1103,7 @@ s_add(void      *sname,
 
 {
     struct sender   *s = NULL;
+    struct sender  **bucket;
 
     if ((s = (struct sender *)malloc(sizeof(*s))) == NULL){
 	clicon_err(OE_UNIX, errno, "malloc");
@@ -503,225 +1113,1674 @@ s_add(void      *sname,
     s->s_snamelen = snamelen;
     if ((s->s_sname = malloc(snamelen)) == NULL){
 	clicon_err(OE_UNIX, errno, "malloc");
+	free(s);
+	s = NULL;
 	goto done;
     }
     memcpy(s->s_sname, sname, snamelen);
-    /* Always remove s_list to ensure single sender only */
-    if (s_list)
-	s_rm(s_list);
-    s->s_next = s_list;
-    s_list = s;
+    s->s_hash = s_hashfn(sname, snamelen);
+    s->s_lastseen = time(NULL);
+    bucket = &s_hashtab[s->s_hash & (SENDER_HASHLEN-1)];
+    s->s_next = *bucket;
+    *bucket = s;
+    s_count++;
  done:
     return s;
 }
 
+/*! Find a registered sender
+ * @note Caller must hold s_lock and not use the sender after releasing it
+ */
 static struct sender *
 s_find(void      *sname, 
        socklen_t  snamelen)
 {
     struct sender *s;
+    uint32_t       h;
 
-    for (s = s_list; s; s = s->s_next)
-	if (s->s_snamelen == snamelen && 
+    h = s_hashfn(sname, snamelen);
+    for (s = s_hashtab[h & (SENDER_HASHLEN-1)]; s; s = s->s_next)
+	if (s->s_hash == h &&
+	    s->s_snamelen == snamelen && 
 	    memcmp(sname, s->s_sname, snamelen)==0)
 	    return s;
     return NULL;
 }
 
+/*! Remove senders that have not sent data packets for idle seconds
+ * @param[in]  idle  Seconds, 0 removes all senders
+ * @note Caller must hold s_lock for writing
+ */
+static int
+s_expire(int idle)
+{
+    struct sender *s;
+    struct sender *next;
+    time_t         now = time(NULL);
+    int            i;
+
+    for (i=0; s_count && i<SENDER_HASHLEN; i++)
+	for (s = s_hashtab[i]; s; s = next){
+	    next = s->s_next;
+	    if (idle && now - s->s_lastseen < idle)
+		continue;
+	    if (idle)
+		clicon_log(LOG_NOTICE, "grideye_agent: Expired idle sender %s:%hu",
+			   inet_ntoa(((struct sockaddr_in *)s->s_sname)->sin_addr),
+			   ntohs(((struct sockaddr_in *)s->s_sname)->sin_port));
+	    s_rm(s);
+	}
+    return 0;
+}
+
 /*
  * Format of sendbuf:
  * sequence:32
  * eid64:64
  * timeval:64
+ * The datagram is gathered from iov, eg a header encoded in the received
+ * packet and a payload elsewhere, see encode_twoway_iov.
+ * @note Caller must hold r->r_txlock, see send_one_agent
  */
 static int
-send_one_agent(int              s, 
-	       struct sockaddr *addr, 
-	       int              addrlen, 
-	       char            *buf, 
-	       int              len)
+send_one_agent_locked(struct reflector *r, 
+		      struct sockaddr  *addr, 
+		      int               addrlen, 
+		      struct iovec     *iov, 
+		      int               iovlen)
 {
-    int retval = -1;
+    int           retval = -1;
+    struct msghdr msg = {0,};
 
-    if (sendto(s, buf, len, 0x0, addr, addrlen) < 0){
+    msg.msg_name = addr;
+    msg.msg_namelen = addrlen;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovlen;
+    if (sendmsg(r->r_s, &msg, 0x0) < 0){
 	switch (errno){
 	case ENOBUFS: /* try again if ifq is empty */
-	    nr_nobufs++;
-	    clicon_log(LOG_WARNING,  "sendto %s %s", __FUNCTION__, strerror(errno));
+	    __sync_fetch_and_add(&nr_nobufs, 1);
+	    r->r_txkey++; /* dropped after timestamp key assigned */
+	    clicon_log(LOG_WARNING,  "sendmsg %s %s", __FUNCTION__, strerror(errno));
 	    return 0;
 	    break;
 	case ENETUNREACH: /* try again */
-	    clicon_log(LOG_WARNING,  "sendto %s %s", __FUNCTION__, strerror(errno));
+	    clicon_log(LOG_WARNING,  "sendmsg %s %s", __FUNCTION__, strerror(errno));
 	    return 0;
 	    break;
 	default:
-	    clicon_err(OE_UNIX, errno, "sendto");
+	    clicon_err(OE_UNIX, errno, "sendmsg");
 	    goto done;
 	}
     }
+    else
+	r->r_txkey++;
     retval = 0;
  done:
     return retval;
 }
 
+/*! Send a datagram on a reflector socket
+ * Plugin workers send results on the same socket as the reflector, so
+ * sends and tx timestamp keys are serialized by r_txlock.
+ */
+static int
+send_one_agent(struct reflector *r, 
+	       struct sockaddr  *addr, 
+	       int               addrlen, 
+	       char             *buf, 
+	       int               len)
+{
+    int          retval;
+    struct iovec iov[1];
 
+    iov[0].iov_base = buf;
+    iov[0].iov_len = len;
+    pthread_mutex_lock(&r->r_txlock);
+    retval = send_one_agent_locked(r, addr, addrlen, iov, 1);
+    pthread_mutex_unlock(&r->r_txlock);
+    return retval;
+}
 
-/*! Received grideye data packet. Make application emulation
- * @param[in]  snd     Sender of received data packet 
- * @param[in]  payload String payload in data packet
- * @retval -1  Fatal error
- * @retval  0  Error in packet, drop and continue
- * @retval  1  OK
+#ifdef UDP_SEGMENT
+/*! Send datagrams of segsize bytes with one UDP GSO send
+ * The datagrams are gathered from iov, the last may be shorter.
+ * @retval  1  Sent, or dropped as in send_one_agent_locked
+ * @retval  0  GSO not supported by the socket or device, -G is turned off
+ * @retval -1  Error
+ * @note Caller must hold r->r_txlock
  */
 static int
-echo_application(struct sender *snd,
-		 char          *myname,
-		 char          *payload,
-		 cbuf          *cb,
-		 struct plugin  plugins[])
+send_gso_locked(struct reflector *r, 
+		struct sockaddr  *addr, 
+		int               addrlen, 
+		struct iovec     *iov, 
+		int               iovlen,
+		uint16_t          segsize)
 {
-    int                retval = -1;
-    cxobj             *xcontrol = NULL;
-    uint64_t          *v = NULL;
-    int64_t           *vi = NULL;
-    int                i;
-    struct plugin     *p;
-    struct grideye_plugin_api_v2 *api;
-    char              *argstr;
-    char              *pstr;
-    int                pret;
-    char              *str = NULL;
-    cxobj             *xt = NULL;
-    cxobj             *x;
-    cxobj             *xp;
-    char              *xb;
-    cxobj            **xvec = NULL;
-    size_t             xlen;
-    
-    clicon_log(LOG_DEBUG, "%s payload:%s", __FUNCTION__, payload);
-    if ((xcontrol = snd->s_xml) == NULL){ /* <grideye> */
-	clicon_log(LOG_WARNING, "%s: Expected xml template when receiving data", 
-		   __FUNCTION__);
-	retval = 0; 	    /* sanity check failed, just continue */
-	errpkts++;
-	goto done;
-    }
-    /* Look at payload in data packets:
-     * <grideye><version>2</version><name>a1</name><plugin><name>p1</name><param>12</param><param>www.youtube.com</param></plugin><plugin>p2</plugin></grideye> 
-     * and decompress
-     */
-    if (payload){
-	/* parse incoming payload XML */
-	if (json_parse_str(payload, &xt) < 0)
-	    goto done;
-	/* Check version */
-	if ((x = xpath_first(xt, "grideye/version")) == NULL){
-	    clicon_log(LOG_ERR, "%s: <version> not found in payload", 
-		       __FUNCTION__);
-	    retval = 0; 	    /* sanity check failed, just continue */
-	    errpkts++;
-	    goto done;
-	}
-	xb = xml_body(x);
-	if (xb==NULL || atoi(xb) != GRIDEYE_AGENT_VERSION){
-	    clicon_log(LOG_ERR, "%s: Sender version %d expected, received %s", 
-		       __FUNCTION__, GRIDEYE_AGENT_VERSION, xb);
-	    retval = 0; 	    /* sanity check failed, just continue */
-	    errpkts++;
-	    goto done;
-	}
-	/* Verify name of agent */
-	if ((x = xpath_first(xt, "grideye/name")) == NULL){
-	    clicon_log(LOG_ERR, "%s: <name> not found in payload", 
-		       __FUNCTION__);
-	    retval = 0; 	    /* sanity check failed, just continue */
-	    errpkts++;
-	    goto done;
+    struct msghdr   msg = {0,};
+    char            cmsgbuf[CMSG_SPACE(sizeof(uint16_t))] = {0,};
+    struct cmsghdr *cmsg;
+
+    msg.msg_name = addr;
+    msg.msg_namelen = addrlen;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovlen;
+    msg.msg_control = cmsgbuf;
+    msg.msg_controllen = sizeof(cmsgbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(cmsg), &segsize, sizeof(segsize));
+    if (sendmsg(r->r_s, &msg, 0x0) < 0){
+	switch (errno){
+	case ENOBUFS: /* try again if ifq is empty */
+	    __sync_fetch_and_add(&nr_nobufs, 1);
+	    r->r_txkey++; /* dropped after timestamp key assigned */
+	    /* FALLTHROUGH */
+	case ENETUNREACH: /* try again */
+	    clicon_log(LOG_WARNING,  "sendmsg %s %s", __FUNCTION__, strerror(errno));
+	    return 1;
+	case EIO:
+	case EINVAL:
+	case ENOPROTOOPT:
+	case EOPNOTSUPP:
+	    clicon_log(LOG_WARNING, "%s: UDP GSO not supported: %s, disabled", 
+		       __FUNCTION__, strerror(errno));
+	    gso = 0;
+	    return 0;
+	default:
+	    clicon_err(OE_UNIX, errno, "sendmsg");
+	    return -1;
 	}
-	xb = xml_body(x);
-	if (xb==NULL || strcmp(xb, myname)){
-	    clicon_log(LOG_ERR, "%s: Expected name %s but received %s", 
-		       __FUNCTION__, myname, xb);
-	    retval = 0; 	    /* sanity check failed, just continue */
-	    errpkts++;
-	    goto done;
+    }
+    r->r_txkey++;
+    return 1;
+}
+#endif /* UDP_SEGMENT */
+
+/*! Send a result too large for one datagram as MTYPE_FRAG fragments
+ * Each fragment is the header th with mtype MTYPE_FRAG, a frag_hdr and
+ * at most FRAG_DATALEN bytes of the result, see struct frag_hdr. With -G
+ * up to FRAG_GSO_MAX fragments are sent with one UDP GSO send.
+ * @param[in]  r      Reflector to send on
+ * @param[in]  addr   Sender
+ * @param[in]  th     Header of reply or result
+ * @param[in]  reply  Plugin results
+ * @param[in]  plen   Length of reply
+ * @retval  0  OK, or result dropped
+ * @retval -1  Error
+ */
+static int
+result_send_frags(struct reflector   *r,
+		  struct sockaddr_in *addr,
+		  struct twoway_hdr  *th,
+		  char               *reply,
+		  size_t              plen)
+{
+    int               retval = -1;
+    struct twoway_hdr fth = *th;
+    struct frag_hdr   fh = {0,};
+    char              hdr[TWOWAY_HDRLEN];
+    char              fhdr[FRAG_GSO_MAX][FRAG_HDRLEN];
+    struct iovec      iov[3*FRAG_GSO_MAX];
+    size_t            count;
+    size_t            off = 0;
+    size_t            len;
+    int               n;
+    int               i;
+    int               ret;
+
+    count = (plen + FRAG_DATALEN-1) / FRAG_DATALEN;
+    if (count > UINT16_MAX){
+	clicon_log(LOG_WARNING, "%s: seq %u: result of %zu bytes dropped", 
+		   __FUNCTION__, th->th_seq0, plen);
+	return 0;
+    }
+    fth.th_mtype = MTYPE_FRAG;
+    encode_twoway_hdr(hdr, &fth);
+    fh.fh_count = count;
+    fh.fh_len = plen;
+    pthread_mutex_lock(&r->r_txlock);
+    while (fh.fh_index < count){
+	for (n=0; n<FRAG_GSO_MAX && fh.fh_index < count; n++, fh.fh_index++){
+	    len = plen-off < FRAG_DATALEN ? plen-off : FRAG_DATALEN;
+	    encode_frag_hdr(fhdr[n], &fh);
+	    iov[3*n].iov_base = hdr;
+	    iov[3*n].iov_len = TWOWAY_HDRLEN;
+	    iov[3*n+1].iov_base = fhdr[n];
+	    iov[3*n+1].iov_len = FRAG_HDRLEN;
+	    iov[3*n+2].iov_base = reply + off;
+	    iov[3*n+2].iov_len = len;
+	    off += len;
 	}
-	/* Invoke plugins */
-	if (xpath_vec(xt, "grideye/plugin", &xvec, &xlen) < 0) 
+	ret = 0;
+#ifdef UDP_SEGMENT
+	if (gso && (ret = send_gso_locked(r, (struct sockaddr*)addr, sizeof(*addr),
+					  iov, 3*n, FRAG_DGRAMLEN)) < 0)
 	    goto done;
-	/* Loop through plugin calls */
-	for (i=0; i<xlen; i++){
-	    xp = xvec[i];
-	    if ((x = xpath_first(xp, "name")) == NULL){
-		clicon_log(LOG_ERR, "%s: <name> expected in plugin", 
-			   __FUNCTION__);
-		retval = 0; 	    /* sanity check failed, just continue */
-		errpkts++;
+#endif
+	for (i=0; ret == 0 && i<n; i++)
+	    if (send_one_agent_locked(r, (struct sockaddr*)addr, sizeof(*addr),
+				      &iov[3*i], 3) < 0)
 		goto done;
-	    }
-	    pstr = xml_body(x);
-	    /* Find matching plugin */
-	    if ((p = plugin_find(pstr)) == NULL)
-		continue; /* silently ignore */
-	    if (p->p_disable)
-		continue; /* silently ignore */
-	    if ((api = p->p_api) == NULL)
+    }
+    retval = 0;
+ done:
+    pthread_mutex_unlock(&r->r_txlock);
+    return retval;
+}
+
+/*! Send plugin results in a datagram, or as fragments if they do not fit
+ * @param[in]  r      Reflector to send on
+ * @param[in]  addr   Sender
+ * @param[in]  th     Header, eg of MTYPE_RESULT
+ * @param[in]  reply  Plugin results, or NULL
+ * @param[in]  plen   Length of reply
+ * @retval  0  OK
+ * @retval -1  Error
+ * @see result_send_frags
+ */
+int
+result_send(struct reflector   *r,
+	    struct sockaddr_in *addr,
+	    struct twoway_hdr  *th,
+	    char               *reply,
+	    size_t              plen)
+{
+    char         hdr[TWOWAY_HDRLEN];
+    struct iovec iov[TWOWAY_IOVLEN];
+    int          niov;
+    int          ret;
+    size_t       slen = sizeof(*th)+plen+1;
+
+    if (slen > BUFSIZE)
+	return result_send_frags(r, addr, th, reply, plen);
+    if ((niov = encode_twoway_iov(iov, hdr, slen, th, reply, plen)) < 0)
+	return -1;
+    pthread_mutex_lock(&r->r_txlock);
+    ret = send_one_agent_locked(r, (struct sockaddr*)addr, sizeof(*addr),
+				iov, niov);
+    pthread_mutex_unlock(&r->r_txlock);
+    return ret;
+}
+
+/*! Remember a reply about to be sent so its tx timestamp can be matched
+ * @param[in]  r      Reflector whose socket the reply is sent on
+ * @param[in]  key    OPT_ID key the kernel will assign to the datagram
+ * @param[in]  addr   Destination address
+ * @param[in]  seq1   Sequence number of reply
+ * @see txstamp_recv
+ */
+static void
+txstamp_pending(struct reflector   *r,
+		uint32_t            key,
+		struct sockaddr_in *addr,
+		uint32_t            seq1)
+{
+    struct txpending *tp;
+
+    tp = &r->r_txpending[key%TXPENDING_LEN];
+    tp->tp_key  = key;
+    tp->tp_seq1 = seq1;
+    memcpy(&tp->tp_addr, addr, sizeof(*addr));
+}
+
+/*! Read kernel transmit timestamps from the socket error queue
+ * Each timestamp is matched with its reply via the OPT_ID key and stored
+ * in the sender, so that it can be sent in t3 of the next reply.
+ * @param[in]  r   Reflector with SO_TIMESTAMPING tx timestamps enabled
+ * @see txstamp_pending
+ */
+#ifdef HAVE_TXSTAMP
+static int
+txstamp_recv(struct reflector *r)
+{
+    int                       retval = -1;
+    struct msghdr             msg;
+    char                      cmsgbuf[ECHO_CMSGLEN];
+    struct cmsghdr           *cmsg;
+    struct scm_timestamping  *tss;
+    struct sock_extended_err *serr;
+    struct timespec           ts;
+    struct txpending         *tp;
+    struct sender            *snd;
+
+    for (;;){
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+	if (recvmsg(r->r_s, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) < 0){
+	    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		break;
+	    clicon_err(OE_UNIX, errno, "recvmsg(MSG_ERRQUEUE)");
+	    goto done;
+	}
+	tss = NULL;
+	serr = NULL;
+	for (cmsg=CMSG_FIRSTHDR(&msg); cmsg!=NULL; cmsg=CMSG_NXTHDR(&msg,cmsg)) {
+	    if (cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SCM_TIMESTAMPING)
+		tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+	    else if (cmsg->cmsg_level==IPPROTO_IP && cmsg->cmsg_type==IP_RECVERR)
+		serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+	}
+	if (tss == NULL || serr == NULL ||
+	    serr->ee_errno != ENOMSG || 
+	    serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ||
+	    serr->ee_info != SCM_TSTAMP_SND)
+	    continue;
+	tp = &r->r_txpending[serr->ee_data%TXPENDING_LEN];
+	if (tp->tp_key != serr->ee_data) /* Not a reply or overwritten */
+	    continue;
+	memcpy(&ts, &tss->ts[0], sizeof(ts)); /* ts[0] is software timestamp */
+	pthread_rwlock_rdlock(&s_lock);
+	/* Only this reflector replies to this sender, see struct reflector */
+	if ((snd = s_find(&tp->tp_addr, sizeof(tp->tp_addr))) != NULL){
+	    snd->s_t3.tv_sec = ts.tv_sec;
+	    snd->s_t3.tv_usec = ts.tv_nsec/1000;
+	    snd->s_t3seq = tp->tp_seq1;
+	    snd->s_t3ok = 1;
+	}
+	pthread_rwlock_unlock(&s_lock);
+    }
+    retval = 0;
+ done:
+    return retval;
+}
+#else /* HAVE_TXSTAMP */
+static int
+txstamp_recv(struct reflector *r)
+{
+    return 0;
+}
+#endif /* HAVE_TXSTAMP */
+
+
+
+/*! Hash of a payload, FNV-1a
+ */
+uint64_t
+plan_hash(char  *payload,
+	  size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t   i;
+
+    for (i=0; i<len; i++){
+	h ^= (unsigned char)payload[i];
+	h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*! Mark a plan empty
+ * Its buffers are kept, so that compiling the slot again does not allocate
+ * once they are large enough, eg for payloads that differ in each packet.
+ */
+static void
+plan_clear(struct plan *pl)
+{
+    pl->pl_hash = 0;
+    pl->pl_len = 0;
+    pl->pl_ncalls = 0;
+    pl->pl_parlen = 0;
+    pl->pl_deadline = 0;
+    pl->pl_gen = 0;
+}
+
+/*! Free a plan cache
+ * @param[in]  plans  Vector of PLAN_SLOTS plans
+ */
+void
+plans_free(struct plan *plans)
+{
+    struct plan *pl;
+    int          i;
+
+    for (i=0; i<PLAN_SLOTS; i++){
+	pl = &plans[i];
+	if (pl->pl_calls)
+	    free(pl->pl_calls);
+	if (pl->pl_params)
+	    free(pl->pl_params);
+	if (pl->pl_payload)
+	    free(pl->pl_payload);
+    }
+    free(plans);
+}
+
+/*! Copy the payload of a compiled plan, growing its buffer if needed
+ * @param[in]  pl       Plan
+ * @param[in]  payload  Payload in data packet
+ * @param[in]  len      Length of payload, > 0
+ */
+static int
+plan_payload(struct plan *pl,
+	     char        *payload,
+	     size_t       len)
+{
+    char *p;
+
+    if (len > pl->pl_paysize){
+	if ((p = realloc(pl->pl_payload, len)) == NULL){
+	    clicon_err(OE_UNIX, errno, "realloc");
+	    return -1;
+	}
+	pl->pl_payload = p;
+	pl->pl_paysize = len;
+    }
+    memcpy(pl->pl_payload, payload, len);
+    pl->pl_len = len;
+    return 0;
+}
+
+/*! Get room for the param of a plan call in the params of the plan
+ * The buffer may move while compiling, pc_param is set from pc_paramoff
+ * when done, see plan_get.
+ * @param[in]  pl   Plan
+ * @param[in]  pc   Call of pl
+ * @param[in]  len  Length of param including its NUL
+ * @retval     buf  Write the param here, valid until the next call
+ * @retval     NULL Error
+ */
+static char *
+plan_param(struct plan      *pl,
+	   struct plan_call *pc,
+	   size_t            len)
+{
+    size_t size;
+    char  *p;
+
+    if (pl->pl_parlen + len > pl->pl_parsize){
+	size = pl->pl_parsize ? pl->pl_parsize : 64;
+	while (size < pl->pl_parlen + len)
+	    size *= 2;
+	if ((p = realloc(pl->pl_params, size)) == NULL){
+	    clicon_err(OE_UNIX, errno, "realloc");
+	    return NULL;
+	}
+	pl->pl_params = p;
+	pl->pl_parsize = size;
+    }
+    pc->pc_paramoff = pl->pl_parlen;
+    pc->pc_param = pl->pl_params + pc->pc_paramoff;
+    pl->pl_parlen += len;
+    return pc->pc_param;
+}
+
+/*! Add a call of a plugin to a plan
+ * @param[in]  pl    Plan
+ * @param[in]  name  Name of plugin
+ * @param[out] pcp   Call, its param is not set. NULL if plugin is not found
+ *                   or disabled, then it is silently ignored
+ * @retval -1  Fatal error
+ * @retval  0  OK
+ */
+static int
+plan_call_add(struct plan       *pl,
+	      char              *name,
+	      struct plan_call **pcp)
+{
+    struct plan_call *pc;
+    struct plugin    *p;
+
+    *pcp = NULL;
+    /* Find matching plugin */
+    if ((p = plugin_find(name)) == NULL)
+	return 0;
+    if (p->p_disable || p->p_api == NULL)
+	return 0;
+    if (pl->pl_ncalls == pl->pl_maxcalls){
+	if ((pc = realloc(pl->pl_calls, 
+			  (pl->pl_ncalls+4)*sizeof(*pc))) == NULL){
+	    clicon_err(OE_UNIX, errno, "realloc");
+	    return -1;
+	}
+	pl->pl_calls = pc;
+	pl->pl_maxcalls = pl->pl_ncalls+4;
+    }
+    pc = &pl->pl_calls[pl->pl_ncalls++];
+    memset(pc, 0, sizeof(*pc));
+    pc->pc_plugin = p;
+    *pcp = pc;
+    return 0;
+}
+
+/*! Compile one plugin object of a payload into a plan call
+ * Eg {"name":"p1","param":"12"}. param may also be an array, then only its
+ * first element is used.
+ * @param[in]  jl   Tokenizer, at the first token of the plugin object
+ * @param[in]  t    The first token
+ * @param[out] pl   Plan, the call is added if the plugin is enabled
+ * @retval -1  Fatal error
+ * @retval  0  Error in packet, drop and continue
+ * @retval  1  OK
+ */
+static int
+plan_compile_plugin(struct json_lexer *jl,
+		    struct json_tok   *t,
+		    struct plan       *pl)
+{
+    struct json_tok   tname = {JT_END,};
+    struct json_tok   tparam = {JT_END,};
+    struct plan_call *pc;
+    char              name[MAXPATHLEN];
+    char             *param;
+
+    if (t->jt_type != JT_OBJ){
+	if (json_lex_skip(jl, t) < 0)
+	    clicon_log(LOG_ERR, "%s: malformed payload", __FUNCTION__);
+	else
+	    clicon_log(LOG_ERR, "%s: <name> expected in plugin", __FUNCTION__);
+	__sync_fetch_and_add(&errpkts, 1);
+	return 0;
+    }
+    while (json_lex_next(jl, t) == JT_KEY){
+	if (json_tok_eq(t, "name")){
+	    if (json_lex_next(jl, t) == JT_ERROR || json_lex_skip(jl, t) < 0)
+		break;
+	    tname = *t;
+	}
+	else if (json_tok_eq(t, "param")){
+	    if (json_lex_next(jl, t) == JT_ARR){ /* XXX only single argument */
+		if (json_lex_next(jl, t) == JT_ARREND)
+		    continue;
+		tparam = *t;
+		while (t->jt_type != JT_ERROR && t->jt_type != JT_ARREND)
+		    if (json_lex_skip(jl, t) < 0 || json_lex_next(jl, t) == JT_ERROR)
+			break;
+	    }
+	    else{
+		tparam = *t;
+		if (json_lex_skip(jl, t) < 0)
+		    break;
+	    }
+	}
+	else if (json_lex_next(jl, t) == JT_ERROR || json_lex_skip(jl, t) < 0)
+	    break;
+    }
+    if (t->jt_type != JT_OBJEND){
+	clicon_log(LOG_ERR, "%s: malformed payload", __FUNCTION__);
+	__sync_fetch_and_add(&errpkts, 1);
+	return 0;
+    }
+    if (json_tok_str(&tname, name, sizeof(name)) < 0){
+	clicon_log(LOG_ERR, "%s: <name> expected in plugin", __FUNCTION__);
+	__sync_fetch_and_add(&errpkts, 1);
+	return 0;
+    }
+    if (plan_call_add(pl, name, &pc) < 0)
+	return -1;
+    if (pc && json_tok_scalar(&tparam)){ /* Unescaped is never longer */
+	if ((param = plan_param(pl, pc, tparam.jt_len+1)) == NULL)
+	    return -1;
+	json_tok_str(&tparam, param, tparam.jt_len+1);
+    }
+    return 1;
+}
+
+/*! Compile a payload into a plan: check version and name and resolve the
+ * plugins it requests
+ * Payloads look like:
+ * {"grideye":{"version":2,"name":"a1","plugin":[{"name":"p1","param":"12"},{"name":"p2"}]}}
+ * and may set the deadline of its plugins in ms, eg "deadline":500.
+ * The payload is read in one pass with the tokenizer of grideye_json.c,
+ * members other than these are skipped.
+ * @param[in]  myname   Name of this agent
+ * @param[in]  payload  String payload in data packet
+ * @param[in]  len      Length of payload
+ * @param[out] pl       Plan, cleared if not OK
+ * @retval -1  Fatal error
+ * @retval  0  Error in packet, drop and continue
+ * @retval  1  OK
+ */
+static int
+plan_compile(char        *myname,
+	     char        *payload,
+	     size_t       len,
+	     struct plan *pl)
+{
+    int                retval = -1;
+    int                ret;
+    struct json_lexer  jl;
+    struct json_tok    t;
+    struct json_tok    tversion = {JT_END,};
+    struct json_tok    tname = {JT_END,};
+    struct json_tok    tdeadline = {JT_END,};
+    char               buf[64];
+
+    json_lex_init(&jl, payload, len);
+    if (json_lex_next(&jl, &t) != JT_OBJ)
+	goto malformed;
+    while (json_lex_next(&jl, &t) == JT_KEY){
+	if (!json_tok_eq(&t, "grideye")){
+	    if (json_lex_next(&jl, &t) == JT_ERROR || json_lex_skip(&jl, &t) < 0)
+		break;
+	    continue;
+	}
+	if (json_lex_next(&jl, &t) != JT_OBJ){
+	    if (json_lex_skip(&jl, &t) < 0)
+		break;
+	    continue;
+	}
+	while (json_lex_next(&jl, &t) == JT_KEY){
+	    if (json_tok_eq(&t, "version")){
+		if (json_lex_next(&jl, &t) == JT_ERROR || json_lex_skip(&jl, &t) < 0)
+		    break;
+		tversion = t;
+	    }
+	    else if (json_tok_eq(&t, "name")){
+		if (json_lex_next(&jl, &t) == JT_ERROR || json_lex_skip(&jl, &t) < 0)
+		    break;
+		tname = t;
+	    }
+	    else if (json_tok_eq(&t, "deadline")){
+		if (json_lex_next(&jl, &t) == JT_ERROR || json_lex_skip(&jl, &t) < 0)
+		    break;
+		tdeadline = t;
+	    }
+	    else if (json_tok_eq(&t, "plugin")){
+		if (json_lex_next(&jl, &t) != JT_ARR){
+		    if ((ret = plan_compile_plugin(&jl, &t, pl)) < 1){
+			retval = ret;
+			goto done;
+		    }
+		    continue;
+		}
+		while (json_lex_next(&jl, &t) != JT_ARREND && t.jt_type != JT_ERROR)
+		    if ((ret = plan_compile_plugin(&jl, &t, pl)) < 1){
+			retval = ret;
+			goto done;
+		    }
+	    }
+	    else if (json_lex_next(&jl, &t) == JT_ERROR || json_lex_skip(&jl, &t) < 0)
+		break;
+	}
+	if (t.jt_type != JT_OBJEND)
+	    break;
+    }
+    if (t.jt_type != JT_OBJEND || json_lex_next(&jl, &t) != JT_END)
+	goto malformed;
+    /* Check version */
+    if (tversion.jt_type == JT_END){
+	clicon_log(LOG_ERR, "%s: <version> not found in payload", 
+		   __FUNCTION__);
+	retval = 0; 	    /* sanity check failed, just continue */
+	__sync_fetch_and_add(&errpkts, 1);
+	goto done;
+    }
+    if (json_tok_str(&tversion, buf, sizeof(buf)) < 0 ||
+	atoi(buf) != GRIDEYE_AGENT_VERSION){
+	clicon_log(LOG_ERR, "%s: Sender version %d expected, received %.*s", 
+		   __FUNCTION__, GRIDEYE_AGENT_VERSION,
+		   (int)tversion.jt_len, tversion.jt_s);
+	retval = 0; 	    /* sanity check failed, just continue */
+	__sync_fetch_and_add(&errpkts, 1);
+	goto done;
+    }
+    /* Verify name of agent */
+    if (tname.jt_type == JT_END){
+	clicon_log(LOG_ERR, "%s: <name> not found in payload", 
+		   __FUNCTION__);
+	retval = 0; 	    /* sanity check failed, just continue */
+	__sync_fetch_and_add(&errpkts, 1);
+	goto done;
+    }
+    if (!json_tok_scalar(&tname) || !json_tok_eq(&tname, myname)){
+	clicon_log(LOG_ERR, "%s: Expected name %s but received %.*s", 
+		   __FUNCTION__, myname, (int)tname.jt_len, tname.jt_s);
+	retval = 0; 	    /* sanity check failed, just continue */
+	__sync_fetch_and_add(&errpkts, 1);
+	goto done;
+    }
+    if (tdeadline.jt_type != JT_END &&
+	json_tok_str(&tdeadline, buf, sizeof(buf)) >= 0)
+	pl->pl_deadline = atoi(buf);
+    if (plan_payload(pl, payload, len) < 0)
+	goto done;
+    retval = 1; /* OK */
+    goto done;
+ malformed:
+    clicon_log(LOG_ERR, "%s: malformed payload", __FUNCTION__);
+    retval = 0; 	    /* sanity check failed, just continue */
+    __sync_fetch_and_add(&errpkts, 1);
+ done:
+    if (retval < 1)
+	plan_clear(pl);
+    return retval;
+}
+
+/*! Next item of a cbor array or map
+ * @param[in]     cr  Decoder
+ * @param[in]     ch  Head of array or map
+ * @param[in,out] n   Items read, for maps keys read
+ * @param[out]    ci  Item
+ * @retval  1  OK
+ * @retval  0  End of array or map
+ * @retval -1  Malformed
+ */
+static int
+plan_cbor_next(struct cbor_reader *cr,
+	       struct cbor_item   *ch,
+	       uint64_t           *n,
+	       struct cbor_item   *ci)
+{
+    if (!ch->ci_indef && *n == ch->ci_val)
+	return 0;
+    if (cbor_next(cr, ci) < 0)
+	return -1;
+    if (ci->ci_major < 0)
+	return ch->ci_indef ? 0 : -1;
+    (*n)++;
+    return 1;
+}
+
+/*! Next key of a cbor map, see plan_cbor_next. Keys other than text are
+ * skipped as a whole
+ */
+static int
+plan_cbor_key(struct cbor_reader *cr,
+	      struct cbor_item   *ch,
+	      uint64_t           *n,
+	      struct cbor_item   *ci)
+{
+    int ret;
+
+    if ((ret = plan_cbor_next(cr, ch, n, ci)) == 1 && cbor_skip(cr, ci) < 0)
+	return -1;
+    return ret;
+}
+
+/*! Head of the value of a cbor map key
+ * @retval  0  OK
+ * @retval -1  Malformed
+ */
+static int
+plan_cbor_value(struct cbor_reader *cr,
+		struct cbor_item   *ci)
+{
+    if (cbor_next(cr, ci) < 0 || ci->ci_major < 0)
+	return -1;
+    return 0;
+}
+
+/*! Copy a cbor text or unsigned integer as a string
+ * @param[in]  ci   Item
+ * @param[out] buf  String
+ * @param[in]  len  Length of buf
+ * @retval  0  OK
+ * @retval -1  Not text or unsigned, or does not fit
+ */
+static int
+plan_cbor_str(struct cbor_item *ci,
+	      char             *buf,
+	      size_t            len)
+{
+    if (ci->ci_major == CBOR_UINT)
+	return snprintf(buf, len, "%" PRIu64, ci->ci_val) < len ? 0 : -1;
+    if (ci->ci_major != CBOR_TEXT || ci->ci_val >= len)
+	return -1;
+    memcpy(buf, ci->ci_s, ci->ci_val);
+    buf[ci->ci_val] = '\0';
+    return 0;
+}
+
+/*! Compile one plugin map of a cbor payload into a plan call
+ * As plan_compile_plugin, eg {"name":"p1","param":"12"}
+ * @param[in]  cr   Decoder
+ * @param[in]  ch   Head of the plugin item
+ * @param[out] pl   Plan, the call is added if the plugin is enabled
+ * @retval -1  Fatal error
+ * @retval  0  Error in packet, drop and continue
+ * @retval  1  OK
+ */
+static int
+plan_compile_cbor_plugin(struct cbor_reader *cr,
+			 struct cbor_item   *ch,
+			 struct plan        *pl)
+{
+    struct cbor_item  ci;
+    struct cbor_item  ca;
+    struct cbor_item  cname = {CBOR_SIMPLE,};
+    struct cbor_item  cparam = {CBOR_SIMPLE,};
+    struct plan_call *pc;
+    char              name[MAXPATHLEN];
+    uint64_t          n = 0;
+    uint64_t          na;
+    int               ret;
+    char             *param;
+
+    if (ch->ci_major != CBOR_MAP){
+	if (cbor_skip(cr, ch) < 0)
+	    goto malformed;
+	clicon_log(LOG_ERR, "%s: <name> expected in plugin", __FUNCTION__);
+	__sync_fetch_and_add(&errpkts, 1);
+	return 0;
+    }
+    while ((ret = plan_cbor_key(cr, ch, &n, &ci)) == 1){
+	if (cbor_text_eq(&ci, "name")){
+	    if (plan_cbor_value(cr, &cname) < 0 || cbor_skip(cr, &cname) < 0)
+		goto malformed;
+	}
+	else if (cbor_text_eq(&ci, "param")){
+	    if (plan_cbor_value(cr, &ci) < 0)
+		goto malformed;
+	    if (ci.ci_major != CBOR_ARRAY){ /* XXX only single argument */
+		if (cbor_skip(cr, &ci) < 0)
+		    goto malformed;
+		cparam = ci;
+		continue;
+	    }
+	    na = 0;
+	    while ((ret = plan_cbor_next(cr, &ci, &na, &ca)) == 1){
+		if (na == 1)
+		    cparam = ca;
+		if (cbor_skip(cr, &ca) < 0)
+		    goto malformed;
+	    }
+	    if (ret < 0)
+		goto malformed;
+	}
+	else if (plan_cbor_value(cr, &ci) < 0 || cbor_skip(cr, &ci) < 0)
+	    goto malformed;
+    }
+    if (ret < 0)
+	goto malformed;
+    if (plan_cbor_str(&cname, name, sizeof(name)) < 0){
+	clicon_log(LOG_ERR, "%s: <name> expected in plugin", __FUNCTION__);
+	__sync_fetch_and_add(&errpkts, 1);
+	return 0;
+    }
+    if (plan_call_add(pl, name, &pc) < 0)
+	return -1;
+    if (pc && (cparam.ci_major == CBOR_TEXT || cparam.ci_major == CBOR_UINT)){
+	n = cparam.ci_major == CBOR_TEXT ? cparam.ci_val+1 : 21; /* 2^64 */
+	if ((param = plan_param(pl, pc, n)) == NULL)
+	    return -1;
+	plan_cbor_str(&cparam, param, n);
+    }
+    return 1;
+ malformed:
+    clicon_log(LOG_ERR, "%s: malformed payload", __FUNCTION__);
+    __sync_fetch_and_add(&errpkts, 1);
+    return 0;
+}
+
+/*! Compile a cbor payload into a plan
+ * As plan_compile but the payload is the same map encoded in cbor and
+ * prefixed with CBOR_MAGIC. version may be text or an unsigned integer.
+ * @param[in]  myname   Name of this agent
+ * @param[in]  payload  Cbor payload in data packet
+ * @param[in]  len      Length of payload
+ * @param[out] pl       Plan, cleared if not OK
+ * @retval -1  Fatal error
+ * @retval  0  Error in packet, drop and continue
+ * @retval  1  OK
+ * @see grideye_cbor.c
+ */
+static int
+plan_compile_cbor(char        *myname,
+		  char        *payload,
+		  size_t       len,
+		  struct plan *pl)
+{
+    int                retval = -1;
+    int                ret;
+    struct cbor_reader cr;
+    struct cbor_item   ch;
+    struct cbor_item   cg;
+    struct cbor_item   ci;
+    struct cbor_item   cp;
+    struct cbor_item   cversion = {CBOR_SIMPLE,};
+    struct cbor_item   cname = {CBOR_SIMPLE,};
+    struct cbor_item   cdeadline = {CBOR_SIMPLE,};
+    uint64_t           n = 0;
+    uint64_t           ng;
+    uint64_t           np;
+    char               buf[64];
+
+    cbor_init(&cr, payload, len);
+    if (cbor_next(&cr, &ch) < 0 || ch.ci_major != CBOR_TAG ||
+	cbor_next(&cr, &ch) < 0 || ch.ci_major != CBOR_MAP)
+	goto malformed;
+    while ((ret = plan_cbor_key(&cr, &ch, &n, &ci)) == 1){
+	if (plan_cbor_value(&cr, &cg) < 0)
+	    goto malformed;
+	if (!cbor_text_eq(&ci, "grideye") || cg.ci_major != CBOR_MAP){
+	    if (cbor_skip(&cr, &cg) < 0)
+		goto malformed;
+	    continue;
+	}
+	ng = 0;
+	while ((ret = plan_cbor_key(&cr, &cg, &ng, &ci)) == 1){
+	    if (cbor_text_eq(&ci, "version")){
+		if (plan_cbor_value(&cr, &cversion) < 0 ||
+		    cbor_skip(&cr, &cversion) < 0)
+		    goto malformed;
+	    }
+	    else if (cbor_text_eq(&ci, "name")){
+		if (plan_cbor_value(&cr, &cname) < 0 ||
+		    cbor_skip(&cr, &cname) < 0)
+		    goto malformed;
+	    }
+	    else if (cbor_text_eq(&ci, "deadline")){
+		if (plan_cbor_value(&cr, &cdeadline) < 0 ||
+		    cbor_skip(&cr, &cdeadline) < 0)
+		    goto malformed;
+	    }
+	    else if (cbor_text_eq(&ci, "plugin")){
+		if (plan_cbor_value(&cr, &ci) < 0)
+		    goto malformed;
+		if (ci.ci_major != CBOR_ARRAY){
+		    if ((ret = plan_compile_cbor_plugin(&cr, &ci, pl)) < 1){
+			retval = ret;
+			goto done;
+		    }
+		    continue;
+		}
+		np = 0;
+		while ((ret = plan_cbor_next(&cr, &ci, &np, &cp)) == 1)
+		    if ((ret = plan_compile_cbor_plugin(&cr, &cp, pl)) < 1){
+			retval = ret;
+			goto done;
+		    }
+		if (ret < 0)
+		    goto malformed;
+	    }
+	    else if (plan_cbor_value(&cr, &ci) < 0 || cbor_skip(&cr, &ci) < 0)
+		goto malformed;
+	}
+	if (ret < 0)
+	    goto malformed;
+    }
+    if (ret < 0 || cr.cr_p != cr.cr_end)
+	goto malformed;
+    /* Check version */
+    if (plan_cbor_str(&cversion, buf, sizeof(buf)) < 0){
+	clicon_log(LOG_ERR, "%s: <version> not found in payload", 
+		   __FUNCTION__);
+	retval = 0; 	    /* sanity check failed, just continue */
+	__sync_fetch_and_add(&errpkts, 1);
+	goto done;
+    }
+    if (atoi(buf) != GRIDEYE_AGENT_VERSION){
+	clicon_log(LOG_ERR, "%s: Sender version %d expected, received %s", 
+		   __FUNCTION__, GRIDEYE_AGENT_VERSION, buf);
+	retval = 0; 	    /* sanity check failed, just continue */
+	__sync_fetch_and_add(&errpkts, 1);
+	goto done;
+    }
+    /* Verify name of agent, in place since it may be longer than buf */
+    if (cname.ci_major != CBOR_TEXT && cname.ci_major != CBOR_UINT){
+	clicon_log(LOG_ERR, "%s: <name> not found in payload", 
+		   __FUNCTION__);
+	retval = 0; 	    /* sanity check failed, just continue */
+	__sync_fetch_and_add(&errpkts, 1);
+	goto done;
+    }
+    if (!cbor_text_eq(&cname, myname)){
+	clicon_log(LOG_ERR, "%s: Expected name %s but received %.*s", 
+		   __FUNCTION__, myname,
+		   cname.ci_major == CBOR_TEXT ? (int)cname.ci_val : 0,
+		   cname.ci_major == CBOR_TEXT ? (char *)cname.ci_s : "");
+	retval = 0; 	    /* sanity check failed, just continue */
+	__sync_fetch_and_add(&errpkts, 1);
+	goto done;
+    }
+    if (plan_cbor_str(&cdeadline, buf, sizeof(buf)) == 0)
+	pl->pl_deadline = atoi(buf);
+    if (plan_payload(pl, payload, len) < 0)
+	goto done;
+    retval = 1; /* OK */
+    goto done;
+ malformed:
+    clicon_log(LOG_ERR, "%s: malformed payload", __FUNCTION__);
+    retval = 0; 	    /* sanity check failed, just continue */
+    __sync_fetch_and_add(&errpkts, 1);
+ done:
+    if (retval < 1)
+	plan_clear(pl);
+    return retval;
+}
+
+/*! Get the plan of a payload, compile it if it is not in the cache
+ * The cache is per thread and has one plan per slot, indexed by the payload
+ * hash. A hit is verified by comparing the payload bytes.
+ * @param[in]  plans    Plan cache of calling thread, PLAN_SLOTS plans
+ * @param[in]  myname   Name of this agent
+ * @param[in]  payload  Payload in data packet, json or cbor
+ * @param[in]  len      Length of payload
+ * @param[in]  gen      Generation of plugins in use, a plan of an older
+ *                      one is compiled again
+ * @param[out] plp      Plan, valid until the next call with plans
+ * @retval -1  Fatal error
+ * @retval  0  Error in packet, drop and continue
+ * @retval  1  OK
+ */
+static int
+plan_get(struct plan  *plans,
+	 char         *myname,
+	 char         *payload,
+	 size_t        len,
+	 unsigned      gen,
+	 struct plan **plp)
+{
+    uint64_t     h = plan_hash(payload, len);
+    struct plan *pl = &plans[h % PLAN_SLOTS];
+    int          ret;
+    int          i;
+    struct plan_call *pc;
+
+    if (pl->pl_len == 0 || pl->pl_hash != h || pl->pl_len != len ||
+	pl->pl_gen != gen || memcmp(pl->pl_payload, payload, len) != 0){
+	plan_clear(pl);
+	if (cbor_is(payload, len))
+	    ret = plan_compile_cbor(myname, payload, len, pl);
+	else
+	    ret = plan_compile(myname, payload, len, pl);
+	if (ret < 1)
+	    return ret;
+	pl->pl_hash = h;
+	pl->pl_gen = gen;
+	for (i=0; i<pl->pl_ncalls; i++){
+	    pc = &pl->pl_calls[i];
+	    if (pc->pc_param) /* pl_params may have moved */
+		pc->pc_param = pl->pl_params + pc->pc_paramoff;
+	    pc->pc_key = pc->pc_param ?
+		plan_hash(pc->pc_param, strlen(pc->pc_param)) : 0;
+	}
+	if (debug)
+	    clicon_log(LOG_DEBUG, "%s: compiled %d calls", __FUNCTION__, 
+		       pl->pl_ncalls);
+    }
+    *plp = pl;
+    return 1;
+}
+
+/*! Write an unsigned integer plugin result as <key>val</key>
+ * @see struct grideye_writer
+ */
+static int
+result_write_u64(struct grideye_writer *gw,
+		 const char            *key,
+		 uint64_t               val)
+{
+    struct result_writer *rw = gw->gw_arg;
+    int                   n;
+
+    if ((n = arena_cprintf(rw->rw_arena, rw->rw_reply, "<%s>%" PRIu64 "</%s>",
+			   key, val, key)) < 0)
+	return -1;
+    rw->rw_len += n;
+    return 0;
+}
+
+/*! Write a decimal plugin result val*10^-fd as <key>val</key>
+ * @see struct grideye_writer
+ */
+static int
+result_write_dec(struct grideye_writer *gw,
+		 const char            *key,
+		 int64_t                val,
+		 int                    fd)
+{
+    struct result_writer *rw = gw->gw_arg;
+    uint64_t              u;
+    uint64_t              d = 1;
+    int                   i;
+    int                   n;
+
+    if (fd < 0 || fd > 18){
+	clicon_err(OE_UNIX, EINVAL, "%s: fraction-digits %d", __FUNCTION__, fd);
+	return -1;
+    }
+    for (i=0; i<fd; i++)
+	d *= 10;
+    u = val<0 ? -(uint64_t)val : (uint64_t)val;
+    if (fd == 0)
+	n = arena_cprintf(rw->rw_arena, rw->rw_reply, "<%s>%s%" PRIu64 "</%s>",
+			  key, val<0?"-":"", u, key);
+    else
+	n = arena_cprintf(rw->rw_arena, rw->rw_reply, "<%s>%s%" PRIu64 ".%0*" PRIu64 "</%s>",
+			  key, val<0?"-":"", u/d, fd, u%d, key);
+    if (n < 0)
+	return -1;
+    rw->rw_len += n;
+    return 0;
+}
+
+/*! Write a string plugin result as <key>val</key>, XML-escaped
+ * @see struct grideye_writer
+ */
+static int
+result_write_str(struct grideye_writer *gw,
+		 const char            *key,
+		 const char            *val)
+{
+    struct result_writer *rw = gw->gw_arg;
+    const char           *p;
+    char                 *esc;
+    char                 *e;
+    int                   n;
+
+    if (strpbrk(val, "<>&") == NULL)
+	esc = (char*)val;
+    else{
+	if ((esc = e = arena_alloc(rw->rw_arena, 5*strlen(val)+1)) == NULL)
+	    return -1;
+	for (p = val; *p; p++)
+	    switch (*p){
+	    case '<': e = stpcpy(e, "&lt;"); break;
+	    case '>': e = stpcpy(e, "&gt;"); break;
+	    case '&': e = stpcpy(e, "&amp;"); break;
+	    default: *e++ = *p; break;
+	    }
+	*e = '\0';
+    }
+    if ((n = arena_cprintf(rw->rw_arena, rw->rw_reply, "<%s>%s</%s>",
+			   key, esc, key)) < 0)
+	return -1;
+    rw->rw_len += n;
+    return 0;
+}
+
+/*! Append bytes to a cbor reply, the map is started on the first write
+ */
+static int
+result_cbor_append(struct result_writer *rw,
+		   const void           *data,
+		   size_t                n)
+{
+    if (rw->rw_len == 0){
+	if (arena_append(rw->rw_arena, rw->rw_reply, 0, 
+			 CBOR_MAGIC "\xbf", CBOR_MAGICLEN+1) < 0)
+	    return -1;
+	rw->rw_len = CBOR_MAGICLEN+1;
+    }
+    if (arena_append(rw->rw_arena, rw->rw_reply, rw->rw_len, data, n) < 0)
+	return -1;
+    rw->rw_len += n;
+    return 0;
+}
+
+/*! Append a text item to a cbor reply, eg a key
+ */
+static int
+result_cbor_text(struct result_writer *rw,
+		 const char           *str)
+{
+    uint8_t h[CBOR_HEADLEN];
+    size_t  len = strlen(str);
+
+    if (result_cbor_append(rw, h, cbor_head(h, CBOR_TEXT, len)) < 0 ||
+	result_cbor_append(rw, str, len) < 0)
+	return -1;
+    return 0;
+}
+
+/*! Write an unsigned integer plugin result as key: uint in a cbor map
+ * @see struct grideye_writer
+ */
+static int
+result_cbor_u64(struct grideye_writer *gw,
+		const char            *key,
+		uint64_t               val)
+{
+    struct result_writer *rw = gw->gw_arg;
+    uint8_t               h[CBOR_HEADLEN];
+
+    if (result_cbor_text(rw, key) < 0 ||
+	result_cbor_append(rw, h, cbor_head(h, CBOR_UINT, val)) < 0)
+	return -1;
+    return 0;
+}
+
+/*! Write a decimal plugin result val*10^-fd in a cbor map
+ * As an integer if fd is 0, else as a decimal fraction 4([-fd, val])
+ * @see struct grideye_writer
+ */
+static int
+result_cbor_dec(struct grideye_writer *gw,
+		const char            *key,
+		int64_t                val,
+		int                    fd)
+{
+    struct result_writer *rw = gw->gw_arg;
+    uint8_t               h[3+CBOR_HEADLEN];
+    int                   n = 0;
+
+    if (fd < 0 || fd > 18){
+	clicon_err(OE_UNIX, EINVAL, "%s: fraction-digits %d", __FUNCTION__, fd);
+	return -1;
+    }
+    if (fd){
+	h[n++] = (CBOR_TAG<<5) | CBOR_TAG_DECIMAL;
+	h[n++] = (CBOR_ARRAY<<5) | 2;
+	h[n++] = (CBOR_NINT<<5) | (fd-1);  /* -fd */
+    }
+    if (val < 0)
+	n += cbor_head(h+n, CBOR_NINT, -(val+1));
+    else
+	n += cbor_head(h+n, CBOR_UINT, val);
+    if (result_cbor_text(rw, key) < 0 || result_cbor_append(rw, h, n) < 0)
+	return -1;
+    return 0;
+}
+
+/*! Write a string plugin result as key: text in a cbor map
+ * @see struct grideye_writer
+ */
+static int
+result_cbor_str(struct grideye_writer *gw,
+		const char            *key,
+		const char            *val)
+{
+    struct result_writer *rw = gw->gw_arg;
+
+    if (result_cbor_text(rw, key) < 0 || result_cbor_text(rw, val) < 0)
+	return -1;
+    return 0;
+}
+
+/*! Initialize a writer of plugin results
+ * @param[out] rw     Writer
+ * @param[in]  a      Arena of calling thread
+ * @param[out] reply  Plugin results allocated in a, set to NULL
+ * @param[in]  cbor   Write a cbor map, else XML text
+ */
+void
+result_init(struct result_writer *rw,
+	    struct arena         *a,
+	    char                **reply,
+	    int                   cbor)
+{
+    memset(rw, 0, sizeof(*rw));
+    rw->rw_gw.gw_u64 = cbor ? result_cbor_u64 : result_write_u64;
+    rw->rw_gw.gw_dec = cbor ? result_cbor_dec : result_write_dec;
+    rw->rw_gw.gw_str = cbor ? result_cbor_str : result_write_str;
+    rw->rw_gw.gw_arg = rw;
+    rw->rw_arena = a;
+    rw->rw_reply = reply;
+    rw->rw_cbor = cbor;
+    *reply = NULL;
+}
+
+/*! Drop what was written after len, eg by a failed plugin
+ */
+void
+result_truncate(struct result_writer *rw,
+		size_t                len)
+{
+    rw->rw_len = len;
+    if (*rw->rw_reply)
+	(*rw->rw_reply)[len] = '\0';
+}
+
+/*! All results are written, close the cbor map
+ * @retval  0  OK
+ * @retval -1  Error
+ */
+int
+result_end(struct result_writer *rw)
+{
+    uint8_t b = CBOR_BREAK;
+
+    if (rw->rw_cbor && rw->rw_len)
+	return result_cbor_append(rw, &b, 1);
+    return 0;
+}
+
+/*! Append written results, ie XML text or cbor map items
+ * @param[in]  rw    Writer
+ * @param[in]  data  Results in the encoding of rw
+ * @param[in]  n     Length of data
+ * @retval  0  OK
+ * @retval -1  Error
+ */
+int
+result_append(struct result_writer *rw,
+	      const char           *data,
+	      size_t                n)
+{
+    if (n == 0)
+	return 0;
+    if (rw->rw_cbor)
+	return result_cbor_append(rw, data, n);
+    if (arena_append(rw->rw_arena, rw->rw_reply, rw->rw_len, data, n) < 0)
+	return -1;
+    rw->rw_len += n;
+    return 0;
+}
+
+/*! Append the results of another writer, eg of a fan-out task
+ * @param[in]  rw    Writer
+ * @param[in]  data  Results of a writer of the same encoding, not ended
+ * @param[in]  n     Length of data
+ * @retval  0  OK
+ * @retval -1  Error
+ */
+int
+result_merge(struct result_writer *rw,
+	     const char           *data,
+	     size_t                n)
+{
+    if (n == 0)
+	return 0;
+    if (rw->rw_cbor) /* Without the start of its map */
+	return result_append(rw, data+CBOR_MAGICLEN+1, n-CBOR_MAGICLEN-1);
+    return result_append(rw, data, n);
+}
+
+/*! Compress plugin results if the sender enabled it and they are large enough
+ * The results are replaced only if they get smaller, see compress_payload.
+ * @param[in]     a      Arena of calling thread, reply is allocated in it
+ * @param[in]     enc    Result encoding ENC_* of sender
+ * @param[in,out] reply  Plugin results, or NULL
+ * @param[in,out] plen   Length of reply
+ * @retval  0  OK, reply may or may not be compressed
+ * @retval -1  Error
+ */
+int
+result_compress(struct arena *a,
+		int           enc,
+		char        **reply,
+		size_t       *plen)
+{
+    char   *out;
+    size_t  outlen;
+    int     ret;
+
+    if ((enc & ENC_ZLIB) == 0 || compress_min == 0 ||
+	*reply == NULL || *plen < (size_t)compress_min)
+	return 0;
+    if ((ret = compress_payload(a, *reply, *plen, &out, &outlen)) < 0)
+	return -1;
+    if (ret == 1){
+	*reply = out;
+	*plen = outlen;
+    }
+    return 0;
+}
+
+/*! Call the test function of a v2 plugin and add its string result to reply
+ * XML results are added as is. JSON results are reduced to their first 
+ * member, see json_member_compact. In a cbor reply the string is the text
+ * value of the plugin name.
+ * @param[in]  p       Plugin, v2
+ * @param[in]  argstr  Parameter, or NULL
+ * @param[in]  rw      Writer of plugin results
+ * @retval -1  Fatal error
+ * @retval  0  Test failed
+ * @retval  1  OK
+ */
+static int
+plugin_test_v2(struct plugin        *p,
+	       char                 *argstr,
+	       struct result_writer *rw)
+{
+    int                           retval = -1;
+    struct grideye_plugin_api_v2 *api = p->p_api2;
+    char                         *str = NULL;
+    int                           pret;
+    size_t                        len;
+    char                         *js;
+    int                           n;
+
+    if ((pret = api->gp_test_fn(argstr, &str)) < 0){
+	clicon_log(LOG_NOTICE, "plugin %s failed: retval:%d str:%s", p->p_name, pret, str);
+	retval = 0;
+	goto done;
+    }
+    if (str){
+	js = str; /* XML */
+	if (strcmp(api->gp_output_format, "json")==0){
+	    len = 2*strlen(str)+3;
+	    if ((js = arena_alloc(rw->rw_arena, len)) == NULL)
+		goto done;
+	    if (json_member_compact(str, strlen(str), js, len) < 0){
+		clicon_log(LOG_NOTICE, "plugin %s: invalid json: %s", p->p_name, str);
+		retval = 1;
+		goto done;
+	    }
+	}
+	if (rw->rw_cbor){
+	    if (result_cbor_str(&rw->rw_gw, p->p_name, js) < 0)
+		goto done;
+	}
+	else{
+	    if ((n = arena_cprintf(rw->rw_arena, rw->rw_reply, "%s", js)) < 0)
+		goto done;
+	    rw->rw_len += n;
+	}
+    }
+    retval = 1;
+ done:
+    if (str)
+	free(str);
+    return retval;
+}
+
+/*! Run a blocking plugin test in this process and write its results
+ * A failed test is logged and what it wrote is dropped.
+ * @param[in]  p       Plugin, v2 or v3 with gp_test_fn
+ * @param[in]  argstr  Parameter, or NULL
+ * @param[in]  rw      Writer of results
+ * @retval -1  Fatal error
+ * @retval  0  Test failed
+ * @retval  1  OK
+ */
+int
+plugin_test(struct plugin        *p,
+	    char                 *argstr,
+	    struct result_writer *rw)
+{
+    size_t         len;
+    int            pret;
+
+    if (p->p_api2)
+	return plugin_test_v2(p, argstr, rw);
+    len = rw->rw_len;
+    if ((pret = p->p_api->gp_test_fn(argstr, &rw->rw_gw)) < 0){
+	clicon_log(LOG_NOTICE, "plugin %s failed: retval:%d", p->p_name, pret);
+	result_truncate(rw, len); /* Drop what it wrote */
+	return 0;
+    }
+    return 1;
+}
+
+/*! Run a blocking plugin test and write its results
+ * The test runs in a worker process of the calling thread with -O, else in
+ * this thread, see plugin_test. The result of a plugin with gp_cache_ms is
+ * kept, see cache_put.
+ * @param[in]  p       Plugin, v2 or v3 with gp_test_fn
+ * @param[in]  argstr  Parameter, or NULL
+ * @param[in]  key     Hash of argstr, see plan_call
+ * @param[in]  rw      Writer of results
+ * @retval -1  Fatal error
+ * @retval  0  Test failed
+ * @retval  1  OK
+ */
+int
+plugin_call(struct plugin        *p,
+	    char                 *argstr,
+	    uint64_t              key,
+	    struct result_writer *rw)
+{
+    size_t         len;
+    struct timeval t = {0,};
+    char          *data;
+    size_t         n;
+    int            ret;
+
+    len = rw->rw_len;
+    if (p->p_cache)
+	t = gettimestamp();
+    if (isolate_on){
+	if ((ret = isolate_call(p, argstr, key,
+				rw->rw_cbor ? ISOLATE_CBOR : ISOLATE_TEXT,
+				&data, &n)) != 1)
+	    return ret;
+	ret = result_merge(rw, data, n);
+	isolate_release();
+	if (ret < 0)
+	    return -1;
+    }
+    else if ((ret = plugin_test(p, argstr, rw)) != 1)
+	return ret;
+    if (p->p_cache && cache_put(p, key, rw, len, t) < 0)
+	return -1;
+    return 1;
+}
+
+/*! Received grideye data packet from a registered sender. Make application 
+ * emulation
+ * The payload is compiled into a plan once and then taken from the plan 
+ * cache of the thread, so repeated payloads are not parsed.
+ * v3 plugins write their results directly into reply, see result_writer,
+ * v2 plugins return a string that is copied, see plugin_test_v2.
+ * Plugins with non-blocking tests are started and returned in ajp, their
+ * results are sent later, see async_submit. A test sampled in the 
+ * background is not run, its latest result is sent, see sample_get.
+ * With fan-out threads (-J) the blocking tests run in parallel and their
+ * results are appended after the others when all are done or the deadline
+ * passed, see fanout_wait.
+ * @param[in]  myname  Name of this agent
+ * @param[in]  payload Payload in data packet, json or cbor, or NULL
+ * @param[in]  paylen  Length of payload
+ * @param[in]  plans   Plan cache of calling thread, see plan_get
+ * @param[in]  a       Arena of calling thread
+ * @param[in]  enc     Result encoding ENC_*, eg cbor, else XML text
+ * @param[out] reply   Plugin results allocated in a, or NULL if none
+ * @param[out] rlen    Length of reply
+ * @param[out] ajp     Started non-blocking tests, or NULL if none
+ * @retval -1  Fatal error
+ * @retval  0  Error in packet, drop and continue
+ * @retval  1  OK
+ * @note May be called from several threads, see -n and -j
+ */
+int
+echo_application(char              *myname,
+		 char              *payload,
+		 size_t             paylen,
+		 struct plan       *plans,
+		 struct arena      *a,
+		 int                enc,
+		 char             **reply,
+		 size_t            *rlen,
+		 struct async_job **ajp)
+{
+    int                   retval = -1;
+    int                   i;
+    struct plan          *pl;
+    struct plugin        *p;
+    char                 *argstr;
+    uint64_t              key;
+    int                   ret;
+    struct result_writer  rw;
+    struct fanout         fo = {PTHREAD_COND_INITIALIZER, 0, 0, NULL};
+    struct plugin_gen    *pg = NULL;
+
+    result_init(&rw, a, reply, enc & ENC_CBOR);
+    *rlen = 0;
+    *ajp = NULL;
+    if (debug)
+	clicon_log(LOG_DEBUG, "%s payload:%s", __FUNCTION__, 
+		   payload == NULL ? "" : cbor_is(payload, paylen) ? "(cbor)" : payload);
+    if (payload){
+	if ((pg = plugin_enter()) == NULL)
+	    goto done;
+	if ((retval = plan_get(plans, myname, payload, paylen, pg->pg_gen,
+			       &pl)) < 1)
+	    goto done;
+	retval = -1;
+	if (nfanouts &&
+	    (fo.fo_tasks = arena_alloc(a, pl->pl_ncalls*sizeof(*fo.fo_tasks))) == NULL)
+	    goto done;
+	/* Loop through plugin calls */
+	for (i=0; i<pl->pl_ncalls; i++){
+	    p = pl->pl_calls[i].pc_plugin;
+	    argstr = pl->pl_calls[i].pc_param;
+	    key = pl->pl_calls[i].pc_key;
+	    if (p->p_disable)
 		continue; /* silently ignore */
-	    /* XXX only single argument */
-	    argstr = NULL;
-	    if ((x = xpath_first(xp, "param")) != NULL)
-		argstr = xml_body(x);
-	    if (api->gp_test_fn){
+	    if (debug)
 		clicon_log(LOG_DEBUG, "%s name:%s(%s)",
 			   __FUNCTION__, p->p_name, argstr?argstr:"");
-		if ((pret = api->gp_test_fn(argstr, &str)) < 0){
-		    clicon_log(LOG_NOTICE, "plugin %s failed: retval:%d str:%s", p->p_name, pret, str);
+	    if (p->p_api2){ /* v2 */
+		if (p->p_api2->gp_test_fn == NULL)
+		    continue;
+	    }
+	    else if (p->p_api->gp_start_fn == NULL && p->p_api->gp_test_fn == NULL)
+		continue;
+	    if (p->p_samples){ /* background sample */
+		if ((ret = sample_get(p, argstr, key, &rw)) < 0)
+		    goto done;
+		if (ret == 1)
+		    continue;
+	    }
+	    if (p->p_cache){ /* recent result */
+		if ((ret = cache_get(p, key, &rw)) < 0)
+		    goto done;
+		if (ret == 1)
 		    continue;
-		}
-		if (str){
-		    if (strcmp(api->gp_output_format, "json")==0){
-			cxobj *xt= NULL;
-			cbuf *cbj;
-			if ((cbj = cbuf_new())==NULL){
-			    clicon_err(OE_UNIX, errno, "cbuf_new");
-			    goto done;
-			}
-			if (json_parse_str(str, &xt) < 0)
-			    goto done;
-			xml_rootchild(xt,0,&xt);
-			if (xml2json_cbuf(cb, xt, 0) < 0)
-			    goto done;
-			xml_free(xt);
-		    }
-		    else 
-			cprintf(cb, "%s", str); /* XML */
-		    free(str);
-		    str = NULL;
-		}		    
 	    }
+	    if (p->p_api->gp_start_fn){ /* non-blocking */
+		if (async_start(pg, p, argstr, key, pl->pl_ncalls, enc, ajp) < 0)
+		    goto done;
+		continue;
+	    }
+	    if (fo.fo_tasks){ /* parallel */
+		if (fanout_add(&fo, p, argstr, key, rw.rw_cbor, pg) < 0)
+		    goto done;
+	    }
+	    else if (plugin_call(p, argstr, key, &rw) < 0)
+		goto done;
 	}
+	if (fanout_wait(&fo, &rw, pl->pl_deadline ? pl->pl_deadline :
+			fanout_deadline) < 0)
+	    goto done;
     } /* payload */
-
-    clicon_log(LOG_DEBUG, "%s return:%s", __FUNCTION__, cbuf_get(cb));
+    if (result_end(&rw) < 0)
+	goto done;
+    *rlen = rw.rw_len;
+    if (debug)
+	clicon_log(LOG_DEBUG, "%s return:%s", __FUNCTION__, 
+		   (enc & ENC_CBOR) ? "(cbor)" : *reply?*reply:"");
+    if (result_compress(a, enc, reply, rlen) < 0)
+	goto done;
     retval = 1; /* OK */
  done:
-    if (xvec)
-       free(xvec);
-    if (xt)
-	xml_free(xt);
-    if (v)
-	free(v);
-    if (vi)
-	free(vi);
+    if (fo.fo_ntasks) /* Abandon */
+	fanout_wait(&fo, &rw, 0);
+    pthread_cond_destroy(&fo.fo_cond);
+    if (retval < 1 && *ajp){
+	async_abort(*ajp);
+	*ajp = NULL;
+    }
+    if (pg)
+	plugin_leave();
     return retval;
 }
 
-/*! Receive a packet, do stuff, and return it
- *                          no application monitoring
- * @param[in]      eid64str EID64 string, given or random for this agent
- * @param[in]      wi       Wireless interface name, or NULL if no wlan tests
- * @param[in]      name     If set with -n the name
- * @param[oit]     ok       Set to 1 if an OK (eg known sender) pkt arrived
+/*! Process one received datagram and encode the reply header in place
+ * The reply is returned as an iovec of the header in buf, the payload in
+ * r_arena and padding. The arena must not be reset until it is sent.
+ * @param[in]      r        Reflector the datagram was received on
+ * @param[in]      msg      Message header of received packet (name and cmsgs)
+ * @param[in]      t1       When woken up, unless kernel rx timestamp in msg
+ * @param[in,out]  buf      Received datagram, on return the reply header
+ * @param[in]      buflen   Length of buf
+ * @param[in]      len      Length of received datagram
+ * @param[in]      myname   Name of this agent
+ * @param[out]     ok       Set to 1 if an OK (eg known sender) pkt arrived
+ * @param[out]     iov      Reply, vector of TWOWAY_IOVLEN
+ * @param[out]     niov     Number of entries used in iov
+ * @param[out]     slen     Length of reply, 0 if nothing should be sent
+ * @param[out]     dup      Set to 1 if reply should be sent twice
+ * @param[out]     seq1     Sequence number of reply
+ * @retval -1  Fatal error
+ * @retval  0  OK, or packet dropped (slen is 0)
  * xcontrol:  Ctrl hdr has been received and this is the one
  * snd:  0    A data packet has been received from an unregistered sender
  * snd:  1    A data packet has been received from a registered sender
@@ -733,84 +2792,59 @@ echo_application(struct sender *snd,
  *------------------------------
  */
 static int 
-echo_packet(int            s, 
-	    struct timeval t1, /* when received */
-	    char          *buf, 
-	    int            buflen, 
-	    char          *eid64str,
-	    int            loss,
-	    int            reorder,
-	    int            duplicate,
-	    char          *wi,
-	    struct plugin  plugins[],
-	    char          *myname,
-	    int           *ok
-	    )
+echo_reflect(struct reflector *r,
+	     struct msghdr    *msg,
+	     struct timeval    t1, 
+	     char             *buf, 
+	     int               buflen, 
+	     int               len,
+	     char             *myname,
+	     int              *ok,
+	     struct iovec     *iov,
+	     int              *niov,
+	     int              *slen,
+	     int              *dup,
+	     uint32_t         *seq1)
 {
     int                retval = -1;
-    struct msghdr      msg;
-    struct iovec       iov[1];
+    int                locked = 0;
     struct cmsghdr    *cmsg;
     struct timeval     t0; /* from sender */
     struct timeval     t2;
     struct timeval     dt;  /* t1-t0 */
-    char               cmsgbuf[64];
     struct twoway_hdr  th;
     uint32_t           tag;
-    cbuf              *cb = NULL; /* return payload */
-    int                fromlen;
-    struct sockaddr_in from={0,};
+    char              *reply = NULL; /* return payload, in r_arena */
+    struct sockaddr_in *from = (struct sockaddr_in *)msg->msg_name;
     uint32_t           sseq = 0; // debug only
     uint32_t           rlen = 0;
-    uint32_t           slen;
+    int                rslen;
+    size_t             plen = 0;
     char              *dpayload = NULL;
+    size_t             dlen = 0;
+    int                enc = 0;   /* Result encoding ENC_* */
     struct sender     *snd = NULL; /* Sender of received data packet */
-    int                len;
-    cxobj             *xpayload = NULL;
+    int                noxml = 0; /* Sender has no xml template */
     int                ver;
     enum mtype         mtype;
+    int                async = 0; /* Plugins are run by worker */
+    struct async_job  *aj = NULL; /* Started non-blocking tests */
 
-    //    xr = NULL;
-    memset(&msg, 0, sizeof(msg));
-    memset(iov, 0, sizeof(iov));
-    iov[0].iov_base = buf;
-    iov[0].iov_len  = buflen;
-    msg.msg_iov     = iov;
-    msg.msg_iovlen  = 1;
-    fromlen = sizeof(from);
-    msg.msg_name = &from;
-    msg.msg_namelen = fromlen;
-    memset(cmsgbuf, 0, 64);
-    cmsg = (struct cmsghdr *)cmsgbuf;
-    msg.msg_control = cmsg;
-    msg.msg_controllen = 64;
-
-    /* Here is where the message is actually read */
-    if ((len = recvmsg(s, &msg, 0x0)) < 0){
-	clicon_err(OE_UNIX, errno, "recvmsg");
-	goto done;
-    }
-    clicon_log(LOG_DEBUG, "%s: recvmsg from: %s:%hu", __FUNCTION__, 
-	       inet_ntoa(from.sin_addr),
-	       ntohs(from.sin_port)
-	       );
-    if (len == 0){
-	clicon_log(LOG_WARNING, "%s: close socket, len=0", __FUNCTION__);
-	goto done;
-    }
+    *slen = 0;
+    *dup = 0;
     if (len < 8){
 	clicon_log(LOG_WARNING, "%s: dropped packet len:%d", 
 		   __FUNCTION__, len);
 	retval = 0; 	    /* sanity check failed, just continue */
-	errpkts++;
+	__sync_fetch_and_add(&errpkts, 1);
 	goto done;
     }
-#if 1
-    clicon_log(LOG_DEBUG, "%s: pkt dump: [%02x%02x%02x%02x %02x%02x%02x%02x]", 
-	       __FUNCTION__, 
-	       buf[0]&0xff, buf[1]&0xff, buf[2]&0xff, buf[3]&0xff,
-	       buf[4]&0xff, buf[5]&0xff, buf[6]&0xff, buf[7]&0xff);
-#endif
+    /* Debug logs are formatted in allocated memory, only do it if enabled */
+    if (debug)
+	clicon_log(LOG_DEBUG, "%s: pkt dump: [%02x%02x%02x%02x %02x%02x%02x%02x]", 
+		   __FUNCTION__, 
+		   buf[0]&0xff, buf[1]&0xff, buf[2]&0xff, buf[3]&0xff,
+		   buf[4]&0xff, buf[5]&0xff, buf[6]&0xff, buf[7]&0xff);
 
 #ifdef DUMPMSGFILE
     /* This is for record / replay with nc -u */
@@ -833,41 +2867,46 @@ echo_packet(int            s,
     tag   = ((int*)buf)[1]; /* Second 32-bit word for twoway. */
     if (ver != PROTO_VERSION){
 	clicon_log(LOG_WARNING, "%s: dropped version:'%d'", 
-		   __FUNCTION__, ver, ver);
+		   __FUNCTION__, ver);
 	retval = 0; 	    
-	errpkts++;
+	__sync_fetch_and_add(&errpkts, 1);
 	goto done;
     }
     if (ntohl(tag) != TWOWAY_TAG){
 	clicon_log(LOG_WARNING, "%s: unexpected tag :0x%x", 
 		   __FUNCTION__, ntohl(tag));
 	retval = 0; 	    
-	errpkts++;
+	__sync_fetch_and_add(&errpkts, 1);
 	goto done;
     }
     if (mtype != MTYPE_TWOWAY){
 	clicon_log(LOG_WARNING, "%s: Not expected message type :%d", 
 		   __FUNCTION__, mtype);
 	retval = 0; 	    /* sanity check failed, just continue */
-	errpkts++;
+	__sync_fetch_and_add(&errpkts, 1);
 	goto done;
     }
     switch (mtype){
     case MTYPE_TWOWAY:
-	clicon_log(LOG_DEBUG, "%s: MTYPE_TWOWAY", __FUNCTION__);
-	/* Check sender registered in callhome_http*/
-	if ((snd = s_find(msg.msg_name, msg.msg_namelen)) == NULL){
-	  clicon_log(LOG_DEBUG, "grideye_agent: Unregistered twoway sender %s:%hu",
-		     inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+	if (debug)
+	    clicon_log(LOG_DEBUG, "%s: MTYPE_TWOWAY", __FUNCTION__);
+	/* Check sender registered in callhome_http. Hold lock while using snd,
+	 * not while running plugins, see below */
+	pthread_rwlock_rdlock(&s_lock);
+	locked++;
+	if ((snd = s_find(msg->msg_name, msg->msg_namelen)) == NULL){
+	    if (debug)
+		clicon_log(LOG_DEBUG, "grideye_agent: Unregistered twoway sender %s:%hu",
+			   inet_ntoa(from->sin_addr), ntohs(from->sin_port));
 	    retval = 0; 	    /* sanity check failed, just continue */
-	    errpkts++;
+	    __sync_fetch_and_add(&errpkts, 1);
 	    goto done;
 	}
 	if (decode_twoway(buf, len, &th, &dpayload, &rlen) < 0){
 	    clicon_log(LOG_DEBUG, "%s: dropped packet decode_twoway len:%d", 
 		       __FUNCTION__, len);
 	    retval = 0; 	    /* sanity check failed, just continue */
-	    errpkts++;
+	    __sync_fetch_and_add(&errpkts, 1);
 	    goto done;
 	}
 	if (reorder){
@@ -880,28 +2919,69 @@ echo_packet(int            s,
 		th.th_seq0 = th.th_seq0-1;
 	    }
 	}
+	if (dpayload){
+	    /* Results as cbor if requested in cbor or chosen at callhome */
+	    if (cbor_is(dpayload, rlen - TWOWAY_HDRLEN)){
+		dlen = rlen - TWOWAY_HDRLEN;
+		enc = ENC_CBOR;
+	    }
+	    else
+		dlen = strlen(dpayload);
+	}
+	enc |= snd->s_enc;
 	sseq = th.th_seq0;
 	t0 = th.th_t0;
+	/* Copy what the reply needs of the sender and unlock, so that plugin
+	 * tests do not hold up new senders (s_add) or expiry (s_expire_timer) */
+	snd->s_lastseen = t1.tv_sec;
+	if (snd->s_xml == NULL)
+	    noxml++;
+	else{
+	    th.th_seq1 = __sync_fetch_and_add(&snd->s_seq, 1);
+	    /* Kernel tx time of previous reply to this sender, else t3 is echoed */
+	    if (txstamp){
+		if (snd->s_t3ok && snd->s_t3seq+1 == th.th_seq1)
+		    th.th_t3 = snd->s_t3;
+		else
+		    timerclear(&th.th_t3);
+	    }
+	}
+	snd = NULL;
+	pthread_rwlock_unlock(&s_lock);
+	locked = 0;
 	break;
     default:
 	retval = 0; 	    
-	errpkts++;
+	__sync_fetch_and_add(&errpkts, 1);
 	goto done;
     	break;
     }
     /*
-     * A data-packet has been received. This is its state:
-     * snd holds it control state if any. If snd=NULL the control packet has
-     * not received yet or it is just a non-grideye_sender
+     * A data-packet has been received from a registered sender, whose state
+     * needed for the reply is copied above.
      */
     *ok = 1; /* ok pkt */
-    for (cmsg=CMSG_FIRSTHDR(&msg); cmsg!=NULL; cmsg=CMSG_NXTHDR(&msg,cmsg)) {
-	if (cmsg->cmsg_type==IP_TTL) {
-	    if (CMSG_DATA(cmsg) !=  NULL){
+    if (msg->msg_flags & MSG_CTRUNC)
+	clicon_log(LOG_DEBUG, "%s: control message truncated", __FUNCTION__);
+    for (cmsg=CMSG_FIRSTHDR(msg); cmsg!=NULL; cmsg=CMSG_NXTHDR(msg,cmsg)) {
+	if (cmsg->cmsg_level==IPPROTO_IP && cmsg->cmsg_type==IP_TTL) {
 //			ttl = *(int*)CMSG_DATA(cmsg);
-		break;
-	    }
+	    continue;
+	}
+	/* Kernel receive timestamp replaces t1 taken after wakeup */
+#if defined(SO_TIMESTAMPNS)
+	if (cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SCM_TIMESTAMPNS) {
+	    struct timespec ts;
+
+	    memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+	    /* twoway timestamps are in us */
+	    t1.tv_sec = ts.tv_sec;
+	    t1.tv_usec = ts.tv_nsec/1000;
 	}
+#elif defined(SO_TIMESTAMP)
+	if (cmsg->cmsg_level==SOL_SOCKET && cmsg->cmsg_type==SCM_TIMESTAMP)
+	    memcpy(&t1, CMSG_DATA(cmsg), sizeof(t1));
+#endif
     }
 #if 0
     if (SEQ_LEQ(i,last))
@@ -913,69 +2993,284 @@ echo_packet(int            s,
      * Here starts actual tests. Would like this to be more generic,
      * ie easy to add new tests.
      */
-    /* Global packet counter */
-    pkts++;
-    if (pkts == 1) 
-	firstpkt = t1;
-    lastpkt = t1;
-    /* Payload buffer. If no registered sender this is empty */
-    if ((cb = cbuf_new()) ==NULL){
-	clicon_err(OE_PLUGIN, errno, "cbuf_new");
+    /* Per-reflector packet counter */
+    r->r_pkts++;
+    if (r->r_pkts == 1) 
+	r->r_firstpkt = t1;
+    r->r_lastpkt = t1;
+
+    /* Here starts 'Application monitoring' ie 'programable behaviour'
+     * Only do this if sender is known and if we have received grideye 
+     * control packets
+     */
+    if (noxml){ /* <grideye> */
+	clicon_log(LOG_WARNING, "%s: Expected xml template when receiving data", 
+		   __FUNCTION__);
+	retval = 0; 	    /* sanity check failed, just continue */
+	__sync_fetch_and_add(&errpkts, 1);
+	goto done;
+    }
+    /* With plugin workers, reply at once and send plugin results later */
+    if (nworkers && dpayload)
+	async++;
+    /* Problem: three-value return
+     * Fatal error: -1 and quit
+     * Drop: 0: return 0, break
+     * OK: 1 continue
+     */
+    else if ((retval = echo_application(myname, dpayload, dlen, r->r_plans,
+					r->r_arena, enc, &reply, &plen,
+					&aj)) < 0)
+	goto done;
+    else if (retval == 0)
+	goto done;
+    retval = -1;
+    /* Payload. If no registered sender this is empty */
+    rslen = sizeof(th)+plen+1;
+    if (rslen > buflen) /* encode_twoway_iov truncates payload */
+	rslen = buflen;
+    t2 = gettimestamp();
+
+    *seq1 = th.th_seq1;
+    th.th_t1 = t1;
+    th.th_t2 = t2;
+    /* Queue before encode since payload is in buf */
+    if (async && job_enqueue(r, from, &th, dpayload, dlen, enc) < 0)
+	goto done;
+    if (aj){
+	retval = async_submit(aj, r, from, &th);
+	aj = NULL;
+	if (retval < 0)
+	    goto done;
+	retval = -1;
+    }
+    /* Results that do not fit are sent as fragments before the reply */
+    if (plen && rslen < sizeof(th)+plen+1){
+	if (result_send_frags(r, from, &th, reply, plen) < 0)
+	    goto done;
+	plen = 0;
+	rslen = sizeof(th)+1;
+    }
+    if ((*niov = encode_twoway_iov(iov, buf, rslen, &th, reply, plen)) < 0)
+	goto done;
+    /* Simulated loss and duplicate for debugging */
+    if (loss && loss == sseq)
+	clicon_log(LOG_DEBUG, "Loss %d", sseq);
+    else
+	*slen = rslen;
+    if (duplicate && duplicate==sseq){
+	clicon_log(LOG_DEBUG, "Duplicate %d", sseq);
+	*dup = 1;
+    }
+    if (debug){
+	timersub(&t1, &t0, &dt);
+	clicon_log(LOG_DEBUG, "%s seq: %u %lu.%06lu", 
+		   __FUNCTION__, sseq, dt.tv_sec, dt.tv_usec);
+    }
+    retval = 0;
+  done:
+    if (debug)
+	clicon_log(LOG_DEBUG, "%s: end %d", __FUNCTION__, retval);
+    if (locked)
+	pthread_rwlock_unlock(&s_lock);
+    if (aj)
+	async_abort(aj);
+    return retval;
+}
+
+/*! Receive a packet, do stuff, and return it
+ * @param[in]      r        Reflector: socket and buffer
+ * @param[in]      t1       When received
+ * @param[in]      myname   Name of this agent
+ * @param[out]     ok       Set to 1 if an OK (eg known sender) pkt arrived
+ * @see echo_batch  for receiving and sending several packets per syscall
+ */
+static int 
+echo_packet(struct reflector *r,
+	    struct timeval    t1, /* when received */
+	    char             *myname,
+	    int              *ok
+	    )
+{
+    int                retval = -1;
+    struct msghdr      msg;
+    struct iovec       iov[1];
+    char               cmsgbuf[ECHO_CMSGLEN];
+    struct sockaddr_in from={0,};
+    char              *buf = r->r_bufs;
+    int                buflen = BUFSIZE;
+    int                len;
+    struct iovec       siov[TWOWAY_IOVLEN];
+    int                niov;
+    int                slen;
+    int                dup;
+    uint32_t           seq1;
+    int                i;
+    int                ret;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(iov, 0, sizeof(iov));
+    iov[0].iov_base = buf;
+    iov[0].iov_len  = buflen;
+    msg.msg_iov     = iov;
+    msg.msg_iovlen  = 1;
+    msg.msg_name = &from;
+    msg.msg_namelen = sizeof(from);
+    memset(cmsgbuf, 0, sizeof(cmsgbuf));
+    msg.msg_control = cmsgbuf;
+    msg.msg_controllen = sizeof(cmsgbuf);
+
+    /* Here is where the message is actually read 
+     * Dont block: socket may have been readable only due to the error queue
+     */
+    if ((len = recvmsg(r->r_s, &msg, MSG_DONTWAIT)) < 0){
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	    return 0;
+	clicon_err(OE_UNIX, errno, "recvmsg");
+	goto done;
+    }
+    if (debug)
+	clicon_log(LOG_DEBUG, "%s: recvmsg from: %s:%hu", __FUNCTION__, 
+		   inet_ntoa(from.sin_addr),
+		   ntohs(from.sin_port)
+		   );
+    if (len == 0){
+	clicon_log(LOG_WARNING, "%s: close socket, len=0", __FUNCTION__);
 	goto done;
     }
-
-    /* Here starts 'Application monitoring' ie 'programable behaviour'
-     * Only do this if sender is known and if we have received grideye 
-     * control packets
-     */
-    if (snd != NULL){
-	/* Problem: three-value return
-	 * Fatal error: -1 and quit
-	 * Drop: 0: return 0, break
-	 * OK: 1 continue
-	 */
-	if ((retval = echo_application(snd, myname, dpayload, cb, plugins)) < 0)
-	    goto done;
-	if (retval == 0)
+    if (echo_reflect(r, &msg, t1, buf, buflen, len, myname, 
+		     ok, siov, &niov, &slen, &dup, &seq1) < 0)
+	goto done;
+    for (i=0; slen && i<1+dup; i++){
+	pthread_mutex_lock(&r->r_txlock);
+	/* If not sent, the key is not used and entry is overwritten next time */
+	if (txstamp)
+	    txstamp_pending(r, r->r_txkey, &from, seq1);
+	ret = send_one_agent_locked(r, msg.msg_name, msg.msg_namelen, 
+				    siov, niov);
+	pthread_mutex_unlock(&r->r_txlock);
+	if (ret < 0)
 	    goto done;
-	retval = -1;
     }
-    slen = sizeof(th)+cbuf_len(cb)+1;
-    t2 = gettimestamp();
+    retval = 0;
+  done:
+    return retval;
+}
 
-    if (snd)
-	th.th_seq1 = snd->s_seq++;
-    th.th_t1 = t1;
-    th.th_t2 = t2;
-    if (encode_twoway(buf, slen, &th, cbuf_get(cb)) < 0)
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+/*! Receive up to batch packets with one syscall, reflect and send all replies
+ * with one syscall. Same as echo_packet but with recvmmsg/sendmmsg.
+ * Each packet gets its own kernel receive timestamp as t1 if available, 
+ * otherwise all packets received in the same wakeup share t1.
+ * @param[in]      r        Reflector: socket and batch buffers
+ * @param[in]      t1       When received
+ * @param[in]      myname   Name of this agent
+ * @param[out]     ok       Set to 1 if an OK (eg known sender) pkt arrived
+ * @see echo_packet
+ */
+static int 
+echo_batch(struct reflector *r,
+	   struct timeval    t1,
+	   char             *myname,
+	   int              *ok)
+{
+    int                 retval = -1;
+    struct mmsghdr      rmsg[ECHO_BATCH_MAX];
+    struct mmsghdr      smsg[2*ECHO_BATCH_MAX]; /* incl duplicates */
+    uint32_t            sseq1[2*ECHO_BATCH_MAX]; /* seq1 of each reply */
+    struct iovec        riov[ECHO_BATCH_MAX];
+    struct iovec        siov[ECHO_BATCH_MAX][TWOWAY_IOVLEN];
+    struct sockaddr_in  from[ECHO_BATCH_MAX];
+    char                cmsgbuf[ECHO_BATCH_MAX][ECHO_CMSGLEN];
+    char               *bufs = r->r_bufs;
+    int                 buflen = BUFSIZE;
+    char               *buf;
+    int                 n;
+    int                 ns;
+    int                 i;
+    int                 j;
+    int                 slen;
+    int                 dup;
+    uint32_t            seq1;
+    int                 niov;
+    int                 locked = 0;
+
+    memset(rmsg, 0, batch*sizeof(rmsg[0]));
+    for (i=0; i<batch; i++){
+	riov[i].iov_base = bufs + i*buflen;
+	riov[i].iov_len  = buflen;
+	rmsg[i].msg_hdr.msg_iov        = &riov[i];
+	rmsg[i].msg_hdr.msg_iovlen     = 1;
+	rmsg[i].msg_hdr.msg_name       = &from[i];
+	rmsg[i].msg_hdr.msg_namelen    = sizeof(from[i]);
+	rmsg[i].msg_hdr.msg_control    = cmsgbuf[i];
+	rmsg[i].msg_hdr.msg_controllen = sizeof(cmsgbuf[i]);
+    }
+    /* Socket is readable, so at least one packet is returned without blocking */
+    if ((n = recvmmsg(r->r_s, rmsg, batch, MSG_DONTWAIT, NULL)) < 0){
+	if (errno == EAGAIN || errno == EINTR)
+	    return 0;
+	clicon_err(OE_UNIX, errno, "recvmmsg");
 	goto done;
-    /* Simulated loss and duplicate for debugging */
-    if (loss && loss == sseq)
-	clicon_log(LOG_DEBUG, "Loss %d", sseq);
-    else{
-	if (send_one_agent(s, msg.msg_name, msg.msg_namelen, buf, slen) < 0)
-	    goto done;
     }
-    if (duplicate && duplicate==sseq){
-	clicon_log(LOG_DEBUG, "Duplicate %d", sseq);
-	if (send_one_agent(s, msg.msg_name, msg.msg_namelen, buf, slen) < 0)
+    if (debug)
+	clicon_log(LOG_DEBUG, "%s: recvmmsg %d packets", __FUNCTION__, n);
+    ns = 0;
+    for (i=0; i<n; i++){
+	buf = bufs + i*buflen;
+	if (echo_reflect(r, &rmsg[i].msg_hdr, t1, buf, buflen, rmsg[i].msg_len,
+			 myname, ok, siov[i], &niov, &slen, &dup, 
+			 &seq1) < 0)
 	    goto done;
+	if (slen == 0)
+	    continue;
+	for (j=0; j<1+dup; j++){
+	    memset(&smsg[ns], 0, sizeof(smsg[ns]));
+	    smsg[ns].msg_hdr.msg_name    = rmsg[i].msg_hdr.msg_name;
+	    smsg[ns].msg_hdr.msg_namelen = rmsg[i].msg_hdr.msg_namelen;
+	    smsg[ns].msg_hdr.msg_iov     = siov[i];
+	    smsg[ns].msg_hdr.msg_iovlen  = niov;
+	    sseq1[ns] = seq1;
+	    ns++;
+	}
     }
-		
-    if (debug){
-	timersub(&t1, &t0, &dt);
-	clicon_log(LOG_DEBUG, "%s seq: %u %lu.%06lu", 
-		   __FUNCTION__, sseq, dt.tv_sec, dt.tv_usec);
+    /* sendmmsg may send fewer than requested, continue with the rest */
+    pthread_mutex_lock(&r->r_txlock);
+    locked++;
+    for (i=0; i<ns; i+=n){
+	if ((n = sendmmsg(r->r_s, &smsg[i], ns-i, 0x0)) < 0){
+	    switch (errno){
+	    case ENOBUFS: /* try again if ifq is empty */
+		__sync_fetch_and_add(&nr_nobufs, 1);
+		r->r_txkey++; /* dropped after timestamp key assigned */
+		/* FALLTHROUGH */
+	    case ENETUNREACH: /* try again */
+		/* Skip the failing packet and go on with the rest */
+		clicon_log(LOG_WARNING,  "sendmmsg %s %s", __FUNCTION__, strerror(errno));
+		n = 1;
+		break;
+	    default:
+		clicon_err(OE_UNIX, errno, "sendmmsg");
+		goto done;
+	    }
+	    continue;
+	}
+	/* Sent datagrams got consecutive tx timestamp keys */
+	for (j=i; j<i+n; j++)
+	    if (txstamp)
+		txstamp_pending(r, r->r_txkey++, 
+				(struct sockaddr_in *)smsg[j].msg_hdr.msg_name,
+				sseq1[j]);
+	    else
+		r->r_txkey++;
     }
     retval = 0;
   done:
-    clicon_log(LOG_DEBUG, "%s: end %d", __FUNCTION__, retval);
-    if (xpayload)
-	xml_free(xpayload);
-    if (cb)
-	cbuf_free(cb);
+    if (locked)
+	pthread_mutex_unlock(&r->r_txlock);
     return retval;
 }
+#endif /* HAVE_RECVMMSG && HAVE_SENDMMSG */
 
 /*! This is signaling: create agent to send to this agent 
  * Send a CURL POST to controller and register (or change) existing agent.
@@ -1013,6 +3308,7 @@ callhome_http(char               *url,
     struct sockaddr_in sndaddr = {0,};
     int    i;
     struct plugin *p;
+    int    locked = 0;
     
     if ((cb = cbuf_new()) == NULL){
       clicon_err(OE_UNIX, errno, "cbuf_new");
@@ -1029,12 +3325,24 @@ callhome_http(char               *url,
 	cprintf(cb, "&port=%hu", ntohs(myaddr->sin_port));
     cprintf(cb, "&version=%u", GRIDEYE_AGENT_VERSION);
     cprintf(cb, "&proto=%s", grideye_proto2str(proto));
+    /* Payload encodings, the sender chooses one in its reply */
+    cprintf(cb, "&encodings=\"text,cbor\"");
+    /* Result compression, the sender enables it in its reply, see -Z */
+    if (compress_min && compress_supported())
+	cprintf(cb, "&compress=\"zlib\"");
     if (info)
 	cprintf(cb, "&info=\"%s\"", info);
+    /* Cores owned by spinning reflectors, see -C */
+    if (lowlat_cpu != -1){
+	cprintf(cb, "&cpus=\"");
+	for (i=0; i<nreflectors; i++)
+	    cprintf(cb, "%s%d", i?",":"", reflectors[i].r_cpu);
+	cprintf(cb, "\"");
+    }
     /* Send comma-separated list of plugins */
     cprintf(cb, "&plugins=\"");
     i = 0;
-    for (p = plugins; (p->p_api!=NULL); p++){
+    for (p = plugin_cur->pg_plugins; (p->p_api!=NULL); p++){
 	if (p->p_disable)
 	    continue;
 	if (i++)
@@ -1081,6 +3389,8 @@ callhome_http(char               *url,
 	    	clicon_log(LOG_DEBUG,  "%s: no udp sport", __FUNCTION__);
 	    if (*natstate > 1){
 		/* register sender */
+		pthread_rwlock_wrlock(&s_lock);
+		locked++;
 		if ((snd = s_find(&sndaddr, sizeof(sndaddr))) == NULL){
 		    if ((snd = s_add(&sndaddr, sizeof(sndaddr))) == NULL)
 			goto done;
@@ -1093,10 +3403,24 @@ callhome_http(char               *url,
 			goto done;
 		    }
 		}
+		snd->s_lastseen = time(NULL);
+		/* Results as cbor, else text, and compressed */
+		snd->s_enc = 0;
+		if ((x = xpath_first(xreply, "grideye/encoding")) != NULL &&
+		    xml_body(x) && strcmp(xml_body(x), "cbor") == 0)
+		    snd->s_enc |= ENC_CBOR;
+		if ((x = xpath_first(xreply, "grideye/compress")) != NULL &&
+		    xml_body(x) && strcmp(xml_body(x), "zlib") == 0)
+		    snd->s_enc |= ENC_ZLIB;
+		s_newest = snd;
+		if (sample_config(xreply) < 0)
+		    goto done;
 		if (snd->s_xml != NULL)
 		    xml_free(snd->s_xml); /* delete old tree */
 		snd->s_xml = xreply;
 		xreply = NULL;
+		pthread_rwlock_unlock(&s_lock);
+		locked = 0;
 	    }
 	}
 	break;
@@ -1109,6 +3433,8 @@ callhome_http(char               *url,
     }
     retval = 0;
  done:
+    if (locked)
+	pthread_rwlock_unlock(&s_lock);
     if (remoteip)
 	free(remoteip);
     if (xreply)
@@ -1124,7 +3450,7 @@ callhome_http(char               *url,
 
 /*! This is for NAT traversal: send udp towards server just to open existing stream 
  * Timeout only when there havent been any packets for some time.
- * @param[in]  s         Socket to send on
+ * @param[in]  r         Reflector whose socket to send on
  * @param[in]  myaddr    Address, port of locally bound socket
  * @param[in]  sndaddr   Address to send a nat traversal probe packet to.
  * @param[in]  buf       Raw message buffer to re-use
@@ -1134,7 +3460,7 @@ callhome_http(char               *url,
  * @see callhome_http
  */
 static int
-nattraversal_udp(int                 s, 
+nattraversal_udp(struct reflector   *r,
 		 struct sockaddr_in *myaddr,
 		 char               *name,
 		 char               *eid64str)
@@ -1145,12 +3471,16 @@ nattraversal_udp(int                 s,
     cbuf              *xmlbuf = NULL;
     char               buf[BUFSIZE];
     int                len = BUFSIZE;
-    struct sockaddr_in *sndaddr;
+    struct sockaddr_in  sndaddr0;
+    struct sockaddr_in *sndaddr = &sndaddr0;
     struct sender      *snd;
 
-    if ((snd = s_list) == NULL)
+    pthread_rwlock_rdlock(&s_lock);
+    if ((snd = s_newest) != NULL)
+	memcpy(sndaddr, snd->s_sname, sizeof(*sndaddr));
+    pthread_rwlock_unlock(&s_lock);
+    if (snd == NULL)
 	return 0;
-    sndaddr = (struct sockaddr_in *)(snd->s_sname);
     clicon_log(LOG_DEBUG, "%s nat probe address : %s:%u", 
 		 __FUNCTION__,
 		 inet_ntoa(sndaddr->sin_addr), 
@@ -1169,7 +3499,7 @@ nattraversal_udp(int                 s,
     cprintf(xmlbuf, "</grideye>"); 
     if ((clen = encode_control(buf, len, &ch0, cbuf_get(xmlbuf))) < 0)
 	goto done;
-    if (send_one_agent(s, 
+    if (send_one_agent(r, 
 		       (struct sockaddr*)sndaddr, 
 		       sizeof(*sndaddr), 
 		       buf, clen) < 0){
@@ -1231,7 +3561,7 @@ get_system_info(char **info)
 
 /*! This is for NAT traversal: connect via tcp to grideye_sender
  * Timeout only when there havent been any packets for some time.
- * @param[in]  s         Socket to send on
+ * @param[in]  r         Reflector whose socket to connect and send on
  * @param[in]  myaddr    Address, port of locally bound socket
  * @param[in]  sndaddr  Address to send a nat traversal probe packet to.
  * @param[in]  buf       Raw message buffer to re-use
@@ -1241,7 +3571,7 @@ get_system_info(char **info)
  * @see callhome_http
  */
 static int
-nattraversal_tcp(int                 s, 
+nattraversal_tcp(struct reflector   *r,
 		 struct sockaddr_in *myaddr,
 		 char               *name,
 		 char               *eid64str,
@@ -1253,19 +3583,23 @@ nattraversal_tcp(int                 s,
     cbuf              *xmlbuf = NULL;
     char               buf[BUFSIZE];
     int                len = BUFSIZE;
-    struct sockaddr_in *sndaddr;
+    struct sockaddr_in  sndaddr0;
+    struct sockaddr_in *sndaddr = &sndaddr0;
     struct sender      *snd;
 
     clicon_log(LOG_DEBUG, "%s", __FUNCTION__);
-    if ((snd = s_list) == NULL)
+    pthread_rwlock_rdlock(&s_lock);
+    if ((snd = s_newest) != NULL)
+	memcpy(sndaddr, snd->s_sname, sizeof(*sndaddr));
+    pthread_rwlock_unlock(&s_lock);
+    if (snd == NULL)
 	return 0;
-    sndaddr = (struct sockaddr_in *)(snd->s_sname);
 
     clicon_log(LOG_DEBUG, "%s Trying to connect to : %s:%u", 
 		 __FUNCTION__,
 		 inet_ntoa(sndaddr->sin_addr), 
 		 ntohs(sndaddr->sin_port));	    
-    if (connect(s, (struct sockaddr *)sndaddr, sizeof(*sndaddr)) < 0){
+    if (connect(r->r_s, (struct sockaddr *)sndaddr, sizeof(*sndaddr)) < 0){
 	clicon_err(OE_UNIX, errno, "connect");
 	goto done;
     }
@@ -1286,7 +3620,7 @@ nattraversal_tcp(int                 s,
     cprintf(xmlbuf, "</grideye>");
     if ((clen = encode_control(buf, len, &ch0, cbuf_get(xmlbuf))) < 0)
 	goto done;
-    if (send_one_agent(s, NULL, 0, buf, clen) < 0)
+    if (send_one_agent(r, NULL, 0, buf, clen) < 0)
 	goto done;
     *natstate = 3;
     retval = 0;
@@ -1302,93 +3636,622 @@ nattraversal_tcp(int                 s,
 static void 
 grideye_sig(int arg)
 {
-    clicon_log(LOG_NOTICE, "%s: %d", __FUNCTION__, arg);
+    clicon_log(LOG_NOTICE, "%s: %d", __FUNCTION__, arg);
+}
+
+/*! Exit functions either called on sigterm or end of main */
+static void 
+doexit(int arg)
+{
+    struct timeval dur;
+    struct plugin_gen *pg;
+    double         secs;
+    struct reflector *r;
+    struct timeval firstpkt = {0,};
+    struct timeval lastpkt = {0,};
+    int            pkts = 0;
+    int            i;
+    int            hung;
+
+    clicon_log(LOG_NOTICE, "%s: %d", __FUNCTION__, arg);
+    /* Stop reflector threads before freeing what they use, then sum counters */
+    if (reflectors == NULL)
+	nreflectors = 0;
+    for (i=1; i<nreflectors; i++){
+	r = &reflectors[i];
+	if (r->r_started){
+	    pthread_cancel(r->r_thread);
+	    pthread_join(r->r_thread, NULL);
+	}
+    }
+    worker_stop();
+    /* A hung plugin test is left running, then its plugin is not unloaded */
+    hung = fanout_stop() < 0;
+    if (sample_stop() < 0)
+	hung = 1;
+    isolate_stop(hung);
+    for (i=0; i<nreflectors; i++){
+	r = &reflectors[i];
+	if (r->r_pkts == 0)
+	    continue;
+	if (pkts == 0 || timercmp(&r->r_firstpkt, &firstpkt, <))
+	    firstpkt = r->r_firstpkt;
+	if (timercmp(&r->r_lastpkt, &lastpkt, >))
+	    lastpkt = r->r_lastpkt;
+	pkts += r->r_pkts;
+    }
+    timersub(&lastpkt, &firstpkt, &dur);
+
+    if (pidfile)
+	unlink(pidfile);   
+    secs = dur.tv_sec + dur.tv_usec/1000000.0;
+    clicon_log(LOG_NOTICE, "grideye_agent: %s: Terminated: Received %d packets (term) during %ld.%03ld secs (%.0f pkts/s)", 
+	       hostname, pkts, dur.tv_sec, dur.tv_usec/1000, 
+	       secs>0?pkts/secs:0.0);
+/* Cant run exit functions here because we may run in interrupt stack */
+    if (plugin_cur && !hung){
+	while ((pg = plugin_retired) != NULL){
+	    plugin_retired = pg->pg_next;
+	    if (pg->pg_refs == 0) /* Else an async test may still use it */
+		plugin_gen_free(pg, 0);
+	}
+	plugin_gen_free(plugin_cur, 0);
+	plugin_cur = NULL;
+	sample_orphans_free();
+    }
+    s_expire(0);
+    for (i=0; i<nreflectors; i++){
+	r = &reflectors[i];
+	if (r->r_s != -1)
+	    close(r->r_s);
+	if (r->r_bufs)
+	    free(r->r_bufs);
+	if (r->r_arena)
+	    arena_free(r->r_arena);
+	if (r->r_plans)
+	    plans_free(r->r_plans);
+	if (r->r_ring)
+	    uring_free(r->r_ring);
+	if (r->r_slots)
+	    free(r->r_slots);
+    }
+    if (reflectors)
+	free(reflectors);
+    exit(0);
+}
+
+static int
+callhome(struct reflector   *r,
+	 char               *callhome_url,
+	 char               *hostname,
+	 char               *userid,
+	 enum grideye_proto  proto,
+	 int                *natstate,
+	 struct sockaddr_in *myaddr,
+	 char               *eid64str,
+	 char               *info
+	 )
+{
+    int            retval = -1;
+
+    clicon_log(LOG_DEBUG, "%s", __FUNCTION__);
+    if (callhome_url && userid){     /* Timeout Send a (call)home message */
+	if (callhome_http(callhome_url, 
+			  hostname, 
+			  userid, 
+			  proto, 
+			  myaddr,
+			  info,
+			  natstate) < 0)
+	    goto done;
+    }
+    clicon_log(LOG_DEBUG, "%s natstate:%d", __FUNCTION__, *natstate);
+    if ((*natstate) > 1){     /* Timeout Send a (call)home message */
+	switch(proto){
+	case GRIDEYE_PROTO_TCP:
+	    if (nattraversal_tcp(r, 
+				 myaddr, 
+				 hostname,
+				 eid64str,
+				 natstate) < 0)
+		goto done;
+	    break;
+	case GRIDEYE_PROTO_UDP:
+	    if (nattraversal_udp(r, 
+				 myaddr, 
+				 hostname,
+				 eid64str) < 0)
+		goto done;
+	    break;
+	default:
+	    break;
+	}
+    }
+    retval = 0;
+ done:
+    return retval;
+}
+
+/*! Create, configure and bind the udp socket of a reflector
+ * All reflector sockets bind the same address and port with SO_REUSEPORT,
+ * and the kernel spreads incoming flows among them.
+ * @param[in]     r       Reflector
+ * @param[in]     inaddr  Local address, or NULL
+ * @param[in]     lport   Local port, 0 for ephemeral (first reflector only)
+ * @param[out]    myaddr  Bound address and port
+ */
+static int
+reflector_socket(struct reflector   *r,
+		 struct in_addr     *inaddr,
+		 uint16_t            lport,
+		 struct sockaddr_in *myaddr)
+{
+    int retval = -1;
+    int s;
+    int yes = 1;
+
+    if ((s = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+	clicon_err(OE_UNIX, errno, "socket");
+	goto done;
+    }
+    r->r_s = s;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) < 0){
+	clicon_err(OE_UNIX, errno, "socket");
+	goto done;
+    }
+#if defined(SO_REUSEPORT)
+    if (nreflectors > 1 &&
+	setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) < 0){
+	clicon_err(OE_UNIX, errno, "setsockopt SO_REUSEPORT");
+	goto done;
+    }
+#endif
+    if (socket_bind_udp(s, inaddr, lport, myaddr) < 0)
+	goto done;
+#if defined(SOL_IP)
+    if(setsockopt(s, SOL_IP, IP_RECVTTL, &yes, sizeof(int))<0){
+	clicon_err(OE_UNIX, errno, "socket");
+	goto done;
+    }
+#endif
+#if defined(SO_BUSY_POLL)
+    if (busy_poll &&
+	setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(int)) < 0)
+	clicon_log(LOG_NOTICE, "setsockopt SO_BUSY_POLL: %s", strerror(errno));
+#endif
+    /* Kernel receive timestamps for t1, fall back to wakeup time if not */
+#if defined(SO_TIMESTAMPNS)
+    if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof(int)) < 0)
+	clicon_log(LOG_NOTICE, "setsockopt SO_TIMESTAMPNS: %s", strerror(errno));
+#elif defined(SO_TIMESTAMP)
+    if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMP, &yes, sizeof(int)) < 0)
+	clicon_log(LOG_NOTICE, "setsockopt SO_TIMESTAMP: %s", strerror(errno));
+#endif
+#ifdef HAVE_TXSTAMP
+    /* Software tx timestamps on error queue, keyed per sent datagram */
+    if (txstamp){
+	int tsflags = SOF_TIMESTAMPING_TX_SOFTWARE | 
+	    SOF_TIMESTAMPING_SOFTWARE |
+	    SOF_TIMESTAMPING_OPT_ID | 
+	    SOF_TIMESTAMPING_OPT_TSONLY;
+
+	if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, 
+		       &tsflags, sizeof(tsflags)) < 0){
+	    clicon_err(OE_UNIX, errno, "setsockopt SO_TIMESTAMPING");
+	    goto done;
+	}
+	r->r_txkey = 0;
+    }
+#endif
+    retval = 0;
+ done:
+    return retval;
+}
+
+/*! Receive and reflect packets of a reflector
+ * @param[in]  r       Reflector
+ * @param[in]  txpoll  Read transmit timestamps from the error queue, see -T
+ * @retval -1  Fatal error
+ * @retval  0  OK
+ */
+static int
+reflector_rx(struct reflector *r,
+	     int               txpoll)
+{
+    struct timeval    t1; /* when received */
+    int               ok = 0;
+
+    t1 = gettimestamp();
+    if (txstamp && txpoll && txstamp_recv(r) < 0)
+	return -1;
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+    if (batch > 1){
+	if (echo_batch(r, t1, hostname, &ok) < 0)
+	    return -1;
+    }
+    else
+#endif
+    if (echo_packet(r, t1, hostname, &ok) < 0)
+	return -1;
+    /* Replies are sent, free their payloads */
+    arena_reset(r->r_arena);
+    if (ok) /* Postpones callhome, see callhome_timer */
+	rx_last = t1.tv_sec;
+    return 0;
+}
+
+/*! Socket of a reflector is readable: receive and reflect packets
+ * Called from the main reactor for reflector 0, which does not tell if the
+ * error queue is readable, so transmit timestamps are read on every wakeup.
+ * @param[in]  s     Socket
+ * @param[in]  arg   Reflector
+ * @retval -1  Fatal error
+ * @retval  0  OK
+ */
+static int
+reflector_recv(int   s,
+	       void *arg)
+{
+    return reflector_rx((struct reflector *)arg, 1);
+}
+
+/* User data of io_uring operations: slot index and if it is a send */
+#define USLOT_DATA(i, send) (((uint64_t)(i)<<1) | (send))
+
+/*! Queue a receive in a slot of a reflector io_uring
+ * @param[in]  r   Reflector
+ * @param[in]  i   Slot, uses buffer i of r_bufs
+ */
+static int
+uslot_recv(struct reflector *r,
+	   int               i)
+{
+    struct uslot *us = &r->r_slots[i];
+
+    memset(&us->us_msg, 0, sizeof(us->us_msg));
+    us->us_iov.iov_base = r->r_bufs + i*BUFSIZE;
+    us->us_iov.iov_len  = BUFSIZE;
+    us->us_msg.msg_iov = &us->us_iov;
+    us->us_msg.msg_iovlen = 1;
+    us->us_msg.msg_name = &us->us_from;
+    us->us_msg.msg_namelen = sizeof(us->us_from);
+    us->us_msg.msg_control = us->us_cmsg;
+    us->us_msg.msg_controllen = sizeof(us->us_cmsg);
+    return uring_recvmsg(r->r_ring, r->r_s, &us->us_msg, USLOT_DATA(i, 0));
+}
+
+/*! Create the io_uring of a reflector and queue receives in all slots
+ * @param[in]  r   Reflector, with batch buffers
+ * @see -U
+ */
+static int
+reflector_uring_start(struct reflector *r)
+{
+    int i;
+
+    /* A slot has a receive or at most two sends (duplicate) in flight */
+    if ((r->r_ring = uring_new(2*batch)) == NULL)
+	return -1;
+    if ((r->r_slots = calloc(batch, sizeof(struct uslot))) == NULL){
+	clicon_err(OE_UNIX, errno, "calloc");
+	return -1;
+    }
+    for (i=0; i<batch; i++)
+	if (uslot_recv(r, i) < 0)
+	    return -1;
+    if (uring_submit(r->r_ring, 0) < 0)
+	return -1;
+    return 0;
+}
+
+/*! Handle a completion of a reflector io_uring slot
+ * A received packet is reflected and its reply queued as sends, the slot 
+ * is queued for receive again when the reply is sent. Since a send may 
+ * complete after the arena is reset, the reply payload is copied after the
+ * header in the receive buffer.
+ * @param[in]  r     Reflector
+ * @param[in]  cqe   Completion
+ * @param[in]  t1    When received
+ * @param[out] ok    Set if a valid packet was received
+ * @retval -1  Fatal error
+ * @retval  0  OK
+ */
+static int
+uslot_done(struct reflector *r,
+	   struct uring_cqe *cqe,
+	   struct timeval    t1,
+	   int              *ok)
+{
+    struct uslot     *us;
+    char             *buf;
+    int               i;
+    int               j;
+    int               p;
+    int               niov;
+    int               slen;
+    int               dup;
+    uint32_t          seq1;
+
+    i = cqe->uc_data >> 1;
+    us = &r->r_slots[i];
+    buf = r->r_bufs + i*BUFSIZE;
+    if (cqe->uc_data & 1){ /* Reply sent */
+	if (cqe->uc_res < 0){
+	    if (cqe->uc_res == -ENOBUFS)
+		__sync_fetch_and_add(&nr_nobufs, 1);
+	    clicon_log(LOG_WARNING, "sendmsg %s %s", __FUNCTION__, 
+		       strerror(-cqe->uc_res));
+	}
+	if (--us->us_sending == 0)
+	    return uslot_recv(r, i);
+	return 0;
+    }
+    if (cqe->uc_res < 0){
+	switch (-cqe->uc_res){
+	case EAGAIN:
+	case EINTR:
+	case ENOBUFS:
+	    break;
+	default:
+	    clicon_err(OE_UNIX, -cqe->uc_res, "recvmsg");
+	    return -1;
+	}
+	slen = 0;
+    }
+    else if (echo_reflect(r, &us->us_msg, t1, buf, BUFSIZE, cqe->uc_res, 
+			  hostname, ok, us->us_siov, &niov, 
+			  &slen, &dup, &seq1) < 0)
+	return -1;
+    if (slen == 0)
+	return uslot_recv(r, i);
+    for (j=1, p=us->us_siov[0].iov_len; j<niov; j++){
+	memcpy(buf+p, us->us_siov[j].iov_base, us->us_siov[j].iov_len);
+	p += us->us_siov[j].iov_len;
+    }
+    us->us_siov[0].iov_base = buf;
+    us->us_siov[0].iov_len = slen;
+    memset(&us->us_smsg, 0, sizeof(us->us_smsg));
+    us->us_smsg.msg_name = &us->us_from;
+    us->us_smsg.msg_namelen = us->us_msg.msg_namelen;
+    us->us_smsg.msg_iov = us->us_siov;
+    us->us_smsg.msg_iovlen = 1;
+    for (j=0; j<1+dup; j++){
+	if (uring_sendmsg(r->r_ring, r->r_s, &us->us_smsg, 
+			  USLOT_DATA(i, 1)) < 0)
+	    return -1;
+	us->us_sending++;
+    }
+    return 0;
+}
+
+/*! Reap io_uring completions of a reflector: reflect received packets
+ * Same as reflector_recv but with io_uring, see -U. The sends and receives
+ * queued by the completions are submitted with one system call.
+ * @param[in]  fd    Ring file descriptor
+ * @param[in]  arg   Reflector
+ * @retval -1  Fatal error
+ * @retval  0  OK
+ */
+static int
+reflector_uring(int   fd,
+		void *arg)
+{
+    struct reflector *r = (struct reflector *)arg;
+    struct uring_cqe  cqe;
+    struct timeval    t1; /* when received */
+    int               ok = 0;
+
+    t1 = gettimestamp();
+    while (uring_cqe(r->r_ring, &cqe))
+	if (uslot_done(r, &cqe, t1, &ok) < 0)
+	    return -1;
+    arena_reset(r->r_arena);
+    if (uring_submit(r->r_ring, 0) < 0)
+	return -1;
+    if (ok) /* Postpones callhome, see callhome_timer */
+	rx_last = t1.tv_sec;
+    return 0;
+}
+
+/*! Reflector thread: receive and reflect packets on its own socket
+ * Only cancelled while waiting in poll, never while holding s_lock.
+ * With -C the thread spins on the socket (or ring) instead of sleeping in
+ * poll, so that there is no wakeup latency between rx and t1..t2.
+ * @param[in]  arg   Reflector
+ */
+static void *
+reflector_thread(void *arg)
+{
+    struct reflector *r = (struct reflector *)arg;
+    struct pollfd     pfd;
+    int               n;
+    int               spins = 0;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    /* Completions are posted to the thread that submits, see grideye_uring.c */
+    if (use_uring && reflector_uring_start(r) < 0){
+	clicon_log(LOG_WARNING, "reflector %d exited", r->r_id);
+	return NULL;
+    }
+    pfd.fd = r->r_ring ? uring_fd(r->r_ring) : r->r_s;
+    pfd.events = POLLIN;
+    for (;;){
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	if (lowlat_cpu != -1){ /* Spin: receives do not block */
+	    pthread_testcancel();
+	    n = 1;
+	    pfd.revents = POLLIN;
+	    /* The error queue is not polled, read it every TXSTAMP_SPINS */
+	    if (++spins == TXSTAMP_SPINS){
+		spins = 0;
+		pfd.revents |= POLLERR;
+	    }
+	}
+	else
+	    n = poll(&pfd, 1, -1);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	if (n < 0){
+	    if (errno == EINTR)
+		continue;
+	    clicon_err(OE_UNIX, errno, "poll");
+	    break;
+	}
+	if (n == 0 || (pfd.revents & (POLLIN|POLLERR)) == 0)
+	    continue;
+	if (r->r_ring){
+	    if (reflector_uring(pfd.fd, r) < 0)
+		break;
+	}
+	else if (reflector_rx(r, pfd.revents & POLLERR) < 0)
+	    break;
+    }
+    clicon_log(LOG_WARNING, "reflector %d exited", r->r_id);
+    return NULL;
+}
+
+/*! Start reflector threads 1..nreflectors-1, reflector 0 is run by main
+ * Each thread is pinned to its own core if supported. Signals are blocked 
+ * in the threads so that they are delivered to the main thread.
+ * With -C also reflector 0 gets a thread, and thread i is pinned to core
+ * -C + i and run with SCHED_FIFO if -R is given.
+ */
+static int
+reflector_start(void)
+{
+    int               retval = -1;
+    struct reflector *r;
+    sigset_t          set;
+    sigset_t          oset;
+    int               i;
+    int               ret;
+    struct sched_param sp;
+    long              ncpu;
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t         cpus;
+#endif
+
+    if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+	ncpu = 1;
+    /* Spinning SCHED_FIFO threads on all cores starve the main thread */
+    if (lowlat_prio && nreflectors >= ncpu){
+	clicon_log(LOG_NOTICE, "SCHED_FIFO not used: %d reflectors on %ld cores", 
+		   nreflectors, ncpu);
+	lowlat_prio = 0;
+    }
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oset);
+    for (i=lowlat_cpu!=-1?0:1; i<nreflectors; i++){
+	r = &reflectors[i];
+	if ((ret = pthread_create(&r->r_thread, NULL, reflector_thread, r)) != 0){
+	    clicon_err(OE_UNIX, ret, "pthread_create");
+	    goto done;
+	}
+	r->r_started = 1;
+	if (lowlat_prio){
+	    memset(&sp, 0, sizeof(sp));
+	    sp.sched_priority = lowlat_prio;
+	    if ((ret = pthread_setschedparam(r->r_thread, SCHED_FIFO, &sp)) != 0)
+		clicon_log(LOG_NOTICE, "reflector %d: pthread_setschedparam: %s", 
+			   i, strerror(ret));
+	}
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	r->r_cpu = (lowlat_cpu!=-1 ? lowlat_cpu+i : i) % ncpu;
+	CPU_ZERO(&cpus);
+	CPU_SET(r->r_cpu, &cpus);
+	if ((ret = pthread_setaffinity_np(r->r_thread, sizeof(cpus), &cpus)) != 0){
+	    clicon_log(LOG_NOTICE, "reflector %d: pthread_setaffinity_np: %s", 
+		       i, strerror(ret));
+	    r->r_cpu = -1;
+	}
+#endif
+	clicon_log(LOG_DEBUG, "reflector %d started on cpu %d", i, r->r_cpu);
+    }
+    retval = 0;
+ done:
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+    return retval;
+}
+
+/*! Register the tcp socket in the reactor when it is connected
+ * @param[in]  cs   Callhome state
+ */
+static int
+callhome_tcp(struct callhome_state *cs)
+{
+    if (cs->cs_proto != GRIDEYE_PROTO_TCP || cs->cs_tcpreg ||
+	*cs->cs_natstate <= 2) /* not connected */
+	return 0;
+    cs->cs_tcpreg++;
+    return reactor_fd_reg(cs->cs_re, cs->cs_r->r_s, reflector_recv, cs->cs_r,
+			  "tcp");
+}
+
+#ifdef PLUGIN_RELOAD
+static int callhome_timer(void *arg);
+
+/*! Plugins were reloaded: re-advertise them with a callhome at once
+ * @param[in]  arg   Callhome state
+ */
+static int
+plugin_reloaded(void *arg)
+{
+    struct callhome_state *cs = (struct callhome_state *)arg;
+
+    plugin_changed = 1;
+    return reactor_timer_add(cs->cs_re, &cs->cs_timer, 0,
+			     callhome_timer, cs, "callhome");
 }
+#endif /* PLUGIN_RELOAD */
 
-/*! Exit functions either called on sigterm or end of main */
-static void 
-doexit(int arg)
+/*! Callhome timer: callhome if no known sender has been seen for a while
+ * Also registers the tcp socket once nat traversal has connected it.
+ * @param[in]  arg   Callhome state
+ */
+static int
+callhome_timer(void *arg)
 {
-    struct timeval dur;
-    void          *handle = NULL;
-    struct plugin *p;
-
-    clicon_log(LOG_NOTICE, "%s: %d", __FUNCTION__, arg);
-    timersub(&lastpkt, &firstpkt, &dur);
+    struct callhome_state *cs = (struct callhome_state *)arg;
+    time_t                 idle;
 
-    if (pidfile)
-	unlink(pidfile);   
-    clicon_log(LOG_NOTICE, "grideye_agent: %s: Terminated: Received %d packets (term) during %ld.%03ld secs", 
-	    hostname, pkts, dur.tv_sec, dur.tv_usec/1000);
-    if (plugins){
-	handle = plugins->p_handle;
-/* Cant run exit functions here because we may run in interrupt stack */
-	for (p = plugins; (p->p_api!=NULL); p++){
-	    if (p->p_filename)
-		free(p->p_filename);
-	    if (p->p_name)
-		free(p->p_name);
-	}
-	free(plugins);
-	plugins = NULL;
-	if (handle)
-	    dlclose(handle);
-    }
-    while (s_list != NULL)
-	s_rm(s_list);
-    exit(0);
+    idle = gettimestamp().tv_sec - rx_last;
+    if (!plugin_changed && /* Re-advertised at once */
+	idle >= 0 && idle < cs->cs_timeout) /* Wait for the rest */
+	return reactor_timer_add(cs->cs_re, &cs->cs_timer, 
+				 (cs->cs_timeout - idle)*1000,
+				 callhome_timer, cs, "callhome");
+    if (callhome(cs->cs_r, 
+		 cs->cs_url,
+		 hostname,
+		 cs->cs_userid,
+		 cs->cs_proto,
+		 cs->cs_natstate,
+		 cs->cs_myaddr,
+		 cs->cs_eid64str,
+		 cs->cs_info) < 0)
+	return -1;
+    plugin_changed = 0;
+    if (callhome_tcp(cs) < 0)
+	return -1;
+    return reactor_timer_add(cs->cs_re, &cs->cs_timer, cs->cs_timeout*1000,
+			     callhome_timer, cs, "callhome");
 }
 
+/*! Sender expiry timer: remove senders idle for more than -E seconds
+ * @param[in]  arg   Reactor
+ */
 static int
-callhome(int                 s,
-	 char               *callhome_url,
-	 char               *hostname,
-	 char               *userid,
-	 enum grideye_proto  proto,
-	 int                *natstate,
-	 struct sockaddr_in *myaddr,
-	 char               *eid64str,
-	 char               *info
-	 )
+s_expire_timer(void *arg)
 {
-    int            retval = -1;
+    struct reactor *re = (struct reactor *)arg;
+    static struct reactor_timer rt = {0,};
 
-    clicon_log(LOG_DEBUG, "%s", __FUNCTION__);
-    if (callhome_url && userid){     /* Timeout Send a (call)home message */
-	if (callhome_http(callhome_url, 
-			  hostname, 
-			  userid, 
-			  proto, 
-			  myaddr,
-			  info,
-			  natstate) < 0)
-	    goto done;
-    }
-    clicon_log(LOG_DEBUG, "%s natstate:%d", __FUNCTION__, *natstate);
-    if ((*natstate) > 1){     /* Timeout Send a (call)home message */
-	switch(proto){
-	case GRIDEYE_PROTO_TCP:
-	    if (nattraversal_tcp(s, 
-				 myaddr, 
-				 hostname,
-				 eid64str,
-				 natstate) < 0)
-		goto done;
-	    break;
-	case GRIDEYE_PROTO_UDP:
-	    if (nattraversal_udp(s, 
-				 myaddr, 
-				 hostname,
-				 eid64str) < 0)
-		goto done;
-	    break;
-	default:
-	    break;
-	}
+    if (s_count){
+	pthread_rwlock_wrlock(&s_lock);
+	s_expire(s_idle);
+	pthread_rwlock_unlock(&s_lock);
     }
-    retval = 0;
- done:
-    return retval;
+    return reactor_timer_add(re, &rt, s_idle>4?s_idle/4*1000:1000,
+			     s_expire_timer, re, "sender expiry");
 }
 
 static void
@@ -1419,18 +4282,54 @@ usage(char *argv0)
 	    "\t-w [ifname]\tWireless interface\n"
 	    "\t-P <dir>\tPlugin directory(default: %s)\n"
 	    "\t-z \t\tKill other config daemon and exit\n"
-	    "\t-k <pidfile> \tPidfile, default: %s\n",
+	    "\t-k <pidfile> \tPidfile, default: %s\n"
+	    "\t-b <n> \t\tReceive and send up to n (max %d) packets per syscall\n"
+	    "\t-U \t\tReflect with io_uring, -b receives in flight (default: %d)\n"
+	    "\t-T \t\tSend kernel tx time of previous reply to same sender in t3\n"
+	    "\t-n <n> \t\tReflect on n (max %d) sockets/threads sharing port (default: 1)\n"
+	    "\t-j <n> \t\tRun plugins in n (max %d) worker threads and send their\n"
+	    "\t\t\tresults after the timestamp reply (default: 0, inline)\n"
+	    "\t-E <s> \t\tExpire senders without packets for s seconds, 0: never\n"
+	    "\t\t\t(default: %d)\n"
+	    "\t-C <cpu> \tLow latency: reflectors spin on their sockets in threads\n"
+	    "\t\t\tpinned to cores cpu, cpu+1,..\n"
+	    "\t-R <prio> \tRun -C reflectors with SCHED_FIFO priority prio\n"
+	    "\t-B <us> \tBusy poll device queue us microseconds (SO_BUSY_POLL)\n"
+	    "\t-G \t\tSend fragments of results larger than %d bytes with UDP GSO\n"
+	    "\t-Z <bytes> \tCompress results of at least bytes if sender supports\n"
+	    "\t\t\tit, 0 disables (default: %d)\n"
+	    "\t-J <n> \tRun blocking plugin tests of a data packet in parallel in\n"
+	    "\t\t\tn threads (max: %d)\n"
+	    "\t-X <ms> \tDeadline of parallel plugin tests, unless set in payload\n"
+	    "\t\t\t(default: %d)\n"
+	    "\t-O \t\tRun blocking plugin tests in worker processes, restarted\n"
+	    "\t\t\tif they crash\n",
 	    argv0,
 	    CALLHOME_DEFAULT,
 	    DISKIO_DIR,
 	    DISKIO_LARGEFILE,
 	    DISKIO_WRITEFILE,
 	    PLUGINDIR,
-	    GRIDEYE_AGENT_PIDFILE
+	    GRIDEYE_AGENT_PIDFILE,
+	    ECHO_BATCH_MAX,
+	    URING_SLOTS,
+	    REFLECTOR_MAX,
+	    WORKER_MAX,
+	    SENDER_IDLE_DEFAULT,
+	    BUFSIZE,
+	    COMPRESS_MIN,
+	    FANOUT_MAX,
+	    FANOUT_DEADLINE_DEFAULT
 	    );
     exit(0);
 }
 
+#ifdef GRIDEYE_PACKET_TEST
+/* The agent is built as usual, the test has its own main, see below */
+#define main grideye_agent_main
+int main(int argc, char *argv[]);
+#endif
+
 int 
 main(int   argc, 
      char *argv[])
@@ -1438,47 +4337,37 @@ main(int   argc,
     char               *argv0;
     int                 retval = -1;
     int                 s = -1;
+    struct reflector   *r;
+    int                 i;
     int                 c;
+    int                 ret;
     struct in_addr      inaddr = {0, };
     unsigned short      localport; /* local port */
     struct sockaddr_in  myaddr = {0, };
-    fd_set              fdset;
     int                 callhome_timeout;
     char               *filename;
     FILE               *f;
     uint64_t            eid64;
     char                eid64str[24];
-    int                 yes;
-    int                 n;
     char               *diskio_dir;
-    char               *diskio_largefile = NULL;
-    char               *diskio_writefile = NULL;
-    char               buf[BUFSIZE];
-    int                len = BUFSIZE;
-    struct timeval     t1; /* when received */
     int                natstate; /* state: 0:none 1:enabled 2:addr&port defined */
     char              *callhome_url;
-    struct timeval     tv;
     struct timeval     trnd;
-    int                loss;
-    int                reorder;
-    int                duplicate;
     char              *userid = NULL;
     enum grideye_proto proto;
-    char              *wi = NULL; /* Wireless interface */
-    char              *plugin_dir = NULL;
-    struct plugin     *p;
-    struct grideye_plugin_api_v2 *api;
     int                foreground;
     int                slen;
     int                zap;
     pid_t              pid;
     struct stat        st;
     char              *info = NULL;
-    int                errno0;
-    int                ok;
     char               pidfile[MAXPATHLEN];
+    struct reactor    *re = NULL;
+    struct callhome_state cs;
 
+    /* A plugin worker process of -O, see isolate_fork */
+    if (argc > 1 && strcmp(argv[1], ISOLATE_ARG) == 0)
+	return isolate_worker(argc, argv);
     /* Initialization */
     argv0 = argv[0];
     localport = 0;
@@ -1492,16 +4381,11 @@ main(int   argc,
     eid64 = random();
     eid64 = eid64<<32;
     eid64 |= random();
-    yes = 1;
     zap = 0;
     diskio_dir  = DISKIO_DIR;
-    loss = 0;
-    reorder = 0;
-    duplicate = 0;
-    plugin_dir = PLUGINDIR;
-    plugins = NULL;
     foreground = 0;
     proto = GRIDEYE_PROTO_UDP;
+    nreflectors = 1;
     strncpy(pidfile, GRIDEYE_AGENT_PIDFILE, sizeof(pidfile)-1);
 
     /* Hostname for logs and callbacks, overwritten by -N */
@@ -1584,7 +4468,7 @@ main(int   argc,
 	    duplicate = 40;
 	    break;
 	case 'w':    /* Wireless interface */
-	    wi = optarg;
+	    wlan_device = optarg;
 	    break;
 	case 'P':    /* Grideye_agent plugin dir*/
 	    plugin_dir = optarg;
@@ -1595,9 +4479,112 @@ main(int   argc,
 	case 'k':    /* PID file*/
 	    strncpy(pidfile, optarg, sizeof(pidfile)-1);
 	    break;
+	case 'b':    /* Batch: packets per recvmmsg/sendmmsg */
+	    batch = atoi(optarg);
+	    if (batch <= 0 || batch > ECHO_BATCH_MAX){
+		fprintf(stderr, "Invalid batch size: %s\n", optarg);
+		usage(argv0);
+	    }
+#if !defined(HAVE_RECVMMSG) || !defined(HAVE_SENDMMSG)
+	    if (batch > 1){
+		fprintf(stderr, "Batching not supported on this platform, using 1\n");
+		batch = 1;
+	    }
+#endif
+	    break;
+	case 'U':    /* io_uring */
+#ifdef HAVE_LINUX_IO_URING_H
+	    use_uring = 1;
+#else
+	    fprintf(stderr, "io_uring not supported on this platform\n");
+#endif
+	    break;
+	case 'T':    /* Tx timestamps in t3 */
+#ifdef HAVE_TXSTAMP
+	    txstamp = 1;
+#else
+	    fprintf(stderr, "Tx timestamps not supported on this platform\n");
+#endif
+	    break;
+	case 'j':    /* Number of plugin worker threads */
+	    nworkers = atoi(optarg);
+	    if (nworkers < 0 || nworkers > WORKER_MAX){
+		fprintf(stderr, "Invalid number of plugin workers: %s\n", optarg);
+		usage(argv0);
+	    }
+	    break;
+	case 'C':    /* Low latency: spinning pinned reflectors */
+	    lowlat_cpu = atoi(optarg);
+	    if (lowlat_cpu < 0){
+		fprintf(stderr, "Invalid cpu: %s\n", optarg);
+		usage(argv0);
+	    }
+	    break;
+	case 'R':    /* SCHED_FIFO priority of -C reflectors */
+	    lowlat_prio = atoi(optarg);
+	    if (lowlat_prio < sched_get_priority_min(SCHED_FIFO) ||
+		lowlat_prio > sched_get_priority_max(SCHED_FIFO)){
+		fprintf(stderr, "Invalid SCHED_FIFO priority: %s\n", optarg);
+		usage(argv0);
+	    }
+	    break;
+	case 'B':    /* Busy poll */
+	    busy_poll = atoi(optarg);
+	    if (busy_poll < 0){
+		fprintf(stderr, "Invalid busy poll time: %s\n", optarg);
+		usage(argv0);
+	    }
+#if !defined(SO_BUSY_POLL)
+	    fprintf(stderr, "Busy poll not supported on this platform\n");
+	    busy_poll = 0;
+#endif
+	    break;
+	case 'G':    /* UDP GSO of result fragments */
+#ifdef UDP_SEGMENT
+	    gso = 1;
+#else
+	    fprintf(stderr, "UDP GSO not supported on this platform\n");
+#endif
+	    break;
+	case 'J':    /* Plugin fan-out threads */
+	    nfanouts = atoi(optarg);
+	    if (nfanouts < 0 || nfanouts > FANOUT_MAX){
+		fprintf(stderr, "Invalid number of fan-out threads: %s\n", optarg);
+		usage(argv0);
+	    }
+	    break;
+	case 'X':    /* Deadline of fanned out plugin tests */
+	    fanout_deadline = atoi(optarg);
+	    break;
+	case 'O':    /* Plugin worker processes */
+	    isolate_on = 1;
+	    break;
+	case 'Z':    /* Result compression threshold */
+	    compress_min = atoi(optarg);
+	    break;
+	case 'E':    /* Sender idle expiry */
+	    s_idle = atoi(optarg);
+	    if (s_idle < 0){
+		fprintf(stderr, "Invalid sender expiry: %s\n", optarg);
+		usage(argv0);
+	    }
+	    break;
+	case 'n':    /* Number of reflector sockets/threads */
+	    nreflectors = atoi(optarg);
+	    if (nreflectors <= 0 || nreflectors > REFLECTOR_MAX){
+		fprintf(stderr, "Invalid number of reflectors: %s\n", optarg);
+		usage(argv0);
+	    }
+#if !defined(SO_REUSEPORT)
+	    if (nreflectors > 1){
+		fprintf(stderr, "SO_REUSEPORT not supported on this platform, using 1\n");
+		nreflectors = 1;
+	    }
+#endif
+	    break;
 	} /* switch */
     } /* while */
-    clicon_log(LOG_DEBUG, "wi:%s", wi);
+    clicon_log(LOG_DEBUG, "wi:%s", wlan_device);
     /* sensd does not want an 0x%lx but parse_uint64 does */
     snprintf(eid64str, sizeof(eid64str), "0x%" PRIu64, eid64);
     /* Get some system info */
@@ -1637,55 +4624,36 @@ main(int   argc,
     /* Write pid-file */
     if ((pid = pidfile_write(pidfile)) <  0)
 	goto done; 
-    if ((plugins = calloc(1, sizeof(struct plugin))) == NULL){
+    /* Options of plugins, see plugin_setopt */
+    if ((slen = snprintf(NULL, 0, "%s/%s", diskio_dir, DISKIO_WRITEFILE)) <= 0)
+	goto done;
+    if ((diskio_writefile = malloc(slen+1)) == NULL)
+	goto done;
+    snprintf(diskio_writefile, slen+1, "%s/%s", diskio_dir, DISKIO_WRITEFILE);
+    if ((slen = snprintf(NULL, 0, "%s/%s", diskio_dir, DISKIO_LARGEFILE)) <= 0)
+	goto done;
+    if ((diskio_largefile = malloc(slen+1)) == NULL)
+	goto done;
+    snprintf(diskio_largefile, slen+1, "%s/%s", diskio_dir, DISKIO_LARGEFILE);
+    /* Threads that call plugins register as readers, see plugin_enter */
+    if ((ret = pthread_key_create(&plugin_key, NULL)) != 0){
+	clicon_err(OE_UNIX, ret, "pthread_key_create");
+	goto done;
+    }
+    if ((plugin_cur = calloc(1, sizeof(struct plugin_gen))) == NULL ||
+	(plugin_cur->pg_plugins = calloc(1, sizeof(struct plugin))) == NULL){
 	clicon_err(OE_UNIX, errno, "calloc");
 	goto done;
     }
+    plugin_cur->pg_gen = 1;
     /* Load test plugins, and call their init functions */
-    if (plugin_load_dir(plugin_dir, &plugins) < 0)
+#ifdef GRIDEYE_STATIC
+    if (plugin_load_static(&plugin_cur->pg_plugins) < 0)
 	goto done;
-    for (p = plugins; (api=p->p_api)!=NULL; p++){
-	if (api->gp_setopt_fn){
-	    /* XXX rewrite these file/device setopts */
-	    if ((slen = snprintf(NULL, 0, "%s/%s", diskio_dir, 
-				 DISKIO_WRITEFILE)) <= 0)
-		goto done;
-	    if ((diskio_writefile = malloc(slen+1)) == NULL)
-		goto done;
-	    snprintf(diskio_writefile, slen+1, "%s/%s", diskio_dir, 
-		     DISKIO_WRITEFILE);
-
-	    if ((slen = snprintf(NULL, 0, "%s/%s", diskio_dir, 
-				 DISKIO_LARGEFILE)) <= 0)
-		goto done;
-	    if ((diskio_largefile = malloc(slen+1)) == NULL)
-		goto done;
-	    snprintf(diskio_largefile, slen+1, "%s/%s", diskio_dir, 
-		     DISKIO_LARGEFILE);
-	    if (api->gp_setopt_fn("writefile", diskio_writefile) < 0){
-		p->p_disable++;
-		clicon_log(LOG_NOTICE, "plugin setopt(writefile):%s",
-			   diskio_writefile);
-		clicon_log(LOG_NOTICE, "Disable plugin %s: %s", 
-			   p->p_filename, strerror(errno));
-	    }
-	    if (api->gp_setopt_fn("largefile", diskio_largefile) < 0){
-		clicon_log(LOG_NOTICE, "plugin setopt(largefile):%s",
-			   diskio_largefile);
-		clicon_log(LOG_NOTICE, "Disable plugin %s: %s", 
-			   p->p_filename, strerror(errno));
-	    }
-	    if (api->gp_setopt_fn("device", wi) < 0){
-		p->p_disable++;
-		clicon_log(LOG_NOTICE, "plugin setopt(device):%s",
-			   diskio_largefile);
-		clicon_log(LOG_NOTICE, "Disable plugin %s: %s", 
-			   p->p_filename, strerror(errno));
-	    }
-	}
-    }
-    if (0)
-	fprintf(stderr, "%s %s\n", diskio_largefile, diskio_writefile);
+#else
+    if (plugin_load_dir(plugin_dir, NULL, &plugin_cur->pg_plugins) < 0)
+	goto done;
+#endif
     if (filename){
 	if ((f = fopen(filename, "w")) == NULL){
 	    clicon_err(OE_UNIX, errno, "fopen");
@@ -1696,47 +4664,93 @@ main(int   argc,
     set_signal(SIGTERM, grideye_sig, NULL);
 
     /* Initialize: create/bind socket for tcp/udp */
-    switch (proto){
-    case GRIDEYE_PROTO_TCP:
-	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-	    clicon_err(OE_UNIX, errno, "socket");
-	    goto done;
+    if (proto != GRIDEYE_PROTO_UDP){
+	nreflectors = 1;
+	batch = 1;
+	use_uring = 0;
+	lowlat_cpu = -1;
+    }
+    if (lowlat_prio && lowlat_cpu == -1){
+	fprintf(stderr, "SCHED_FIFO (-R) only with low latency reflectors (-C)\n");
+	usage(argv0);
+    }
+    if (use_uring){
+	if (txstamp){
+	    fprintf(stderr, "Tx timestamps (-T) not supported with io_uring (-U)\n");
+	    usage(argv0);
 	}
-	break;
-    case GRIDEYE_PROTO_UDP:
-	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-	    clicon_err(OE_UNIX, errno, "socket");
+	if (batch == 1)
+	    batch = URING_SLOTS;
+    }
+    if ((reflectors = calloc(nreflectors, sizeof(struct reflector))) == NULL){
+	clicon_err(OE_UNIX, errno, "calloc");
+	goto done;
+    }
+    for (i=0; i<nreflectors; i++){
+	r = &reflectors[i];
+	r->r_id = i;
+	r->r_s = -1;
+	r->r_cpu = -1;
+	pthread_mutex_init(&r->r_txlock, NULL);
+	if ((r->r_bufs = malloc(batch*BUFSIZE)) == NULL){
+	    clicon_err(OE_UNIX, errno, "malloc");
 	    goto done;
 	}
-	if (socket_bind_udp(s, 
-			    &inaddr, 
-			    localport, 
-			    &myaddr) < 0)
+	if ((r->r_arena = arena_new(ARENA_SIZE)) == NULL)
 	    goto done;
-	/* From here on use myaddr, not localport/inaddr */
-	clicon_log(LOG_NOTICE, "grideye_agent %s Listening to: %s:%hu", 
-		   hostname, inet_ntoa(myaddr.sin_addr), ntohs(myaddr.sin_port));
-	/* Local socket */
-	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) < 0){
-	    clicon_err(OE_UNIX, errno, "socket");
+	if ((r->r_plans = calloc(PLAN_SLOTS, sizeof(struct plan))) == NULL){
+	    clicon_err(OE_UNIX, errno, "calloc");
 	    goto done;
 	}
-#if defined(SOL_IP)
-	if(setsockopt(s, SOL_IP, IP_RECVTTL, &yes, sizeof(int))<0){
+    }
+    r = &reflectors[0];
+    switch (proto){
+    case GRIDEYE_PROTO_TCP:
+	if ((r->r_s = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
 	    clicon_err(OE_UNIX, errno, "socket");
 	    goto done;
 	}
-#endif
+	break;
+    case GRIDEYE_PROTO_UDP:
+	/* First socket may get an ephemeral port, the rest share it */
+	for (i=0; i<nreflectors; i++)
+	    if (reflector_socket(&reflectors[i], 
+				 &inaddr, 
+				 i?ntohs(myaddr.sin_port):localport, 
+				 &myaddr) < 0)
+		goto done;
+	/* From here on use myaddr, not localport/inaddr */
+	clicon_log(LOG_NOTICE, "grideye_agent %s Listening to: %s:%hu (%d reflectors)", 
+		   hostname, inet_ntoa(myaddr.sin_addr), ntohs(myaddr.sin_port),
+		   nreflectors);
 	break;
     case GRIDEYE_PROTO_HTTP:
     default:
 	break;
     }
+    s = r->r_s;
+    /* Before threads that may start non-blocking tests */
+    if (async_init() < 0)
+	goto done;
+    /* Before threads that call plugins */
+    if (isolate_on && 
+	isolate_init(argv0, foreground?CLICON_LOG_STDERR:CLICON_LOG_SYSLOG) < 0)
+	goto done;
+    if (nworkers && worker_start() < 0)
+	goto done;
+    if (nfanouts && fanout_start() < 0)
+	goto done;
+    /* Rings of reflector threads are created by the threads */
+    if (use_uring && lowlat_cpu == -1 && reflector_uring_start(r) < 0)
+	goto done;
+    /* Before callhome, which reports the cores of -C */
+    if (reflector_start() < 0)
+	goto done;
     /* kickstart */
     switch (proto){
     case GRIDEYE_PROTO_TCP:
     case GRIDEYE_PROTO_UDP:
-	if (callhome(s, 
+	if (callhome(r, 
 		     callhome_url,
 		     hostname,
 		     userid,
@@ -1761,79 +4775,61 @@ main(int   argc,
     default:
       break;
     }
-    tv.tv_sec = callhome_timeout;
-    for (;;){
-	FD_ZERO(&fdset);
-	switch (proto){
-	case GRIDEYE_PROTO_UDP:
-	    FD_SET(s, &fdset);
-	    break;
-	case GRIDEYE_PROTO_TCP:
-	    if (natstate > 2) /* connected */
-		FD_SET(s, &fdset); 
-	    break;
-	case GRIDEYE_PROTO_HTTP:
-	default:
+    /* Event loop: reflector 0 socket and callhome timer */
+    if ((re = reactor_new()) == NULL)
+	goto done;
+    /* Terminate on signals also if they arrive while packets are handled */
+    if (reactor_signal(re, SIGINT) < 0 || reactor_signal(re, SIGTERM) < 0)
+	goto done;
+    /* Non-blocking plugin tests are polled here */
+    if (async_register(re) < 0)
+	goto done;
+    memset(&cs, 0, sizeof(cs));
+    cs.cs_re = re;
+    cs.cs_r = r;
+    cs.cs_url = callhome_url;
+    cs.cs_userid = userid;
+    cs.cs_proto = proto;
+    cs.cs_natstate = &natstate;
+    cs.cs_myaddr = &myaddr;
+    cs.cs_eid64str = eid64str;
+    cs.cs_info = info;
+    cs.cs_timeout = callhome_timeout;
+    switch (proto){
+    case GRIDEYE_PROTO_UDP:
+	if (r->r_started) /* -C */
 	    break;
-	}
-	//clicon_log(LOG_DEBUG, "Callhome timeout: %d", callhome_timeout;)
-	tv.tv_usec = 0;
-	n = select(FD_SETSIZE, &fdset, NULL, NULL, &tv);
-	/* Consider timeout to be undefined after select() returns. */
-	errno0 = errno;
-	t1 = gettimestamp();
-	if (n == -1) {
-	    clicon_err(OE_UNIX, errno0, "select");
-	    goto done;
-	}
-	/* Timeout */
-	if (n==0){
-	    if (callhome(s, 
-			 callhome_url,
-			 hostname,
-			 userid,
-			 proto,
-			 &natstate,
-			 &myaddr,
-			 eid64str,
-			 info) < 0)
+	if (r->r_ring){
+	    if (reactor_fd_reg(re, uring_fd(r->r_ring), reflector_uring, r, 
+			       "udp io_uring") < 0)
 		goto done;
-	    tv.tv_sec = callhome_timeout;
-	}
-	/* Check sockets */
-	switch(proto){
-	case GRIDEYE_PROTO_TCP:
-	case GRIDEYE_PROTO_UDP:
-	    if (FD_ISSET(s, &fdset)){  /* udp. can this work for tcp? */
-		ok = 0;
-		if (echo_packet(s, 
-				t1,
-				buf, 
-				len, 
-				eid64str, 
-				loss,
-				reorder,
-				duplicate,
-				wi,
-				plugins,
-				hostname,
-				&ok) < 0)
-		    goto done;
-		if (ok)
-		    tv.tv_sec = callhome_timeout;
-	    }
-	    break;
-	case GRIDEYE_PROTO_HTTP: /* Eeeh need timer */
-	    clicon_log(LOG_DEBUG, "Send curl Sample");
-	    break;
-	default:
-	  break;
 	}
-    } /* for */
+	else if (reactor_fd_reg(re, s, reflector_recv, r, "udp") < 0)
+	    goto done;
+	break;
+    case GRIDEYE_PROTO_TCP:
+	if (callhome_tcp(&cs) < 0)
+	    goto done;
+	break;
+    case GRIDEYE_PROTO_HTTP: /* Only callhome */
+    default:
+	break;
+    }
+    if (reactor_timer_add(re, &cs.cs_timer, callhome_timeout*1000,
+			  callhome_timer, &cs, "callhome") < 0)
+	goto done;
+    if (s_idle && s_expire_timer(re) < 0)
+	goto done;
+#ifdef PLUGIN_RELOAD
+    if (plugin_watch(re, plugin_reloaded, &cs) < 0)
+	goto done;
+#endif
+    if (reactor_loop(re) < 0)
+	goto done;
     retval = 0;
  done:
-    if (s != -1)
-	close(s);
+    if (re)
+	reactor_free(re);
 #if 0
     if (callhome_url && name && userid){     /* Timeout Send a (call)home message */
 	if (callhome_http(callhome_url, name, userid, proto, localport, info,
@@ -1848,3 +4844,277 @@ main(int   argc,
     return(retval);
 }
 
+
+#ifdef GRIDEYE_PACKET_TEST
+#undef main
+/* Test: reflecting data packets does no heap allocation after warmup
+ * Data packets are run through echo_reflect and sent as echo_packet does,
+ * with plugin tests run inline or queued for a plugin worker (job_run and
+ * result_send), and payloads whose plans are cached or compiled again.
+ * Allocations are counted by wrapping malloc of the C library, so that
+ * those of the agent, its libraries and the plugins are all seen. A v2
+ * plugin allocates its result string, that is the only allocation allowed.
+ * compile: make grideye_packet_test
+ */
+#ifndef __GLIBC__
+#error "The packet test counts allocations of glibc"
+#endif
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+#define PACKET_TEST_WARMUP 1000
+#define PACKET_TEST_N      10000
+
+static uint64_t test_mallocs = 0;
+
+void *
+malloc(size_t size)
+{
+    __sync_fetch_and_add(&test_mallocs, 1);
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n,
+       size_t size)
+{
+    __sync_fetch_and_add(&test_mallocs, 1);
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void  *ptr,
+	size_t size)
+{
+    __sync_fetch_and_add(&test_mallocs, 1);
+    return __libc_realloc(ptr, size);
+}
+
+/* v3 plugin: writes its param and a counter */
+static int
+test_v3(char                  *param,
+	struct grideye_writer *gw)
+{
+    static uint64_t n = 0;
+
+    if (param && gw->gw_str(gw, "tparam", param) < 0)
+	return -1;
+    return gw->gw_u64(gw, "tn", n++);
+}
+
+static struct grideye_plugin_api_v3 test_api3 = {
+    GRIDEYE_PLUGIN_VERSION_V3, GRIDEYE_PLUGIN_MAGIC, "t3", "str", NULL,
+    test_v3, NULL};
+
+/* v2 plugin: returns its param in an allocated string */
+static int
+test_v2(char  *param,
+	char **out)
+{
+    char buf[128];
+
+    snprintf(buf, sizeof(buf), "<tparam2>%s</tparam2>", param ? param : "");
+    return (*out = strdup(buf)) == NULL ? -1 : 0;
+}
+
+static struct grideye_plugin_api_v2 test_api2 = {
+    GRIDEYE_PLUGIN_VERSION, GRIDEYE_PLUGIN_MAGIC, "t2", "str", "xml", NULL,
+    test_v2, NULL};
+
+/* p_api of t2 is adapted when the test starts */
+static struct plugin test_plugins[] = {
+    {NULL, GRIDEYE_PLUGIN_VERSION_V3, "t3", "t3", 0, &test_api3, NULL},
+    {NULL, GRIDEYE_PLUGIN_VERSION, "t2", "t2", 0, NULL, &test_api2},
+    {NULL,}
+};
+
+/* A payload, %s is replaced by the name of the agent and %06u by the
+ * sequence number, its result has the param p%06u, else pc. An empty 
+ * payload is reflected with timestamps only */
+struct packet_test{
+    char *pt_name;
+    char *pt_payload;
+    int   pt_namelen;  /* Of agent name, see -N, 0 for "test" */
+    int   pt_workers;  /* Plugin tests queued for a worker, see -j */
+    int   pt_enc;      /* Result encoding ENC_* of sender */
+    int   pt_mallocs;  /* Allowed per packet */
+};
+
+static struct packet_test packet_tests[] = {
+    {"timestamps only", "", 0, 0, 0, 0},
+    {"v3 plugin, cached plan",
+     "{\"grideye\":{\"version\":2,\"name\":\"%s\",\"plugin\":[{\"name\":\"t3\",\"param\":\"pc\"},{\"name\":\"t3\"}]}}",
+     0, 0, 0, 0},
+    {"v3 plugin, new plan in each packet",
+     "{\"grideye\":{\"version\":2,\"name\":\"%s\",\"plugin\":[{\"name\":\"t3\",\"param\":\"p%06u\"},{\"name\":\"t3\",\"param\":[\"q\\u0041%06u\"]}]}}",
+     0, 0, 0, 0},
+    {"v3 plugin, 100 character agent name",
+     "{\"grideye\":{\"version\":2,\"name\":\"%s\",\"plugin\":[{\"name\":\"t3\",\"param\":\"p%06u\"}]}}",
+     100, 0, 0, 0},
+    {"v3 plugin, cbor result",
+     "{\"grideye\":{\"version\":2,\"name\":\"%s\",\"plugin\":[{\"name\":\"t3\",\"param\":\"p%06u\"}]}}",
+     0, 0, ENC_CBOR, 0},
+    /* 55799({"grideye": {"version": 2, "name": <100 characters>,
+     *   "plugin": [{"name": "t3", "param": "p%06u"}]}}) */
+    {"v3 plugin, cbor request, 100 character agent name",
+     "\xd9\xd9\xf7\xa1\x67grideye\xa3\x67version\x02\x64name\x78\x64%s"
+     "\x66plugin\x81\xa2\x64name\x62t3\x65param\x67p%06u",
+     100, 0, 0, 0},
+    {"v3 plugin, plugin worker",
+     "{\"grideye\":{\"version\":2,\"name\":\"%s\",\"plugin\":[{\"name\":\"t3\",\"param\":\"p%06u\"}]}}",
+     0, 1, 0, 0},
+    {"v2 plugin",
+     "{\"grideye\":{\"version\":2,\"name\":\"%s\",\"plugin\":[{\"name\":\"t2\",\"param\":\"p%06u\"}]}}",
+     0, 0, 0, 1},
+    {NULL,}
+};
+
+/*! Reflect one data packet and check that its reply is received
+ * @param[in]  r      Reflector, its socket sends to s
+ * @param[in]  s      Socket of sender
+ * @param[in]  from   Address of s
+ * @param[in]  pt     Test
+ * @param[in]  seq    Sequence number
+ * @param[in]  plans  Plan cache of plugin worker
+ * @param[in]  a      Arena of plugin worker
+ */
+static int
+packet_test_one(struct reflector   *r,
+		int                 s,
+		struct sockaddr_in *from,
+		struct packet_test *pt,
+		uint32_t            seq,
+		struct plan        *plans,
+		struct arena       *a)
+{
+    static char        rbuf[BUFSIZE];
+    char               payload[512];
+    char               param[16];
+    struct twoway_hdr  th = {0,};
+    struct msghdr      msg = {0,};
+    struct iovec       iov[TWOWAY_IOVLEN];
+    uint32_t           seq1;
+    int                len;
+    int                ok = 0;
+    int                niov;
+    int                slen;
+    int                dup;
+    int                found = 0;
+    int                n;
+
+    snprintf(payload, sizeof(payload), pt->pt_payload, hostname, seq, seq);
+    if (*pt->pt_payload == '\0') /* Any reply will do */
+	*param = '\0';
+    else if (strstr(pt->pt_payload, "%06u"))
+	snprintf(param, sizeof(param), "p%06u", seq);
+    else
+	strncpy(param, "pc", sizeof(param));
+    th.th_ver = PROTO_VERSION;
+    th.th_mtype = MTYPE_TWOWAY;
+    th.th_tag = TWOWAY_TAG;
+    th.th_seq0 = seq;
+    th.th_t0 = gettimestamp();
+    len = sizeof(th) + strlen(payload) + 1;
+    if (encode_twoway(r->r_bufs, len, &th, payload) < 0)
+	return -1;
+    msg.msg_name = from;
+    msg.msg_namelen = sizeof(*from);
+    if (echo_reflect(r, &msg, gettimestamp(), r->r_bufs, BUFSIZE, len,
+		     hostname, &ok, iov, &niov, &slen, &dup, &seq1) < 0 ||
+	!ok || !slen)
+	return -1;
+    if (send_one_agent_locked(r, (struct sockaddr *)from, sizeof(*from),
+			      iov, niov) < 0)
+	return -1;
+    arena_reset(r->r_arena);
+    job_poll(plans, a); /* As worker_thread */
+    while ((n = recv(s, rbuf, sizeof(rbuf), MSG_DONTWAIT)) > 0)
+	if (memmem(rbuf, n, param, strlen(param)) != NULL)
+	    found++;
+    if (!found){
+	fprintf(stderr, "%s: seq %u: no reply with '%s'\n", pt->pt_name, seq,
+		param);
+	return -1;
+    }
+    return 0;
+}
+
+int
+main(int   argc,
+     char *argv[])
+{
+    int                 retval = -1;
+    struct reflector    r = {0,};
+    struct sender      *snd;
+    struct sockaddr_in  sin = {0,};
+    struct sockaddr_in  from;
+    socklen_t           slen = sizeof(from);
+    struct packet_test *pt;
+    struct plan        *plans;
+    struct arena       *a;
+    uint32_t            seq = 0;
+    uint64_t            warm;
+    uint64_t            n;
+    int                 s;
+    int                 i;
+
+    clicon_log_init("grideye_packet_test", LOG_WARNING, CLICON_LOG_STDERR);
+    if ((test_plugins[1].p_api = plugin_adapt_v2(&test_api2)) == NULL ||
+	pthread_key_create(&plugin_key, NULL) != 0 ||
+	(plugin_cur = calloc(1, sizeof(struct plugin_gen))) == NULL)
+	return -1;
+    plugin_cur->pg_plugins = test_plugins;
+    plugin_cur->pg_gen = 1;
+    /* Reflector and sender on loopback */
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((r.r_s = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+	bind(r.r_s, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	(s = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+	bind(s, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	getsockname(s, (struct sockaddr *)&from, &slen) < 0){
+	perror("socket");
+	return -1;
+    }
+    r.r_cpu = -1;
+    pthread_mutex_init(&r.r_txlock, NULL);
+    if ((r.r_bufs = malloc(BUFSIZE)) == NULL ||
+	(r.r_arena = arena_new(ARENA_SIZE)) == NULL ||
+	(r.r_plans = calloc(PLAN_SLOTS, sizeof(struct plan))) == NULL ||
+	(a = arena_new(ARENA_SIZE)) == NULL ||
+	(plans = calloc(PLAN_SLOTS, sizeof(struct plan))) == NULL)
+	return -1;
+    /* Registered as by callhome_http */
+    if ((snd = s_add(&from, sizeof(from))) == NULL ||
+	xml_parse_string("<grideye/>", NULL, &snd->s_xml) < 0)
+	return -1;
+    for (pt = packet_tests; pt->pt_name; pt++){
+	nworkers = pt->pt_workers;
+	if (pt->pt_namelen){
+	    memset(hostname, 'n', pt->pt_namelen);
+	    hostname[pt->pt_namelen] = '\0';
+	}
+	else
+	    strncpy(hostname, "test", sizeof(hostname)-1);
+	snd->s_enc = pt->pt_enc;
+	warm = 0;
+	for (i=0; i<PACKET_TEST_WARMUP+PACKET_TEST_N; i++){
+	    if (i == PACKET_TEST_WARMUP)
+		warm = test_mallocs;
+	    if (packet_test_one(&r, s, &from, pt, seq++, plans, a) < 0)
+		goto done;
+	}
+	n = test_mallocs - warm;
+	fprintf(stdout, "%s: mallocs in %d packets after warmup: %llu\n",
+		pt->pt_name, PACKET_TEST_N, (unsigned long long)n);
+	if (n != (uint64_t)pt->pt_mallocs*PACKET_TEST_N)
+	    goto done;
+    }
+    retval = 0;
+ done:
+    close(s);
+    close(r.r_s);
+    return retval;
+}
+#endif /* GRIDEYE_PACKET_TEST */
@@ -25,6 +25,15 @@
 #define TWOWAY_TAG  0xcf30e506
 #define PROTO_VERSION 4
 
+/* Length of encoded twoway_hdr */
+#define TWOWAY_HDRLEN 60
+
+/* Entries of an iovec from encode_twoway_iov: header, payload, padding */
+#define TWOWAY_IOVLEN 3
+
+/* Length of encoded frag_hdr, after the twoway header of a MTYPE_FRAG */
+#define FRAG_HDRLEN 8
+
 /*
  * Types
  */
@@ -33,6 +42,8 @@
 enum mtype{
     MTYPE_CONTROL=0,     /* @see control_hdr: Regular control */
     MTYPE_TWOWAY=8,   /* @see twoway_hdr */
+    MTYPE_RESULT=9,   /* @see twoway_hdr: plugin results of twoway with th_seq0 */
+    MTYPE_FRAG=10,    /* @see frag_hdr: fragment of MTYPE_RESULT or reply payload */
 };
 
 
@@ -60,6 +71,17 @@ struct twoway_hdr{
     struct timeval th_t3;
 };
 
+/* Fragment of a result too large for one datagram. A MTYPE_FRAG packet is
+ * the twoway_hdr of the reply or result, the frag_hdr and fh_len/fh_count
+ * bytes or less of the result, without terminator or padding. The result
+ * is the fragments concatenated in fh_index order.
+ */
+struct frag_hdr{
+    uint16_t fh_index;  /* 0..fh_count-1 */
+    uint16_t fh_count;  /* Number of fragments of result */
+    uint32_t fh_len;    /* Length of result */
+};
+
 /* See pt_2way_req */
 struct control_hdr{
     uint8_t   ch_ver;      /* See twoway_hdr, eg 4  */
@@ -83,7 +105,11 @@ enum grideye_proto{
  * Prototypes
  */
 int encode_twoway(char *msg, int pktlen, struct twoway_hdr *th, char *payload);
+int encode_twoway_hdr(char *hdr, struct twoway_hdr *th);
+int encode_twoway_iov(struct iovec *iov, char *hdr, int pktlen, struct twoway_hdr *th, char *payload, int plen);
 int decode_twoway(char *msg, int pktlen, struct twoway_hdr *th, char **payload, uint32_t *rlen);
+int encode_frag_hdr(char *hdr, struct frag_hdr *fh);
+int decode_frag(char *msg, int pktlen, struct twoway_hdr *th, struct frag_hdr *fh, char **payload, uint32_t *plen);
 int encode_control(char *msg, int pktlen, struct control_hdr *ch, char *xstr);
 
 int decode_control(char *msg, int pktlen, struct control_hdr *ch, char **payload, uint32_t *rlen);
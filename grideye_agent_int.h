@@ -0,0 +1,161 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Types and functions of grideye_agent.c used by the other modules of the
+ * agent, eg grideye_worker.c. Not part of the lib and not installed.
+ * Include after grideye_agent.h, grideye_arena.h and grideye_plugin_v3.h
+ */
+#ifndef _GRIDEYE_AGENT_INT_H_
+#define _GRIDEYE_AGENT_INT_H_
+
+/*
+ * Constants
+ */
+/* Changed plugins are reloaded, not if they are linked into the agent */
+#if defined(HAVE_SYS_INOTIFY_H) && !defined(GRIDEYE_STATIC)
+#define PLUGIN_RELOAD 1
+#endif
+
+#define BUFSIZE           8*1024
+
+/* Result encodings of a sender, see callhome_http */
+#define ENC_CBOR          0x01 /* Results as cbor, else XML text */
+#define ENC_ZLIB          0x02 /* Results compressed, see -Z */
+
+/* Plans cached per thread, ie different payloads of a sender */
+#define PLAN_SLOTS        16
+
+/*
+ * Types
+ */
+struct reflector;
+struct async_job;
+
+/* Info of a plugin. Make a vector of these for all plugins */
+struct plugin{
+    void                         *p_handle;
+    int                           p_version;
+    char                         *p_filename; /* Actual filename */
+    char                         *p_name;     /* Name corresponds to yang spec */
+    int                           p_disable; /* something failed */
+    struct grideye_plugin_api_v3 *p_api;  /* v2 plugins: adapted copy */
+    struct grideye_plugin_api_v2 *p_api2; /* v2 plugins, else NULL */
+    struct result_cache          *p_cache; /* If gp_cache_ms is set */
+    struct sample       *volatile p_samples; /* Sampled in background */
+    int                           p_fd;   /* Reloaded: file of p_handle */
+    dev_t                         p_dev;  /* Of file, to detect changes */
+    ino_t                         p_ino;
+    time_t                        p_mtime;
+    int                           p_kept; /* Unchanged, moved to next gen */
+};
+
+/* A generation of loaded plugins. A reload publishes a new generation, and
+ * the previous is freed when no thread uses it anymore, see plugin_retire */
+struct plugin_gen{
+    struct plugin_gen *pg_next;    /* Replaced, not yet freed */
+    struct plugin     *pg_plugins; /* Null-terminated vector */
+    unsigned           pg_gen;     /* 1, 2, .. */
+    int                pg_refs;    /* Async jobs started in it */
+};
+
+/* Writer of plugin results into the reply, see struct grideye_writer
+ * The reply is XML text, or a cbor map if rw_cbor is set, see result_init */
+struct result_writer{
+    struct grideye_writer rw_gw;
+    struct arena         *rw_arena;
+    char                **rw_reply;
+    size_t                rw_len;    /* Length of reply */
+    int                   rw_cbor;
+};
+
+/* A plugin call of a plan */
+struct plan_call{
+    struct plugin *pc_plugin;
+    char          *pc_param;    /* Single param in pl_params, or NULL */
+    size_t         pc_paramoff; /* Of pc_param, while compiling */
+    uint64_t       pc_key;      /* Hash of param, see cache_get */
+};
+
+/* A data packet payload compiled into the plugin calls it requests, so that
+ * repeated payloads are not parsed again, see plan_get */
+struct plan{
+    uint64_t          pl_hash;     /* Hash of payload */
+    size_t            pl_len;      /* 0 if slot is empty */
+    char             *pl_payload;  /* Copy */
+    int               pl_ncalls;
+    struct plan_call *pl_calls;
+    char             *pl_params;   /* Params of pl_calls */
+    size_t            pl_parlen;
+    /* Sizes of buffers, kept when the slot is compiled again, see plan_clear */
+    size_t            pl_paysize;
+    int               pl_maxcalls;
+    size_t            pl_parsize;
+    int               pl_deadline; /* ms, or 0 for -X, see fanout_wait */
+    unsigned          pl_gen;      /* Of plugins in pl_calls */
+};
+
+/*
+ * Variables
+ */
+extern char hostname[128]; /* name of this host, -N or gethostname */
+extern struct plugin_gen *volatile plugin_cur; /* See plugin_enter */
+extern struct plugin_gen *plugin_retired; /* Replaced, see plugin_retire */
+extern char *plugin_dir;   /* -P */
+extern char *diskio_largefile; /* Plugin options, see plugin_setopt */
+extern char *diskio_writefile;
+extern char *wlan_device;  /* -w */
+
+/*
+ * Prototypes
+ */
+struct plugin *plugin_find(char *name);
+struct plugin_gen *plugin_enter(void);
+#ifdef GRIDEYE_STATIC
+int    plugin_load_static(struct plugin *plugins[]);
+#endif
+int    plugin_load_dir(char *dir, struct plugin *old, struct plugin *plugins[]);
+int    plugins_len(struct plugin *plugins);
+void   plugin_free(struct plugin *p, int exitfn);
+void   plugin_gen_free(struct plugin_gen *pg, int exitfn);
+#ifdef PLUGIN_RELOAD
+int    plugin_in_use(unsigned gen);
+#endif
+int    plugin_pin(struct plugin_gen *pg);
+void   plugin_leave(void);
+int    result_send(struct reflector *r, struct sockaddr_in *addr,
+		   struct twoway_hdr *th, char *reply, size_t plen);
+uint64_t plan_hash(char *payload, size_t len);
+void   plans_free(struct plan *plans);
+void   result_init(struct result_writer *rw, struct arena *a, char **reply,
+		   int cbor);
+void   result_truncate(struct result_writer *rw, size_t len);
+int    result_end(struct result_writer *rw);
+int    result_append(struct result_writer *rw, const char *data, size_t n);
+int    result_merge(struct result_writer *rw, const char *data, size_t n);
+int    result_compress(struct arena *a, int enc, char **reply, size_t *plen);
+int    plugin_test(struct plugin *p, char *argstr, struct result_writer *rw);
+int    plugin_call(struct plugin *p, char *argstr, uint64_t key,
+		   struct result_writer *rw);
+int    echo_application(char *myname, char *payload, size_t paylen,
+			struct plan *plans, struct arena *a, int enc,
+			char **reply, size_t *rlen, struct async_job **ajp);
+
+#endif /* _GRIDEYE_AGENT_INT_H_ */
@@ -20,6 +20,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
@@ -47,6 +48,7 @@
 #endif
 
 #include "grideye_agent.h"
+#include "grideye_cbor.h"
 
 static int 
 short2Bytes(int16_t h, 
@@ -120,11 +122,48 @@ twamp2timeval(uint64_t        ts,
     return 0;
 }
 
-/*! Encode Twoway protocol header
+/* Zero padding after payload, see encode_twoway_iov */
+static const char twoway_zeros[sizeof(struct twoway_hdr)+1] = {0,};
+
+/*! Encode Twoway protocol header at fixed offsets
+ * @param[out]    hdr      Buffer of TWOWAY_HDRLEN bytes
+ * @param[in]     th       Structured twoway protocol header  
+ * Can be done in place in a received packet decoded with decode_twoway
+ */
+int
+encode_twoway_hdr(char              *hdr,
+		  struct twoway_hdr *th)
+{
+    hdr[0] = th->th_ver; 
+    hdr[1] = th->th_mtype; 
+    short2Bytes(th->th_label, hdr, 2);
+    int2Bytes(th->th_tag, hdr, 4);        /* 0xcf30e506 */
+    hdr[8] = th->th_ver2;                 /* Version */
+    hdr[9] = th->th_rcode;                /* Reflector code */
+    hdr[10] = th->th_ttl;                 /* ttl + padding */
+    memset(&hdr[11], 0, 3);
+    hdr[14] = th->th_tos;                 /* tos + padding */
+    memset(&hdr[15], 0, 3);
+    short2Bytes(th->th_inc, hdr, 18);     /* Incnumber */
+    int2Bytes(th->th_seq0, hdr, 20);      /* seq-ul */
+    int2Bytes(th->th_seq1, hdr, 24);      /* seq-dl */
+    int2Bytes(th->th_t0.tv_sec, hdr, 28); /* t0 - s */
+    int2Bytes(th->th_t0.tv_usec, hdr, 32);/* t0 - us */
+    int2Bytes(th->th_t1.tv_sec, hdr, 36);
+    int2Bytes(th->th_t1.tv_usec, hdr, 40);
+    int2Bytes(th->th_t2.tv_sec, hdr, 44);
+    int2Bytes(th->th_t2.tv_usec, hdr, 48);
+    int2Bytes(th->th_t3.tv_sec, hdr, 52); /* t3, zero if unknown */
+    int2Bytes(th->th_t3.tv_usec, hdr, 56);
+    return 0;
+}
+
+/*! Encode Twoway protocol header and payload
  * @param[in,out] msg      Buffer for encoding
  * @param[in]     pktlen   Length of buffer
  * @param[in]     tn       Structured twoway protocol header  
  * @param[in]     payload  A string directly after the header
+ * @see encode_twoway_iov  which does not copy the payload
  */
 int
 encode_twoway(char              *msg, 
@@ -132,77 +171,93 @@ encode_twoway(char              *msg,
 	      struct twoway_hdr *th, 
 	      char              *payload)
 {
-    int        retval = -1;
-    char      *b = msg;
-    int        p = 0;
-    int        i;
+    char       hdr[TWOWAY_HDRLEN];
     int        plen;
 
-    if (strlen(payload))
-	if (60 + strlen(payload)+1 > pktlen){
-	    clicon_log(LOG_WARNING, "%s: Packet too short (%u) for header (%u) and payload (%u) '%s'", 
-		       __FUNCTION__, 
-		       pktlen, 
-		       60, 
-		       (uint32_t)strlen(payload)+1, 
-		       payload);
-	}
-    b[p++] = th->th_ver; 
-    b[p++] = th->th_mtype; 
-    short2Bytes(th->th_label, b, p); p += 2;
-
-    int2Bytes(th->th_tag, b, p); p += 4;//0xcf30e506
-    b[p++] = th->th_ver2; // Version
-    b[p++] = th->th_rcode; // Reflector code
-    b[p++] = th->th_ttl; p+=3; // ttl + padding
-    b[p++] = th->th_tos; p+=3; // tos + padding 
-    short2Bytes(th->th_inc, b, p); p+=2; // Incnumber
-    int2Bytes(th->th_seq0, b, p); p+=4; // seq-ul
-    int2Bytes(th->th_seq1, b, p); p+=4; // seq-dl
-    int2Bytes(th->th_t0.tv_sec, b, p); p+=4; // t0 - s
-    int2Bytes(th->th_t0.tv_usec, b, p); p+=4; // t0 - us
-    if (p>pktlen-4)
-	goto skip;
-    int2Bytes(th->th_t1.tv_sec, b, p); p+=4; 
-    if (p>pktlen-4)
-	goto skip;
-    int2Bytes(th->th_t1.tv_usec, b, p); p+=4;
-    if (p>pktlen-4)
-	goto skip;
-    int2Bytes(th->th_t2.tv_sec, b, p); p+=4; 
-    if (p>pktlen-4)
-	goto skip;
-    int2Bytes(th->th_t2.tv_usec, b, p); p+=4;
-    p+=8; /* t3 */
-    assert(p == 60);
-    //    fprintf(stderr, "%s: %lu %d %d\n", __FUNCTION__, strlen(payload)+1, pktlen, p);
-    plen = strlen(payload)+1;
-    if (p + plen > pktlen)
-	plen = pktlen-p;
+    if (pktlen < TWOWAY_HDRLEN){ /* Truncated header */
+	encode_twoway_hdr(hdr, th);
+	memcpy(msg, hdr, pktlen);
+	return 0;
+    }
+    encode_twoway_hdr(msg, th);
     /*
      * Truncate payload  <-----strlen(payload)+1----->
      *                  p  plen              pktlen
      * --------------------------------------|
      */
-    for (i = 0; i< plen; i++)
-	b[p++] = payload[i];  
-    if (plen != strlen(payload)+1)
-	b[pktlen-1] = '\0';
- skip:
-    if (p<pktlen)
-	memset(&b[p], 0, pktlen-p); 
-    p = pktlen; /* padding */
-    retval = 0;
-    // done:
-    return retval;
+    plen = strlen(payload);
+    if (plen && TWOWAY_HDRLEN + plen + 1 > pktlen){
+	clicon_log(LOG_WARNING, "%s: Packet too short (%u) for header (%u) and payload (%u) '%s'", 
+		   __FUNCTION__, pktlen, TWOWAY_HDRLEN, plen+1, payload);
+	plen = pktlen - TWOWAY_HDRLEN - 1;
+    }
+    if (plen > 0)
+	memcpy(&msg[TWOWAY_HDRLEN], payload, plen);
+    if (TWOWAY_HDRLEN + plen < pktlen) /* padding */
+	memset(&msg[TWOWAY_HDRLEN+plen], 0, pktlen-TWOWAY_HDRLEN-plen); 
+    return 0;
+}
+
+/*! Encode Twoway packet as an iovec, without copying the payload
+ * The packet is the header, the payload string and zero padding up to 
+ * pktlen, as encode_twoway. The padding includes the string terminator.
+ * @param[out]    iov      Vector of TWOWAY_IOVLEN entries
+ * @param[out]    hdr      Buffer of TWOWAY_HDRLEN bytes for the header, 
+ *                         eg the start of the received packet
+ * @param[in]     pktlen   Length of packet, at most 
+ *                         sizeof(struct twoway_hdr)+plen+1
+ * @param[in]     th       Structured twoway protocol header  
+ * @param[in]     payload  A string directly after the header, or NULL
+ * @param[in]     plen     strlen of payload
+ * @retval  n   Number of iov entries used
+ * @retval -1   Error
+ */
+int
+encode_twoway_iov(struct iovec      *iov,
+		  char              *hdr,
+		  int                pktlen, 
+		  struct twoway_hdr *th, 
+		  char              *payload,
+		  int                plen)
+{
+    int n = 0;
+    int pad;
+
+    if (pktlen <= TWOWAY_HDRLEN){
+	clicon_err(OE_PROTO, EINVAL, "%s: Packet too short (%d) for header", 
+		   __FUNCTION__, pktlen);
+	return -1;
+    }
+    encode_twoway_hdr(hdr, th);
+    iov[n].iov_base = hdr;
+    iov[n++].iov_len = TWOWAY_HDRLEN;
+    if (payload == NULL)
+	plen = 0;
+    if (TWOWAY_HDRLEN + plen + 1 > pktlen) /* Truncate payload */
+	plen = pktlen - TWOWAY_HDRLEN - 1;
+    if (plen){
+	iov[n].iov_base = payload;
+	iov[n++].iov_len = plen;
+    }
+    pad = pktlen - TWOWAY_HDRLEN - plen;
+    if (pad > sizeof(twoway_zeros)){
+	clicon_err(OE_PROTO, EINVAL, "%s: Packet too long (%d) for payload", 
+		   __FUNCTION__, pktlen);
+	return -1;
+    }
+    iov[n].iov_base = (char*)twoway_zeros;
+    iov[n++].iov_len = pad;
+    return n;
 }
 
 /*! Decode twoway header
  * @param[in]  msg     Packet buffer
  * @param[in]  pktlen  Packet length
  * @param[out] th      Twoway header
- * @param[out] payload pointer to string in payload
- * @param[out] rlen    length of returned header
+ * @param[out] payload pointer to string in payload, or to cbor payload
+ * @param[out] rlen    length of returned header and payload
+ * A cbor payload starts with CBOR_MAGIC and is not NUL-terminated, its
+ * length is rlen minus the header.
  */
 int
 decode_twoway(char              *msg, 
@@ -214,6 +269,7 @@ decode_twoway(char              *msg,
     int        retval = -1;
     char      *b = msg;
     int        p = 0;
+    int        len;
 
     if (pktlen < 60)
 	goto done;
@@ -234,13 +290,22 @@ decode_twoway(char              *msg,
     th->th_t1.tv_usec = Bytes2int(b, p); p+=4;
     th->th_t2.tv_sec  = Bytes2int(b, p); p+=4; 
     th->th_t2.tv_usec = Bytes2int(b, p); p+=4;
-    p+=8; // t3
+    th->th_t3.tv_sec  = Bytes2int(b, p); p+=4; 
+    th->th_t3.tv_usec = Bytes2int(b, p); p+=4;
     //    assert(p == 60);
     if ((pktlen>60) & (b[p] !=0) && (payload!=NULL)){
-	if (pktlen - 60 < strlen(&b[p])+1)
-	    goto done;
-	*payload = &b[p];
-	p += strlen(&b[p])+1;
+	if (cbor_is(&b[p], pktlen - 60)){
+	    if ((len = cbor_len(&b[p], pktlen - 60)) < 0)
+		goto done;
+	    *payload = &b[p];
+	    p += len;
+	}
+	else{
+	    if (pktlen - 60 < strlen(&b[p])+1)
+		goto done;
+	    *payload = &b[p];
+	    p += strlen(&b[p])+1;
+	}
     }
     if (rlen)
 	*rlen = p;
@@ -249,6 +314,55 @@ decode_twoway(char              *msg,
     return retval;
 }
 
+/*! Encode fragment header
+ * @param[out]  hdr  Buffer of FRAG_HDRLEN bytes, after the twoway header
+ * @param[in]   fh   Structured fragment header
+ * @see decode_frag
+ */
+int
+encode_frag_hdr(char            *hdr,
+		struct frag_hdr *fh)
+{
+    short2Bytes(fh->fh_index, hdr, 0);
+    short2Bytes(fh->fh_count, hdr, 2);
+    int2Bytes(fh->fh_len, hdr, 4);
+    return 0;
+}
+
+/*! Decode a MTYPE_FRAG packet
+ * @param[in]  msg     Packet buffer
+ * @param[in]  pktlen  Packet length
+ * @param[out] th      Twoway header
+ * @param[out] fh      Fragment header
+ * @param[out] payload Pointer to fragment of result
+ * @param[out] plen    Length of fragment
+ * @retval  0  OK
+ * @retval -1  Not a valid fragment
+ */
+int
+decode_frag(char              *msg, 
+	    int                pktlen, 
+	    struct twoway_hdr *th, 
+	    struct frag_hdr   *fh,
+	    char             **payload, 
+	    uint32_t          *plen)
+{
+    char *b = &msg[TWOWAY_HDRLEN];
+
+    if (pktlen < TWOWAY_HDRLEN + FRAG_HDRLEN)
+	return -1;
+    if (decode_twoway(msg, TWOWAY_HDRLEN, th, NULL, NULL) < 0)
+	return -1;
+    fh->fh_index = Bytes2short(b, 0);
+    fh->fh_count = Bytes2short(b, 2);
+    fh->fh_len   = Bytes2int(b, 4);
+    if (th->th_mtype != MTYPE_FRAG || fh->fh_index >= fh->fh_count)
+	return -1;
+    *payload = &b[FRAG_HDRLEN];
+    *plen = pktlen - TWOWAY_HDRLEN - FRAG_HDRLEN;
+    return 0;
+}
+
 /*! Marshal a control_hdr and an xml body to a char msg buf 
  * @param[out]  msg      Send msg buffer which will be written to
  * @param[in]   pktlen   Length of msg buffer
@@ -559,3 +673,96 @@ grideye_str2proto(char *str)
 	return GRIDEYE_PROTO_HTTP;
     return -1;
 }
+
+#ifndef _NOMAIN
+/* Unit test: a result larger than BUFSIZE of the agent is encoded as
+ * MTYPE_FRAG packets as result_frag does, and decoded with decode_frag in
+ * reverse order and with a fragment missing.
+ * compile: gcc -I. -D_NOMAIN -c grideye_cbor.c && 
+ *          gcc -I. grideye_agent_lib.c grideye_cbor.o -lclixon -lcligen -o frag_test
+ */
+#define TEST_RESLEN  (3*8*1024+100) /* > BUFSIZE */
+#define TEST_DATALEN (1472-TWOWAY_HDRLEN-FRAG_HDRLEN) /* FRAG_DATALEN */
+#define TEST_FRAGS   ((TEST_RESLEN+TEST_DATALEN-1)/TEST_DATALEN)
+
+/*! Reassemble the result of fragments received in any order
+ * @param[in]  pkts  Packets
+ * @param[in]  lens  Length of each packet
+ * @param[in]  n     Number of packets
+ * @param[out] res   Result, TEST_RESLEN bytes
+ * @retval  0  Complete
+ * @retval -1  Invalid or missing fragment
+ */
+static int
+frag_reassemble(char **pkts,
+		int   *lens,
+		int    n,
+		char  *res)
+{
+    struct twoway_hdr th;
+    struct frag_hdr   fh;
+    char              seen[TEST_FRAGS] = {0,};
+    char             *data;
+    uint32_t          dlen;
+    int               count = 0;
+    int               i;
+
+    for (i=0; i<n; i++){
+	if (decode_frag(pkts[i], lens[i], &th, &fh, &data, &dlen) < 0)
+	    return -1;
+	if (th.th_seq0 != 17 || fh.fh_count != TEST_FRAGS ||
+	    fh.fh_len != TEST_RESLEN ||
+	    fh.fh_index*TEST_DATALEN + dlen > fh.fh_len)
+	    return -1;
+	memcpy(res + fh.fh_index*TEST_DATALEN, data, dlen);
+	if (seen[fh.fh_index]++ == 0)
+	    count++;
+    }
+    return count == TEST_FRAGS ? 0 : -1;
+}
+
+int main()
+{
+    static char       result[TEST_RESLEN];
+    static char       res[TEST_RESLEN];
+    static char       bufs[TEST_FRAGS][TWOWAY_HDRLEN+FRAG_HDRLEN+TEST_DATALEN];
+    char             *pkts[TEST_FRAGS];
+    int               lens[TEST_FRAGS];
+    struct twoway_hdr th = {0,};
+    struct frag_hdr   fh = {0,};
+    int               off;
+    int               len;
+    int               i;
+
+    for (i=0; i<TEST_RESLEN; i++)
+	result[i] = 'a' + i%26;
+    th.th_ver = PROTO_VERSION;
+    th.th_mtype = MTYPE_FRAG;
+    th.th_tag = TWOWAY_TAG;
+    th.th_seq0 = 17;
+    fh.fh_count = TEST_FRAGS;
+    fh.fh_len = TEST_RESLEN;
+    /* Fragment 0 is last in pkts */
+    for (off=0; fh.fh_index<TEST_FRAGS; fh.fh_index++, off+=len){
+	len = TEST_RESLEN-off < TEST_DATALEN ? TEST_RESLEN-off : TEST_DATALEN;
+	i = TEST_FRAGS-1-fh.fh_index;
+	encode_twoway_hdr(bufs[i], &th);
+	encode_frag_hdr(bufs[i]+TWOWAY_HDRLEN, &fh);
+	memcpy(bufs[i]+TWOWAY_HDRLEN+FRAG_HDRLEN, result+off, len);
+	pkts[i] = bufs[i];
+	lens[i] = TWOWAY_HDRLEN+FRAG_HDRLEN+len;
+    }
+    if (frag_reassemble(pkts, lens, TEST_FRAGS, res) < 0 ||
+	memcmp(res, result, TEST_RESLEN) != 0)
+	return -1;
+    /* Fragment 0 missing */
+    if (frag_reassemble(pkts, lens, TEST_FRAGS-1, res) == 0)
+	return -1;
+    /* Not a fragment */
+    bufs[0][1] = MTYPE_RESULT;
+    if (frag_reassemble(pkts, lens, TEST_FRAGS, res) == 0)
+	return -1;
+    fprintf(stdout, "OK: %d fragments\n", TEST_FRAGS);
+    return 0;
+}
+#endif
@@ -0,0 +1,330 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Per-thread arena for the packet path. Each reflector and plugin worker
+ * owns one arena, allocates reply and plugin output in it while handling
+ * packets, and resets it when the replies are sent.
+ * Allocation is a pointer bump in one block. If a packet needs more than
+ * the block, the rest is taken from the heap in overflow blocks, and the
+ * block is grown to the high-water mark on the next reset. After the first
+ * packets of each size the arena therefore does no heap allocations.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include <cligen/cligen.h>
+#include <clixon/clixon.h>
+
+#include "grideye_arena.h"
+
+/* Allocations are aligned to this */
+#define ARENA_ALIGN     (2*sizeof(void*))
+#define ARENA_ROUND(n)  (((n)+ARENA_ALIGN-1) & ~(ARENA_ALIGN-1))
+
+/* Heap allocation used when the block is exhausted, freed on reset.
+ * The memory follows the header, which is ARENA_ALIGN bytes long. */
+struct arena_overflow{
+    struct arena_overflow *ao_next;
+    void                  *ao_pad;
+};
+
+struct arena{
+    char                  *a_buf;     /* Block */
+    size_t                 a_size;    /* Size of block */
+    size_t                 a_len;     /* Used of block */
+    struct arena_overflow *a_overflow;/* Overflow allocations since reset */
+    size_t                 a_total;   /* Allocated since reset, incl overflow */
+    size_t                 a_hwm;     /* High-water mark of a_total */
+    char                  *a_last;    /* Most recent allocation in block */
+    size_t                 a_lastlen; /* Rounded length of a_last */
+    uint64_t               a_mallocs; /* Heap allocations, see arena_mallocs */
+};
+
+/*! Create an arena
+ * @param[in]  size  Initial size of block, eg ARENA_SIZE
+ * @retval  a     Arena, free with arena_free
+ * @retval  NULL  Error
+ */
+struct arena *
+arena_new(size_t size)
+{
+    struct arena *a;
+
+    if ((a = malloc(sizeof(*a))) == NULL){
+	clicon_err(OE_UNIX, errno, "malloc");
+	return NULL;
+    }
+    memset(a, 0, sizeof(*a));
+    a->a_size = ARENA_ROUND(size);
+    if ((a->a_buf = malloc(a->a_size)) == NULL){
+	clicon_err(OE_UNIX, errno, "malloc");
+	free(a);
+	return NULL;
+    }
+    return a;
+}
+
+/*! Free an arena and everything allocated in it
+ */
+int
+arena_free(struct arena *a)
+{
+    arena_reset(a);
+    free(a->a_buf);
+    free(a);
+    return 0;
+}
+
+/*! Allocate memory valid until the next arena_reset
+ * @param[in]  a    Arena
+ * @param[in]  len  Number of bytes
+ * @retval  p     Memory, aligned for any type
+ * @retval  NULL  Error
+ */
+void *
+arena_alloc(struct arena *a,
+	    size_t        len)
+{
+    struct arena_overflow *ao;
+    char                  *p;
+
+    len = ARENA_ROUND(len);
+    a->a_total += len;
+    if (a->a_total > a->a_hwm)
+	a->a_hwm = a->a_total;
+    if (a->a_len + len <= a->a_size){
+	p = a->a_buf + a->a_len;
+	a->a_len += len;
+	a->a_last = p;
+	a->a_lastlen = len;
+	return p;
+    }
+    if ((ao = malloc(sizeof(*ao) + len)) == NULL){
+	clicon_err(OE_UNIX, errno, "malloc");
+	return NULL;
+    }
+    a->a_mallocs++;
+    ao->ao_next = a->a_overflow;
+    a->a_overflow = ao;
+    a->a_last = NULL; /* Overflow allocations are not extended */
+    return ao + 1;
+}
+
+/*! Copy a string into an arena
+ */
+char *
+arena_strdup(struct arena *a,
+	     const char   *str)
+{
+    size_t len = strlen(str)+1;
+    char  *s;
+
+    if ((s = arena_alloc(a, len)) != NULL)
+	memcpy(s, str, len);
+    return s;
+}
+
+/*! Extend the most recent allocation in place
+ * @retval  0  OK, p is now at least len bytes
+ * @retval -1  p is not the most recent allocation or block is full
+ */
+static int
+arena_extend(struct arena *a,
+	     char         *p,
+	     size_t        len)
+{
+    size_t off;
+
+    if (p == NULL || p != a->a_last)
+	return -1;
+    len = ARENA_ROUND(len);
+    off = p - a->a_buf;
+    if (off + len > a->a_size)
+	return -1;
+    a->a_total += len - a->a_lastlen;
+    if (a->a_total > a->a_hwm)
+	a->a_hwm = a->a_total;
+    a->a_len = off + len;
+    a->a_lastlen = len;
+    return 0;
+}
+
+/*! Append a formatted string to a string in an arena, like cprintf
+ * Appending to the most recent allocation is done in place, otherwise the
+ * string is copied.
+ * @param[in]     a       Arena
+ * @param[in,out] str     String allocated in a, or NULL to start a new string
+ * @param[in]     format  Format string as in printf
+ * @retval  n  Number of characters appended
+ * @retval -1  Error
+ */
+int
+arena_cprintf(struct arena *a,
+	      char        **str,
+	      const char   *format, ...)
+{
+    va_list ap;
+    size_t  old = 0;
+    int     n;
+    char   *s;
+
+    va_start(ap, format);
+    n = vsnprintf(NULL, 0, format, ap);
+    va_end(ap);
+    if (n < 0){
+	clicon_err(OE_UNIX, errno, "vsnprintf");
+	return -1;
+    }
+    if (*str)
+	old = strlen(*str);
+    if (arena_extend(a, *str, old+n+1) < 0){
+	if ((s = arena_alloc(a, old+n+1)) == NULL)
+	    return -1;
+	if (old)
+	    memcpy(s, *str, old);
+	*str = s;
+    }
+    va_start(ap, format);
+    vsnprintf(*str+old, n+1, format, ap);
+    va_end(ap);
+    return n;
+}
+
+/*! Append bytes to a buffer in an arena, like arena_cprintf for binary data
+ * The buffer is kept NUL-terminated after its len+n bytes.
+ * @param[in]     a     Arena
+ * @param[in,out] buf   Buffer allocated in a, or NULL to start a new buffer
+ * @param[in]     len   Length of buf
+ * @param[in]     data  Bytes to append
+ * @param[in]     n     Number of bytes
+ * @retval  0  OK
+ * @retval -1  Error
+ */
+int
+arena_append(struct arena *a,
+	     char        **buf,
+	     size_t        len,
+	     const void   *data,
+	     size_t        n)
+{
+    char *s;
+
+    if (*buf == NULL)
+	len = 0;
+    if (arena_extend(a, *buf, len+n+1) < 0){
+	if ((s = arena_alloc(a, len+n+1)) == NULL)
+	    return -1;
+	if (len)
+	    memcpy(s, *buf, len);
+	*buf = s;
+    }
+    memcpy(*buf+len, data, n);
+    (*buf)[len+n] = '\0';
+    return 0;
+}
+
+/*! Free everything allocated in an arena since the last reset
+ * If overflow blocks were needed, the block is grown so that the same
+ * allocations fit next time.
+ * @retval  0  OK
+ * @retval -1  Error, the arena is still usable with its old block
+ */
+int
+arena_reset(struct arena *a)
+{
+    struct arena_overflow *ao;
+    char                  *p;
+    size_t                 size;
+
+    while ((ao = a->a_overflow) != NULL){
+	a->a_overflow = ao->ao_next;
+	free(ao);
+    }
+    a->a_len = 0;
+    a->a_total = 0;
+    a->a_last = NULL;
+    a->a_lastlen = 0;
+    if (a->a_hwm > a->a_size){
+	size = a->a_size;
+	while (size < a->a_hwm)
+	    size *= 2;
+	if ((p = malloc(size)) == NULL){
+	    clicon_err(OE_UNIX, errno, "malloc");
+	    return -1;
+	}
+	a->a_mallocs++;
+	free(a->a_buf);
+	a->a_buf = p;
+	a->a_size = size;
+    }
+    return 0;
+}
+
+/*! Number of heap allocations an arena has done after it was created
+ * Stops increasing when the block is large enough for every packet.
+ */
+uint64_t
+arena_mallocs(struct arena *a)
+{
+    return a->a_mallocs;
+}
+
+#ifndef _NOMAIN
+/* Unit test: after the arena has grown, reset cycles do no heap allocations
+ * compile: gcc -I. grideye_arena.c -lclixon -lcligen -o arena_test
+ */
+int main()
+{
+    struct arena *a;
+    char         *s;
+    uint64_t      warm = 0;
+    int           i;
+    int           j;
+
+    if ((a = arena_new(256)) == NULL)
+	return -1;
+    for (i=0; i<1000; i++){
+	if (i == 10)
+	    warm = arena_mallocs(a);
+	s = NULL;
+	for (j=0; j<100; j++)
+	    if (arena_cprintf(a, &s, "<p%d>%d</p%d>", j, i, j) < 0)
+		return -1;
+	if (arena_strdup(a, s) == NULL || arena_alloc(a, 1000) == NULL)
+	    return -1;
+	if (strncmp(s, "<p0>", 4) != 0)
+	    return -1;
+	if (arena_reset(a) < 0)
+	    return -1;
+    }
+    fprintf(stdout, "mallocs: warmup: %llu steady state: %llu\n",
+	    (unsigned long long)warm,
+	    (unsigned long long)(arena_mallocs(a) - warm));
+    i = arena_mallocs(a) == warm ? 0 : -1;
+    arena_free(a);
+    return i;
+}
+#endif
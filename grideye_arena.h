@@ -0,0 +1,52 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Per-thread arena: bump allocator for memory that lives during the
+ * handling of one packet, freed all at once with arena_reset.
+ */
+#ifndef _GRIDEYE_ARENA_H_
+#define _GRIDEYE_ARENA_H_
+
+/*
+ * Constants
+ */
+/* Initial size of an arena, grows to what one packet needs */
+#define ARENA_SIZE 16*1024
+
+/*
+ * Types
+ */
+struct arena;
+
+/*
+ * Prototypes
+ */
+struct arena *arena_new(size_t size);
+int   arena_free(struct arena *a);
+void *arena_alloc(struct arena *a, size_t len);
+char *arena_strdup(struct arena *a, const char *str);
+int   arena_cprintf(struct arena *a, char **str, const char *format, ...);
+int   arena_append(struct arena *a, char **buf, size_t len, const void *data,
+		   size_t n);
+int   arena_reset(struct arena *a);
+uint64_t arena_mallocs(struct arena *a);
+
+#endif /* _GRIDEYE_ARENA_H_ */
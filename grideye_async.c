@@ -0,0 +1,423 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Non-blocking plugin tests, see gp_start_fn and grideye_async.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include <cligen/cligen.h>     /* cbuf */
+#include <clixon/clixon.h>     /* log, err */
+
+#include "grideye_agent.h"     /* lib */
+#include "grideye_reactor.h"   /* lib: event loop */
+#include "grideye_arena.h"     /* lib: per-packet memory */
+#include "grideye_plugin_v3.h" /* plugin C API with writer */
+#include "grideye_agent_int.h"
+#include "grideye_cache.h"
+#include "grideye_async.h"
+
+/*
+ * Constants
+ */
+/* Max number of data packets with non-blocking tests in flight, more are
+ * not started, see async_start */
+#define ASYNC_MAX         1024
+
+/*
+ * Types
+ */
+/* A started non-blocking plugin test, see gp_start_fn */
+struct async_test{
+    struct async_job    *at_job;
+    struct plugin       *at_plugin;
+    void                *at_handle;   /* Of plugin */
+    int                  at_fd;       /* Registered in reactor, or -1 */
+    struct reactor_timer at_timer;
+    struct grideye_wait  at_wait;     /* What the test waits for */
+    int                  at_state;    /* 0: running, 1: done, -1: failed */
+    uint64_t             at_key;      /* Hash of param, see cache_put */
+    struct timeval       at_time;     /* Started, with gp_cache_ms */
+};
+
+/* The non-blocking tests of a data packet. They are started by the 
+ * reflector (or worker) and then polled from the main event loop. When all
+ * are done, the results are sent in a MTYPE_RESULT packet as for -j.
+ */
+struct async_job{
+    struct async_job  *aj_next;     /* Handoff to main thread */
+    struct reflector  *aj_r;        /* Reflector to send result on */
+    struct sockaddr_in aj_addr;     /* Sender */
+    struct twoway_hdr  aj_th;       /* Header of timestamp reply */
+    int                aj_running;  /* Tests not done */
+    int                aj_enc;      /* Result encoding ENC_* */
+    int                aj_ntests;
+    int                aj_maxtests;
+    struct plugin_gen *aj_gen;      /* Of plugins of tests, referenced */
+    struct async_test  aj_tests[];
+};
+
+/*
+ * Variables
+ */
+/* Non-blocking tests, handed off to and polled by the main thread */
+static struct reactor   *async_re = NULL;   /* Main event loop */
+static pthread_t         async_main;        /* Main thread */
+static int               async_pipe[2] = {-1, -1}; /* Wakes main thread */
+static struct async_job *async_head = NULL; /* Handed off, not watched */
+static pthread_mutex_t   async_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct arena     *async_arena = NULL; /* Results, main thread */
+static int               async_jobs = 0;    /* In flight */
+static int               async_drops = 0;   /* Not started, ASYNC_MAX */
+
+/*! Free an async job, its tests must be collected
+ */
+static void
+async_free(struct async_job *aj)
+{
+    __sync_fetch_and_sub(&aj->aj_gen->pg_refs, 1);
+    free(aj);
+    __sync_fetch_and_sub(&async_jobs, 1);
+}
+
+/*! Abort the tests of an async job that was never handed off, and free it
+ */
+void
+async_abort(struct async_job *aj)
+{
+    int i;
+
+    for (i=0; i<aj->aj_ntests; i++)
+	aj->aj_tests[i].at_plugin->p_api->gp_collect_fn(aj->aj_tests[i].at_handle, NULL);
+    async_free(aj);
+}
+
+/*! Start a non-blocking test of a plugin and add it to the async job
+ * The job keeps the generation of its plugins until it is freed.
+ * @param[in]     pg      Generation of plugins in use, see plugin_enter
+ * @param[in]     p       Plugin with gp_start_fn
+ * @param[in]     argstr  Parameter, or NULL
+ * @param[in]     key     Hash of argstr, see plan_call
+ * @param[in]     n       Max number of tests of the packet
+ * @param[in]     enc     Result encoding ENC_*
+ * @param[in,out] ajp     Async job of the packet, allocated on first test
+ * @retval -1  Fatal error
+ * @retval  0  OK, or test not started
+ * @see async_submit
+ */
+int
+async_start(struct plugin_gen *pg,
+	    struct plugin     *p,
+	    char              *argstr,
+	    uint64_t           key,
+	    int                n,
+	    int                enc,
+	    struct async_job **ajp)
+{
+    struct async_job   *aj = *ajp;
+    struct async_test  *at;
+    struct grideye_wait wt = {-1, 0};
+    void               *h = NULL;
+    int                 ret;
+    struct timeval      t = {0,};
+
+    if (aj == NULL){
+	if (async_jobs >= ASYNC_MAX){ /* Unlocked peek, an approximate limit is ok */
+	    if (__sync_fetch_and_add(&async_drops, 1) == 0)
+		clicon_log(LOG_WARNING, "%s: too many tests in flight, dropping",
+			   __FUNCTION__);
+	    return 0;
+	}
+	if ((aj = calloc(1, sizeof(*aj) + n*sizeof(struct async_test))) == NULL){
+	    clicon_err(OE_UNIX, errno, "calloc");
+	    return -1;
+	}
+	aj->aj_maxtests = n;
+	aj->aj_enc = enc;
+	aj->aj_gen = pg;
+	__sync_fetch_and_add(&pg->pg_refs, 1);
+	__sync_fetch_and_add(&async_jobs, 1);
+	*ajp = aj;
+    }
+    if (aj->aj_ntests == aj->aj_maxtests)
+	return 0;
+    if (p->p_cache)
+	t = gettimestamp();
+    if ((ret = p->p_api->gp_start_fn(argstr, &h, &wt)) < 0){
+	clicon_log(LOG_NOTICE, "plugin %s failed: retval:%d", p->p_name, ret);
+	return 0;
+    }
+    at = &aj->aj_tests[aj->aj_ntests++];
+    at->at_job = aj;
+    at->at_plugin = p;
+    at->at_handle = h;
+    at->at_fd = -1;
+    at->at_wait = wt;
+    at->at_key = key;
+    at->at_time = t;
+    return 0;
+}
+
+/*! All tests of an async job are done: collect and send the results
+ * The result is a MTYPE_RESULT packet as sent by job_run.
+ */
+static int
+async_done(struct async_job *aj)
+{
+    struct result_writer rw;
+    char                *reply;
+    struct async_test   *at;
+    struct twoway_hdr    th;
+    int                  i;
+    size_t               len;
+
+    result_init(&rw, async_arena, &reply, aj->aj_enc & ENC_CBOR);
+    for (i=0; i<aj->aj_ntests; i++){
+	at = &aj->aj_tests[i];
+	if (at->at_state < 0){
+	    clicon_log(LOG_NOTICE, "plugin %s failed", at->at_plugin->p_name);
+	    at->at_plugin->p_api->gp_collect_fn(at->at_handle, NULL);
+	    continue;
+	}
+	len = rw.rw_len;
+	if (at->at_plugin->p_api->gp_collect_fn(at->at_handle, &rw.rw_gw) < 0){
+	    clicon_log(LOG_NOTICE, "plugin %s failed", at->at_plugin->p_name);
+	    result_truncate(&rw, len); /* Drop what it wrote */
+	}
+	else if (at->at_plugin->p_cache &&
+		 cache_put(at->at_plugin, at->at_key, &rw, len, at->at_time) < 0)
+	    result_truncate(&rw, len);
+    }
+    if (result_end(&rw) < 0)
+	result_truncate(&rw, 0);
+    len = rw.rw_len;
+    if (result_compress(async_arena, aj->aj_enc, &reply, &len) < 0)
+	clicon_log(LOG_NOTICE, "%s: seq %u: result not compressed",
+		   __FUNCTION__, aj->aj_th.th_seq0);
+    th = aj->aj_th;
+    th.th_t3 = gettimestamp();
+    if (result_send(aj->aj_r, &aj->aj_addr, &th, reply, len) < 0)
+	clicon_log(LOG_WARNING, "%s: seq %u: plugin result not sent", 
+		   __FUNCTION__, th.th_seq0);
+    arena_reset(async_arena);
+    async_free(aj);
+    return 0;
+}
+
+/*! A test of an async job is done or failed, stop watching it
+ */
+static int
+async_finish(struct async_test *at,
+	     int                state)
+{
+    struct async_job *aj = at->at_job;
+
+    if (at->at_fd != -1 && reactor_fd_unreg(async_re, at->at_fd) < 0)
+	return -1;
+    at->at_fd = -1;
+    reactor_timer_del(async_re, &at->at_timer);
+    at->at_state = state;
+    if (--aj->aj_running == 0)
+	return async_done(aj);
+    return 0;
+}
+
+static int async_fd_cb(int fd, void *arg);
+static int async_timer_cb(void *arg);
+
+/*! Watch what a test waits for in the main event loop
+ * @retval -1  Error, the test should be failed
+ * @retval  0  OK
+ */
+static int
+async_arm(struct async_test *at)
+{
+    struct grideye_wait *wt = &at->at_wait;
+
+    if (wt->wt_fd != at->at_fd){
+	if (at->at_fd != -1 && reactor_fd_unreg(async_re, at->at_fd) < 0)
+	    return -1;
+	at->at_fd = -1;
+	if (wt->wt_fd != -1){
+	    if (reactor_fd_reg(async_re, wt->wt_fd, async_fd_cb, at,
+			       "async test") < 0)
+		return -1;
+	    at->at_fd = wt->wt_fd;
+	}
+    }
+    if (wt->wt_ms > 0 || wt->wt_fd == -1)
+	return reactor_timer_add(async_re, &at->at_timer, 
+				 wt->wt_ms>0?wt->wt_ms:0, async_timer_cb, at,
+				 "async test");
+    return reactor_timer_del(async_re, &at->at_timer);
+}
+
+/*! Poll a test whose fd is readable or whose time has passed
+ */
+static int
+async_poll(struct async_test *at)
+{
+    int ret;
+
+    if ((ret = at->at_plugin->p_api->gp_poll_fn(at->at_handle, &at->at_wait)) == 0){
+	if (async_arm(at) == 0)
+	    return 0;
+	ret = -1;
+    }
+    return async_finish(at, ret>0 ? 1 : -1);
+}
+
+static int
+async_fd_cb(int   fd,
+	    void *arg)
+{
+    return async_poll((struct async_test *)arg);
+}
+
+static int
+async_timer_cb(void *arg)
+{
+    return async_poll((struct async_test *)arg);
+}
+
+/*! Watch the tests of an async job in the main event loop
+ * Called in the main thread.
+ */
+static int
+async_watch(struct async_job *aj)
+{
+    struct async_test *at;
+    int                i;
+
+    aj->aj_running = aj->aj_ntests;
+    for (i=0; i<aj->aj_ntests; i++){
+	at = &aj->aj_tests[i];
+	if (async_arm(at) < 0 && async_finish(at, -1) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+/*! Handoff of async jobs from other threads, see async_submit
+ */
+static int
+async_pipe_cb(int   fd,
+	      void *arg)
+{
+    struct async_job *aj;
+    struct async_job *next;
+    char              buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+	;
+    pthread_mutex_lock(&async_mutex);
+    aj = async_head;
+    async_head = NULL;
+    pthread_mutex_unlock(&async_mutex);
+    for (; aj; aj = next){
+	next = aj->aj_next;
+	if (async_watch(aj) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+/*! Hand off the started tests of a data packet to the main thread
+ * @param[in]  aj    Async job from echo_application, taken over
+ * @param[in]  r     Reflector to send result on
+ * @param[in]  from  Sender
+ * @param[in]  th    Header of timestamp reply
+ * @retval -1  Fatal error
+ * @retval  0  OK
+ */
+int
+async_submit(struct async_job   *aj,
+	     struct reflector   *r,
+	     struct sockaddr_in *from,
+	     struct twoway_hdr  *th)
+{
+    if (aj->aj_ntests == 0){
+	async_free(aj);
+	return 0;
+    }
+    aj->aj_r = r;
+    memcpy(&aj->aj_addr, from, sizeof(*from));
+    aj->aj_th = *th;
+    aj->aj_th.th_mtype = MTYPE_RESULT;
+    if (async_re && pthread_equal(pthread_self(), async_main))
+	return async_watch(aj);
+    pthread_mutex_lock(&async_mutex);
+    aj->aj_next = async_head;
+    async_head = aj;
+    pthread_mutex_unlock(&async_mutex);
+    /* Full pipe is ok, the main thread has not yet read earlier wakeups */
+    if (write(async_pipe[1], "", 1) < 0 && errno != EAGAIN){
+	clicon_err(OE_UNIX, errno, "write");
+	return -1;
+    }
+    return 0;
+}
+
+/*! Set up the handoff of async jobs to the main thread
+ * Call before reflector and worker threads are started, then async_register
+ * in the main event loop.
+ */
+int
+async_init(void)
+{
+    int i;
+
+    async_main = pthread_self();
+    if ((async_arena = arena_new(ARENA_SIZE)) == NULL)
+	return -1;
+    if (pipe(async_pipe) < 0){
+	clicon_err(OE_UNIX, errno, "pipe");
+	return -1;
+    }
+    for (i=0; i<2; i++)
+	if (fcntl(async_pipe[i], F_SETFL, O_NONBLOCK) < 0){
+	    clicon_err(OE_UNIX, errno, "fcntl");
+	    return -1;
+	}
+    return 0;
+}
+
+/*! Poll non-blocking tests in the main event loop
+ * @param[in]  re  Event loop of the main thread, see async_init
+ */
+int
+async_register(struct reactor *re)
+{
+    if (reactor_fd_reg(re, async_pipe[0], async_pipe_cb, NULL, "async") < 0)
+	return -1;
+    async_re = re;
+    return 0;
+}
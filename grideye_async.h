@@ -0,0 +1,47 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Non-blocking plugin tests. A reflector or worker starts the tests of a
+ * data packet, see gp_start_fn, and hands them off to the main thread,
+ * which polls them from its event loop and sends their results in a
+ * MTYPE_RESULT packet when all are done.
+ */
+#ifndef _GRIDEYE_ASYNC_H_
+#define _GRIDEYE_ASYNC_H_
+
+/*
+ * Types
+ */
+struct async_job;
+struct reactor;
+
+/*
+ * Prototypes
+ */
+int    async_start(struct plugin_gen *pg, struct plugin *p, char *argstr,
+		   uint64_t key, int n, int enc, struct async_job **ajp);
+void   async_abort(struct async_job *aj);
+int    async_submit(struct async_job *aj, struct reflector *r,
+		    struct sockaddr_in *from, struct twoway_hdr *th);
+int    async_init(void);
+int    async_register(struct reactor *re);
+
+#endif /* _GRIDEYE_ASYNC_H_ */
@@ -0,0 +1,210 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Results of plugins with gp_cache_ms, see grideye_cache.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include <cligen/cligen.h>     /* cbuf */
+#include <clixon/clixon.h>     /* log, err */
+
+#include "grideye_agent.h"     /* lib */
+#include "grideye_arena.h"     /* lib: per-packet memory */
+#include "grideye_cbor.h"      /* lib: data packet cbor */
+#include "grideye_plugin_v3.h" /* plugin C API with writer */
+#include "grideye_agent_int.h"
+#include "grideye_cache.h"
+
+/*
+ * Constants
+ */
+/* Cached results per plugin, ie different params, see gp_cache_ms */
+#define RCACHE_SLOTS      8
+
+/*
+ * Types
+ */
+/* A cached result of a test, see cache_get */
+struct cache_entry{
+    uint64_t       ce_key;    /* Hash of param, see plan_call */
+    int            ce_cbor;   /* ce_buf is cbor items, else XML text */
+    struct timeval ce_time;   /* Sample time, ie when the test started */
+    char          *ce_buf;    /* Result, NULL until a test is kept */
+    size_t         ce_len;
+    size_t         ce_size;   /* Allocated, reused for the next result */
+};
+
+/* Results of a plugin with gp_cache_ms, by param. Shared by all threads */
+struct result_cache{
+    pthread_mutex_t    rc_lock;
+    char              *rc_tskey;  /* Key of sample time, <name>_tsample */
+    struct cache_entry rc_slots[RCACHE_SLOTS];
+};
+
+/*! Allocate the result cache of a plugin with gp_cache_ms
+ * @param[in]  name  Name of plugin
+ * @retval     rc    Cache, free with cache_free
+ * @retval     NULL  Error
+ */
+struct result_cache *
+cache_new(const char *name)
+{
+    struct result_cache *rc;
+    size_t               len = strlen(name)+strlen("_tsample")+1;
+
+    if ((rc = calloc(1, sizeof(*rc))) == NULL){
+	clicon_err(OE_UNIX, errno, "calloc");
+	return NULL;
+    }
+    if ((rc->rc_tskey = malloc(len)) == NULL){
+	clicon_err(OE_UNIX, errno, "malloc");
+	free(rc);
+	return NULL;
+    }
+    snprintf(rc->rc_tskey, len, "%s_tsample", name);
+    pthread_mutex_init(&rc->rc_lock, NULL);
+    return rc;
+}
+
+/*! Free the result cache of a plugin
+ */
+void
+cache_free(struct result_cache *rc)
+{
+    int i;
+
+    for (i=0; i<RCACHE_SLOTS; i++)
+	if (rc->rc_slots[i].ce_buf)
+	    free(rc->rc_slots[i].ce_buf);
+    pthread_mutex_destroy(&rc->rc_lock);
+    free(rc->rc_tskey);
+    free(rc);
+}
+
+/*! Write the sample time of a result of a plugin with gp_cache_ms
+ * As seconds with 6 fraction digits, eg <sysinfo_tsample>1510000000.123456<
+ */
+static int
+cache_stamp(struct plugin        *p,
+	    struct result_writer *rw,
+	    struct timeval        t)
+{
+    return rw->rw_gw.gw_dec(&rw->rw_gw, p->p_cache->rc_tskey,
+			    (int64_t)t.tv_sec*1000000 + t.tv_usec, 6);
+}
+
+/*! Write the cached result of a test if it is younger than gp_cache_ms
+ * @param[in]  p    Plugin with gp_cache_ms
+ * @param[in]  key  Hash of param, see plan_call
+ * @param[in]  rw   Writer of reply
+ * @retval  1  Written with its sample time
+ * @retval  0  Not cached, run the test
+ * @retval -1  Error
+ */
+int
+cache_get(struct plugin        *p,
+	  uint64_t              key,
+	  struct result_writer *rw)
+{
+    int                  retval = 0;
+    struct result_cache *rc = p->p_cache;
+    struct cache_entry  *ce = &rc->rc_slots[(key ^ rw->rw_cbor) % RCACHE_SLOTS];
+    struct timeval       t;
+    struct timeval       dt;
+
+    t = gettimestamp();
+    pthread_mutex_lock(&rc->rc_lock);
+    if (ce->ce_buf == NULL || ce->ce_key != key || ce->ce_cbor != rw->rw_cbor)
+	goto done;
+    timersub(&t, &ce->ce_time, &dt);
+    if (dt.tv_sec < 0 ||
+	dt.tv_sec*1000 + dt.tv_usec/1000 >= p->p_api->gp_cache_ms)
+	goto done;
+    if (result_append(rw, ce->ce_buf, ce->ce_len) < 0 ||
+	cache_stamp(p, rw, ce->ce_time) < 0)
+	retval = -1;
+    else
+	retval = 1;
+ done:
+    pthread_mutex_unlock(&rc->rc_lock);
+    return retval;
+}
+
+/*! Keep the result of a test for cache_get, and write its sample time
+ * @param[in]  p    Plugin with gp_cache_ms
+ * @param[in]  key  Hash of param, see plan_call
+ * @param[in]  rw   Writer of reply, the result is what was written from len
+ * @param[in]  len  Length of reply before the test
+ * @param[in]  t    Sample time, ie when the test started
+ * @retval  0  OK
+ * @retval -1  Error
+ */
+int
+cache_put(struct plugin        *p,
+	  uint64_t              key,
+	  struct result_writer *rw,
+	  size_t                len,
+	  struct timeval        t)
+{
+    int                  retval = -1;
+    struct result_cache *rc = p->p_cache;
+    struct cache_entry  *ce = &rc->rc_slots[(key ^ rw->rw_cbor) % RCACHE_SLOTS];
+    const char          *data = *rw->rw_reply + len;
+    size_t               n = rw->rw_len - len;
+    char                *buf;
+
+    if (rw->rw_cbor && len == 0 && n){ /* Without the start of the map */
+	data += CBOR_MAGICLEN+1;
+	n -= CBOR_MAGICLEN+1;
+    }
+    pthread_mutex_lock(&rc->rc_lock);
+    if (ce->ce_buf == NULL || n > ce->ce_size){
+	if ((buf = realloc(ce->ce_buf, n+1)) == NULL){
+	    clicon_err(OE_UNIX, errno, "realloc");
+	    goto done;
+	}
+	ce->ce_buf = buf;
+	ce->ce_size = n;
+    }
+    if (n)
+	memcpy(ce->ce_buf, data, n);
+    ce->ce_len = n;
+    ce->ce_key = key;
+    ce->ce_cbor = rw->rw_cbor;
+    ce->ce_time = t;
+    retval = 0;
+ done:
+    pthread_mutex_unlock(&rc->rc_lock);
+    if (retval == 0)
+	retval = cache_stamp(p, rw, t);
+    return retval;
+}
@@ -0,0 +1,43 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Results of plugins with gp_cache_ms. The result of a test is kept per
+ * param and encoding, and a data packet within gp_cache_ms of when the test
+ * started gets the kept result with its sample time instead.
+ */
+#ifndef _GRIDEYE_CACHE_H_
+#define _GRIDEYE_CACHE_H_
+
+/*
+ * Types
+ */
+struct result_cache;
+
+/*
+ * Prototypes
+ */
+struct result_cache *cache_new(const char *name);
+void   cache_free(struct result_cache *rc);
+int    cache_get(struct plugin *p, uint64_t key, struct result_writer *rw);
+int    cache_put(struct plugin *p, uint64_t key, struct result_writer *rw,
+		 size_t len, struct timeval t);
+
+#endif /* _GRIDEYE_CACHE_H_ */
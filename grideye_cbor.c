@@ -0,0 +1,267 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * CBOR payloads, see grideye_agent -h and README.doc.
+ * A request is the grideye payload of the json encoding as a CBOR map, eg
+ *   {"grideye": {"version": 2, "name": "a1", "plugin": [{"name": "p1"}]}}
+ * and a result is a map of plugin output fields, eg {"tior": 123}.
+ * Both start with the self-describe tag CBOR_MAGIC.
+ * Only what payloads use is supported: no floats and no indefinite length
+ * strings. Items are decoded one head at a time and point into the packet,
+ * nothing is allocated.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "grideye_cbor.h"
+
+/*! Encode the head of an item
+ * @param[out] buf    Buffer of at least CBOR_HEADLEN bytes
+ * @param[in]  major  Major type, eg CBOR_UINT
+ * @param[in]  val    Value, length of string, number of items or tag
+ * @retval     n      Number of bytes in buf
+ */
+int
+cbor_head(uint8_t *buf,
+	  int      major,
+	  uint64_t val)
+{
+    int n;
+    int i;
+
+    major <<= 5;
+    if (val < 24){
+	buf[0] = major | val;
+	return 1;
+    }
+    if (val <= 0xff){
+	buf[0] = major | 24;
+	n = 1;
+    }
+    else if (val <= 0xffff){
+	buf[0] = major | 25;
+	n = 2;
+    }
+    else if (val <= 0xffffffffULL){
+	buf[0] = major | 26;
+	n = 4;
+    }
+    else{
+	buf[0] = major | 27;
+	n = 8;
+    }
+    for (i=n; i>0; i--, val >>= 8)
+	buf[i] = val & 0xff;
+    return n+1;
+}
+
+/*! Payload is CBOR, ie starts with the self-describe tag
+ */
+int
+cbor_is(const char *s,
+	size_t      len)
+{
+    return len >= CBOR_MAGICLEN && memcmp(s, CBOR_MAGIC, CBOR_MAGICLEN) == 0;
+}
+
+/*! Initialize a decoder
+ * @param[out] cr   Decoder
+ * @param[in]  s    CBOR
+ * @param[in]  len  Length of s
+ */
+void
+cbor_init(struct cbor_reader *cr,
+	  const char         *s,
+	  size_t              len)
+{
+    cr->cr_p = (const uint8_t *)s;
+    cr->cr_end = cr->cr_p + len;
+}
+
+/*! Decode the head of the next item
+ * Bytes and text strings are skipped and returned in ci_s. The items of
+ * arrays and maps, and the item of a tag, follow.
+ * @param[in]  cr  Decoder
+ * @param[out] ci  Item, ci_major is -1 for the break of an indefinite item
+ * @retval  0  OK
+ * @retval -1  Malformed or truncated
+ */
+int
+cbor_next(struct cbor_reader *cr,
+	  struct cbor_item   *ci)
+{
+    int      info;
+    int      n;
+    uint64_t val = 0;
+
+    memset(ci, 0, sizeof(*ci));
+    if (cr->cr_p == cr->cr_end)
+	return -1;
+    if (*cr->cr_p == CBOR_BREAK){
+	cr->cr_p++;
+	ci->ci_major = -1;
+	return 0;
+    }
+    ci->ci_major = *cr->cr_p >> 5;
+    info = *cr->cr_p++ & 0x1f;
+    if (info < 24)
+	val = info;
+    else if (info <= 27){
+	n = 1 << (info - 24);
+	if (cr->cr_end - cr->cr_p < n)
+	    return -1;
+	while (n--)
+	    val = (val << 8) | *cr->cr_p++;
+    }
+    else if (info == 31 &&
+	     (ci->ci_major == CBOR_ARRAY || ci->ci_major == CBOR_MAP))
+	ci->ci_indef = 1;
+    else
+	return -1;
+    ci->ci_val = val;
+    if (ci->ci_major == CBOR_BYTES || ci->ci_major == CBOR_TEXT){
+	if (cr->cr_end - cr->cr_p < val)
+	    return -1;
+	ci->ci_s = cr->cr_p;
+	cr->cr_p += val;
+    }
+    return 0;
+}
+
+/*! Skip the rest of an item, ie the items of an array, map or tag
+ * @param[in]  cr  Decoder
+ * @param[in]  ci  Head of the item, from cbor_next
+ * @retval  0  OK, the next item follows
+ * @retval -1  Malformed or truncated
+ */
+int
+cbor_skip(struct cbor_reader *cr,
+	  struct cbor_item   *ci)
+{
+    struct cbor_item it;
+    uint64_t         left[CBOR_DEPTH_MAX];  /* Items left at each depth */
+    int              indef[CBOR_DEPTH_MAX];
+    int              depth = 0;
+
+    if (ci->ci_major == CBOR_ARRAY || ci->ci_major == CBOR_MAP){
+	indef[0] = ci->ci_indef;
+	left[0] = ci->ci_val * (ci->ci_major == CBOR_MAP ? 2 : 1);
+    }
+    else if (ci->ci_major == CBOR_TAG){
+	indef[0] = 0;
+	left[0] = 1;
+    }
+    else
+	return ci->ci_major < 0 ? -1 : 0;
+    depth = 1;
+    while (depth > 0){
+	if (!indef[depth-1] && left[depth-1] == 0){
+	    depth--;
+	    continue;
+	}
+	if (cbor_next(cr, &it) < 0)
+	    return -1;
+	if (it.ci_major < 0){
+	    if (!indef[depth-1])
+		return -1;
+	    depth--;
+	    continue;
+	}
+	left[depth-1]--;
+	if (it.ci_major == CBOR_ARRAY || it.ci_major == CBOR_MAP ||
+	    it.ci_major == CBOR_TAG){
+	    if (depth == CBOR_DEPTH_MAX)
+		return -1;
+	    indef[depth] = it.ci_indef;
+	    left[depth] = it.ci_major == CBOR_TAG ? 1 :
+		it.ci_val * (it.ci_major == CBOR_MAP ? 2 : 1);
+	    depth++;
+	}
+    }
+    return 0;
+}
+
+/*! Length of the CBOR item first in a buffer, eg a payload with padding
+ * @retval  n   Length of item
+ * @retval -1   Malformed or truncated
+ */
+int
+cbor_len(const char *s,
+	 size_t      len)
+{
+    struct cbor_reader cr;
+    struct cbor_item   ci;
+
+    cbor_init(&cr, s, len);
+    if (cbor_next(&cr, &ci) < 0 || cbor_skip(&cr, &ci) < 0)
+	return -1;
+    return (const char *)cr.cr_p - s;
+}
+
+/*! Compare a text item with a string
+ * @retval  1  Equal
+ * @retval  0  Not equal, or not text
+ */
+int
+cbor_text_eq(struct cbor_item *ci,
+	     const char       *str)
+{
+    size_t len = strlen(str);
+
+    return ci->ci_major == CBOR_TEXT && ci->ci_val == len &&
+	memcmp(ci->ci_s, str, len) == 0;
+}
+
+#ifndef _NOMAIN
+/* Unit test
+ * compile: gcc -I. grideye_cbor.c -o cbor_test
+ */
+int main()
+{
+    uint8_t buf[CBOR_HEADLEN];
+    /* 55799({"grideye": {"version": 2, "name": "a", "plugin": [{"name": "p"}],
+     *   "x": [_ 1, 4([-2, 153])]}}) and padding */
+    const char req[] = "\xd9\xd9\xf7\xa1\x67grideye\xa4\x67version\x02\x64name\x61\x61"
+	"\x66plugin\x81\xa1\x64name\x61p\x61x\x9f\x01\xc4\x82\x21\x18\x99\xff\0\0";
+    struct cbor_reader cr;
+    struct cbor_item   ci;
+
+    if (cbor_head(buf, CBOR_UINT, 23) != 1 || buf[0] != 23 ||
+	cbor_head(buf, CBOR_TEXT, 24) != 2 || buf[0] != 0x78 || buf[1] != 24 ||
+	cbor_head(buf, CBOR_NINT, 0x10000) != 5 || buf[0] != 0x3a || buf[2] != 1 ||
+	cbor_head(buf, CBOR_UINT, 1ULL<<32) != 9 || buf[4] != 1)
+	return -1;
+    if (!cbor_is(req, sizeof(req)-1) ||
+	cbor_len(req, sizeof(req)-1) != sizeof(req)-3)
+	return -1;
+    if (cbor_len(req, sizeof(req)-5) != -1) /* truncated */
+	return -1;
+    cbor_init(&cr, req, sizeof(req)-1);
+    if (cbor_next(&cr, &ci) < 0 || ci.ci_major != CBOR_TAG ||
+	cbor_next(&cr, &ci) < 0 || ci.ci_major != CBOR_MAP ||
+	cbor_next(&cr, &ci) < 0 || !cbor_text_eq(&ci, "grideye"))
+	return -1;
+    fprintf(stdout, "OK\n");
+    return 0;
+}
+#endif
@@ -0,0 +1,88 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Minimal CBOR (RFC 7049) encoding and decoding of data packet payloads.
+ * Binary payloads start with the self-describe tag, so that they can be
+ * told from text payloads by their first bytes.
+ */
+#ifndef _GRIDEYE_CBOR_H_
+#define _GRIDEYE_CBOR_H_
+
+/*
+ * Constants
+ */
+/* Self-describe CBOR tag 55799, first in a binary payload */
+#define CBOR_MAGIC    "\xd9\xd9\xf7"
+#define CBOR_MAGICLEN 3
+
+/* Major types */
+#define CBOR_UINT  0
+#define CBOR_NINT  1  /* -1-val */
+#define CBOR_BYTES 2
+#define CBOR_TEXT  3
+#define CBOR_ARRAY 4
+#define CBOR_MAP   5
+#define CBOR_TAG   6
+#define CBOR_SIMPLE 7 /* false, true, null, floats, break */
+
+/* Max length of an item head, see cbor_head */
+#define CBOR_HEADLEN 9
+
+/* Max nesting of arrays, maps and tags */
+#define CBOR_DEPTH_MAX 32
+
+/* Tag of decimal fraction [exponent, mantissa] */
+#define CBOR_TAG_DECIMAL 4
+
+/* Start of indefinite length map and array, and their end */
+#define CBOR_MAP_INDEF   0xbf
+#define CBOR_ARRAY_INDEF 0x9f
+#define CBOR_BREAK       0xff
+
+/*
+ * Types
+ */
+/* A decoded item head, see cbor_next */
+struct cbor_item{
+    int            ci_major;  /* CBOR_UINT, ... or -1 for break */
+    int            ci_indef;  /* Indefinite length array or map */
+    uint64_t       ci_val;    /* Value, length, count or tag */
+    const uint8_t *ci_s;      /* Bytes and text: the string */
+};
+
+/* Decoder state, see cbor_init */
+struct cbor_reader{
+    const uint8_t *cr_p;
+    const uint8_t *cr_end;
+};
+
+/*
+ * Prototypes
+ */
+int  cbor_head(uint8_t *buf, int major, uint64_t val);
+int  cbor_is(const char *s, size_t len);
+void cbor_init(struct cbor_reader *cr, const char *s, size_t len);
+int  cbor_next(struct cbor_reader *cr, struct cbor_item *ci);
+int  cbor_skip(struct cbor_reader *cr, struct cbor_item *ci);
+int  cbor_len(const char *s, size_t len);
+int  cbor_text_eq(struct cbor_item *ci, const char *str);
+
+#endif /* _GRIDEYE_CBOR_H_ */
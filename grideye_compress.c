@@ -0,0 +1,246 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Compressed results are zlib streams (RFC 1950) with the preset dictionary
+ * below, so that the tag names of a small result are not sent in clear.
+ * The stream header has FDICT set and the adler32 of the dictionary as
+ * DICTID, a receiver inflates with the same dictionary, see compress_dict.
+ * The zlib state is allocated in the arena of the packet, so compression
+ * does no heap allocation once the arena has grown to fit it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#include <zlib.h>
+#endif
+
+#include <cligen/cligen.h>
+#include <clixon/clixon.h>
+
+#include "grideye_arena.h"
+#include "grideye_compress.h"
+
+/* Preset dictionary: result tags of the plugins in plugins/, and cbor
+ * keys of the same names. zlib finds matches near the end cheapest, so the
+ * most common come last. Changing it changes DICTID, keep it stable.
+ */
+static const char compress_dictionary[] =
+    "wMCSwlastTxRatedhrystonesiwprotoiwaddriwessidiwchanbytesfilehost"
+    "uptimeloadsfreeramusedrambufferramprocsfreeswapusedswap"
+    "wlinkwlevelwnoisewretryhstatushtimehsizetiowrtiowtior"
+    "<wMCS></wMCS><wlastTxRate></wlastTxRate><dhrystones></dhrystones>"
+    "<iwproto></iwproto><iwaddr>\"\"</iwaddr><iwessid>\"\"</iwessid>"
+    "<iwchan></iwchan><tcyc></tcyc><tcmp></tcmp><tmr></tmr>"
+    "<uptime></uptime><loads>.</loads><freeram></freeram><usedram></usedram>"
+    "<bufferram></bufferram><procs></procs><freeswap></freeswap>"
+    "<usedswap></usedswap>"
+    "<wlink>.</wlink><wlevel>.</wlevel><wnoise>.</wnoise><wretry>.0</wretry>"
+    "<hstatus>\"200\"</hstatus><htime></htime><hsize></hsize>"
+    "<tiowr></tiowr><tiow></tiow><tior></tior>";
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+
+/*! zlib allocator: allocate in the arena given as opaque */
+static voidpf
+compress_alloc(voidpf opaque,
+	       uInt   items,
+	       uInt   size)
+{
+    return arena_alloc((struct arena *)opaque, (size_t)items*size);
+}
+
+/*! zlib deallocator: freed by arena_reset */
+static void
+compress_free(voidpf opaque,
+	      voidpf address)
+{
+}
+
+/*! Compression is supported
+ */
+int
+compress_supported(void)
+{
+    return 1;
+}
+
+/*! Compress a payload if it gets smaller
+ * @param[in]  a       Arena of calling thread, for zlib state and output
+ * @param[in]  in      Payload
+ * @param[in]  len     Length of payload
+ * @param[out] out     Compressed payload, allocated in a
+ * @param[out] outlen  Length of compressed payload
+ * @retval  1  Compressed
+ * @retval  0  Not smaller compressed, out is not set
+ * @retval -1  Error
+ */
+int
+compress_payload(struct arena *a,
+		 const char   *in,
+		 size_t        len,
+		 char        **out,
+		 size_t       *outlen)
+{
+    int      retval = -1;
+    z_stream zs;
+    char    *buf;
+    int      ret;
+
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = compress_alloc;
+    zs.zfree = compress_free;
+    zs.opaque = a;
+    if ((ret = deflateInit2(&zs, COMPRESS_LEVEL, Z_DEFLATED, COMPRESS_WBITS,
+			    COMPRESS_MEMLEVEL, Z_DEFAULT_STRATEGY)) != Z_OK){
+	clicon_err(OE_UNIX, ret == Z_MEM_ERROR ? ENOMEM : EINVAL,
+		   "deflateInit2");
+	return -1;
+    }
+    if (deflateSetDictionary(&zs, (const Bytef *)compress_dictionary,
+			     sizeof(compress_dictionary)-1) != Z_OK){
+	clicon_err(OE_UNIX, EINVAL, "deflateSetDictionary");
+	goto done;
+    }
+    /* Only a smaller result is used, so output is at most len */
+    if ((buf = arena_alloc(a, len)) == NULL)
+	goto done;
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)buf;
+    zs.avail_out = len;
+    switch (deflate(&zs, Z_FINISH)){
+    case Z_STREAM_END:
+	if (zs.total_out >= len){
+	    retval = 0;
+	    break;
+	}
+	*out = buf;
+	*outlen = zs.total_out;
+	retval = 1;
+	break;
+    case Z_OK:       /* Output full */
+    case Z_BUF_ERROR:
+	retval = 0;
+	break;
+    default:
+	clicon_err(OE_UNIX, EINVAL, "deflate");
+	break;
+    }
+ done:
+    deflateEnd(&zs);
+    return retval;
+}
+
+#else /* HAVE_ZLIB_H && HAVE_LIBZ */
+
+int
+compress_supported(void)
+{
+    return 0;
+}
+
+int
+compress_payload(struct arena *a,
+		 const char   *in,
+		 size_t        len,
+		 char        **out,
+		 size_t       *outlen)
+{
+    return 0;
+}
+
+#endif /* HAVE_ZLIB_H && HAVE_LIBZ */
+
+/*! Get the preset dictionary, eg to decompress results
+ * @param[out] dict  Dictionary
+ * @param[out] len   Length of dict
+ */
+int
+compress_dict(const char **dict,
+	      size_t      *len)
+{
+    *dict = compress_dictionary;
+    *len = sizeof(compress_dictionary)-1;
+    return 0;
+}
+
+#if !defined(_NOMAIN) && defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+/* Unit test: compress a sysinfo result with and without the dictionary
+ * compile: gcc -O2 -DHAVE_ZLIB_H -DHAVE_LIBZ -I. grideye_compress.c \
+ *            grideye_arena.c -lz -lclixon -lcligen -o compress_test
+ */
+int main()
+{
+    const char    *res = "<uptime>1234567</uptime><loads>0.53</loads>"
+	"<freeram>1846087680</freeram><usedram>6320111616</usedram>"
+	"<bufferram>417263616</bufferram><procs>1187</procs>"
+	"<freeswap>2147479552</freeswap><usedswap>4096</usedswap><tior>23</tior>";
+    struct arena  *a;
+    char          *out = NULL;
+    size_t         outlen = 0;
+    char           back[1024];
+    z_stream       zs;
+    uLongf         plain;
+    int            i;
+    uint64_t       warm = 0;
+
+    if ((a = arena_new(1024)) == NULL)
+	return -1;
+    for (i=0; i<100; i++){
+	if (i == 10)
+	    warm = arena_mallocs(a);
+	if (compress_payload(a, res, strlen(res), &out, &outlen) != 1)
+	    return -1;
+	if (i < 99 && arena_reset(a) < 0)
+	    return -1;
+    }
+    /* Inflate with the dictionary */
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK)
+	return -1;
+    zs.next_in = (Bytef *)out;
+    zs.avail_in = outlen;
+    zs.next_out = (Bytef *)back;
+    zs.avail_out = sizeof(back);
+    if (inflate(&zs, Z_FINISH) != Z_NEED_DICT ||
+	inflateSetDictionary(&zs, (const Bytef *)compress_dictionary,
+			     sizeof(compress_dictionary)-1) != Z_OK ||
+	inflate(&zs, Z_FINISH) != Z_STREAM_END)
+	return -1;
+    if (zs.total_out != strlen(res) || memcmp(back, res, zs.total_out))
+	return -1;
+    inflateEnd(&zs);
+    plain = sizeof(back);
+    compress2((Bytef *)back, &plain, (const Bytef *)res, strlen(res),
+	      COMPRESS_LEVEL);
+    fprintf(stdout, "%zu bytes: %zu with dictionary, %lu without\n",
+	    strlen(res), outlen, (unsigned long)plain);
+    fprintf(stdout, "mallocs: warmup: %llu steady state: %llu\n",
+	    (unsigned long long)warm,
+	    (unsigned long long)(arena_mallocs(a) - warm));
+    arena_free(a);
+    return 0;
+}
+#endif
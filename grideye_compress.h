@@ -0,0 +1,47 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Compression of plugin results with zlib and a preset dictionary of
+ * result tag names.
+ */
+#ifndef _GRIDEYE_COMPRESS_H_
+#define _GRIDEYE_COMPRESS_H_
+
+/*
+ * Constants
+ */
+/* Window of 2^bits bytes and hash memory level. Compression state is
+ * 2^(bits+2) + 2^(level+9) bytes, allocated in the arena of the packet */
+#define COMPRESS_WBITS    12
+#define COMPRESS_MEMLEVEL 6
+
+/* Compression level, results are small so favour speed */
+#define COMPRESS_LEVEL    1
+
+/*
+ * Prototypes
+ */
+int compress_supported(void);
+int compress_dict(const char **dict, size_t *len);
+int compress_payload(struct arena *a, const char *in, size_t len,
+		     char **out, size_t *outlen);
+
+#endif /* _GRIDEYE_COMPRESS_H_ */
@@ -0,0 +1,602 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Plugin worker processes, see grideye_isolate.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include <cligen/cligen.h>     /* cbuf */
+#include <clixon/clixon.h>     /* log, err */
+
+#include "grideye_agent.h"     /* lib */
+#include "grideye_arena.h"     /* lib: per-packet memory */
+#include "grideye_ring.h"      /* lib: shared memory rings */
+#include "grideye_plugin_v3.h" /* plugin C API with writer */
+#include "grideye_agent_int.h"
+#include "grideye_sample.h"    /* sample_test */
+#include "grideye_isolate.h"
+
+/*
+ * Constants
+ */
+/* Size of request and response rings of a plugin worker process, see -O.
+ * A larger result fails the test */
+#define ISOLATE_REQ_RING  (64*1024)
+#define ISOLATE_RESP_RING (1024*1024)
+
+/* A plugin worker process that died within this many ms of its start is
+ * not restarted until this many ms after, tests of its calling thread fail
+ * meanwhile */
+#define ISOLATE_RESTART_MS 1000
+
+/* Descriptors of a plugin worker process, see isolate_fork */
+#define ISOLATE_FD_REQ    3   /* Request ring */
+#define ISOLATE_FD_RESP   4   /* Response ring */
+#define ISOLATE_FD_REQW   5   /* Wakeup of worker, read end */
+#define ISOLATE_FD_RESPW  6   /* Wakeup of caller, write end */
+#define ISOLATE_FD_LIFE   7   /* Held until the worker exits */
+#define ISOLATE_FD_PLIFE  8   /* Hangs up when the agent exits */
+#define ISOLATE_FDS       6
+
+/*
+ * Types
+ */
+/* A plugin worker process, see -O. The thread that created it is the only
+ * one that sends it requests, so that its rings have a single producer and
+ * a single consumer */
+struct isolate{
+    struct isolate      *is_next;     /* isolate_list, for exit */
+    pid_t                is_pid;      /* 0: not running */
+    struct ring         *is_req;      /* Requests to worker */
+    struct ring         *is_resp;     /* Responses from worker */
+    int                  is_reqfd;    /* Of is_req, see ring_map */
+    int                  is_respfd;   /* Of is_resp */
+    struct ring_wake     is_reqw;     /* Wakes worker */
+    struct ring_wake     is_respw;    /* Wakes caller */
+    int                  is_life;     /* Hangs up when worker exits */
+    int                  is_plife;    /* Worker exits when it hangs up */
+    struct timeval       is_started;  /* See ISOLATE_RESTART_MS */
+    struct timeval       is_died;
+    int                  is_restarts;
+    unsigned             is_gen;      /* Plugins when it was started */
+};
+
+/* Request to a worker process, followed by the plugin name and its NUL,
+ * and the parameter and its NUL, if any */
+struct isolate_req{
+    int32_t              ir_enc;      /* ISOLATE_* */
+    int32_t              ir_pad;
+    uint64_t             ir_key;      /* See plan_call */
+};
+
+/* Response of a worker process, followed by the result */
+struct isolate_resp{
+    int32_t              ip_status;   /* As plugin_call */
+    int32_t              ip_pad;
+};
+
+/*
+ * Variables
+ */
+/* Plugin worker processes, one per thread calling plugins, see -O */
+int                     isolate_on = 0;
+static pthread_key_t    isolate_key;     /* struct isolate of thread */
+static struct isolate  *isolate_list = NULL;
+static pthread_mutex_t  isolate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char            *isolate_exe = NULL;
+static char            *isolate_argv[9];  /* See isolate_init */
+static char             isolate_debug[12];
+static char             isolate_logdst[12];
+
+/*! Run the requests of a plugin worker process until the agent exits
+ * The worker runs a test as plugin_test or, for the sampler, records it as
+ * sample_run, with the plugin of the same name that it has loaded itself.
+ * @param[in]  is       Rings and wakeups of isolate_worker
+ * @param[in]  plugins  Plugins loaded by the worker
+ */
+static void
+isolate_main(struct isolate *is,
+	     struct plugin  *plugins)
+{
+    struct isolate_req    ir;
+    struct isolate_resp   ip;
+    struct result_writer  rw;
+    struct arena         *a;
+    struct plugin        *p;
+    struct pollfd         pfd[2];
+    struct iovec          iov[2];
+    char                 *msg;
+    char                 *name;
+    char                 *param;
+    char                 *reply;
+    size_t                n;
+    size_t                len;
+    int                   ret;
+
+    if ((a = arena_new(ARENA_SIZE)) == NULL)
+	_exit(1);
+    pfd[0].fd = is->is_reqw.rw_fd[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = ISOLATE_FD_PLIFE;
+    pfd[1].events = POLLIN;
+    while (1){
+	ring_wake_clear(&is->is_reqw);
+	while (ring_get(is->is_req, &msg, &n) == 1){
+	    memcpy(&ir, msg, sizeof(ir));
+	    name = msg + sizeof(ir);
+	    param = name + strlen(name) + 1;
+	    if (param >= msg + n)
+		param = NULL;
+	    for (p = plugins; p&&p->p_api!=NULL; p++)
+		if (strcmp(p->p_name, name) == 0)
+		    break;
+	    memset(&ip, 0, sizeof(ip));
+	    reply = NULL;
+	    len = 0;
+	    if (arena_reset(a) < 0)
+		_exit(1);
+	    if (p == NULL || p->p_api == NULL){
+		clicon_log(LOG_NOTICE, "plugin %s: not loaded by worker process",
+			   name);
+		p = NULL;
+	    }
+	    else if (ir.ir_enc == ISOLATE_RECORD)
+		ip.ip_status = sample_test(p, param, &reply, &len);
+	    else {
+		result_init(&rw, a, &reply, ir.ir_enc == ISOLATE_CBOR);
+		ip.ip_status = plugin_test(p, param, &rw);
+		len = rw.rw_len;
+	    }
+	    ring_release(is->is_req);
+	    iov[0].iov_base = &ip;
+	    iov[0].iov_len = sizeof(ip);
+	    iov[1].iov_base = reply;
+	    iov[1].iov_len = ip.ip_status == 1 ? len : 0;
+	    if ((ret = ring_put(is->is_resp, iov, 2)) < 0){
+		clicon_log(LOG_NOTICE, "plugin %s: result of %zu bytes too large",
+			   p->p_name, len);
+		ip.ip_status = 0;
+		ret = ring_put(is->is_resp, iov, 1);
+	    }
+	    if (ret != 1) /* The caller waits for each response */
+		_exit(1);
+	    ring_wake_signal(&is->is_respw);
+	}
+	if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+	    _exit(1);
+	if (pfd[1].revents)
+	    _exit(0);
+    }
+}
+
+/*! Main of a plugin worker process, the agent exec'd by isolate_fork
+ * Unlike a process forked from a thread of the agent, it is a process of
+ * its own that may take locks and allocate. It loads the plugins as the
+ * agent, and gets its rings, wakeups and lifelines as ISOLATE_FD_*.
+ * @param[in]  argc  Number of arguments
+ * @param[in]  argv  As isolate_argv
+ */
+int
+isolate_worker(int   argc,
+	       char *argv[])
+{
+    struct isolate  is = {0, };
+    struct plugin  *plugins = NULL;
+    sigset_t        set;
+    int             logdst;
+    int             fd;
+
+    if (argc != 8)
+	return 1;
+    /* Exit with the agent, not on its signals. A crash is still fatal */
+    sigfillset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+    /* Not inherited by what plugins exec */
+    for (fd = ISOLATE_FD_REQ; fd < ISOLATE_FD_REQ+ISOLATE_FDS; fd++)
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+    plugin_dir = argv[2];
+    diskio_writefile = argv[3];
+    diskio_largefile = argv[4];
+    wlan_device = *argv[5] ? argv[5] : NULL;
+    debug = atoi(argv[6]);
+    logdst = atoi(argv[7]);
+    /* The agent has logged the loading of its plugins */
+    clicon_log_init("grideye_agent", LOG_ERR, logdst);
+    if ((plugins = calloc(1, sizeof(struct plugin))) == NULL){
+	clicon_err(OE_UNIX, errno, "calloc");
+	return 1;
+    }
+#ifdef GRIDEYE_STATIC
+    if (plugin_load_static(&plugins) < 0)
+	return 1;
+#else
+    if (plugin_load_dir(plugin_dir, NULL, &plugins) < 0)
+	return 1;
+#endif
+    clicon_log_init("grideye_agent", debug?LOG_DEBUG:LOG_INFO, logdst);
+    if ((is.is_req = ring_map(ISOLATE_FD_REQ)) == NULL ||
+	(is.is_resp = ring_map(ISOLATE_FD_RESP)) == NULL)
+	return 1;
+    close(ISOLATE_FD_REQ);
+    close(ISOLATE_FD_RESP);
+    is.is_reqw.rw_fd[0] = is.is_reqw.rw_fd[1] = ISOLATE_FD_REQW;
+    is.is_respw.rw_fd[0] = is.is_respw.rw_fd[1] = ISOLATE_FD_RESPW;
+    isolate_main(&is, plugins);
+    return 0;
+}
+
+/*! Prepare plugin worker processes, see -O
+ * Called before threads that call plugins. Workers are started as the
+ * agent binary with ISOLATE_ARG, and the options plugins are loaded with.
+ * @param[in]  argv0   Of the agent, used where /proc is missing
+ * @param[in]  logdst  Log destination of the agent, CLICON_LOG_*
+ */
+int
+isolate_init(char *argv0,
+	     int   logdst)
+{
+    int ret;
+
+    if ((ret = pthread_key_create(&isolate_key, NULL)) != 0){
+	clicon_err(OE_UNIX, ret, "pthread_key_create");
+	return -1;
+    }
+    /* The running binary, whatever argv0 and the working directory are */
+    if (access("/proc/self/exe", X_OK) == 0)
+	isolate_exe = "/proc/self/exe";
+    else if (*argv0 == '/')
+	isolate_exe = argv0;
+    else{
+	clicon_err(OE_UNIX, ENOENT, "-O: start %s with its absolute path", 
+		   argv0);
+	return -1;
+    }
+    snprintf(isolate_debug, sizeof(isolate_debug), "%d", debug);
+    snprintf(isolate_logdst, sizeof(isolate_logdst), "%d", logdst);
+    isolate_argv[0] = argv0;
+    isolate_argv[1] = ISOLATE_ARG;
+    isolate_argv[2] = plugin_dir;
+    isolate_argv[3] = diskio_writefile;
+    isolate_argv[4] = diskio_largefile;
+    isolate_argv[5] = wlan_device ? wlan_device : "";
+    isolate_argv[6] = isolate_debug;
+    isolate_argv[7] = isolate_logdst;
+    isolate_argv[8] = NULL;
+    return 0;
+}
+
+/*! Start the worker process of a thread
+ * The child of fork only makes async-signal-safe calls, other threads may
+ * hold locks it would need, until it execs the agent as isolate_worker.
+ * Lifeline pipes tell each side when the other exits. They are close on
+ * exec, and forks are serialized so that the lifelines of a worker are only
+ * inherited by itself.
+ * @param[in]  is  Worker of calling thread, not running
+ */
+static int
+isolate_fork(struct isolate *is)
+{
+    int   retval = -1;
+    int   life[2] = {-1, -1};
+    int   plife[2] = {-1, -1};
+    int   fds[ISOLATE_FDS];
+    int   i;
+    pid_t pid;
+
+    pthread_mutex_lock(&isolate_mutex);
+    /* Plugins of this and older generations in use are valid in the worker */
+    is->is_gen = plugin_cur->pg_gen;
+    if (pipe(life) < 0 || pipe(plife) < 0){
+	clicon_err(OE_UNIX, errno, "pipe");
+	goto done;
+    }
+    for (i=0; i<2; i++){
+	fcntl(life[i], F_SETFD, FD_CLOEXEC);
+	fcntl(plife[i], F_SETFD, FD_CLOEXEC);
+    }
+    /* In the order of ISOLATE_FD_* */
+    fds[0] = is->is_reqfd;
+    fds[1] = is->is_respfd;
+    fds[2] = is->is_reqw.rw_fd[0];
+    fds[3] = is->is_respw.rw_fd[1];
+    fds[4] = life[1];
+    fds[5] = plife[0];
+    if ((pid = fork()) < 0){
+	clicon_err(OE_UNIX, errno, "fork");
+	goto done;
+    }
+    if (pid == 0){
+	/* Above the targets, then in place without close on exec */
+	for (i=0; i<ISOLATE_FDS; i++)
+	    if ((fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 
+				ISOLATE_FD_REQ+ISOLATE_FDS)) < 0)
+		_exit(127);
+	for (i=0; i<ISOLATE_FDS; i++)
+	    if (dup2(fds[i], ISOLATE_FD_REQ+i) < 0)
+		_exit(127);
+	execv(isolate_exe, isolate_argv);
+	_exit(127);
+    }
+    close(life[1]);
+    close(plife[0]);
+    is->is_life = life[0];
+    is->is_plife = plife[1];
+    is->is_pid = pid;
+    is->is_started = gettimestamp();
+    clicon_debug(1, "%s: plugin worker process %d", __FUNCTION__, pid);
+    retval = 0;
+ done:
+    if (retval < 0)
+	for (i=0; i<2; i++){
+	    if (life[i] != -1)
+		close(life[i]);
+	    if (plife[i] != -1)
+		close(plife[i]);
+	}
+    pthread_mutex_unlock(&isolate_mutex);
+    return retval;
+}
+
+/*! Reap the worker process of a thread, so that it can be forked again
+ * @param[in]  is      Worker of calling thread, exited or killed
+ * @param[out] status  Exit status
+ */
+static void
+isolate_reap(struct isolate *is,
+	     int            *status)
+{
+    if (waitpid(is->is_pid, status, 0) < 0)
+	clicon_err(OE_UNIX, errno, "waitpid");
+    close(is->is_life);
+    close(is->is_plife);
+    is->is_life = is->is_plife = -1;
+    is->is_pid = 0;
+    ring_reset(is->is_req);
+    ring_reset(is->is_resp);
+    ring_wake_clear(&is->is_reqw);
+    ring_wake_clear(&is->is_respw);
+}
+
+/*! The worker process of a thread exited, reap it and let it be restarted
+ * @param[in]  is  Worker of calling thread
+ * @param[in]  p   Plugin whose test it ran
+ */
+static void
+isolate_died(struct isolate *is,
+	     struct plugin  *p)
+{
+    pid_t pid = is->is_pid;
+    int   status = 0;
+
+    isolate_reap(is, &status);
+    if (WIFSIGNALED(status))
+	clicon_log(LOG_WARNING, "plugin %s: worker process %d killed by signal %d, restarted",
+		   p->p_name, pid, WTERMSIG(status));
+    else
+	clicon_log(LOG_WARNING, "plugin %s: worker process %d exited: %d, restarted",
+		   p->p_name, pid, WEXITSTATUS(status));
+    is->is_died = gettimestamp();
+    is->is_restarts++;
+}
+
+/*! Free a worker, kill it if it is running
+ */
+static void
+isolate_free(struct isolate *is)
+{
+    if (is->is_pid > 0){
+	kill(is->is_pid, SIGKILL);
+	waitpid(is->is_pid, NULL, 0);
+    }
+    if (is->is_life != -1)
+	close(is->is_life);
+    if (is->is_plife != -1)
+	close(is->is_plife);
+    if (is->is_req)
+	ring_free(is->is_req);
+    if (is->is_resp)
+	ring_free(is->is_resp);
+    if (is->is_reqfd != -1)
+	close(is->is_reqfd);
+    if (is->is_respfd != -1)
+	close(is->is_respfd);
+    ring_wake_close(&is->is_reqw);
+    ring_wake_close(&is->is_respw);
+    free(is);
+}
+
+/*! Get the worker of the calling thread, create it on first use
+ * @retval  is    Worker, its process may not be running
+ * @retval  NULL  Error
+ */
+static struct isolate *
+isolate_get(void)
+{
+    struct isolate *is;
+
+    if ((is = pthread_getspecific(isolate_key)) != NULL)
+	return is;
+    if ((is = calloc(1, sizeof(*is))) == NULL){
+	clicon_err(OE_UNIX, errno, "calloc");
+	return NULL;
+    }
+    is->is_life = is->is_plife = -1;
+    is->is_reqfd = is->is_respfd = -1;
+    is->is_reqw.rw_fd[0] = is->is_reqw.rw_fd[1] = -1;
+    is->is_respw.rw_fd[0] = is->is_respw.rw_fd[1] = -1;
+    if ((is->is_req = ring_new(ISOLATE_REQ_RING, &is->is_reqfd)) == NULL ||
+	(is->is_resp = ring_new(ISOLATE_RESP_RING, &is->is_respfd)) == NULL ||
+	ring_wake_open(&is->is_reqw) < 0 ||
+	ring_wake_open(&is->is_respw) < 0){
+	isolate_free(is);
+	return NULL;
+    }
+    pthread_mutex_lock(&isolate_mutex);
+    is->is_next = isolate_list;
+    isolate_list = is;
+    pthread_mutex_unlock(&isolate_mutex);
+    pthread_setspecific(isolate_key, is);
+    return is;
+}
+
+/*! Run a blocking plugin test in the worker process of the calling thread
+ * A worker that dies fails the test and is restarted by the next call, or
+ * ISOLATE_RESTART_MS later if it died soon after its start.
+ * @param[in]  p       Plugin
+ * @param[in]  argstr  Parameter, or NULL
+ * @param[in]  key     Hash of argstr, see plan_call
+ * @param[in]  enc     Encoding of result, ISOLATE_*
+ * @param[out] data    Result, valid until isolate_release
+ * @param[out] len     Length of data
+ * @retval -1  Fatal error
+ * @retval  0  Test failed
+ * @retval  1  OK, call isolate_release when done with data
+ */
+int
+isolate_call(struct plugin *p,
+	     char          *argstr,
+	     uint64_t       key,
+	     int            enc,
+	     char         **data,
+	     size_t        *len)
+{
+    struct isolate     *is;
+    struct isolate_req  ir;
+    struct isolate_resp ip;
+    struct iovec        iov[3];
+    struct pollfd       pfd[2];
+    struct timeval      t;
+    char               *msg;
+    size_t              n;
+
+    if ((is = isolate_get()) == NULL)
+	return -1;
+    /* Started before a plugin reload, it does not have the new plugins */
+    if (is->is_pid && is->is_gen != plugin_cur->pg_gen){
+	kill(is->is_pid, SIGKILL);
+	isolate_reap(is, NULL);
+    }
+    if (is->is_pid == 0){
+	if (is->is_restarts){
+	    timersub(&is->is_died, &is->is_started, &t);
+	    if (t.tv_sec*1000 + t.tv_usec/1000 < ISOLATE_RESTART_MS){
+		t = gettimestamp();
+		timersub(&t, &is->is_died, &t);
+		if (t.tv_sec*1000 + t.tv_usec/1000 < ISOLATE_RESTART_MS)
+		    return 0;
+	    }
+	}
+	if (isolate_fork(is) < 0)
+	    return 0;
+    }
+    memset(&ir, 0, sizeof(ir));
+    ir.ir_enc = enc;
+    ir.ir_key = key;
+    iov[0].iov_base = &ir;
+    iov[0].iov_len = sizeof(ir);
+    iov[1].iov_base = p->p_name;
+    iov[1].iov_len = strlen(p->p_name)+1;
+    iov[2].iov_base = argstr;
+    iov[2].iov_len = argstr ? strlen(argstr)+1 : 0;
+    if (ring_put(is->is_req, iov, 3) != 1){
+	clicon_log(LOG_NOTICE, "plugin %s: parameter too large", p->p_name);
+	return 0;
+    }
+    ring_wake_signal(&is->is_reqw);
+    pfd[0].fd = is->is_respw.rw_fd[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = is->is_life;
+    pfd[1].events = POLLIN;
+    while (1){
+	ring_wake_clear(&is->is_respw);
+	if (ring_get(is->is_resp, &msg, &n) == 1)
+	    break;
+	if (poll(pfd, 2, -1) < 0){
+	    if (errno == EINTR)
+		continue;
+	    clicon_err(OE_UNIX, errno, "poll");
+	    return -1;
+	}
+	/* A response sent just before exit is still used */
+	if (pfd[1].revents && ring_get(is->is_resp, &msg, &n) != 1){
+	    isolate_died(is, p);
+	    return 0;
+	}
+    }
+    memcpy(&ip, msg, sizeof(ip));
+    if (ip.ip_status != 1){
+	ring_release(is->is_resp);
+	return 0;
+    }
+    *data = msg + sizeof(ip);
+    *len = n - sizeof(ip);
+    return 1;
+}
+
+/*! Release the result of isolate_call
+ */
+int
+isolate_release(void)
+{
+    struct isolate *is;
+
+    if ((is = pthread_getspecific(isolate_key)) == NULL)
+	return 0;
+    return ring_release(is->is_resp);
+}
+
+/*! Kill and reap all worker processes, free them unless a test is hung
+ * Called on exit when threads calling plugins are stopped.
+ * @param[in]  hung  A thread may still wait for its worker
+ */
+void
+isolate_stop(int hung)
+{
+    struct isolate *is;
+
+    pthread_mutex_lock(&isolate_mutex);
+    if (hung){
+	for (is = isolate_list; is; is = is->is_next)
+	    if (is->is_pid > 0)
+		kill(is->is_pid, SIGKILL);
+    }
+    else
+	while ((is = isolate_list) != NULL){
+	    isolate_list = is->is_next;
+	    isolate_free(is);
+	}
+    pthread_mutex_unlock(&isolate_mutex);
+}
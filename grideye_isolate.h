@@ -0,0 +1,57 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Plugin worker processes, see -O. Each thread that calls plugins runs
+ * their blocking tests in a process of its own, the agent exec'd with
+ * ISOLATE_ARG, so that a crashing or leaking plugin does not take the agent
+ * with it. Requests and results pass through shared memory rings.
+ */
+#ifndef _GRIDEYE_ISOLATE_H_
+#define _GRIDEYE_ISOLATE_H_
+
+/*
+ * Constants
+ */
+/* A plugin worker process is the agent exec'd with this first argument,
+ * see isolate_worker */
+#define ISOLATE_ARG "--plugin-worker"
+
+/* Encoding of a result requested from a worker process, see isolate_call */
+#define ISOLATE_TEXT   0   /* XML text */
+#define ISOLATE_CBOR   1   /* cbor map */
+#define ISOLATE_RECORD 2   /* Fields recorded as by the sampler */
+
+/*
+ * Variables
+ */
+extern int isolate_on;     /* Plugins run in worker processes, -O */
+
+/*
+ * Prototypes
+ */
+int    isolate_worker(int argc, char *argv[]);
+int    isolate_init(char *argv0, int logdst);
+int    isolate_call(struct plugin *p, char *argstr, uint64_t key, int enc,
+		    char **data, size_t *len);
+int    isolate_release(void);
+void   isolate_stop(int hung);
+
+#endif /* _GRIDEYE_ISOLATE_H_ */
@@ -0,0 +1,668 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Single pass JSON tokenizer for data packets: the grideye payload and
+ * json plugin output. Clixon builds a cxobj tree of the whole string,
+ * here the caller pulls one token at a time with json_lex_next and the
+ * tokens point into the string, so nothing is allocated. The syntax is
+ * checked as in RFC 7159, but strings are not unescaped unless asked for
+ * with json_tok_str. Clixon is still used for the control plane.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "grideye_json.h"
+
+/* What the tokenizer expects next, jl_state */
+#define JL_VALUE          0  /* A value, eg after ':' */
+#define JL_VALUE_OR_CLOSE 1  /* After '[' */
+#define JL_KEY            2  /* After ',' in object */
+#define JL_KEY_OR_CLOSE   3  /* After '{' */
+#define JL_AFTER          4  /* After a value: ',' or close */
+
+/*! Initialize a tokenizer
+ * @param[out] jl   Tokenizer
+ * @param[in]  s    String, need not be NUL-terminated
+ * @param[in]  len  Length of s
+ */
+void
+json_lex_init(struct json_lexer *jl,
+	      const char        *s,
+	      size_t             len)
+{
+    memset(jl, 0, sizeof(*jl));
+    jl->jl_p = s;
+    jl->jl_end = s + len;
+    jl->jl_state = JL_VALUE;
+}
+
+static int
+json_ishex(int c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+	(c >= 'A' && c <= 'F');
+}
+
+/*! Scan a string starting after its '"'
+ * @retval  0  OK, token set, p after closing '"'
+ * @retval -1  Error
+ */
+static int
+json_lex_string(struct json_lexer *jl,
+		struct json_tok   *t)
+{
+    const char *p = jl->jl_p;
+    int         i;
+
+    t->jt_s = p;
+    while (p < jl->jl_end && *p != '"'){
+	if ((unsigned char)*p < 0x20)
+	    return -1;
+	if (*p++ != '\\')
+	    continue;
+	if (p == jl->jl_end)
+	    return -1;
+	switch (*p++){
+	case '"': case '\\': case '/': case 'b':
+	case 'f': case 'n': case 'r': case 't':
+	    break;
+	case 'u':
+	    for (i=0; i<4; i++)
+		if (p == jl->jl_end || !json_ishex(*p++))
+		    return -1;
+	    break;
+	default:
+	    return -1;
+	}
+    }
+    if (p == jl->jl_end)
+	return -1;
+    t->jt_len = p - t->jt_s;
+    jl->jl_p = p + 1;
+    return 0;
+}
+
+/*! Scan a number
+ * @retval  0  OK, token set
+ * @retval -1  Error
+ */
+static int
+json_lex_number(struct json_lexer *jl,
+		struct json_tok   *t)
+{
+    const char *p = jl->jl_p;
+    const char *end = jl->jl_end;
+    const char *d;
+
+    t->jt_s = p;
+    if (p < end && *p == '-')
+	p++;
+    if (p < end && *p == '0')
+	p++;
+    else if (p < end && *p >= '1' && *p <= '9')
+	while (p < end && *p >= '0' && *p <= '9')
+	    p++;
+    else
+	return -1;
+    if (p < end && *p == '.'){
+	for (d = ++p; p < end && *p >= '0' && *p <= '9'; p++);
+	if (p == d)
+	    return -1;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')){
+	p++;
+	if (p < end && (*p == '+' || *p == '-'))
+	    p++;
+	for (d = p; p < end && *p >= '0' && *p <= '9'; p++);
+	if (p == d)
+	    return -1;
+    }
+    t->jt_len = p - t->jt_s;
+    jl->jl_p = p;
+    return 0;
+}
+
+/*! Scan true, false or null
+ */
+static int
+json_lex_literal(struct json_lexer *jl,
+		 struct json_tok   *t,
+		 const char        *lit,
+		 enum json_type     type)
+{
+    size_t len = strlen(lit);
+
+    if (jl->jl_end - jl->jl_p < len || memcmp(jl->jl_p, lit, len) != 0)
+	return -1;
+    t->jt_s = jl->jl_p;
+    t->jt_len = len;
+    t->jt_type = type;
+    jl->jl_p += len;
+    return 0;
+}
+
+static void
+json_lex_ws(struct json_lexer *jl)
+{
+    while (jl->jl_p < jl->jl_end &&
+	   (*jl->jl_p == ' ' || *jl->jl_p == '\t' ||
+	    *jl->jl_p == '\n' || *jl->jl_p == '\r'))
+	jl->jl_p++;
+}
+
+/*! Open an object or array
+ */
+static int
+json_lex_push(struct json_lexer *jl,
+	      int                obj)
+{
+    if (jl->jl_depth == JSON_DEPTH_MAX)
+	return -1;
+    if (obj)
+	jl->jl_stack |= 1ULL << jl->jl_depth;
+    else
+	jl->jl_stack &= ~(1ULL << jl->jl_depth);
+    jl->jl_depth++;
+    jl->jl_state = obj ? JL_KEY_OR_CLOSE : JL_VALUE_OR_CLOSE;
+    return 0;
+}
+
+/*! Object (1) or array (0) innermost
+ */
+static int
+json_lex_inobj(struct json_lexer *jl)
+{
+    return (jl->jl_stack >> (jl->jl_depth-1)) & 1;
+}
+
+/*! Get next token
+ * @param[in]  jl   Tokenizer
+ * @param[out] t    Token
+ * @retval  type    Type of token, also in t
+ * @retval  JT_END  The value is complete and only whitespace is left
+ * @retval  JT_ERROR  Syntax error, also for all following calls
+ */
+enum json_type
+json_lex_next(struct json_lexer *jl,
+	      struct json_tok   *t)
+{
+    int c;
+
+    memset(t, 0, sizeof(*t));
+    t->jt_type = JT_ERROR;
+    json_lex_ws(jl);
+    if (jl->jl_state == JL_AFTER){
+	if (jl->jl_depth == 0){
+	    if (jl->jl_p != jl->jl_end)
+		goto err;
+	    t->jt_type = JT_END;
+	    return JT_END;
+	}
+	if (jl->jl_p == jl->jl_end)
+	    goto err;
+	c = *jl->jl_p++;
+	if (c == ','){
+	    jl->jl_state = json_lex_inobj(jl) ? JL_KEY : JL_VALUE;
+	    json_lex_ws(jl);
+	}
+	else if (c == '}' && json_lex_inobj(jl)){
+	    jl->jl_depth--;
+	    t->jt_type = JT_OBJEND;
+	    return JT_OBJEND;
+	}
+	else if (c == ']' && !json_lex_inobj(jl)){
+	    jl->jl_depth--;
+	    t->jt_type = JT_ARREND;
+	    return JT_ARREND;
+	}
+	else
+	    goto err;
+    }
+    if (jl->jl_p == jl->jl_end)
+	goto err;
+    c = *jl->jl_p++;
+    switch (jl->jl_state){
+    case JL_KEY_OR_CLOSE:
+	if (c == '}'){
+	    jl->jl_depth--;
+	    jl->jl_state = JL_AFTER;
+	    t->jt_type = JT_OBJEND;
+	    return JT_OBJEND;
+	}
+	/* FALLTHROUGH */
+    case JL_KEY:
+	if (c != '"' || json_lex_string(jl, t) < 0)
+	    goto err;
+	json_lex_ws(jl);
+	if (jl->jl_p == jl->jl_end || *jl->jl_p++ != ':')
+	    goto err;
+	jl->jl_state = JL_VALUE;
+	t->jt_type = JT_KEY;
+	return JT_KEY;
+    case JL_VALUE_OR_CLOSE:
+	if (c == ']'){
+	    jl->jl_depth--;
+	    jl->jl_state = JL_AFTER;
+	    t->jt_type = JT_ARREND;
+	    return JT_ARREND;
+	}
+	/* FALLTHROUGH */
+    case JL_VALUE:
+	break;
+    default:
+	goto err;
+    }
+    /* A value */
+    switch (c){
+    case '{':
+    case '[':
+	if (json_lex_push(jl, c == '{') < 0)
+	    goto err;
+	t->jt_s = jl->jl_p-1;
+	t->jt_len = 1;
+	t->jt_type = c == '{' ? JT_OBJ : JT_ARR;
+	return t->jt_type; /* state set by push */
+    case '"':
+	if (json_lex_string(jl, t) < 0)
+	    goto err;
+	t->jt_type = JT_STR;
+	break;
+    case 't':
+	jl->jl_p--;
+	if (json_lex_literal(jl, t, "true", JT_TRUE) < 0)
+	    goto err;
+	break;
+    case 'f':
+	jl->jl_p--;
+	if (json_lex_literal(jl, t, "false", JT_FALSE) < 0)
+	    goto err;
+	break;
+    case 'n':
+	jl->jl_p--;
+	if (json_lex_literal(jl, t, "null", JT_NULL) < 0)
+	    goto err;
+	break;
+    default:
+	jl->jl_p--;
+	if (json_lex_number(jl, t) < 0)
+	    goto err;
+	t->jt_type = JT_NUM;
+	break;
+    }
+    jl->jl_state = JL_AFTER;
+    return t->jt_type;
+ err:
+    jl->jl_p = jl->jl_end;
+    jl->jl_state = -1;
+    t->jt_type = JT_ERROR;
+    return JT_ERROR;
+}
+
+/*! Skip the rest of a value, ie its members if it is an object or array
+ * @param[in]  jl   Tokenizer
+ * @param[in]  t    First token of the value
+ * @retval  0  OK, next token follows the value
+ * @retval -1  Syntax error
+ */
+int
+json_lex_skip(struct json_lexer *jl,
+	      struct json_tok   *t)
+{
+    struct json_tok tt;
+    int             depth;
+
+    if (t->jt_type == JT_ERROR)
+	return -1;
+    if (t->jt_type != JT_OBJ && t->jt_type != JT_ARR)
+	return 0;
+    depth = jl->jl_depth - 1;
+    while (jl->jl_depth > depth)
+	if (json_lex_next(jl, &tt) == JT_ERROR)
+	    return -1;
+    return 0;
+}
+
+/*! Token is a string, number or literal
+ */
+int
+json_tok_scalar(struct json_tok *t)
+{
+    return t->jt_type >= JT_STR;
+}
+
+/*! Copy a scalar token to a NUL-terminated buffer, strings are unescaped
+ * \u escapes are converted to UTF-8.
+ * @param[in]  t    Token
+ * @param[out] buf  Buffer
+ * @param[in]  len  Length of buf
+ * @retval  n   Length of string in buf
+ * @retval -1   Does not fit, or not a scalar
+ */
+int
+json_tok_str(struct json_tok *t,
+	     char            *buf,
+	     size_t           len)
+{
+    const char *p = t->jt_s;
+    const char *end = t->jt_s + t->jt_len;
+    size_t      n = 0;
+    unsigned    u;
+    unsigned    u2;
+    char        c;
+
+    if (!json_tok_scalar(t) || len == 0)
+	return -1;
+    while (p < end){
+	if ((c = *p++) != '\\' || t->jt_type != JT_STR){
+	    if (n+1 >= len)
+		return -1;
+	    buf[n++] = c;
+	    continue;
+	}
+	/* Escapes are checked by the tokenizer */
+	switch (c = *p++){
+	case 'b': c = '\b'; break;
+	case 'f': c = '\f'; break;
+	case 'n': c = '\n'; break;
+	case 'r': c = '\r'; break;
+	case 't': c = '\t'; break;
+	case 'u':
+	    u = strtoul((char[5]){p[0], p[1], p[2], p[3], 0}, NULL, 16);
+	    p += 4;
+	    /* Surrogate pair */
+	    if (u >= 0xd800 && u < 0xdc00 && end - p >= 6 &&
+		p[0] == '\\' && p[1] == 'u'){
+		u2 = strtoul((char[5]){p[2], p[3], p[4], p[5], 0}, NULL, 16);
+		if (u2 >= 0xdc00 && u2 < 0xe000){
+		    u = 0x10000 + ((u - 0xd800) << 10) + (u2 - 0xdc00);
+		    p += 6;
+		}
+	    }
+	    if (n+5 >= len)
+		return -1;
+	    if (u < 0x80)
+		buf[n++] = u;
+	    else if (u < 0x800){
+		buf[n++] = 0xc0 | (u >> 6);
+		buf[n++] = 0x80 | (u & 0x3f);
+	    }
+	    else if (u < 0x10000){
+		buf[n++] = 0xe0 | (u >> 12);
+		buf[n++] = 0x80 | ((u >> 6) & 0x3f);
+		buf[n++] = 0x80 | (u & 0x3f);
+	    }
+	    else{
+		buf[n++] = 0xf0 | (u >> 18);
+		buf[n++] = 0x80 | ((u >> 12) & 0x3f);
+		buf[n++] = 0x80 | ((u >> 6) & 0x3f);
+		buf[n++] = 0x80 | (u & 0x3f);
+	    }
+	    continue;
+	default: /* '"', '\\', '/' */
+	    break;
+	}
+	if (n+1 >= len)
+	    return -1;
+	buf[n++] = c;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+/*! Compare a key or string token with a string
+ * Only compares the raw token, so a string with escapes does not match.
+ * @retval  1  Equal
+ * @retval  0  Not equal
+ */
+int
+json_tok_eq(struct json_tok *t,
+	    const char      *str)
+{
+    size_t len = strlen(str);
+
+    return t->jt_len == len && memcmp(t->jt_s, str, len) == 0;
+}
+
+/*! Append to output buffer of json_member_compact
+ */
+static int
+json_out(char       *out,
+	 size_t      outlen,
+	 size_t     *n,
+	 const char *s,
+	 size_t      len)
+{
+    if (*n + len >= outlen)
+	return -1;
+    memcpy(out + *n, s, len);
+    *n += len;
+    return 0;
+}
+
+/*! Re-emit the first member of a JSON object compactly
+ * Scalars are emitted as strings, and other members of the object are
+ * dropped. This is what json_parse_str, xml_rootchild and xml2json_cbuf
+ * of clixon produced for json plugin output, since XML has no types.
+ * Eg { "tior" : 123, "x": 1 } gives {"tior":"123"}.
+ * @param[in]  s       JSON string
+ * @param[in]  len     Length of s
+ * @param[out] out     Buffer, NUL-terminated. 2*len+3 bytes are enough
+ * @param[in]  outlen  Length of out
+ * @retval  n   Length of string in out
+ * @retval -1   Syntax error, not an object with a member, or out too short
+ */
+int
+json_member_compact(const char *s,
+		    size_t      len,
+		    char       *out,
+		    size_t      outlen)
+{
+    struct json_lexer jl;
+    struct json_tok   t;
+    enum json_type    prev = JT_OBJ;
+    size_t            n = 0;
+
+    json_lex_init(&jl, s, len);
+    if (json_lex_next(&jl, &t) != JT_OBJ)
+	return -1;
+    if (json_lex_next(&jl, &t) != JT_KEY)
+	return -1;
+    if (json_out(out, outlen, &n, "{", 1) < 0)
+	return -1;
+    /* The member: until back in the top object */
+    do {
+	switch (t.jt_type){
+	case JT_ERROR:
+	case JT_END:
+	    return -1;
+	case JT_OBJEND:
+	case JT_ARREND:
+	    if (json_out(out, outlen, &n,
+			 t.jt_type == JT_OBJEND ? "}" : "]", 1) < 0)
+		return -1;
+	    break;
+	case JT_OBJ:
+	case JT_ARR:
+	case JT_KEY:
+	default: /* scalars */
+	    if (prev != JT_OBJ && prev != JT_ARR && prev != JT_KEY &&
+		json_out(out, outlen, &n, ",", 1) < 0)
+		return -1;
+	    if (t.jt_type == JT_OBJ || t.jt_type == JT_ARR){
+		if (json_out(out, outlen, &n, t.jt_s, 1) < 0)
+		    return -1;
+		break;
+	    }
+	    if (json_out(out, outlen, &n, "\"", 1) < 0 ||
+		json_out(out, outlen, &n, t.jt_s, t.jt_len) < 0 ||
+		json_out(out, outlen, &n, t.jt_type == JT_KEY ? "\":" : "\"",
+			 t.jt_type == JT_KEY ? 2 : 1) < 0)
+		return -1;
+	    break;
+	}
+	prev = t.jt_type;
+    } while ((jl.jl_depth > 1 || t.jt_type == JT_KEY) &&
+	     json_lex_next(&jl, &t) != JT_ERROR);
+    if (t.jt_type == JT_ERROR)
+	return -1;
+    /* Check the rest */
+    while (json_lex_next(&jl, &t) > JT_END)
+	;
+    if (t.jt_type != JT_END)
+	return -1;
+    if (json_out(out, outlen, &n, "}", 1) < 0)
+	return -1;
+    out[n] = '\0';
+    return n;
+}
+
+#ifndef _NOMAIN
+/* Unit test and microbenchmark: the tokenizer compared with the clixon
+ * parser for a grideye payload and json plugin output
+ * compile: gcc -O2 -I. grideye_json.c -lclixon -lcligen -o json_test
+ */
+#include <time.h>
+#include <cligen/cligen.h>
+#include <clixon/clixon.h>
+
+#define BENCH_N 100000
+
+static const char *payload =
+    "{\"grideye\":{\"version\":2,\"name\":\"agent1\","
+    "\"plugin\":[{\"name\":\"diskio_read\",\"param\":\"4096\"},"
+    "{\"name\":\"grideye_http\",\"param\":\"www.youtube.com\"}]}}";
+
+static const char *output =
+    "{\"tior\": 123, \"http\": {\"code\": 200, \"bytes\": [1, 2.5e3]}}";
+
+static double
+bench_ns(struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return ((t1.tv_sec - t0->tv_sec)*1e9 + (t1.tv_nsec - t0->tv_nsec))/BENCH_N;
+}
+
+/* Read the fields echo_application needs with the tokenizer */
+static int
+bench_lex(const char *s)
+{
+    struct json_lexer jl;
+    struct json_tok   t;
+    char              buf[64];
+    int               n = 0;
+
+    json_lex_init(&jl, s, strlen(s));
+    while (json_lex_next(&jl, &t) > JT_END)
+	if (t.jt_type == JT_KEY &&
+	    (json_tok_eq(&t, "name") || json_tok_eq(&t, "version") ||
+	     json_tok_eq(&t, "param")) &&
+	    json_lex_next(&jl, &t) > JT_END && json_tok_str(&t, buf, sizeof(buf)) > 0)
+	    n++;
+    return t.jt_type == JT_END ? n : -1;
+}
+
+/* Same with clixon, as echo_application did */
+static int
+bench_clixon(const char *s)
+{
+    cxobj  *xt = NULL;
+    cxobj **xvec = NULL;
+    size_t  xlen;
+    int     i;
+    int     n = 0;
+
+    if (json_parse_str((char*)s, &xt) < 0)
+	return -1;
+    if (xml_body(xpath_first(xt, "grideye/version")))
+	n++;
+    if (xml_body(xpath_first(xt, "grideye/name")))
+	n++;
+    if (xpath_vec(xt, "grideye/plugin", &xvec, &xlen) < 0)
+	return -1;
+    for (i=0; i<xlen; i++){
+	if (xml_body(xpath_first(xvec[i], "name")))
+	    n++;
+	if (xml_body(xpath_first(xvec[i], "param")))
+	    n++;
+    }
+    free(xvec);
+    xml_free(xt);
+    return n;
+}
+
+int main()
+{
+    struct timespec t0;
+    char            out[512];
+    cxobj          *xj;
+    cbuf           *cb;
+    int             i;
+    const char     *bad[] = {"{", "{\"a\"}", "{\"a\":1,}", "[1 2]", "{\"a\":01}",
+			     "{\"a\":\"\\x\"}", "{\"a\":1}}", "{}", "1", NULL};
+
+    /* Unit tests */
+    if (bench_lex(payload) != 6 || bench_clixon(payload) != 6)
+	return -1;
+    if (json_member_compact(output, strlen(output), out, sizeof(out)) < 0 ||
+	strcmp(out, "{\"tior\":\"123\"}") != 0)
+	return -1;
+    if (json_member_compact(output+14, strlen(output+14)-1, out, sizeof(out)) >= 0)
+	return -1; /* not an object */
+    for (i=0; bad[i]; i++)
+	if (json_member_compact(bad[i], strlen(bad[i]), out, sizeof(out)) >= 0){
+	    fprintf(stderr, "accepted: %s\n", bad[i]);
+	    return -1;
+	}
+    fprintf(stdout, "%s\n", out);
+    /* Benchmark */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<BENCH_N; i++)
+	bench_lex(payload);
+    fprintf(stdout, "payload: tokenizer: %.0f ns", bench_ns(&t0));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<BENCH_N; i++)
+	bench_clixon(payload);
+    fprintf(stdout, " clixon: %.0f ns\n", bench_ns(&t0));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<BENCH_N; i++)
+	json_member_compact(output, strlen(output), out, sizeof(out));
+    fprintf(stdout, "plugin output: tokenizer: %.0f ns", bench_ns(&t0));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i=0; i<BENCH_N; i++){
+	xj = NULL;
+	cb = cbuf_new();
+	if (json_parse_str((char*)output, &xj) < 0 ||
+	    xml_rootchild(xj, 0, &xj) < 0 ||
+	    xml2json_cbuf(cb, xj, 0) < 0)
+	    return -1;
+	xml_free(xj);
+	cbuf_free(cb);
+    }
+    fprintf(stdout, " clixon: %.0f ns\n", bench_ns(&t0));
+    return 0;
+}
+#endif
@@ -0,0 +1,81 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Streaming JSON tokenizer for the data packet path. Tokens point into the
+ * parsed string, nothing is allocated.
+ */
+#ifndef _GRIDEYE_JSON_H_
+#define _GRIDEYE_JSON_H_
+
+#include <stdint.h> /* uint64_t jl_stack */
+
+/*
+ * Constants
+ */
+/* Max nesting of objects and arrays */
+#define JSON_DEPTH_MAX 64
+
+/*
+ * Types
+ */
+enum json_type{
+    JT_ERROR = -1, /* Syntax error */
+    JT_END = 0,    /* End of string after a complete value */
+    JT_OBJ,        /* { */
+    JT_OBJEND,     /* } */
+    JT_ARR,        /* [ */
+    JT_ARREND,     /* ] */
+    JT_KEY,        /* Object member name, the ':' is consumed */
+    JT_STR,
+    JT_NUM,
+    JT_TRUE,
+    JT_FALSE,
+    JT_NULL,
+};
+
+/* A token. Strings and keys are without quotes, escapes are kept */
+struct json_tok{
+    enum json_type  jt_type;
+    const char     *jt_s;
+    size_t          jt_len;
+};
+
+/* Tokenizer state, see json_lex_init */
+struct json_lexer{
+    const char *jl_p;      /* Next char */
+    const char *jl_end;
+    int         jl_state;  /* What is expected next */
+    int         jl_depth;  /* Open objects and arrays */
+    uint64_t    jl_stack;  /* Bit per depth: 1 object, 0 array */
+};
+
+/*
+ * Prototypes
+ */
+void json_lex_init(struct json_lexer *jl, const char *s, size_t len);
+enum json_type json_lex_next(struct json_lexer *jl, struct json_tok *t);
+int  json_lex_skip(struct json_lexer *jl, struct json_tok *t);
+int  json_tok_scalar(struct json_tok *t);
+int  json_tok_str(struct json_tok *t, char *buf, size_t len);
+int  json_tok_eq(struct json_tok *t, const char *str);
+int  json_member_compact(const char *s, size_t len, char *out, size_t outlen);
+
+#endif /* _GRIDEYE_JSON_H_ */
@@ -0,0 +1,482 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Benchmark a grideye plugin outside the agent.
+ * The plugin is loaded with dlopen as the agent does, options are set with
+ * its setopt function, and its blocking test function is run a number of
+ * times after a warmup. For every numeric output field of the plugin, and for
+ * the wall and cpu time of each run, min/median/p99/max are printed.
+ * Example:
+ *   grideye_plugin_bench -n 1000 -o largefile=/var/tmp/GRIDEYE_LARGEFILE \
+ *        /usr/local/lib/grideye/grideye_diskio_read.so.1
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "grideye_plugin_v2.h"
+#include "grideye_plugin_v3.h"
+
+/* Command line options to be passed to getopt(3) */
+#define GRIDEYE_BENCH_OPTS "hDn:w:p:o:"
+
+#define BENCH_RUNS    100 /* Default number of measured runs, see -n */
+#define BENCH_WARMUP   10 /* Default number of warmup runs, see -w */
+#define BENCH_SERIES   32 /* Max number of measured fields incl wall and cpu */
+
+/* Measured values of one field, one per run where the plugin wrote it */
+struct series{
+    char   *se_key;  /* Field name */
+    int     se_len;  /* Number of values */
+    double *se_val;  /* Vector of values, one per measured run */
+};
+
+/* Benchmark state, also given to the v3 writer */
+struct bench{
+    int            b_runs;     /* Number of measured runs */
+    int            b_measure;  /* Record values, ie not in warmup */
+    int            b_nseries;
+    struct series  b_series[BENCH_SERIES];
+};
+
+static int debug = 0;
+
+/*! Find or create the series of a field
+ * @param[in]  b    Benchmark state
+ * @param[in]  key  Field name
+ * @retval     se   Series, or NULL if there are too many fields
+ */
+static struct series *
+bench_series(struct bench *b,
+	     const char   *key)
+{
+    int            i;
+    struct series *se;
+
+    for (i=0; i<b->b_nseries; i++)
+	if (strcmp(b->b_series[i].se_key, key) == 0)
+	    return &b->b_series[i];
+    if (b->b_nseries == BENCH_SERIES)
+	return NULL;
+    se = &b->b_series[b->b_nseries];
+    if ((se->se_key = strdup(key)) == NULL ||
+	(se->se_val = calloc(b->b_runs, sizeof(double))) == NULL){
+	perror("bench_series");
+	exit(2);
+    }
+    b->b_nseries++;
+    return se;
+}
+
+/*! Add a measured value of a field
+ * Values written during warmup are dropped, as are values of fields beyond
+ * BENCH_SERIES.
+ * @param[in]  b    Benchmark state
+ * @param[in]  key  Field name
+ * @param[in]  val  Value
+ */
+static int
+bench_add(struct bench *b,
+	  const char   *key,
+	  double        val)
+{
+    struct series *se;
+
+    if (debug)
+	fprintf(stderr, "%s: %g\n", key, val);
+    if (!b->b_measure)
+	return 0;
+    if ((se = bench_series(b, key)) == NULL)
+	return 0;
+    if (se->se_len < b->b_runs) /* A plugin may write a field twice */
+	se->se_val[se->se_len++] = val;
+    return 0;
+}
+
+/*! v3 writer callback: unsigned integer field */
+static int
+bench_write_u64(struct grideye_writer *gw,
+		const char            *key,
+		uint64_t               val)
+{
+    return bench_add((struct bench *)gw->gw_arg, key, (double)val);
+}
+
+/*! v3 writer callback: decimal field, val * 10^-fd */
+static int
+bench_write_dec(struct grideye_writer *gw,
+		const char            *key,
+		int64_t                val,
+		int                    fd)
+{
+    double d = (double)val;
+
+    while (fd-- > 0)
+	d /= 10;
+    return bench_add((struct bench *)gw->gw_arg, key, d);
+}
+
+/*! v3 writer callback: string fields are not measured */
+static int
+bench_write_str(struct grideye_writer *gw,
+		const char            *key,
+		const char            *val)
+{
+    if (debug)
+	fprintf(stderr, "%s: \"%s\"\n", key, val);
+    return 0;
+}
+
+/*! Add numeric fields of v2 xml output, eg <tmr>123</tmr><ior>1024</ior>
+ * Fields that are not numbers are not measured
+ * @param[in]  b    Benchmark state
+ * @param[in]  str  Output string of a v2 test function
+ */
+static void
+bench_parse_xml(struct bench *b,
+		char         *str)
+{
+    char   *s = str;
+    char   *e;
+    char   *end;
+    char    key[64];
+    size_t  len;
+    double  d;
+
+    while ((s = strchr(s, '<')) != NULL){
+	s++;
+	if ((e = strchr(s, '>')) == NULL)
+	    break;
+	if (*s == '/'){ /* End tag */
+	    s = e + 1;
+	    continue;
+	}
+	if ((len = e - s) >= sizeof(key))
+	    len = sizeof(key) - 1;
+	memcpy(key, s, len);
+	key[len] = '\0';
+	s = e + 1;
+	d = strtod(s, &end);
+	if (end != s && *end == '<')
+	    bench_add(b, key, d);
+    }
+}
+
+/*! Return time in microseconds between two timespecs */
+static double
+ts_us(struct timespec *t0,
+      struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec)*1000000.0 + (t1->tv_nsec - t0->tv_nsec)/1000.0;
+}
+
+/*! Return user+system cpu time in microseconds of self and waited children */
+static double
+cpu_us(void)
+{
+    struct rusage ru;
+    double        us = 0;
+
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+	us += ru.ru_utime.tv_sec*1000000.0 + ru.ru_utime.tv_usec +
+	    ru.ru_stime.tv_sec*1000000.0 + ru.ru_stime.tv_usec;
+    if (getrusage(RUSAGE_CHILDREN, &ru) == 0)
+	us += ru.ru_utime.tv_sec*1000000.0 + ru.ru_utime.tv_usec +
+	    ru.ru_stime.tv_sec*1000000.0 + ru.ru_stime.tv_usec;
+    return us;
+}
+
+static int
+double_cmp(const void *a,
+	   const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*! Return the nearest-rank percentile of a sorted vector
+ * @param[in]  v    Sorted values
+ * @param[in]  len  Number of values, > 0
+ * @param[in]  p    Percentile, 0-100
+ */
+static double
+percentile(double *v,
+	   int     len,
+	   int     p)
+{
+    int i;
+
+    i = (len*p + 99)/100 - 1;
+    if (i < 0)
+	i = 0;
+    if (i >= len)
+	i = len - 1;
+    return v[i];
+}
+
+/*! Print min/median/p99/max of all measured fields */
+static void
+bench_report(struct bench *b)
+{
+    int            i;
+    int            j;
+    int            integral;
+    int            prec;
+    struct series *se;
+
+    fprintf(stdout, "%-20s %8s %14s %14s %14s %14s\n",
+	    "field", "n", "min", "median", "p99", "max");
+    for (i=0; i<b->b_nseries; i++){
+	se = &b->b_series[i];
+	if (se->se_len == 0)
+	    continue;
+	qsort(se->se_val, se->se_len, sizeof(double), double_cmp);
+	integral = 1;
+	for (j=0; j<se->se_len; j++)
+	    if (se->se_val[j] != (double)(int64_t)se->se_val[j])
+		integral = 0;
+	prec = integral ? 0 : 3;
+	fprintf(stdout, "%-20s %8d %14.*f %14.*f %14.*f %14.*f\n",
+		se->se_key, se->se_len,
+		prec, se->se_val[0],
+		prec, percentile(se->se_val, se->se_len, 50),
+		prec, percentile(se->se_val, se->se_len, 99),
+		prec, se->se_val[se->se_len-1]);
+    }
+}
+
+static void
+usage(char *argv0)
+{
+    fprintf(stderr, "usage:\t%s [options]* <plugin>    Benchmark a grideye plugin\n"
+	    "where options are:\n"
+	    "\t-h \t\tHelp text\n"
+	    "\t-D \t\tDebug, print output of every run\n"
+	    "\t-n <runs> \tNumber of measured runs (default: %d)\n"
+	    "\t-w <runs> \tNumber of warmup runs, not measured (default: %d)\n"
+	    "\t-p <param> \tInput parameter to the test function\n"
+	    "\t-o <opt>=<val>\tPlugin option given to setopt, may be repeated\n"
+	    "and <plugin> is the filename of a plugin, eg grideye_sysinfo.so.1\n",
+	    argv0,
+	    BENCH_RUNS,
+	    BENCH_WARMUP);
+    exit(0);
+}
+
+int
+main(int   argc,
+     char *argv[])
+{
+    int                           retval = -1;
+    char                         *argv0 = argv[0];
+    int                           c;
+    int                           i;
+    int                           runs = BENCH_RUNS;
+    int                           warmup = BENCH_WARMUP;
+    int                           failed = 0;
+    char                         *param = NULL;
+    char                         *opts[64];
+    int                           nopts = 0;
+    char                         *filename;
+    char                          path[MAXPATHLEN];
+    void                         *handle = NULL;
+    grideye_plugin_init_t        *initfun;
+    struct grideye_plugin_api_v3 *api = NULL;
+    struct grideye_plugin_api_v2 *api2 = NULL;
+    grideye_plugin_setopt_t      *setopt_fn;
+    grideye_plugin_exit_t        *exit_fn;
+    char                         *name;
+    char                         *v;
+    char                         *str;
+    struct bench                  b = {0,};
+    struct grideye_writer         gw = {bench_write_u64, bench_write_dec,
+					bench_write_str, &b};
+    struct timespec               t0;
+    struct timespec               t1;
+    double                        c0;
+    double                        c1;
+    int                           ret;
+
+    while ((c = getopt(argc, argv, GRIDEYE_BENCH_OPTS)) != -1)
+	switch (c) {
+	case 'h':
+	    usage(argv0);
+	    break;
+	case 'D':
+	    debug++;
+	    break;
+	case 'n':
+	    if ((runs = atoi(optarg)) <= 0)
+		usage(argv0);
+	    break;
+	case 'w':
+	    if ((warmup = atoi(optarg)) < 0)
+		usage(argv0);
+	    break;
+	case 'p':
+	    param = optarg;
+	    break;
+	case 'o':
+	    if (strchr(optarg, '=') == NULL ||
+		nopts == sizeof(opts)/sizeof(opts[0]))
+		usage(argv0);
+	    opts[nopts++] = optarg;
+	    break;
+	default:
+	    usage(argv0);
+	    break;
+	}
+    argc -= optind;
+    argv += optind;
+    if (argc != 1)
+	usage(argv0);
+    filename = argv[0];
+    /* dlopen searches the library path for a name without '/' */
+    if (strchr(filename, '/') == NULL)
+	snprintf(path, sizeof(path), "./%s", filename);
+    else
+	snprintf(path, sizeof(path), "%s", filename);
+    if ((handle = dlopen(path, RTLD_NOW)) == NULL){
+	fprintf(stderr, "dlopen: %s\n", dlerror());
+	goto done;
+    }
+    /* Same lookup as the agent: v3 init function, else v2 */
+    if ((initfun = dlsym(handle, PLUGIN_INIT_FN_V3)) != NULL){
+	if ((api = initfun(GRIDEYE_PLUGIN_VERSION_V3)) == NULL){
+	    fprintf(stderr, "%s: failed when running init function %s: %s\n",
+		    filename, PLUGIN_INIT_FN_V3, errno?strerror(errno):"");
+	    goto done;
+	}
+	if (api->gp_version != GRIDEYE_PLUGIN_VERSION_V3){
+	    fprintf(stderr, "%s: Unexpected plugin version number: %d\n",
+		    filename, api->gp_version);
+	    goto done;
+	}
+	if (api->gp_magic != GRIDEYE_PLUGIN_MAGIC){
+	    fprintf(stderr, "%s: Wrong plugin magic number: %x\n",
+		    filename, api->gp_magic);
+	    goto done;
+	}
+	if (api->gp_test_fn == NULL){
+	    fprintf(stderr, "%s: No blocking test function\n", filename);
+	    goto done;
+	}
+	name = api->gp_name;
+	setopt_fn = api->gp_setopt_fn;
+	exit_fn = api->gp_exit_fn;
+    }
+    else if ((initfun = dlsym(handle, PLUGIN_INIT_FN_V2)) != NULL){
+	if ((api2 = initfun(GRIDEYE_PLUGIN_VERSION)) == NULL){
+	    fprintf(stderr, "%s: failed when running init function %s: %s\n",
+		    filename, PLUGIN_INIT_FN_V2, errno?strerror(errno):"");
+	    goto done;
+	}
+	if (api2->gp_version != GRIDEYE_PLUGIN_VERSION){
+	    fprintf(stderr, "%s: Unexpected plugin version number: %d\n",
+		    filename, api2->gp_version);
+	    goto done;
+	}
+	if (api2->gp_magic != GRIDEYE_PLUGIN_MAGIC){
+	    fprintf(stderr, "%s: Wrong plugin magic number: %x\n",
+		    filename, api2->gp_magic);
+	    goto done;
+	}
+	if (api2->gp_test_fn == NULL){
+	    fprintf(stderr, "%s: No test function\n", filename);
+	    goto done;
+	}
+	name = api2->gp_name;
+	setopt_fn = api2->gp_setopt_fn;
+	exit_fn = api2->gp_exit_fn;
+    }
+    else{
+	fprintf(stderr, "%s: No init function %s or %s\n",
+		filename, PLUGIN_INIT_FN_V3, PLUGIN_INIT_FN_V2);
+	goto done;
+    }
+    for (i=0; i<nopts; i++){
+	if (setopt_fn == NULL){
+	    fprintf(stderr, "%s: No setopt function\n", filename);
+	    goto done;
+	}
+	v = strchr(opts[i], '=');
+	*v++ = '\0';
+	if (setopt_fn(opts[i], v) < 0){
+	    fprintf(stderr, "%s: setopt %s=%s failed\n", filename, opts[i], v);
+	    goto done;
+	}
+    }
+    b.b_runs = runs;
+    /* Wall and cpu time first in the report */
+    bench_series(&b, "wall_us");
+    bench_series(&b, "cpu_us");
+    for (i=0; i<warmup+runs; i++){
+	b.b_measure = (i >= warmup);
+	str = NULL;
+	c0 = cpu_us();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (api)
+	    ret = api->gp_test_fn(param, &gw);
+	else
+	    ret = api2->gp_test_fn(param, &str);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	c1 = cpu_us();
+	if (ret < 0){
+	    if (debug)
+		fprintf(stderr, "run %d failed\n", i);
+	    if (b.b_measure)
+		failed++;
+	}
+	else{
+	    if (str)
+		bench_parse_xml(&b, str);
+	    bench_add(&b, "wall_us", ts_us(&t0, &t1));
+	    bench_add(&b, "cpu_us", c1 - c0);
+	}
+	if (str)
+	    free(str);
+    }
+    fprintf(stdout, "%s: %d runs, %d warmup, %d failed\n",
+	    name?name:filename, runs, warmup, failed);
+    bench_report(&b);
+    if (exit_fn && exit_fn() < 0)
+	fprintf(stderr, "%s: exit function failed\n", filename);
+    retval = failed ? 1 : 0;
+ done:
+    for (i=0; i<b.b_nseries; i++){
+	free(b.b_series[i].se_key);
+	free(b.b_series[i].se_val);
+    }
+    if (handle)
+	dlclose(handle);
+    return retval < 0 ? 2 : retval;
+}
@@ -0,0 +1,555 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Event loop replacing select(): file descriptors are waited for with
+ * epoll (poll on platforms without it, eg Darwin) and timers are kept in
+ * a hierarchical timer wheel with 1ms ticks, as in the classic BSD/Linux
+ * kernel timers.
+ * Level 0 has one slot per tick for the next REACTOR_SLOTS ticks, level l
+ * one slot per REACTOR_SLOTS^l ticks. When the ticks of a level wrap, the
+ * next slot of the level above is cascaded down. Adding and deleting a
+ * timer is O(1), and the cost of the loop does not depend on the number
+ * of file descriptors registered.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#include <cligen/cligen.h>
+#include <clixon/clixon.h>
+
+#include "grideye_reactor.h"
+
+/* Max events returned per epoll_wait */
+#define REACTOR_EVENTS 64
+
+/* Handlers replaced by reactor_sighandler, see reactor_signal */
+static void (*reactor_sigold[NSIG])(int);
+
+/* Set when a signal of reactor_signal is delivered */
+static volatile sig_atomic_t reactor_signalled = 0;
+
+/* A registered file descriptor, indexed by fd in reactor */
+struct reactor_fd{
+    reactor_fd_cb *rf_fn;   /* NULL if not registered */
+    void          *rf_arg;
+    char          *rf_str;  /* Name for debugging */
+};
+
+struct reactor{
+    int                    re_exit;     /* Set by reactor_exit */
+#ifdef HAVE_SYS_EPOLL_H
+    int                    re_epfd;
+#endif
+    struct reactor_fd     *re_fds;      /* Vector indexed by fd */
+    int                    re_fdlen;    /* Length of re_fds */
+    sigset_t               re_waitmask; /* Signal mask while waiting */
+    uint64_t               re_tick;     /* Next tick (ms) to process */
+    int                    re_ntimers;  /* Timers in wheel */
+    struct reactor_timer  *re_wheel[REACTOR_LEVELS][REACTOR_SLOTS];
+};
+
+/*! Monotonic time in ms, ie the tick of the timer wheel
+ */
+static uint64_t
+reactor_now(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec*1000 + tv.tv_usec/1000;
+#endif
+}
+
+/*! Create a reactor
+ * @retval  re    Reactor, free with reactor_free
+ * @retval  NULL  Error
+ */
+struct reactor *
+reactor_new(void)
+{
+    struct reactor *re;
+
+    if ((re = malloc(sizeof(*re))) == NULL){
+	clicon_err(OE_UNIX, errno, "malloc");
+	return NULL;
+    }
+    memset(re, 0, sizeof(*re));
+#ifdef HAVE_SYS_EPOLL_H
+    if ((re->re_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+	clicon_err(OE_UNIX, errno, "epoll_create1");
+	free(re);
+	return NULL;
+    }
+#endif
+    sigprocmask(SIG_SETMASK, NULL, &re->re_waitmask);
+    re->re_tick = reactor_now();
+    return re;
+}
+
+/*! Free a reactor. Registered timers are just forgotten
+ */
+int
+reactor_free(struct reactor *re)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    close(re->re_epfd);
+#endif
+    if (re->re_fds)
+	free(re->re_fds);
+    free(re);
+    return 0;
+}
+
+/*! Register a file descriptor, call fn when it is readable or has an error
+ * @param[in]  re   Reactor
+ * @param[in]  fd   File descriptor, at most one callback per fd
+ * @param[in]  fn   Callback, the loop is terminated if it returns -1
+ * @param[in]  arg  Argument to fn
+ * @param[in]  str  Name for debugging
+ */
+int
+reactor_fd_reg(struct reactor *re,
+	       int             fd,
+	       reactor_fd_cb  *fn,
+	       void           *arg,
+	       char           *str)
+{
+    int                retval = -1;
+    struct reactor_fd *rf;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev = {0,};
+#endif
+
+    if (fd >= re->re_fdlen){
+	if ((rf = realloc(re->re_fds, (fd+1)*sizeof(*rf))) == NULL){
+	    clicon_err(OE_UNIX, errno, "realloc");
+	    goto done;
+	}
+	memset(&rf[re->re_fdlen], 0, (fd+1-re->re_fdlen)*sizeof(*rf));
+	re->re_fds = rf;
+	re->re_fdlen = fd+1;
+    }
+    rf = &re->re_fds[fd];
+    if (rf->rf_fn != NULL){
+	clicon_err(OE_CFG, EEXIST, "%s: fd %d already registered",
+		   __FUNCTION__, fd);
+	goto done;
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(re->re_epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+	clicon_err(OE_UNIX, errno, "epoll_ctl");
+	goto done;
+    }
+#endif
+    rf->rf_fn = fn;
+    rf->rf_arg = arg;
+    rf->rf_str = str;
+    clicon_debug(1, "%s: %d %s", __FUNCTION__, fd, str);
+    retval = 0;
+ done:
+    return retval;
+}
+
+/*! Unregister a file descriptor. Must be done before it is closed
+ */
+int
+reactor_fd_unreg(struct reactor *re,
+		 int             fd)
+{
+    if (fd < 0 || fd >= re->re_fdlen || re->re_fds[fd].rf_fn == NULL)
+	return 0;
+#ifdef HAVE_SYS_EPOLL_H
+    if (epoll_ctl(re->re_epfd, EPOLL_CTL_DEL, fd, NULL) < 0){
+	clicon_err(OE_UNIX, errno, "epoll_ctl");
+	return -1;
+    }
+#endif
+    memset(&re->re_fds[fd], 0, sizeof(struct reactor_fd));
+    return 0;
+}
+
+/*! Record that a reactor signal was delivered and call its old handler
+ */
+static void
+reactor_sighandler(int signo)
+{
+    reactor_signalled = 1;
+    if (reactor_sigold[signo] != SIG_DFL && reactor_sigold[signo] != SIG_IGN)
+	reactor_sigold[signo](signo);
+}
+
+/*! Deliver a signal only while the reactor waits
+ * The signal is blocked while callbacks run, so that a signal arriving
+ * outside the wait is not lost but interrupts the next wait. 
+ * reactor_loop then returns -1. Interrupts of the wait by other means, eg
+ * io_uring task work, do not terminate the loop.
+ * The handler of the signal is still called, install it before this.
+ * @param[in]  re     Reactor
+ * @param[in]  signo  Signal, eg SIGTERM
+ */
+int
+reactor_signal(struct reactor *re,
+	       int             signo)
+{
+    sigset_t         set;
+    struct sigaction sa;
+    struct sigaction osa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = reactor_sighandler;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(signo, &sa, &osa) < 0){
+	clicon_err(OE_UNIX, errno, "sigaction");
+	return -1;
+    }
+    if (osa.sa_handler != reactor_sighandler)
+	reactor_sigold[signo] = osa.sa_handler;
+    sigemptyset(&set);
+    sigaddset(&set, signo);
+    if (sigprocmask(SIG_BLOCK, &set, NULL) < 0){
+	clicon_err(OE_UNIX, errno, "sigprocmask");
+	return -1;
+    }
+    sigdelset(&re->re_waitmask, signo);
+    return 0;
+}
+
+/*! Link a timer into the wheel slot given by its expire tick
+ * Timers beyond the last level are put in its last slot and re-inserted
+ * when cascaded, see reactor_tick
+ */
+static void
+wheel_insert(struct reactor       *re,
+	     struct reactor_timer *rt)
+{
+    uint64_t               expire = rt->rt_expire;
+    uint64_t               idx;
+    uint64_t               max;
+    int                    l;
+    struct reactor_timer **slot;
+
+    if (expire < re->re_tick)
+	expire = re->re_tick;
+    idx = expire - re->re_tick;
+    max = 1ULL<<(REACTOR_SLOTBITS*REACTOR_LEVELS);
+    if (idx >= max)
+	expire = re->re_tick + max - 1;
+    for (l=0; l<REACTOR_LEVELS-1; l++)
+	if (idx < 1ULL<<(REACTOR_SLOTBITS*(l+1)))
+	    break;
+    slot = &re->re_wheel[l][(expire>>(REACTOR_SLOTBITS*l)) & (REACTOR_SLOTS-1)];
+    if ((rt->rt_next = *slot) != NULL)
+	rt->rt_next->rt_prev = &rt->rt_next;
+    rt->rt_prev = slot;
+    *slot = rt;
+}
+
+static void
+wheel_unlink(struct reactor_timer *rt)
+{
+    if (rt->rt_next)
+	rt->rt_next->rt_prev = rt->rt_prev;
+    *rt->rt_prev = rt->rt_next;
+    rt->rt_next = NULL;
+    rt->rt_prev = NULL;
+}
+
+/*! Add a one-shot timer, or reschedule it if already added
+ * @param[in]  re   Reactor
+ * @param[in]  rt   Timer, owned by caller and must not be freed while pending
+ * @param[in]  ms   Milliseconds from now
+ * @param[in]  fn   Callback, the loop is terminated if it returns -1
+ * @param[in]  arg  Argument to fn
+ * @param[in]  str  Name for debugging
+ */
+int
+reactor_timer_add(struct reactor       *re,
+		  struct reactor_timer *rt,
+		  uint32_t              ms,
+		  reactor_timer_cb     *fn,
+		  void                 *arg,
+		  char                 *str)
+{
+    if (reactor_timer_pending(rt))
+	reactor_timer_del(re, rt);
+    rt->rt_expire = reactor_now() + ms;
+    rt->rt_fn = fn;
+    rt->rt_arg = arg;
+    rt->rt_str = str;
+    wheel_insert(re, rt);
+    re->re_ntimers++;
+    return 0;
+}
+
+/*! Delete a timer. It is OK to delete a timer that is not pending
+ */
+int
+reactor_timer_del(struct reactor       *re,
+		  struct reactor_timer *rt)
+{
+    if (!reactor_timer_pending(rt))
+	return 0;
+    wheel_unlink(rt);
+    re->re_ntimers--;
+    return 0;
+}
+
+/*! Return 1 if timer is added and has not yet expired
+ */
+int
+reactor_timer_pending(struct reactor_timer *rt)
+{
+    return rt->rt_prev != NULL;
+}
+
+/*! Return the first tick at or after re_tick where the wheel has work,
+ * ie a non-empty level 0 slot or a cascade of a non-empty slot above.
+ * @retval  0     No timers
+ * @retval  tick  Next tick to process
+ */
+static uint64_t
+reactor_next(struct reactor *re)
+{
+    uint64_t next = 0;
+    uint64_t t;
+    uint64_t span;
+    int      l;
+    int      i;
+
+    if (re->re_ntimers == 0)
+	return 0;
+    for (i=0; i<REACTOR_SLOTS; i++){
+	t = re->re_tick + i;
+	if (re->re_wheel[0][t & (REACTOR_SLOTS-1)] != NULL){
+	    next = t;
+	    break;
+	}
+    }
+    for (l=1; l<REACTOR_LEVELS; l++){
+	span = 1ULL<<(REACTOR_SLOTBITS*l);
+	/* First cascade of this level at or after re_tick */
+	t = (re->re_tick + span - 1) & ~(span - 1);
+	for (i=0; i<REACTOR_SLOTS; i++, t+=span){
+	    if (next && t >= next)
+		break;
+	    if (re->re_wheel[l][(t>>(REACTOR_SLOTBITS*l)) & (REACTOR_SLOTS-1)] != NULL){
+		next = t;
+		break;
+	    }
+	}
+    }
+    return next;
+}
+
+/*! Process one tick: cascade higher levels and run expired timers
+ */
+static int
+reactor_tick(struct reactor *re)
+{
+    uint64_t               tick = re->re_tick;
+    struct reactor_timer **slot;
+    struct reactor_timer  *rt;
+    int                    l;
+    int                    i;
+
+    if ((tick & (REACTOR_SLOTS-1)) == 0)
+	for (l=1; l<REACTOR_LEVELS; l++){
+	    i = (tick>>(REACTOR_SLOTBITS*l)) & (REACTOR_SLOTS-1);
+	    slot = &re->re_wheel[l][i];
+	    while ((rt = *slot) != NULL){
+		wheel_unlink(rt);
+		wheel_insert(re, rt);
+	    }
+	    if (i != 0)
+		break;
+	}
+    /* Timers added by callbacks go to later slots since re_tick is advanced */
+    re->re_tick++;
+    slot = &re->re_wheel[0][tick & (REACTOR_SLOTS-1)];
+    while ((rt = *slot) != NULL){
+	wheel_unlink(rt);
+	if (rt->rt_expire > tick){ /* Beyond last level when added */
+	    wheel_insert(re, rt);
+	    continue;
+	}
+	re->re_ntimers--;
+	clicon_debug(2, "%s: %s", __FUNCTION__, rt->rt_str);
+	if (rt->rt_fn(rt->rt_arg) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+/*! Run all timers that have expired
+ * Ticks without work are skipped, so an idle wheel costs nothing.
+ */
+static int
+reactor_timers(struct reactor *re)
+{
+    uint64_t now = reactor_now();
+    uint64_t next;
+
+    while (re->re_tick <= now){
+	if ((next = reactor_next(re)) == 0 || next > now){
+	    re->re_tick = now + 1;
+	    break;
+	}
+	re->re_tick = next;
+	if (reactor_tick(re) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+/*! Milliseconds until next timer, or -1 if there are no timers
+ */
+static int
+reactor_timeout(struct reactor *re)
+{
+    uint64_t next;
+    uint64_t now;
+
+    if ((next = reactor_next(re)) == 0)
+	return -1;
+    now = reactor_now();
+    if (next <= now)
+	return 0;
+    return (int)(next - now);
+}
+
+/*! Call the callback of a ready file descriptor, if still registered
+ */
+static int
+reactor_fd_call(struct reactor *re,
+		int             fd)
+{
+    struct reactor_fd *rf;
+
+    if (fd >= re->re_fdlen)
+	return 0;
+    rf = &re->re_fds[fd];
+    if (rf->rf_fn == NULL) /* Unregistered by an earlier callback */
+	return 0;
+    return rf->rf_fn(fd, rf->rf_arg);
+}
+
+/*! Wait for file descriptors and timers and call their callbacks
+ * @retval -1  Error, or a callback returned -1. Also if interrupted by a
+ *             signal of reactor_signal, as select() in earlier versions
+ * @retval  0  reactor_exit was called
+ */
+int
+reactor_loop(struct reactor *re)
+{
+    int                retval = -1;
+    int                n;
+    int                i;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event evs[REACTOR_EVENTS];
+#else
+    struct pollfd     *pfds = NULL;
+    int                npfds;
+    sigset_t           omask;
+    int                errno0;
+#endif
+
+    re->re_exit = 0;
+    while (!re->re_exit){
+#ifdef HAVE_SYS_EPOLL_H
+	if ((n = epoll_pwait(re->re_epfd, evs, REACTOR_EVENTS,
+			     reactor_timeout(re), &re->re_waitmask)) < 0){
+	    if (errno == EINTR && !reactor_signalled)
+		continue;
+	    clicon_err(OE_UNIX, errno, "epoll_wait");
+	    goto done;
+	}
+	for (i=0; i<n; i++)
+	    if (reactor_fd_call(re, evs[i].data.fd) < 0)
+		goto done;
+#else
+	if (pfds)
+	    free(pfds);
+	if ((pfds = calloc(re->re_fdlen+1, sizeof(*pfds))) == NULL){
+	    clicon_err(OE_UNIX, errno, "calloc");
+	    goto done;
+	}
+	npfds = 0;
+	for (i=0; i<re->re_fdlen; i++)
+	    if (re->re_fds[i].rf_fn){
+		pfds[npfds].fd = i;
+		pfds[npfds++].events = POLLIN;
+	    }
+	/* No ppoll everywhere: a signal just before poll waits for timeout */
+	sigprocmask(SIG_SETMASK, &re->re_waitmask, &omask);
+	n = poll(pfds, npfds, reactor_timeout(re));
+	errno0 = errno;
+	sigprocmask(SIG_SETMASK, &omask, NULL);
+	if (n < 0){
+	    if (errno0 == EINTR && !reactor_signalled)
+		continue;
+	    clicon_err(OE_UNIX, errno0, "poll");
+	    goto done;
+	}
+	for (i=0; n && i<npfds; i++)
+	    if (pfds[i].revents && reactor_fd_call(re, pfds[i].fd) < 0)
+		goto done;
+#endif
+	if (reactor_timers(re) < 0)
+	    goto done;
+    }
+    retval = 0;
+ done:
+#ifndef HAVE_SYS_EPOLL_H
+    if (pfds)
+	free(pfds);
+#endif
+    return retval;
+}
+
+/*! Make reactor_loop return 0 after the current callback
+ */
+int
+reactor_exit(struct reactor *re)
+{
+    re->re_exit = 1;
+    return 0;
+}
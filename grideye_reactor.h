@@ -0,0 +1,75 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Event loop: file descriptor handlers (epoll, or poll where epoll is
+ * missing) and one-shot timers in a hierarchical timer wheel.
+ */
+#ifndef _GRIDEYE_REACTOR_H_
+#define _GRIDEYE_REACTOR_H_
+
+/*
+ * Constants
+ */
+/* Timer wheel: REACTOR_LEVELS levels of 2^REACTOR_SLOTBITS slots, 1ms ticks.
+ * Timers further away than 2^(REACTOR_LEVELS*REACTOR_SLOTBITS) ms (4.6h)
+ * are cascaded again when they reach the last level.
+ */
+#define REACTOR_SLOTBITS 6
+#define REACTOR_SLOTS    (1<<REACTOR_SLOTBITS)
+#define REACTOR_LEVELS   4
+
+/*
+ * Types
+ */
+struct reactor;
+
+typedef int (reactor_fd_cb)(int fd, void *arg);
+typedef int (reactor_timer_cb)(void *arg);
+
+/* A one-shot timer. Owned by the caller, typically embedded in its state,
+ * so that timers are added and deleted in O(1) without allocation.
+ * Add it again from its callback to make it periodic.
+ */
+struct reactor_timer{
+    struct reactor_timer  *rt_next;    /* Slot list */
+    struct reactor_timer **rt_prev;    /* Pointer to this in slot list */
+    uint64_t               rt_expire;  /* Absolute tick (ms) */
+    reactor_timer_cb      *rt_fn;
+    void                  *rt_arg;
+    char                  *rt_str;     /* Name for debugging */
+};
+
+/*
+ * Prototypes
+ */
+struct reactor *reactor_new(void);
+int  reactor_free(struct reactor *re);
+int  reactor_fd_reg(struct reactor *re, int fd, reactor_fd_cb *fn, void *arg, char *str);
+int  reactor_fd_unreg(struct reactor *re, int fd);
+int  reactor_timer_add(struct reactor *re, struct reactor_timer *rt, uint32_t ms,
+		       reactor_timer_cb *fn, void *arg, char *str);
+int  reactor_timer_del(struct reactor *re, struct reactor_timer *rt);
+int  reactor_timer_pending(struct reactor_timer *rt);
+int  reactor_signal(struct reactor *re, int signo);
+int  reactor_loop(struct reactor *re);
+int  reactor_exit(struct reactor *re);
+
+#endif /* _GRIDEYE_REACTOR_H_ */
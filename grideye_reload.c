@@ -0,0 +1,220 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Plugin reload, see grideye_reload.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include <cligen/cligen.h>     /* cbuf */
+#include <clixon/clixon.h>     /* log, err */
+
+#include "grideye_agent.h"     /* lib */
+#include "grideye_reactor.h"   /* lib: event loop */
+#include "grideye_arena.h"     /* lib: per-packet memory */
+#include "grideye_plugin_v3.h" /* plugin C API with writer */
+#include "grideye_agent_int.h"
+#include "grideye_sample.h"    /* sample_move */
+#include "grideye_reload.h"
+
+#ifdef PLUGIN_RELOAD
+/*
+ * Constants
+ */
+/* Changes in the plugin directory are loaded this many ms after the last
+ * one, so that a plugin is not loaded while it is being written */
+#define PLUGIN_RELOAD_MS   200
+
+/* How often replaced plugins are checked for being unused, see
+ * plugin_retire */
+#define PLUGIN_RETIRE_MS   100
+
+/*
+ * Variables
+ */
+static struct reactor      *reload_re = NULL; /* Of main thread */
+static int                (*reload_fn)(void *arg) = NULL;
+static void                *reload_arg = NULL;
+static struct reactor_timer plugin_reload_timer = {0,};
+static struct reactor_timer plugin_retire_timer = {0,};
+
+/*! Find the plugin of a generation with a given handle
+ */
+static struct plugin *
+plugin_handle_find(struct plugin *plugins,
+		   void          *handle)
+{
+    struct plugin *p;
+
+    for (p = plugins; p->p_api!=NULL; p++)
+	if (p->p_handle == handle)
+	    return p;
+    return NULL;
+}
+
+/*! Retire timer: free replaced generations of plugins no longer in use
+ * Exit functions of the plugins are called from here, not from a test.
+ * @param[in]  arg   Reactor
+ */
+static int
+plugin_retire(void *arg)
+{
+    struct reactor     *re = (struct reactor *)arg;
+    struct plugin_gen **pgp = &plugin_retired;
+    struct plugin_gen  *pg;
+
+    while ((pg = *pgp) != NULL){
+	/* Readers take references before they leave, so check them first */
+	if (!plugin_in_use(pg->pg_gen) && 
+	    __sync_add_and_fetch(&pg->pg_refs, 0) == 0){
+	    *pgp = pg->pg_next;
+	    clicon_log(LOG_DEBUG, "%s: plugins of generation %u freed", 
+		       __FUNCTION__, pg->pg_gen);
+	    plugin_gen_free(pg, 1);
+	}
+	else
+	    pgp = &pg->pg_next;
+    }
+    if (plugin_retired)
+	return reactor_timer_add(re, &plugin_retire_timer, PLUGIN_RETIRE_MS,
+				 plugin_retire, re, "plugin retire");
+    return 0;
+}
+
+/*! Reload timer: load the plugins that changed and publish a new generation
+ * Packets from then on use the new generation, while tests in flight
+ * finish with the plugins of the one they started with. The plugin list is
+ * re-advertised, see plugin_watch.
+ * @param[in]  arg   NULL
+ */
+static int
+plugin_reload(void *arg)
+{
+    struct plugin_gen *old = plugin_cur;
+    struct plugin_gen *pg = NULL;
+    struct plugin     *plugins = NULL;
+    struct plugin     *p;
+    struct plugin     *q;
+    int                changed;
+
+    if ((plugins = calloc(1, sizeof(struct plugin))) == NULL){
+	clicon_err(OE_UNIX, errno, "calloc");
+	return -1;
+    }
+    if (plugin_load_dir(plugin_dir, old->pg_plugins, &plugins) < 0 ||
+	(pg = calloc(1, sizeof(*pg))) == NULL){
+	clicon_log(LOG_WARNING, "%s: plugins in %s not reloaded", 
+		   __FUNCTION__, plugin_dir);
+	for (p = plugins; p->p_api!=NULL; p++)
+	    if (plugin_handle_find(old->pg_plugins, p->p_handle) == NULL)
+		plugin_free(p, 1);
+	free(plugins);
+	return 0;
+    }
+    changed = plugins_len(plugins) != plugins_len(old->pg_plugins);
+    for (p = plugins; p->p_api!=NULL; p++)
+	if (plugin_handle_find(old->pg_plugins, p->p_handle) == NULL)
+	    changed++;
+    if (!changed){ /* All entries are copies */
+	free(plugins);
+	free(pg);
+	return 0;
+    }
+    for (p = plugins; p->p_api!=NULL; p++)
+	if ((q = plugin_handle_find(old->pg_plugins, p->p_handle)) != NULL)
+	    q->p_kept = 1;
+    sample_move(old->pg_plugins, plugins);
+    pg->pg_plugins = plugins;
+    pg->pg_gen = old->pg_gen + 1;
+    __sync_synchronize(); /* Readers see pg complete */
+    plugin_cur = pg;
+    old->pg_next = plugin_retired;
+    plugin_retired = old;
+    clicon_log(LOG_NOTICE, "%s: %d plugins loaded from %s, generation %u",
+	       __FUNCTION__, plugins_len(plugins), plugin_dir, pg->pg_gen);
+    if (reactor_timer_add(reload_re, &plugin_retire_timer, PLUGIN_RETIRE_MS,
+			  plugin_retire, reload_re, "plugin retire") < 0)
+	return -1;
+    return reload_fn(reload_arg);
+}
+
+/*! The plugin directory changed: reload when it has been quiet for a while
+ * A plugin is usually written in several steps, or several are installed.
+ * @param[in]  fd    Inotify socket
+ * @param[in]  arg   NULL
+ */
+static int
+plugin_watch_cb(int   fd,
+		void *arg)
+{
+    char buf[4096] 
+	__attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+	;
+    return reactor_timer_add(reload_re, &plugin_reload_timer, 
+			     PLUGIN_RELOAD_MS, plugin_reload, NULL, 
+			     "plugin reload");
+}
+
+/*! Watch the plugin directory for changed plugins
+ * Called once, in the main thread, whose event loop then reloads them.
+ * @param[in]  re        Event loop of main thread
+ * @param[in]  reloaded  Called when a new generation is published, eg to
+ *                       re-advertise the plugins
+ * @param[in]  arg       Argument of reloaded
+ */
+int
+plugin_watch(struct reactor *re,
+	     int           (*reloaded)(void *arg),
+	     void           *arg)
+{
+    int fd;
+
+    reload_re = re;
+    reload_fn = reloaded;
+    reload_arg = arg;
+    if ((fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0){
+	clicon_err(OE_UNIX, errno, "inotify_init1");
+	return -1;
+    }
+    if (inotify_add_watch(fd, plugin_dir, IN_CLOSE_WRITE|IN_MOVED_TO|
+			  IN_MOVED_FROM|IN_CREATE|IN_DELETE) < 0){
+	clicon_log(LOG_WARNING, "%s: %s: %s, plugins are not reloaded", 
+		   __FUNCTION__, plugin_dir, strerror(errno));
+	close(fd);
+	return 0;
+    }
+    return reactor_fd_reg(re, fd, plugin_watch_cb, NULL, 
+			  "plugin watch");
+}
+#endif /* PLUGIN_RELOAD */
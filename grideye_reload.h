@@ -0,0 +1,36 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Plugin reload: the plugin directory is watched, and changed plugins are
+ * loaded into a new generation while tests in flight finish with the
+ * plugins they started with. Not if plugins are linked into the agent.
+ */
+#ifndef _GRIDEYE_RELOAD_H_
+#define _GRIDEYE_RELOAD_H_
+
+/*
+ * Prototypes
+ */
+#ifdef PLUGIN_RELOAD
+int    plugin_watch(struct reactor *re, int (*reloaded)(void *arg), void *arg);
+#endif
+
+#endif /* _GRIDEYE_RELOAD_H_ */
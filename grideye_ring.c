@@ -0,0 +1,476 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * A ring is mapped shared, anonymous or from a file descriptor that is
+ * passed to another process, see ring_new and ring_map. Messages are
+ * records of a length header and the message, aligned to RING_ALIGN,
+ * written at the head by the producer and released at the tail by the
+ * consumer. Head and tail are byte counters that only grow, each written
+ * by one side only, so no lock is needed. A message that does not fit
+ * before the end of the ring is preceded by a wrap record and written at
+ * the start, so that a message is always one contiguous buffer and is read
+ * in place.
+ * The ring does not wait, the side that is empty or full waits for a
+ * ring_wake from the other.
+ */
+#ifdef HAVE_MEMFD_CREATE
+#define _GNU_SOURCE /* memfd_create */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include <cligen/cligen.h>
+#include <clixon/clixon.h>
+
+#include "grideye_ring.h"
+
+/* Records are aligned to this */
+#define RING_ALIGN      8
+#define RING_ROUND(n)   (((n)+RING_ALIGN-1) & ~(uint64_t)(RING_ALIGN-1))
+
+/* rr_len of a wrap record: the next record is at the start */
+#define RING_WRAP       0xffffffff
+
+#ifndef MAP_ANONYMOUS /* Darwin */
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* Header of a record, the message follows */
+struct ring_rec{
+    uint32_t rr_len;
+    uint32_t rr_pad;
+};
+
+/* Producer and consumer counters are on their own cache lines */
+struct ring{
+    volatile uint64_t rg_head;      /* Written by producer */
+    char              rg_pad0[56];
+    volatile uint64_t rg_tail;      /* Written by consumer */
+    char              rg_pad1[56];
+    uint64_t          rg_size;      /* Of rg_data, a power of 2 */
+    uint64_t          rg_mapped;    /* Length of mapping */
+    char              rg_pad2[48];
+    char              rg_data[];
+};
+
+/*! Open an unnamed file of shared memory, for ring_new
+ * A memfd, or an unlinked temporary file where memfd_create is missing.
+ * @retval  fd  Close on exec, pass it on with dup2
+ * @retval -1   Error
+ */
+static int
+ring_file(void)
+{
+    int  fd;
+#ifdef HAVE_MEMFD_CREATE
+
+    if ((fd = memfd_create("grideye_ring", MFD_CLOEXEC)) < 0){
+	clicon_err(OE_UNIX, errno, "memfd_create");
+	return -1;
+    }
+#else
+    char path[] = "/tmp/grideye_ringXXXXXX";
+
+    if ((fd = mkstemp(path)) < 0){
+	clicon_err(OE_UNIX, errno, "mkstemp");
+	return -1;
+    }
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    return fd;
+}
+
+/*! Create a ring in shared memory
+ * @param[in]  size  Bytes of messages, rounded up to a power of 2
+ * @param[out] fd    Descriptor of the ring for ring_map, close on exec.
+ *                   If NULL, the ring is only shared with forked processes
+ * @retval     rg    Ring, shared with processes forked after this
+ * @retval     NULL  Error
+ */
+struct ring *
+ring_new(size_t size,
+	 int   *fd)
+{
+    struct ring *rg;
+    uint64_t     n = 4096;
+    size_t       len;
+    int          rfd = -1;
+
+    while (n < size)
+	n *= 2;
+    len = sizeof(*rg) + n;
+    if (fd){
+	if ((rfd = ring_file()) < 0)
+	    return NULL;
+	if (ftruncate(rfd, len) < 0){
+	    clicon_err(OE_UNIX, errno, "ftruncate");
+	    close(rfd);
+	    return NULL;
+	}
+    }
+    if ((rg = mmap(NULL, len, PROT_READ|PROT_WRITE, 
+		   fd ? MAP_SHARED : MAP_SHARED|MAP_ANONYMOUS,
+		   rfd, 0)) == MAP_FAILED){
+	clicon_err(OE_UNIX, errno, "mmap");
+	if (rfd != -1)
+	    close(rfd);
+	return NULL;
+    }
+    memset(rg, 0, sizeof(*rg));
+    rg->rg_size = n;
+    rg->rg_mapped = len;
+    if (fd)
+	*fd = rfd;
+    return rg;
+}
+
+/*! Map a ring created by ring_new in another process
+ * @param[in]  fd    Descriptor of ring_new, may be closed after this
+ * @retval     rg    Ring, free with ring_free
+ * @retval     NULL  Error
+ */
+struct ring *
+ring_map(int fd)
+{
+    struct ring *rg;
+    struct stat  st;
+
+    if (fstat(fd, &st) < 0){
+	clicon_err(OE_UNIX, errno, "fstat");
+	return NULL;
+    }
+    if (st.st_size <= sizeof(*rg)){
+	clicon_err(OE_UNIX, EINVAL, "%s: not a ring", __FUNCTION__);
+	return NULL;
+    }
+    if ((rg = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED,
+		   fd, 0)) == MAP_FAILED){
+	clicon_err(OE_UNIX, errno, "mmap");
+	return NULL;
+    }
+    if (rg->rg_mapped != st.st_size){
+	clicon_err(OE_UNIX, EINVAL, "%s: not a ring", __FUNCTION__);
+	munmap(rg, st.st_size);
+	return NULL;
+    }
+    return rg;
+}
+
+/*! Unmap a ring, in this process
+ */
+int
+ring_free(struct ring *rg)
+{
+    return munmap(rg, rg->rg_mapped);
+}
+
+/*! Max length of a message
+ */
+size_t
+ring_max(struct ring *rg)
+{
+    return rg->rg_size/2 - sizeof(struct ring_rec);
+}
+
+/*! Empty a ring, when neither side uses it, eg the other has died
+ */
+int
+ring_reset(struct ring *rg)
+{
+    rg->rg_head = 0;
+    rg->rg_tail = 0;
+    __sync_synchronize();
+    return 0;
+}
+
+/*! Put a message, gathered from an iovec, at the head of a ring
+ * @param[in]  rg      Ring
+ * @param[in]  iov     Parts of message
+ * @param[in]  iovcnt  Number of parts
+ * @retval  1  OK
+ * @retval  0  Full, try again when the consumer has released messages
+ * @retval -1  Message longer than ring_max
+ */
+int
+ring_put(struct ring        *rg,
+	 const struct iovec *iov,
+	 int                 iovcnt)
+{
+    uint64_t         head = rg->rg_head;
+    uint64_t         off = head & (rg->rg_size-1);
+    uint64_t         need;
+    uint64_t         skip = 0;
+    size_t           len = 0;
+    struct ring_rec *rr;
+    char            *d;
+    int              i;
+
+    for (i=0; i<iovcnt; i++)
+	len += iov[i].iov_len;
+    if (len > ring_max(rg)){
+	clicon_err(OE_UNIX, EMSGSIZE, "%s: message of %zu bytes",
+		   __FUNCTION__, len);
+	return -1;
+    }
+    need = sizeof(*rr) + RING_ROUND(len);
+    if (need > rg->rg_size - off) /* Wrap to start */
+	skip = rg->rg_size - off;
+    if (rg->rg_size - (head - rg->rg_tail) < skip + need)
+	return 0;
+    __sync_synchronize(); /* Consumer is done with what it released */
+    if (skip){
+	rr = (struct ring_rec *)(rg->rg_data + off);
+	rr->rr_len = RING_WRAP;
+	off = 0;
+    }
+    rr = (struct ring_rec *)(rg->rg_data + off);
+    rr->rr_len = len;
+    d = (char *)(rr + 1);
+    for (i=0; i<iovcnt; i++){
+	memcpy(d, iov[i].iov_base, iov[i].iov_len);
+	d += iov[i].iov_len;
+    }
+    __sync_synchronize(); /* Message is written before it is published */
+    rg->rg_head = head + skip + need;
+    return 1;
+}
+
+/*! Get the message at the tail of a ring, in place
+ * The message is valid until ring_release.
+ * @param[in]  rg    Ring
+ * @param[out] data  Message in the ring
+ * @param[out] len   Length of message
+ * @retval  1  OK
+ * @retval  0  Empty
+ */
+int
+ring_get(struct ring *rg,
+	 char       **data,
+	 size_t      *len)
+{
+    uint64_t         tail = rg->rg_tail;
+    struct ring_rec *rr;
+
+    if (tail == rg->rg_head)
+	return 0;
+    __sync_synchronize(); /* Read the message after the head */
+    rr = (struct ring_rec *)(rg->rg_data + (tail & (rg->rg_size-1)));
+    if (rr->rr_len == RING_WRAP){
+	tail += rg->rg_size - (tail & (rg->rg_size-1));
+	rg->rg_tail = tail;
+	rr = (struct ring_rec *)rg->rg_data;
+    }
+    *data = (char *)(rr + 1);
+    *len = rr->rr_len;
+    return 1;
+}
+
+/*! Release the message of ring_get, for the producer to reuse
+ */
+int
+ring_release(struct ring *rg)
+{
+    uint64_t         tail = rg->rg_tail;
+    struct ring_rec *rr;
+
+    rr = (struct ring_rec *)(rg->rg_data + (tail & (rg->rg_size-1)));
+    __sync_synchronize(); /* Done with the message before it is reused */
+    rg->rg_tail = tail + sizeof(*rr) + RING_ROUND(rr->rr_len);
+    return 0;
+}
+
+/*! Open a wakeup, before fork. Close on exec
+ * Poll rw_fd[0] for it, then ring_wake_clear.
+ */
+int
+ring_wake_open(struct ring_wake *rw)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    if ((rw->rw_fd[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0){
+	clicon_err(OE_UNIX, errno, "eventfd");
+	return -1;
+    }
+    rw->rw_fd[1] = rw->rw_fd[0];
+#else
+    int i;
+
+    if (pipe(rw->rw_fd) < 0){
+	clicon_err(OE_UNIX, errno, "pipe");
+	return -1;
+    }
+    for (i=0; i<2; i++)
+	if (fcntl(rw->rw_fd[i], F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(rw->rw_fd[i], F_SETFD, FD_CLOEXEC) < 0){
+	    clicon_err(OE_UNIX, errno, "fcntl");
+	    return -1;
+	}
+#endif
+    return 0;
+}
+
+/*! Close a wakeup
+ */
+int
+ring_wake_close(struct ring_wake *rw)
+{
+    if (rw->rw_fd[0] != -1)
+	close(rw->rw_fd[0]);
+    if (rw->rw_fd[1] != rw->rw_fd[0] && rw->rw_fd[1] != -1)
+	close(rw->rw_fd[1]);
+    rw->rw_fd[0] = rw->rw_fd[1] = -1;
+    return 0;
+}
+
+/*! Wake the other side, after ring_put or ring_release
+ */
+int
+ring_wake_signal(struct ring_wake *rw)
+{
+    uint64_t one = 1;
+
+    /* Full is ok, the other side has not yet cleared earlier wakeups */
+    if (write(rw->rw_fd[1], &one, sizeof(one)) < 0 && errno != EAGAIN){
+	clicon_err(OE_UNIX, errno, "write");
+	return -1;
+    }
+    return 0;
+}
+
+/*! Clear wakeups, before looking in the ring so that none is lost
+ */
+int
+ring_wake_clear(struct ring_wake *rw)
+{
+    uint64_t buf[8];
+
+    while (read(rw->rw_fd[0], buf, sizeof(buf)) > 0)
+	;
+    return 0;
+}
+
+#ifndef _NOMAIN
+/* Unit test: ping-pong messages with a forked process, and time them.
+ * The request ring is mapped by descriptor, as by an exec'd process
+ * compile: gcc -I. -DHAVE_SYS_EVENTFD_H grideye_ring.c -lclixon -lcligen \
+ *            -o ring_test
+ */
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define RING_TEST_N 100000
+
+static int
+ring_test_wait(struct ring_wake *rw)
+{
+    struct pollfd pfd = {rw->rw_fd[0], POLLIN, 0};
+
+    if (poll(&pfd, 1, 1000) != 1)
+	return -1;
+    return ring_wake_clear(rw);
+}
+
+int main()
+{
+    struct ring      *req;
+    struct ring      *resp;
+    struct ring_wake  w[2];
+    struct iovec      iov[2];
+    char              buf[3000];
+    char             *data;
+    size_t            len;
+    int               pid;
+    int               i;
+    int               status;
+    struct timeval    t0;
+    struct timeval    t1;
+    int               fd;
+
+    if ((req = ring_new(4096, &fd)) == NULL || 
+	(resp = ring_new(4096, NULL)) == NULL ||
+	ring_wake_open(&w[0]) < 0 || ring_wake_open(&w[1]) < 0)
+	return -1;
+    if ((pid = fork()) == 0){ /* Echo messages back */
+	ring_free(req);
+	if ((req = ring_map(fd)) == NULL)
+	    exit(1);
+	for (i=0; i<RING_TEST_N; i++){
+	    while (ring_get(req, &data, &len) == 0)
+		if (ring_test_wait(&w[0]) < 0)
+		    exit(1);
+	    iov[0].iov_base = data;
+	    iov[0].iov_len = len;
+	    if (ring_put(resp, iov, 1) != 1)
+		exit(1);
+	    ring_release(req);
+	    ring_wake_signal(&w[1]);
+	}
+	exit(0);
+    }
+    memset(buf, 'x', sizeof(buf));
+    gettimeofday(&t0, NULL);
+    for (i=0; i<RING_TEST_N; i++){
+	/* Sizes that wrap at different offsets */
+	iov[0].iov_base = &i;
+	iov[0].iov_len = sizeof(i);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = (i*37) % 1500;
+	if (ring_put(req, iov, 2) != 1)
+	    return -1;
+	ring_wake_signal(&w[0]);
+	while (ring_get(resp, &data, &len) == 0)
+	    if (ring_test_wait(&w[1]) < 0)
+		return -1;
+	if (len != sizeof(i)+(i*37)%1500 || memcmp(data, &i, sizeof(i)) ||
+	    memcmp(data+sizeof(i), buf, len-sizeof(i)))
+	    return -1;
+	ring_release(resp);
+    }
+    gettimeofday(&t1, NULL);
+    timersub(&t1, &t0, &t1);
+    iov[0].iov_len = ring_max(req)+1; /* Too large, not read */
+    if (ring_put(req, iov, 1) != -1)
+	return -1;
+    if (waitpid(pid, &status, 0) < 0 || status != 0)
+	return -1;
+    fprintf(stdout, "round trip: %.2f us\n",
+	    (t1.tv_sec*1e6 + t1.tv_usec) / RING_TEST_N);
+    ring_free(req);
+    ring_free(resp);
+    close(fd);
+    ring_wake_close(&w[0]);
+    ring_wake_close(&w[1]);
+    return 0;
+}
+#endif
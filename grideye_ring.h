@@ -0,0 +1,55 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Single producer single consumer message ring in shared memory, and
+ * wakeups with eventfd (a pipe where eventfd is missing), for passing
+ * messages to and from a forked or exec'd process.
+ */
+#ifndef _GRIDEYE_RING_H_
+#define _GRIDEYE_RING_H_
+
+/*
+ * Types
+ */
+struct ring;
+
+/* Wakeup of the other side, see ring_wake_open */
+struct ring_wake{
+    int rw_fd[2];   /* Read and write end, the same eventfd */
+};
+
+/*
+ * Prototypes
+ */
+struct ring *ring_new(size_t size, int *fd);
+struct ring *ring_map(int fd);
+int    ring_free(struct ring *rg);
+size_t ring_max(struct ring *rg);
+int    ring_reset(struct ring *rg);
+int    ring_put(struct ring *rg, const struct iovec *iov, int iovcnt);
+int    ring_get(struct ring *rg, char **data, size_t *len);
+int    ring_release(struct ring *rg);
+int    ring_wake_open(struct ring_wake *rw);
+int    ring_wake_close(struct ring_wake *rw);
+int    ring_wake_signal(struct ring_wake *rw);
+int    ring_wake_clear(struct ring_wake *rw);
+
+#endif /* _GRIDEYE_RING_H_ */
@@ -0,0 +1,729 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Background sampler: plugin tests that senders ask to run periodically in
+ * a thread of their own, see sample_config. Data packets get the latest
+ * sample instead of running the test, see sample_get.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include <cligen/cligen.h>     /* cbuf */
+#include <clixon/clixon.h>     /* log, err, xml */
+
+#include "grideye_agent.h"     /* lib */
+#include "grideye_reactor.h"   /* lib: event loop */
+#include "grideye_arena.h"     /* lib: per-packet memory */
+#include "grideye_plugin_v3.h" /* plugin C API with writer */
+#include "grideye_agent_int.h"
+#include "grideye_worker.h"    /* FANOUT_EXIT_MS */
+#include "grideye_isolate.h"   /* sample_run with -O */
+#include "grideye_sample.h"
+
+/*
+ * Constants
+ */
+/* A background sample older than this many intervals is not used */
+#define SAMPLE_STALE      3
+
+/* Times a reader copies a sample that the sampler writes meanwhile */
+#define SAMPLE_TRIES      4
+
+/*
+ * Types
+ */
+/* A buffer of recorded results of a sample, see sample_replay */
+struct sample_buf{
+    struct sample_buf *sb_next;    /* Outgrown buffers of the sample */
+    size_t             sb_size;
+    char               sb_data[];
+};
+
+/* A plugin test run in the background by the sampler thread, every
+ * sa_interval ms plus up to sa_jitter ms, as senders ask in their callhome
+ * reply, see sample_config. A data packet requesting the same plugin and
+ * param gets the latest result without running the test, see sample_get.
+ * The latest result is a seqlock: sa_seq is odd while the sampler writes
+ * it, and a reader that sees sa_seq change during its copy retries. An
+ * outgrown buffer is kept until exit, since a reader may still copy it.
+ */
+struct sample{
+    struct sample       *sa_next;     /* p_samples of plugin */
+    struct sample       *sa_qnext;    /* Handoff to sampler, see sample_q */
+    int                  sa_queued;
+    struct plugin       *sa_plugin;
+    char                *sa_param;    /* Param, or NULL */
+    uint64_t             sa_key;      /* Hash of param, see plan_call */
+    char                *sa_agekey;   /* Key of age, <name>_age */
+    volatile int         sa_interval; /* ms, 0: stopped */
+    volatile int         sa_jitter;   /* ms */
+    struct reactor_timer sa_timer;
+    volatile unsigned    sa_seq;      /* 0: no sample yet */
+    struct sample_buf   *sa_buf;
+    size_t               sa_len;
+    struct timeval       sa_time;     /* Sample time */
+};
+
+/*
+ * Variables
+ */
+/* Background sampler thread, started by the first sample_config */
+static pthread_t        sampler;
+static struct reactor  *sample_re = NULL;
+static int              sample_pipe[2] = {-1, -1}; /* Wakeup of sampler */
+static struct sample   *sample_q = NULL;   /* Samples to (re)start */
+static pthread_mutex_t  sample_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile int     sample_exit = 0;   /* Set by sample_stop */
+static volatile int     sample_done = 0;   /* Set when sampler has exited */
+static struct sample_buf *sample_rec = NULL; /* Recorded by sampler */
+static size_t           sample_reclen = 0;
+static struct sample   *sample_orphans = NULL; /* Of removed plugins */
+
+/*! Record a result field of a background test in sample_rec
+ * A record is a type ('u', 'd' or 's'), fraction digits, the key and then
+ * the value: 8 bytes for 'u' and 'd', a string for 's'. Strings are nul
+ * terminated. Called in the sampler thread.
+ */
+static int
+sample_record(int         type,
+	      int         fd,
+	      const char *key,
+	      int64_t     val,
+	      const char *str)
+{
+    size_t             klen = strlen(key)+1;
+    size_t             vlen = type == 's' ? strlen(str)+1 : sizeof(val);
+    size_t             len = sample_reclen + 2 + klen + vlen;
+    size_t             size;
+    struct sample_buf *sb;
+    char              *d;
+
+    if (sample_rec == NULL || len > sample_rec->sb_size){
+	size = sample_rec ? sample_rec->sb_size : 256;
+	while (size < len)
+	    size *= 2;
+	if ((sb = realloc(sample_rec, sizeof(*sb)+size)) == NULL){
+	    clicon_err(OE_UNIX, errno, "realloc");
+	    return -1;
+	}
+	sb->sb_next = NULL;
+	sb->sb_size = size;
+	sample_rec = sb;
+    }
+    d = sample_rec->sb_data + sample_reclen;
+    *d++ = type;
+    *d++ = fd;
+    memcpy(d, key, klen);
+    d += klen;
+    if (type == 's')
+	memcpy(d, str, vlen);
+    else
+	memcpy(d, &val, vlen);
+    sample_reclen = len;
+    return 0;
+}
+
+static int
+sample_write_u64(struct grideye_writer *gw,
+		 const char            *key,
+		 uint64_t               val)
+{
+    return sample_record('u', 0, key, (int64_t)val, NULL);
+}
+
+static int
+sample_write_dec(struct grideye_writer *gw,
+		 const char            *key,
+		 int64_t                val,
+		 int                    fd)
+{
+    return sample_record('d', fd, key, val, NULL);
+}
+
+static int
+sample_write_str(struct grideye_writer *gw,
+		 const char            *key,
+		 const char            *val)
+{
+    return sample_record('s', 0, key, 0, val);
+}
+
+/*! Write recorded result fields into a reply, see sample_record
+ * @param[in]  rw    Writer of reply
+ * @param[in]  data  Records, a copy of a sample
+ * @param[in]  len   Length of data
+ */
+static int
+sample_replay(struct result_writer *rw,
+	      const char           *data,
+	      size_t                len)
+{
+    struct grideye_writer *gw = &rw->rw_gw;
+    const char            *end = data + len;
+    const char            *key;
+    int                    type;
+    int                    fd;
+    int64_t                val;
+
+    while (data < end){
+	type = *data++;
+	fd = *data++;
+	key = data;
+	data += strlen(key)+1;
+	if (type == 's'){
+	    if (gw->gw_str(gw, key, data) < 0)
+		return -1;
+	    data += strlen(data)+1;
+	    continue;
+	}
+	memcpy(&val, data, sizeof(val));
+	data += sizeof(val);
+	if ((type == 'u' ? gw->gw_u64(gw, key, (uint64_t)val) :
+	     gw->gw_dec(gw, key, val, fd)) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+/*! Run a test of a plugin, recording its result fields
+ * Called in the sampler thread, or in a worker process with -O.
+ * @param[in]  p      Plugin
+ * @param[in]  param  Param of test, or NULL
+ * @param[out] data   Fields recorded as by sample_record, valid until the
+ *                    next test
+ * @param[out] len    Length of data
+ * @retval  1  OK
+ * @retval  0  Test failed
+ */
+int
+sample_test(struct plugin *p,
+	    char          *param,
+	    char         **data,
+	    size_t        *len)
+{
+    struct grideye_writer gw = {sample_write_u64, sample_write_dec, 
+				sample_write_str, NULL};
+    int                   ret;
+
+    sample_reclen = 0;
+    if ((ret = p->p_api->gp_test_fn(param, &gw)) < 0){
+	clicon_log(LOG_NOTICE, "plugin %s failed: retval:%d", p->p_name, ret);
+	return 0;
+    }
+    *data = sample_rec ? sample_rec->sb_data : NULL;
+    *len = sample_reclen;
+    return 1;
+}
+
+/*! Make recorded fields the latest sample of a background test
+ * Called in the sampler thread, the only writer of samples.
+ * @param[in]  sa    Sample
+ * @param[in]  data  Fields recorded as by sample_record
+ * @param[in]  len   Length of data
+ * @param[in]  t     Sample time
+ */
+static int
+sample_publish(struct sample  *sa,
+	       const char     *data,
+	       size_t          len,
+	       struct timeval  t)
+{
+    struct sample_buf *sb = NULL;
+    size_t             size;
+
+    if (sa->sa_buf == NULL || len > sa->sa_buf->sb_size){
+	size = len ? len : 1;
+	if ((sb = malloc(sizeof(*sb)+size)) == NULL){
+	    clicon_err(OE_UNIX, errno, "malloc");
+	    return -1;
+	}
+	sb->sb_next = sa->sa_buf; /* Outgrown, freed on exit */
+	sb->sb_size = size;
+    }
+    sa->sa_seq++;
+    __sync_synchronize();
+    if (sb)
+	sa->sa_buf = sb;
+    if (len)
+	memcpy(sa->sa_buf->sb_data, data, len);
+    sa->sa_len = len;
+    sa->sa_time = t;
+    __sync_synchronize();
+    sa->sa_seq++;
+    return 0;
+}
+
+/*! Run a background test and make its result the latest sample
+ * The test runs in the worker process of the sampler with -O.
+ * @retval  0  OK, or test failed and the previous sample is kept
+ * @retval -1  Fatal error
+ */
+static int
+sample_run(struct sample *sa)
+{
+    struct plugin  *p = sa->sa_plugin;
+    struct timeval  t;
+    char           *data;
+    size_t          len;
+    int             ret;
+
+    t = gettimestamp();
+    if (isolate_on){
+	if ((ret = isolate_call(p, sa->sa_param, sa->sa_key, ISOLATE_RECORD,
+				&data, &len)) != 1)
+	    return ret;
+	ret = sample_publish(sa, data, len, t);
+	isolate_release();
+	return ret;
+    }
+    if (sample_test(p, sa->sa_param, &data, &len) == 0)
+	return 0;
+    return sample_publish(sa, data, len, t);
+}
+
+static int sample_timer_cb(void *arg);
+
+/*! Arm the timer of a sample
+ * @param[in]  sa     Sample
+ * @param[in]  first  First run, wait only for the jitter
+ */
+static int
+sample_arm(struct sample *sa,
+	   int            first)
+{
+    int ms = first ? 0 : sa->sa_interval;
+
+    if (sa->sa_jitter > 0)
+	ms += random() % (sa->sa_jitter+1);
+    return reactor_timer_add(sample_re, &sa->sa_timer, ms, 
+			     sample_timer_cb, sa, "sample");
+}
+
+/*! Timer of a sample: run its test, then arm it again unless stopped
+ * A plugin reload moves the sample to the new plugin, or stops it.
+ */
+static int
+sample_timer_cb(void *arg)
+{
+    struct sample *sa = (struct sample *)arg;
+    int            ret;
+
+    if (sa->sa_interval == 0 || sample_exit)
+	return 0;
+    if (plugin_enter() == NULL)
+	return -1;
+    /* Stopped or moved before the generation entered was published */
+    ret = sa->sa_interval ? sample_run(sa) : 0;
+    plugin_leave();
+    if (ret < 0)
+	return -1;
+    return sample_arm(sa, 0);
+}
+
+/*! Wakeup of the sampler: start queued samples, or exit
+ */
+static int
+sample_pipe_cb(int   fd,
+	       void *arg)
+{
+    struct sample *sa;
+    struct sample *next;
+    char           buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+	;
+    if (sample_exit)
+	return reactor_exit(sample_re);
+    pthread_mutex_lock(&sample_mutex);
+    sa = sample_q;
+    sample_q = NULL;
+    for (next = sa; next; next = next->sa_qnext)
+	next->sa_queued = 0;
+    pthread_mutex_unlock(&sample_mutex);
+    for (; sa; sa = next){
+	next = sa->sa_qnext;
+	if (sa->sa_interval > 0 && !reactor_timer_pending(&sa->sa_timer) &&
+	    sample_arm(sa, 1) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+/*! Sampler thread: run background tests from its own event loop
+ */
+static void *
+sample_thread(void *arg)
+{
+    if (reactor_loop(sample_re) < 0)
+	clicon_log(LOG_WARNING, "%s: background sampling stopped", __FUNCTION__);
+    sample_done = 1;
+    return NULL;
+}
+
+/*! Start the sampler thread
+ * Signals are blocked in the thread, also while it waits, so that they are
+ * delivered to the main thread.
+ */
+static int
+sample_start(void)
+{
+    int               retval = -1;
+    sigset_t          set;
+    sigset_t          oset;
+    int               i;
+    int               ret;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oset);
+    if (pipe(sample_pipe) < 0){
+	clicon_err(OE_UNIX, errno, "pipe");
+	goto done;
+    }
+    for (i=0; i<2; i++)
+	if (fcntl(sample_pipe[i], F_SETFL, O_NONBLOCK) < 0){
+	    clicon_err(OE_UNIX, errno, "fcntl");
+	    goto done;
+	}
+    if ((sample_re = reactor_new()) == NULL) /* Waits with signals blocked */
+	goto done;
+    if (reactor_fd_reg(sample_re, sample_pipe[0], sample_pipe_cb, NULL,
+		       "sample pipe") < 0)
+	goto done;
+    if ((ret = pthread_create(&sampler, NULL, sample_thread, NULL)) != 0){
+	clicon_err(OE_UNIX, ret, "pthread_create");
+	reactor_free(sample_re);
+	sample_re = NULL;
+	goto done;
+    }
+    retval = 0;
+ done:
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+    return retval;
+}
+
+/*! Stop the sampler thread
+ * @retval  0  Stopped, or not started
+ * @retval -1  A test still runs after FANOUT_EXIT_MS, its plugin must not
+ *             be unloaded
+ */
+int
+sample_stop(void)
+{
+    int i;
+
+    if (sample_re == NULL)
+	return 0;
+    sample_exit = 1;
+    if (write(sample_pipe[1], "", 1) < 0 && errno != EAGAIN)
+	clicon_err(OE_UNIX, errno, "write");
+    for (i=0; i<FANOUT_EXIT_MS/10 && !sample_done; i++)
+	usleep(10000);
+    if (!sample_done){
+	clicon_log(LOG_WARNING, "%s: a background test is still running", 
+		   __FUNCTION__);
+	return -1;
+    }
+    pthread_join(sampler, NULL);
+    reactor_free(sample_re);
+    sample_re = NULL;
+    for (i=0; i<2; i++)
+	close(sample_pipe[i]);
+    if (sample_rec)
+	free(sample_rec);
+    sample_rec = NULL;
+    return 0;
+}
+
+/*! Free the samples of a plugin, the sampler must be stopped
+ */
+void
+sample_free(struct sample *sa)
+{
+    struct sample     *next;
+    struct sample_buf *sb;
+
+    for (; sa; sa = next){
+	next = sa->sa_next;
+	while ((sb = sa->sa_buf) != NULL){
+	    sa->sa_buf = sb->sb_next;
+	    free(sb);
+	}
+	if (sa->sa_param)
+	    free(sa->sa_param);
+	free(sa->sa_agekey);
+	free(sa);
+    }
+}
+
+/*! Find the sample of a plugin and param
+ * @param[in]  p      Plugin
+ * @param[in]  param  Param, or NULL
+ * @param[in]  key    Hash of param, see plan_call
+ * @retval     sa     Sample
+ * @retval     NULL   Not sampled
+ */
+static struct sample *
+sample_find(struct plugin *p,
+	    char          *param,
+	    uint64_t       key)
+{
+    struct sample *sa;
+
+    for (sa = p->p_samples; sa; sa = sa->sa_next)
+	if (sa->sa_key == key &&
+	    (param ? (sa->sa_param && strcmp(sa->sa_param, param) == 0) :
+	     sa->sa_param == NULL))
+	    return sa;
+    return NULL;
+}
+
+/*! Add a sample of a plugin, or find it if it exists
+ * Called in the main thread, the only writer of p_samples.
+ */
+static struct sample *
+sample_add(struct plugin *p,
+	   char          *param,
+	   uint64_t       key)
+{
+    struct sample *sa;
+    size_t         len;
+
+    if ((sa = sample_find(p, param, key)) != NULL)
+	return sa;
+    if ((sa = calloc(1, sizeof(*sa))) == NULL){
+	clicon_err(OE_UNIX, errno, "calloc");
+	return NULL;
+    }
+    len = strlen(p->p_name)+strlen("_age")+1;
+    if ((sa->sa_agekey = malloc(len)) == NULL){
+	clicon_err(OE_UNIX, errno, "malloc");
+	free(sa);
+	return NULL;
+    }
+    snprintf(sa->sa_agekey, len, "%s_age", p->p_name);
+    if (param){
+	if ((sa->sa_param = strdup(param)) == NULL){
+	    clicon_err(OE_UNIX, errno, "strdup");
+	    sample_free(sa);
+	    return NULL;
+	}
+    }
+    sa->sa_key = key;
+    sa->sa_plugin = p;
+    sa->sa_next = p->p_samples;
+    __sync_synchronize(); /* Readers see sa complete */
+    p->p_samples = sa;
+    return sa;
+}
+
+/*! Configure background samples from the callhome reply of a sender
+ * Each <sample> in the reply names a plugin, and optionally a param, an 
+ * interval and a jitter in ms:
+ *   <grideye><sample><name>sysinfo</name><interval>1000</interval>
+ *     <jitter>100</jitter></sample>...</grideye>
+ * A sample is run every interval plus a random delay of at most jitter.
+ * Samples asked for by several senders run at the interval of the latest
+ * reply. Interval 0 stops a sample.
+ * Only v3 plugins with a blocking test function are sampled.
+ * @param[in]  xreply  Callhome reply
+ */
+int
+sample_config(cxobj *xreply)
+{
+    int            retval = -1;
+    cxobj        **xvec = NULL;
+    size_t         xlen;
+    cxobj         *x;
+    char          *name;
+    char          *param;
+    struct plugin *p;
+    struct sample *sa;
+    uint64_t       key;
+    int            interval;
+    int            i;
+    int            wake = 0;
+
+    if (xpath_vec(xreply, "grideye/sample", &xvec, &xlen) < 0)
+	goto done;
+    for (i=0; i<xlen; i++){
+	if ((name = xml_body(xpath_first(xvec[i], "name"))) == NULL)
+	    continue;
+	if ((p = plugin_find(name)) == NULL || p->p_api2 ||
+	    p->p_api->gp_test_fn == NULL){
+	    clicon_log(LOG_WARNING, "%s: %s can not be sampled", 
+		       __FUNCTION__, name);
+	    continue;
+	}
+	param = (x = xpath_first(xvec[i], "param")) ? xml_body(x) : NULL;
+	key = param ? plan_hash(param, strlen(param)) : 0;
+	interval = (x = xpath_first(xvec[i], "interval")) && xml_body(x) ?
+	    atoi(xml_body(x)) : 0;
+	if (interval <= 0){ /* Stop */
+	    if ((sa = sample_find(p, param, key)) != NULL)
+		sa->sa_interval = 0;
+	    continue;
+	}
+	if ((sa = sample_add(p, param, key)) == NULL)
+	    goto done;
+	sa->sa_jitter = (x = xpath_first(xvec[i], "jitter")) && xml_body(x) ?
+	    atoi(xml_body(x)) : 0;
+	if (sa->sa_jitter < 0)
+	    sa->sa_jitter = 0;
+	sa->sa_interval = interval;
+	if (sample_re == NULL && sample_start() < 0)
+	    goto done;
+	pthread_mutex_lock(&sample_mutex);
+	if (!sa->sa_queued){
+	    sa->sa_queued = 1;
+	    sa->sa_qnext = sample_q;
+	    sample_q = sa;
+	    wake++;
+	}
+	pthread_mutex_unlock(&sample_mutex);
+    }
+    if (wake && write(sample_pipe[1], "", 1) < 0 && errno != EAGAIN){
+	clicon_err(OE_UNIX, errno, "write");
+	goto done;
+    }
+    retval = 0;
+ done:
+    if (xvec)
+	free(xvec);
+    return retval;
+}
+
+/*! Write the latest background sample of a test with its age in ms
+ * @param[in]  p     Plugin
+ * @param[in]  param Param of test, or NULL
+ * @param[in]  key   Hash of param, see plan_call
+ * @param[in]  rw    Writer of reply
+ * @retval  1  Written
+ * @retval  0  Not sampled, not yet, or stale: run the test
+ * @retval -1  Error
+ * @note Lock-free, called from reflector and worker threads
+ */
+int
+sample_get(struct plugin        *p,
+	   char                 *param,
+	   uint64_t              key,
+	   struct result_writer *rw)
+{
+    struct sample     *sa;
+    struct sample_buf *sb;
+    unsigned           seq;
+    size_t             len;
+    struct timeval     t;
+    struct timeval     dt;
+    char              *copy;
+    int                i;
+    int64_t            age;
+
+    if ((sa = sample_find(p, param, key)) == NULL || sa->sa_interval == 0)
+	return 0;
+    for (i=0; i<SAMPLE_TRIES; i++){
+	if ((seq = sa->sa_seq) == 0)
+	    return 0;
+	if (seq & 1) /* Being written */
+	    continue;
+	__sync_synchronize();
+	sb = sa->sa_buf;
+	len = sa->sa_len;
+	t = sa->sa_time;
+	if (len > sb->sb_size) /* Torn, retried below */
+	    len = sb->sb_size;
+	if ((copy = arena_alloc(rw->rw_arena, len ? len : 1)) == NULL)
+	    return -1;
+	memcpy(copy, sb->sb_data, len);
+	__sync_synchronize();
+	if (sa->sa_seq == seq)
+	    break;
+    }
+    if (i == SAMPLE_TRIES)
+	return 0;
+    dt = gettimestamp();
+    timersub(&dt, &t, &dt);
+    age = (int64_t)dt.tv_sec*1000 + dt.tv_usec/1000;
+    if (age > SAMPLE_STALE*(int64_t)(sa->sa_interval + sa->sa_jitter))
+	return 0;
+    if (sample_replay(rw, copy, len) < 0 ||
+	rw->rw_gw.gw_u64(&rw->rw_gw, sa->sa_agekey, age < 0 ? 0 : age) < 0)
+	return -1;
+    return 1;
+}
+
+/*! Move the background samples of the current plugins to the next generation
+ * Called before it is published, see sample_timer_cb. The samples of a 
+ * plugin that is removed, or can no longer be sampled, are stopped.
+ * @param[in]  old      Current plugins
+ * @param[in]  plugins  Plugins of the next generation
+ */
+void
+sample_move(struct plugin *old,
+	    struct plugin *plugins)
+{
+    struct plugin *q;
+    struct plugin *p;
+    struct sample *sa;
+
+    for (q = old; q->p_api!=NULL; q++){
+	if ((sa = q->p_samples) == NULL)
+	    continue;
+	for (p = plugins; p->p_api!=NULL; p++)
+	    if (strcmp(p->p_name, q->p_name) == 0)
+		break;
+	if (p->p_api && p->p_api2 == NULL && p->p_api->gp_test_fn){
+	    for (; sa; sa = sa->sa_next)
+		sa->sa_plugin = p;
+	    p->p_samples = q->p_samples;
+	}
+	else {
+	    for (;; sa = sa->sa_next){
+		sa->sa_interval = 0;
+		if (sa->sa_next == NULL)
+		    break;
+	    }
+	    sa->sa_next = sample_orphans; /* Freed on exit */
+	    sample_orphans = q->p_samples;
+	}
+	if (!q->p_kept)
+	    q->p_samples = NULL;
+    }
+}
+
+/*! Free the samples of removed plugins, the sampler must be stopped
+ */
+void
+sample_orphans_free(void)
+{
+    sample_free(sample_orphans);
+    sample_orphans = NULL;
+}
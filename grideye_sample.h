@@ -0,0 +1,46 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Background sampler: plugin tests that senders ask to run periodically in
+ * a thread of their own. Data packets get the latest sample instead of
+ * running the test.
+ */
+#ifndef _GRIDEYE_SAMPLE_H_
+#define _GRIDEYE_SAMPLE_H_
+
+/*
+ * Types
+ */
+struct sample;
+
+/*
+ * Prototypes
+ */
+int    sample_test(struct plugin *p, char *param, char **data, size_t *len);
+int    sample_config(cxobj *xreply);
+int    sample_get(struct plugin *p, char *param, uint64_t key,
+		  struct result_writer *rw);
+int    sample_stop(void);
+void   sample_free(struct sample *sa);
+void   sample_orphans_free(void);
+void   sample_move(struct plugin *old, struct plugin *plugins);
+
+#endif /* _GRIDEYE_SAMPLE_H_ */
@@ -0,0 +1,360 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * io_uring ring for the reflector sockets, see grideye_agent -U.
+ * Operations are queued in the submission ring and handed to the kernel
+ * with one io_uring_enter for all of them. Completions are read from the
+ * completion ring without a syscall. The ring fd is readable when there
+ * are completions, so it is waited for in the reactor as any socket.
+ * Completions are posted by the kernel in the thread that submitted them,
+ * which interrupts its epoll_wait or poll with EINTR.
+ * Only the raw system calls are used, liburing is not needed.
+ * Not thread safe: each reflector creates and uses its own ring.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include <cligen/cligen.h>
+#include <clixon/clixon.h>
+
+#include "grideye_uring.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+struct uring{
+    int                  u_fd;
+    void                *u_sqring;     /* mmap:ed submission ring */
+    size_t               u_sqringsz;
+    void                *u_cqring;     /* mmap:ed completion ring */
+    size_t               u_cqringsz;
+    struct io_uring_sqe *u_sqes;       /* mmap:ed submission entries */
+    size_t               u_sqesz;
+    unsigned            *u_sqhead;     /* Consumed by kernel */
+    unsigned            *u_sqtail;     /* Produced by us */
+    unsigned             u_sqmask;
+    unsigned            *u_sqarray;
+    unsigned             u_sqentries;
+    unsigned             u_pending;    /* Queued but not submitted */
+    unsigned            *u_cqhead;     /* Consumed by us */
+    unsigned            *u_cqtail;     /* Produced by kernel */
+    unsigned             u_cqmask;
+    struct io_uring_cqe *u_cqes;
+};
+
+/*! Create an io_uring
+ * @param[in]  entries  Number of submission entries, rounded up to 2^n by
+ *                      the kernel. The completion ring is twice as large.
+ * @retval  u     Ring, free with uring_free
+ * @retval  NULL  Error, eg kernel without io_uring
+ */
+struct uring *
+uring_new(unsigned entries)
+{
+    struct uring          *u;
+    struct io_uring_params p;
+    char                  *sq;
+    char                  *cq;
+
+    if ((u = malloc(sizeof(*u))) == NULL){
+	clicon_err(OE_UNIX, errno, "malloc");
+	return NULL;
+    }
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    if ((u->u_fd = syscall(__NR_io_uring_setup, entries, &p)) < 0){
+	clicon_err(OE_UNIX, errno, "io_uring_setup");
+	free(u);
+	return NULL;
+    }
+    u->u_sqringsz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    u->u_cqringsz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP){ /* Both rings in one map */
+	if (u->u_cqringsz > u->u_sqringsz)
+	    u->u_sqringsz = u->u_cqringsz;
+	u->u_cqringsz = 0;
+    }
+    if ((u->u_sqring = mmap(NULL, u->u_sqringsz, PROT_READ|PROT_WRITE,
+			    MAP_SHARED|MAP_POPULATE, u->u_fd,
+			    IORING_OFF_SQ_RING)) == MAP_FAILED){
+	u->u_sqring = NULL;
+	clicon_err(OE_UNIX, errno, "mmap");
+	goto fail;
+    }
+    if (u->u_cqringsz == 0)
+	u->u_cqring = u->u_sqring;
+    else if ((u->u_cqring = mmap(NULL, u->u_cqringsz, PROT_READ|PROT_WRITE,
+				 MAP_SHARED|MAP_POPULATE, u->u_fd,
+				 IORING_OFF_CQ_RING)) == MAP_FAILED){
+	u->u_cqring = NULL;
+	clicon_err(OE_UNIX, errno, "mmap");
+	goto fail;
+    }
+    u->u_sqesz = p.sq_entries*sizeof(struct io_uring_sqe);
+    if ((u->u_sqes = mmap(NULL, u->u_sqesz, PROT_READ|PROT_WRITE,
+			  MAP_SHARED|MAP_POPULATE, u->u_fd,
+			  IORING_OFF_SQES)) == MAP_FAILED){
+	u->u_sqes = NULL;
+	clicon_err(OE_UNIX, errno, "mmap");
+	goto fail;
+    }
+    sq = u->u_sqring;
+    u->u_sqhead = (unsigned *)(sq + p.sq_off.head);
+    u->u_sqtail = (unsigned *)(sq + p.sq_off.tail);
+    u->u_sqmask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->u_sqarray = (unsigned *)(sq + p.sq_off.array);
+    u->u_sqentries = p.sq_entries;
+    cq = u->u_cqring;
+    u->u_cqhead = (unsigned *)(cq + p.cq_off.head);
+    u->u_cqtail = (unsigned *)(cq + p.cq_off.tail);
+    u->u_cqmask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->u_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return u;
+ fail:
+    uring_free(u);
+    return NULL;
+}
+
+/*! Free an io_uring. Operations in flight are cancelled by the kernel
+ */
+int
+uring_free(struct uring *u)
+{
+    if (u->u_sqes)
+	munmap(u->u_sqes, u->u_sqesz);
+    if (u->u_cqring && u->u_cqring != u->u_sqring)
+	munmap(u->u_cqring, u->u_cqringsz);
+    if (u->u_sqring)
+	munmap(u->u_sqring, u->u_sqringsz);
+    close(u->u_fd);
+    free(u);
+    return 0;
+}
+
+/*! File descriptor of ring, readable when there are completions
+ */
+int
+uring_fd(struct uring *u)
+{
+    return u->u_fd;
+}
+
+/*! Get a free submission entry, submit queued entries if the ring is full
+ * @retval  sqe   Zeroed entry, fill in and queue with uring_publish
+ * @retval  NULL  Error
+ */
+static struct io_uring_sqe *
+uring_sqe(struct uring *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned             tail;
+
+    tail = *u->u_sqtail;
+    if (tail - __atomic_load_n(u->u_sqhead, __ATOMIC_ACQUIRE) >= u->u_sqentries){
+	if (uring_submit(u, 0) < 0)
+	    return NULL;
+	if (tail - __atomic_load_n(u->u_sqhead, __ATOMIC_ACQUIRE) >= u->u_sqentries){
+	    clicon_err(OE_UNIX, EBUSY, "%s: submission ring full", __FUNCTION__);
+	    return NULL;
+	}
+    }
+    sqe = &u->u_sqes[tail & u->u_sqmask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->u_sqarray[tail & u->u_sqmask] = tail & u->u_sqmask;
+    return sqe;
+}
+
+/*! Queue the entry from uring_sqe, it is submitted by uring_submit
+ */
+static void
+uring_publish(struct uring *u)
+{
+    __atomic_store_n(u->u_sqtail, *u->u_sqtail + 1, __ATOMIC_RELEASE);
+    u->u_pending++;
+}
+
+/*! Queue a recvmsg on a socket
+ * @param[in]  u     Ring
+ * @param[in]  fd    Socket
+ * @param[in]  msg   Message header, must be valid until completion
+ * @param[in]  data  User data returned in completion
+ */
+int
+uring_recvmsg(struct uring  *u,
+	      int            fd,
+	      struct msghdr *msg,
+	      uint64_t       data)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_sqe(u)) == NULL)
+	return -1;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->user_data = data;
+    uring_publish(u);
+    return 0;
+}
+
+/*! Queue a sendmsg on a socket
+ * @param[in]  u     Ring
+ * @param[in]  fd    Socket
+ * @param[in]  msg   Message header and data, must be valid until completion
+ * @param[in]  data  User data returned in completion
+ */
+int
+uring_sendmsg(struct uring  *u,
+	      int            fd,
+	      struct msghdr *msg,
+	      uint64_t       data)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_sqe(u)) == NULL)
+	return -1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->user_data = data;
+    uring_publish(u);
+    return 0;
+}
+
+/*! Submit queued operations with one system call
+ * @param[in]  u     Ring
+ * @param[in]  wait  Wait for this many completions
+ * @retval  n   Number of operations submitted
+ * @retval -1   Error
+ */
+int
+uring_submit(struct uring *u,
+	     unsigned      wait)
+{
+    int n;
+
+    if (u->u_pending == 0 && wait == 0)
+	return 0;
+    if ((n = syscall(__NR_io_uring_enter, u->u_fd, u->u_pending, wait,
+		     wait?IORING_ENTER_GETEVENTS:0, NULL, 0)) < 0){
+	switch (errno){
+	case EINTR:
+	case EAGAIN: /* Completion ring full or no memory, try again later */
+	case EBUSY:
+	    return 0;
+	default:
+	    clicon_err(OE_UNIX, errno, "io_uring_enter");
+	    return -1;
+	}
+    }
+    u->u_pending -= n;
+    return n;
+}
+
+/*! Get next completion, if any
+ * @param[in]  u    Ring
+ * @param[out] cqe  Completion
+ * @retval  1  cqe is set
+ * @retval  0  No completion
+ */
+int
+uring_cqe(struct uring     *u,
+	  struct uring_cqe *cqe)
+{
+    unsigned             head = *u->u_cqhead;
+    struct io_uring_cqe *c;
+
+    if (head == __atomic_load_n(u->u_cqtail, __ATOMIC_ACQUIRE))
+	return 0;
+    c = &u->u_cqes[head & u->u_cqmask];
+    cqe->uc_data = c->user_data;
+    cqe->uc_res = c->res;
+    __atomic_store_n(u->u_cqhead, head+1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+struct uring *
+uring_new(unsigned entries)
+{
+    clicon_err(OE_UNIX, ENOSYS, "io_uring not supported on this platform");
+    return NULL;
+}
+
+int
+uring_free(struct uring *u)
+{
+    return 0;
+}
+
+int
+uring_fd(struct uring *u)
+{
+    return -1;
+}
+
+int
+uring_recvmsg(struct uring  *u,
+	      int            fd,
+	      struct msghdr *msg,
+	      uint64_t       data)
+{
+    return -1;
+}
+
+int
+uring_sendmsg(struct uring  *u,
+	      int            fd,
+	      struct msghdr *msg,
+	      uint64_t       data)
+{
+    return -1;
+}
+
+int
+uring_submit(struct uring *u,
+	     unsigned      wait)
+{
+    return -1;
+}
+
+int
+uring_cqe(struct uring     *u,
+	  struct uring_cqe *cqe)
+{
+    return 0;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
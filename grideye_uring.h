@@ -0,0 +1,50 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Minimal io_uring submission/completion ring on the raw system calls,
+ * for socket i/o without one syscall per operation.
+ */
+#ifndef _GRIDEYE_URING_H_
+#define _GRIDEYE_URING_H_
+
+/*
+ * Types
+ */
+struct uring;
+
+/* A completed operation, see uring_cqe */
+struct uring_cqe{
+    uint64_t uc_data;   /* user data of submitted operation */
+    int32_t  uc_res;    /* Result as of the syscall, or -errno */
+};
+
+/*
+ * Prototypes
+ */
+struct uring *uring_new(unsigned entries);
+int  uring_free(struct uring *u);
+int  uring_fd(struct uring *u);
+int  uring_recvmsg(struct uring *u, int fd, struct msghdr *msg, uint64_t data);
+int  uring_sendmsg(struct uring *u, int fd, struct msghdr *msg, uint64_t data);
+int  uring_submit(struct uring *u, unsigned wait);
+int  uring_cqe(struct uring *u, struct uring_cqe *cqe);
+
+#endif /* _GRIDEYE_URING_H_ */
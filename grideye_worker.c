@@ -0,0 +1,697 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Plugin worker threads (-j) and fan-out threads (-J), see grideye_worker.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#include <cligen/cligen.h>     /* cbuf */
+#include <clixon/clixon.h>     /* log, err */
+
+#include "grideye_agent.h"     /* lib */
+#include "grideye_arena.h"     /* lib: per-packet memory */
+#include "grideye_plugin_v3.h" /* plugin C API with writer */
+#include "grideye_agent_int.h"
+#include "grideye_async.h"
+#include "grideye_worker.h"
+
+/*
+ * Constants
+ */
+/* Max number of queued plugin jobs, more are dropped, see -j */
+#define JOBQ_MAX          1024
+
+/*
+ * Types
+ */
+/* Plugin invocations of a data packet, queued for a plugin worker (-j).
+ * The result is sent in a MTYPE_RESULT packet with the same header as the
+ * timestamp-only reply, so that the sender can match them on th_seq0.
+ * Jobs are reused from a free list, see job_get.
+ */
+struct plugin_job{
+    struct plugin_job *j_next;
+    struct reflector  *j_r;       /* Reflector to send result on */
+    struct sockaddr_in j_addr;    /* Sender */
+    struct twoway_hdr  j_th;      /* Header of timestamp reply */
+    char               j_payload[BUFSIZE]; /* Payload of data packet */
+    size_t             j_paylen;
+    int                j_enc;     /* Result encoding ENC_* */
+};
+
+/* A blocking plugin test of a data packet run by a fan-out thread (-J).
+ * The result is written in the arena of the task and copied into the reply
+ * by the waiting thread, see fanout_wait. A test that runs past the deadline
+ * is abandoned and the task is freed by the fan-out thread when it is done.
+ * Tasks are reused from a free list, see fanout_get.
+ */
+struct fanout_task{
+    struct fanout_task *ft_next;    /* Queue or free list */
+    struct fanout      *ft_fo;      /* Waiting data packet, NULL if abandoned */
+    struct plugin      *ft_plugin;
+    char               *ft_param;   /* Copy in ft_arena, or NULL */
+    uint64_t            ft_key;     /* Hash of param, see plan_call */
+    int                 ft_cbor;    /* Result as cbor */
+    struct arena       *ft_arena;   /* Reset when reused */
+    char               *ft_reply;   /* Result, in ft_arena */
+    size_t              ft_len;
+    int                 ft_state;   /* FT_* */
+    struct plugin_gen  *ft_gen;     /* Of ft_plugin, see plugin_pin */
+};
+
+/* States of a fan-out task */
+#define FT_QUEUED  0
+#define FT_RUNNING 1
+#define FT_DONE    2
+#define FT_FAILED  3
+
+/*
+ * Variables
+ */
+static pthread_t *workers = NULL;
+static int      workers_started = 0; /* Created threads of workers */
+int             nworkers = 0;    /* Plugin worker threads, -j */
+/* Plugin job queue, fifo from reflectors to workers */
+static struct plugin_job  *jobq_head = NULL;
+static struct plugin_job **jobq_tail = &jobq_head;
+static int      jobq_len = 0;
+static int      jobq_drops = 0;  /* Jobs dropped since queue was full */
+static struct plugin_job  *jobq_free = NULL; /* Done jobs, for reuse */
+static pthread_mutex_t jobq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  jobq_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t *fanouts = NULL;
+static int      fanouts_started = 0; /* Created threads of fanouts */
+int             nfanouts = 0;    /* Plugin fan-out threads, -J */
+int             fanout_deadline = FANOUT_DEADLINE_DEFAULT; /* ms, -X */
+/* Fan-out task queue, fifo from echo_application to fan-out threads */
+static struct fanout_task  *fanq_head = NULL;
+static struct fanout_task **fanq_tail = &fanq_head;
+static struct fanout_task  *fanq_free = NULL; /* Done tasks, for reuse */
+static pthread_mutex_t fanq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  fanq_cond = PTHREAD_COND_INITIALIZER;
+static int      fanout_busy = 0; /* Fan-out threads running a test */
+
+/*! Get a plugin job from the free list, or allocate one if it is empty
+ * At most JOBQ_MAX jobs are queued, so the free list stops growing and
+ * jobs are then never allocated.
+ */
+static struct plugin_job *
+job_get(void)
+{
+    struct plugin_job *j;
+
+    pthread_mutex_lock(&jobq_mutex);
+    if ((j = jobq_free) != NULL)
+	jobq_free = j->j_next;
+    pthread_mutex_unlock(&jobq_mutex);
+    if (j == NULL && (j = malloc(sizeof(*j))) == NULL){
+	clicon_err(OE_UNIX, errno, "malloc");
+	return NULL;
+    }
+    j->j_next = NULL;
+    return j;
+}
+
+/*! Return a done plugin job to the free list
+ */
+static void
+job_put(struct plugin_job *j)
+{
+    pthread_mutex_lock(&jobq_mutex);
+    j->j_next = jobq_free;
+    jobq_free = j;
+    pthread_mutex_unlock(&jobq_mutex);
+}
+
+/*! Queue plugin invocations of a data packet for a plugin worker
+ * @param[in]  r        Reflector to send result on
+ * @param[in]  from     Sender
+ * @param[in]  th       Header of timestamp reply
+ * @param[in]  payload  Payload of data packet, copied
+ * @param[in]  paylen   Length of payload
+ * @param[in]  enc      Result encoding ENC_*
+ * @retval -1  Fatal error
+ * @retval  0  OK, or queue full and job dropped
+ * @see worker_thread
+ */
+int
+job_enqueue(struct reflector   *r,
+	    struct sockaddr_in *from,
+	    struct twoway_hdr  *th,
+	    char               *payload,
+	    size_t              paylen,
+	    int                 enc)
+{
+    struct plugin_job *j;
+
+    if (jobq_len >= JOBQ_MAX){ /* Unlocked peek, an approximate limit is ok */
+	if (__sync_fetch_and_add(&jobq_drops, 1) == 0)
+	    clicon_log(LOG_WARNING, "%s: plugin job queue full, dropping",
+		       __FUNCTION__);
+	return 0;
+    }
+    if ((j = job_get()) == NULL)
+	return -1;
+    j->j_r = r;
+    memcpy(&j->j_addr, from, sizeof(*from));
+    j->j_th = *th;
+    if (paylen >= sizeof(j->j_payload))
+	paylen = sizeof(j->j_payload)-1;
+    memcpy(j->j_payload, payload, paylen);
+    j->j_payload[paylen] = '\0';
+    j->j_paylen = paylen;
+    j->j_enc = enc;
+    pthread_mutex_lock(&jobq_mutex);
+    *jobq_tail = j;
+    jobq_tail = &j->j_next;
+    jobq_len++;
+    pthread_cond_signal(&jobq_cond);
+    pthread_mutex_unlock(&jobq_mutex);
+    return 0;
+}
+
+/*! Run the plugins of a queued job and send the result to the sender
+ * The result is a twoway packet of type MTYPE_RESULT with the same seq0, 
+ * seq1 and t0-t2 as the timestamp reply, and t3 set to when the plugins
+ * finished.
+ * Errors are logged and the job dropped, a worker never terminates the agent.
+ * @param[in]  j      Plugin job
+ * @param[in]  plans  Plan cache of worker
+ * @param[in]  a      Arena of worker, reset when done
+ */
+static void
+job_run(struct plugin_job *j,
+	struct plan       *plans,
+	struct arena      *a)
+{
+    char              *reply = NULL;
+    struct twoway_hdr  th;
+    size_t             plen;
+    int                ret;
+    struct async_job  *aj = NULL;
+
+    if ((ret = echo_application(hostname, j->j_payload, j->j_paylen, plans, a,
+				j->j_enc, &reply, &plen, &aj)) <= 0){
+	if (ret < 0)
+	    clicon_log(LOG_WARNING, "%s: seq %u: plugin result dropped", 
+		       __FUNCTION__, j->j_th.th_seq0);
+	goto done;
+    }
+    if (aj && async_submit(aj, j->j_r, &j->j_addr, &j->j_th) < 0)
+	clicon_log(LOG_WARNING, "%s: seq %u: plugin result dropped", 
+		   __FUNCTION__, j->j_th.th_seq0);
+    th = j->j_th;
+    th.th_mtype = MTYPE_RESULT;
+    th.th_t3 = gettimestamp();
+    if (result_send(j->j_r, &j->j_addr, &th, reply, plen) < 0)
+	clicon_log(LOG_WARNING, "%s: seq %u: plugin result not sent", 
+		   __FUNCTION__, j->j_th.th_seq0);
+ done:
+    arena_reset(a);
+}
+
+/*! Take the first queued job, with jobq_mutex held
+ */
+static struct plugin_job *
+job_dequeue_locked(void)
+{
+    struct plugin_job *j;
+
+    if ((j = jobq_head) == NULL)
+	return NULL;
+    if ((jobq_head = j->j_next) == NULL)
+	jobq_tail = &jobq_head;
+    jobq_len--;
+    return j;
+}
+
+/*! Run a queued plugin job in the calling thread, if there is one
+ * As a worker thread does but without waiting, for tests of the packet
+ * path, see GRIDEYE_PACKET_TEST.
+ * @param[in]  plans  Plan cache of calling thread
+ * @param[in]  a      Arena of calling thread, reset when done
+ * @retval  0  No job was queued
+ * @retval  1  A job was run
+ */
+int
+job_poll(struct plan  *plans,
+	 struct arena *a)
+{
+    struct plugin_job *j;
+
+    pthread_mutex_lock(&jobq_mutex);
+    j = job_dequeue_locked();
+    pthread_mutex_unlock(&jobq_mutex);
+    if (j == NULL)
+	return 0;
+    job_run(j, plans, a);
+    job_put(j);
+    return 1;
+}
+
+static void
+worker_cleanup(void *arg)
+{
+    pthread_mutex_unlock(&jobq_mutex);
+}
+
+static void
+worker_arena_free(void *arg)
+{
+    arena_free((struct arena *)arg);
+}
+
+static void
+worker_plans_free(void *arg)
+{
+    plans_free((struct plan *)arg);
+}
+
+/*! Plugin worker thread: run queued plugin jobs
+ * Only cancelled while waiting for a job, so a running plugin is completed.
+ * @param[in]  arg   Not used
+ * @see job_enqueue
+ */
+static void *
+worker_thread(void *arg)
+{
+    struct plugin_job *j;
+    struct arena      *a;
+    struct plan       *plans;
+
+    if ((a = arena_new(ARENA_SIZE)) == NULL){
+	clicon_log(LOG_ERR, "plugin worker exited");
+	return NULL;
+    }
+    if ((plans = calloc(PLAN_SLOTS, sizeof(struct plan))) == NULL){
+	arena_free(a);
+	clicon_log(LOG_ERR, "plugin worker exited");
+	return NULL;
+    }
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_cleanup_push(worker_arena_free, a);
+    pthread_cleanup_push(worker_plans_free, plans);
+    for (;;){
+	pthread_mutex_lock(&jobq_mutex);
+	pthread_cleanup_push(worker_cleanup, NULL);
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	while (jobq_head == NULL)
+	    pthread_cond_wait(&jobq_cond, &jobq_mutex);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	j = job_dequeue_locked();
+	pthread_cleanup_pop(1); /* unlock */
+	job_run(j, plans, a);
+	job_put(j);
+    }
+    pthread_cleanup_pop(1);
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+/*! Start plugin worker threads, see -j
+ * Signals are blocked in the workers so that they are delivered to the main
+ * thread.
+ */
+int
+worker_start(void)
+{
+    int               retval = -1;
+    sigset_t          set;
+    sigset_t          oset;
+    int               i;
+    int               ret;
+
+    if ((workers = calloc(nworkers, sizeof(pthread_t))) == NULL){
+	clicon_err(OE_UNIX, errno, "calloc");
+	return -1;
+    }
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oset);
+    for (i=0; i<nworkers; i++)
+	if ((ret = pthread_create(&workers[i], NULL, worker_thread, NULL)) != 0){
+	    clicon_err(OE_UNIX, ret, "pthread_create");
+	    goto done;
+	}
+	else
+	    workers_started++;
+    retval = 0;
+ done:
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+    return retval;
+}
+
+/*! Stop plugin worker threads and free queued jobs
+ * Workers finish a running plugin before they are cancelled.
+ */
+void
+worker_stop(void)
+{
+    struct plugin_job *j;
+    int                i;
+
+    for (i=0; i<workers_started; i++){
+	pthread_cancel(workers[i]);
+	pthread_join(workers[i], NULL);
+    }
+    while ((j = jobq_head) != NULL){
+	jobq_head = j->j_next;
+	free(j);
+    }
+    jobq_tail = &jobq_head;
+    jobq_len = 0;
+    while ((j = jobq_free) != NULL){
+	jobq_free = j->j_next;
+	free(j);
+    }
+    if (workers)
+	free(workers);
+    workers = NULL;
+    workers_started = 0;
+}
+
+/*! Free a fan-out task
+ */
+static void
+fanout_free(struct fanout_task *ft)
+{
+    arena_free(ft->ft_arena);
+    free(ft);
+}
+
+/*! Get a fan-out task from the free list, or allocate one if it is empty
+ * Tasks are only allocated while more tests than before are in flight.
+ */
+static struct fanout_task *
+fanout_get(void)
+{
+    struct fanout_task *ft;
+
+    pthread_mutex_lock(&fanq_mutex);
+    if ((ft = fanq_free) != NULL)
+	fanq_free = ft->ft_next;
+    pthread_mutex_unlock(&fanq_mutex);
+    if (ft != NULL){
+	if (arena_reset(ft->ft_arena) < 0){
+	    fanout_free(ft);
+	    return NULL;
+	}
+    }
+    else {
+	if ((ft = calloc(1, sizeof(*ft))) == NULL){
+	    clicon_err(OE_UNIX, errno, "calloc");
+	    return NULL;
+	}
+	if ((ft->ft_arena = arena_new(ARENA_SIZE)) == NULL){
+	    free(ft);
+	    return NULL;
+	}
+    }
+    ft->ft_next = NULL;
+    return ft;
+}
+
+/*! Return a fan-out task to the free list, with fanq_mutex held
+ */
+static void
+fanout_put_locked(struct fanout_task *ft)
+{
+    ft->ft_fo = NULL;
+    ft->ft_next = fanq_free;
+    fanq_free = ft;
+}
+
+/*! Queue a blocking plugin test of a data packet for a fan-out thread
+ * @param[in]  fo      Fanned out tests of the data packet
+ * @param[in]  p       Plugin, v2 or v3 with gp_test_fn
+ * @param[in]  argstr  Parameter, or NULL. Copied, the plan may be evicted
+ * @param[in]  key     Hash of argstr, see plan_call
+ * @param[in]  cbor    Write result as cbor
+ * @param[in]  pg      Generation of p, in use until fanout_wait
+ * @retval  0  OK
+ * @retval -1  Fatal error
+ * @see fanout_wait
+ */
+int
+fanout_add(struct fanout *fo,
+	   struct plugin *p,
+	   char          *argstr,
+	   uint64_t       key,
+	   int            cbor,
+	   struct plugin_gen *pg)
+{
+    struct fanout_task *ft;
+
+    if ((ft = fanout_get()) == NULL)
+	return -1;
+    ft->ft_plugin = p;
+    ft->ft_gen = pg;
+    ft->ft_key = key;
+    ft->ft_cbor = cbor;
+    ft->ft_reply = NULL;
+    ft->ft_len = 0;
+    ft->ft_param = NULL;
+    if (argstr && (ft->ft_param = arena_strdup(ft->ft_arena, argstr)) == NULL){
+	pthread_mutex_lock(&fanq_mutex);
+	fanout_put_locked(ft);
+	pthread_mutex_unlock(&fanq_mutex);
+	return -1;
+    }
+    ft->ft_state = FT_QUEUED;
+    fo->fo_tasks[fo->fo_ntasks++] = ft;
+    pthread_mutex_lock(&fanq_mutex);
+    ft->ft_fo = fo;
+    fo->fo_running++;
+    *fanq_tail = ft;
+    fanq_tail = &ft->ft_next;
+    pthread_cond_signal(&fanq_cond);
+    pthread_mutex_unlock(&fanq_mutex);
+    return 0;
+}
+
+/*! Wait for the fanned out tests of a data packet until a deadline
+ * Results of done tests are appended to the reply in the order they were
+ * added, after what was written to rw while they ran. A test that is not
+ * done is given a timeout marker with the name of the plugin instead,
+ * eg <timeout>p1</timeout>, and its result is dropped when it is done.
+ * @param[in]  fo        Fanned out tests, none are left on return
+ * @param[in]  rw        Writer of reply
+ * @param[in]  deadline  Max time to wait in ms
+ * @retval  0  OK
+ * @retval -1  Fatal error
+ */
+int
+fanout_wait(struct fanout        *fo,
+	    struct result_writer *rw,
+	    int                   deadline)
+{
+    int                 retval = 0;
+    struct fanout_task *ft;
+    struct fanout_task **ftp;
+    struct plugin      *p;
+    struct timeval      t;
+    struct timeval      dt;
+    struct timespec     ts;
+    int                 ret = 0;
+    int                 i;
+
+    if (fo->fo_ntasks == 0)
+	return 0;
+    t = gettimestamp();
+    dt.tv_sec = deadline/1000;
+    dt.tv_usec = (deadline%1000)*1000;
+    timeradd(&t, &dt, &t);
+    ts.tv_sec = t.tv_sec;
+    ts.tv_nsec = t.tv_usec*1000;
+    pthread_mutex_lock(&fanq_mutex);
+    while (fo->fo_running && ret != ETIMEDOUT)
+	ret = pthread_cond_timedwait(&fo->fo_cond, &fanq_mutex, &ts);
+    for (i=0; i<fo->fo_ntasks; i++){
+	ft = fo->fo_tasks[i];
+	p = ft->ft_plugin;
+	switch (ft->ft_state){
+	case FT_DONE:
+	    if (result_merge(rw, ft->ft_reply, ft->ft_len) < 0)
+		retval = -1;
+	    fanout_put_locked(ft);
+	    continue;
+	case FT_FAILED:
+	    if (ft->ft_len == (size_t)-1) /* v2 fatal error */
+		retval = -1;
+	    fanout_put_locked(ft);
+	    continue;
+	case FT_QUEUED: /* Not started, dequeue */
+	    ftp = &fanq_head;
+	    while (*ftp != ft)
+		ftp = &(*ftp)->ft_next;
+	    if ((*ftp = ft->ft_next) == NULL)
+		fanq_tail = ftp;
+	    fanout_put_locked(ft);
+	    break;
+	case FT_RUNNING: /* Abandon, freed by fan-out thread */
+	    ft->ft_fo = NULL;
+	    break;
+	}
+	clicon_log(LOG_NOTICE, "plugin %s: deadline %d ms passed", 
+		   p->p_name, deadline);
+	if (retval == 0 && rw->rw_gw.gw_str(&rw->rw_gw, "timeout", p->p_name) < 0)
+	    retval = -1;
+    }
+    fo->fo_ntasks = 0;
+    fo->fo_running = 0;
+    pthread_mutex_unlock(&fanq_mutex);
+    return retval;
+}
+
+static void
+fanout_cleanup(void *arg)
+{
+    pthread_mutex_unlock(&fanq_mutex);
+}
+
+/*! Plugin fan-out thread: run queued blocking plugin tests
+ * Only cancelled while waiting for a task, so a running test is completed.
+ * @param[in]  arg   Not used
+ * @see fanout_add
+ */
+static void *
+fanout_thread(void *arg)
+{
+    struct fanout_task  *ft;
+    struct result_writer rw;
+    int                  ret;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    for (;;){
+	pthread_mutex_lock(&fanq_mutex);
+	pthread_cleanup_push(fanout_cleanup, NULL);
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	while (fanq_head == NULL)
+	    pthread_cond_wait(&fanq_cond, &fanq_mutex);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	ft = fanq_head;
+	if ((fanq_head = ft->ft_next) == NULL)
+	    fanq_tail = &fanq_head;
+	ft->ft_state = FT_RUNNING;
+	fanout_busy++;
+	/* Before the waiting thread, which may abandon the task, leaves it */
+	ret = plugin_pin(ft->ft_gen);
+	pthread_cleanup_pop(1); /* unlock */
+	result_init(&rw, ft->ft_arena, &ft->ft_reply, ft->ft_cbor);
+	if (ret == 0){
+	    ret = plugin_call(ft->ft_plugin, ft->ft_param, ft->ft_key, &rw);
+	    plugin_leave();
+	}
+	pthread_mutex_lock(&fanq_mutex);
+	fanout_busy--;
+	ft->ft_len = ret < 0 ? (size_t)-1 : rw.rw_len;
+	ft->ft_state = ret < 1 ? FT_FAILED : FT_DONE;
+	if (ft->ft_fo == NULL)     /* Abandoned by fanout_wait */
+	    fanout_put_locked(ft);
+	else if (--ft->ft_fo->fo_running == 0)
+	    pthread_cond_signal(&ft->ft_fo->fo_cond);
+	pthread_mutex_unlock(&fanq_mutex);
+    }
+    return NULL;
+}
+
+/*! Start plugin fan-out threads, see -J
+ * Signals are blocked in the threads so that they are delivered to the main
+ * thread.
+ */
+int
+fanout_start(void)
+{
+    int               retval = -1;
+    sigset_t          set;
+    sigset_t          oset;
+    int               i;
+    int               ret;
+
+    if ((fanouts = calloc(nfanouts, sizeof(pthread_t))) == NULL){
+	clicon_err(OE_UNIX, errno, "calloc");
+	return -1;
+    }
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oset);
+    for (i=0; i<nfanouts; i++)
+	if ((ret = pthread_create(&fanouts[i], NULL, fanout_thread, NULL)) != 0){
+	    clicon_err(OE_UNIX, ret, "pthread_create");
+	    goto done;
+	}
+	else
+	    fanouts_started++;
+    retval = 0;
+ done:
+    pthread_sigmask(SIG_SETMASK, &oset, NULL);
+    return retval;
+}
+
+/*! Stop plugin fan-out threads
+ * Threads that are done within FANOUT_EXIT_MS are joined. A test that hangs
+ * is left running.
+ * @retval  0  All threads are stopped
+ * @retval -1  A test is still running, its plugin must not be unloaded
+ */
+int
+fanout_stop(void)
+{
+    struct fanout_task *ft;
+    int                 i;
+    int                 busy = 0;
+
+    for (i=0; i<fanouts_started; i++)
+	pthread_cancel(fanouts[i]);
+    for (i=0; i<FANOUT_EXIT_MS/10; i++){
+	pthread_mutex_lock(&fanq_mutex);
+	busy = fanout_busy;
+	pthread_mutex_unlock(&fanq_mutex);
+	if (busy == 0)
+	    break;
+	usleep(10000);
+    }
+    if (busy){
+	clicon_log(LOG_WARNING, "%s: %d plugin tests still running", 
+		   __FUNCTION__, busy);
+	return -1;
+    }
+    for (i=0; i<fanouts_started; i++)
+	pthread_join(fanouts[i], NULL);
+    while ((ft = fanq_free) != NULL){
+	fanq_free = ft->ft_next;
+	fanout_free(ft);
+    }
+    if (fanouts)
+	free(fanouts);
+    fanouts = NULL;
+    fanouts_started = 0;
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Threads that run plugin tests for the reflectors: plugin workers (-j)
+ * run all plugins of a data packet after its timestamp reply is sent, and
+ * fan-out threads (-J) run the blocking tests of one data packet in
+ * parallel until a deadline.
+ */
+#ifndef _GRIDEYE_WORKER_H_
+#define _GRIDEYE_WORKER_H_
+
+/*
+ * Constants
+ */
+/* Max number of plugin worker threads, see -j */
+#define WORKER_MAX        64
+
+/* Max number of plugin fan-out threads, see -J */
+#define FANOUT_MAX        64
+
+/* Default deadline of fanned out plugin tests in ms, see -X */
+#define FANOUT_DEADLINE_DEFAULT 1000
+
+/* How long to wait for fan-out threads on exit, a hung test is left */
+#define FANOUT_EXIT_MS    500
+
+/*
+ * Types
+ */
+struct fanout_task;
+
+/* The fanned out tests of a data packet, on the stack of the thread that
+ * waits for them */
+struct fanout{
+    pthread_cond_t       fo_cond;    /* Signalled when the last is done */
+    int                  fo_running; /* Tasks not done */
+    int                  fo_ntasks;
+    struct fanout_task **fo_tasks;   /* In plan order, in arena of packet */
+};
+
+/*
+ * Variables
+ */
+extern int nworkers;        /* Plugin worker threads, -j */
+extern int nfanouts;        /* Plugin fan-out threads, -J */
+extern int fanout_deadline; /* ms, -X */
+
+/*
+ * Prototypes
+ */
+int    job_enqueue(struct reflector *r, struct sockaddr_in *from,
+		   struct twoway_hdr *th, char *payload, size_t paylen,
+		   int enc);
+int    job_poll(struct plan *plans, struct arena *a);
+int    worker_start(void);
+void   worker_stop(void);
+int    fanout_add(struct fanout *fo, struct plugin *p, char *argstr,
+		  uint64_t key, int cbor, struct plugin_gen *pg);
+int    fanout_wait(struct fanout *fo, struct result_writer *rw, int deadline);
+int    fanout_start(void);
+int    fanout_stop(void);
+
+#endif /* _GRIDEYE_WORKER_H_ */
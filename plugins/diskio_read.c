@@ -2,7 +2,7 @@
  * Precondition: a large file, typically 2*ram size
  * For every test:
  *   - Open the existing file.
- *   - Read 'ior' bytes from a random position using lseek(2)
+ *   - Read 'ior' bytes from a random position using pread(2)
  *   - Close the file
  * compile:
  *   gcc -O2 -Wall -o diskio_read diskio_read.c
@@ -24,7 +24,7 @@
 #include <sys/stat.h>
 #include <sys/param.h>
 
-#include "grideye_plugin_v2.h"
+#include "grideye_plugin_v3.h"
 
 static int debug = 0;
 
@@ -34,18 +34,17 @@ static int64_t _filesize = 0;
 
 /* Forward */
 int diskio_read_exit(void);
-int diskio_read_test(char *instr, char **outstr);
+int diskio_read_test(char *instr, struct grideye_writer *gw);
 int diskio_read_setopt(const char *optname, char *value);
 
 /*
  * This is the API declaration
  */
-static const struct grideye_plugin_api_v2 api = {
-    2,
+static const struct grideye_plugin_api_v3 api = {
+    3,
     GRIDEYE_PLUGIN_MAGIC,
     "diskio_read",    /* plugin name */
     "str",            /* input format */
-    "xml",            /* output format */
     diskio_read_setopt,
     diskio_read_test, /* actual test */
     diskio_read_exit
@@ -61,15 +60,15 @@ diskio_read_exit(void)
 }
 
 /*
- * @param[in]  len      Nr of bytes to read from file
- * @param[out]  t_us  Latency in micro-seconds
+ * @param[in]  instr  Nr of bytes to read from file
+ * @param[in]  gw     Writer of tior: latency in micro-seconds
  */
 int
-diskio_read_test(char     *instr,
-		 char    **outstr)
+diskio_read_test(char                  *instr,
+		 struct grideye_writer *gw)
 {                                                                      
     int      retval = -1;
-    int      fd;
+    int      fd = -1;
     char    *buf = NULL;
     ssize_t  pos;
     off_t    off;
@@ -79,8 +78,6 @@ diskio_read_test(char     *instr,
     struct timeval t1;
     struct timeval dt;  /* t1-t0 */
     uint64_t t_us;
-    char    *str = NULL;
-    size_t   slen;
     int      len;
 
     len = atoi(instr);
@@ -99,27 +96,22 @@ diskio_read_test(char     *instr,
     /* open file and read from it */
     if ((fd = open(_filename, O_RDONLY)) < 0)
 	goto done;
-    if (lseek(fd, off, SEEK_SET) < 0)
-	goto done;
-    if ((pos = read(fd, buf, len)) < 0)
+    if ((pos = pread(fd, buf, len, off)) < 0)
 	goto done;
     if (pos != len)
 	goto done;
     gettimeofday(&t1, NULL);
     timersub(&t1, &t0, &dt);
-    close(fd);
     t_us = dt.tv_usec+dt.tv_sec*1000000;
     if (debug)
       fprintf(stderr, "%s: %s size: %d:%d\n", 
 	      __FUNCTION__, _filename, (int)off, (int)_filesize);
-    if ((slen = snprintf(NULL, 0, "<tior>%" PRIu64 "</tior>", t_us)) <= 0)
+    if (gw->gw_u64(gw, "tior", t_us) < 0)
 	goto done;
-    if ((str = malloc(slen+1)) == NULL)
-	goto done;
-    snprintf(str, slen+1, "<tior>%" PRIu64 "</tior>", t_us);
-    *outstr = str;
     retval = 0;
  done:
+    if (fd != -1)
+	close(fd);
     if (buf)
 	free(buf);
     return retval;
@@ -181,34 +173,41 @@ diskio_read_setopt(const char *optname,
 
 /* Grideye agent plugin init function must be called grideye_plugin_init */
 void *
-grideye_plugin_init_v2(int version)
+grideye_plugin_init_v3(int version)
 {
-    if (version != GRIDEYE_PLUGIN_VERSION)
+    if (version != GRIDEYE_PLUGIN_VERSION_V3)
 	return NULL;
     return (void*)&api;
 }
 
 #ifndef _NOMAIN
+static int
+main_write_u64(struct grideye_writer *gw,
+	       const char            *key,
+	       uint64_t               val)
+{
+    fprintf(stdout, "<%s>%" PRIu64 "</%s>\n", key, val, key);
+    return 0;
+}
+
 int 
 main(int   argc, 
      char *argv[])
 {
-    char          *f;
-    char          *str = NULL;
+    char                 *f;
+    struct grideye_writer gw = {main_write_u64, NULL, NULL, NULL};
 
     if (argc != 3){
 	fprintf(stderr, "usage %s <file> <bytes>\n", argv[0]);
 	return -1;
     }
     f = argv[1];
-    if (grideye_plugin_init_v2(2) == NULL)
+    if (grideye_plugin_init_v3(3) == NULL)
 	return -1;
     if (diskio_read_setopt("largefile", f) < 0)
 	return -1;
-    if (diskio_read_test(argv[2], &str) < 0)
+    if (diskio_read_test(argv[2], &gw) < 0)
 	return -1;
-    fprintf(stdout, "%s\n", str);
-    free(str);
     diskio_read_exit();
     return 0;
 }
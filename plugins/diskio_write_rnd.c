@@ -2,7 +2,7 @@
  * Precondition: a large file, typically 2*ram size
  * For every test:
  *  - Open the existing file.
- *  - Write 'iow' bytes to a random position using lseek to the file.
+ *  - Write 'iow' bytes to a random position using pwrite to the file.
  *  - Close the file.
  * compile:
  *   gcc -O2 -Wall -o diskio_write_rnd diskio_write_rnd.c
@@ -68,7 +68,7 @@ diskio_write_rnd_test(char     *instr,
 		      char    **outstr)
 {
     int      retval = -1;
-    int      fd;
+    int      fd = -1;
     char    *buf = NULL;
     struct timeval t0;
     struct timeval t1;
@@ -101,19 +101,14 @@ diskio_write_rnd_test(char     *instr,
     n = _filesize/len;
     i = random()%n;
     off = i*len;
-    if (lseek(fd, off, SEEK_SET) < 0){
-	fprintf(stderr, "lseek(%s) %s\n", _filename,  strerror(errno));
-	retval = -4;
-	goto done;
-    }
     memset(buf, 0, len);
-    if (write(fd, buf, len) < 0){ 
-	fprintf(stderr, "write(%s) %s\n", _filename,  strerror(errno));
+    if (pwrite(fd, buf, len, off) < 0){ 
+	fprintf(stderr, "pwrite(%s) %s\n", _filename,  strerror(errno));
 	retval = -5;
-	close(fd);
 	goto done;
     }
     close(fd);
+    fd = -1;
     gettimeofday(&t1, NULL);
     timersub(&t1, &t0, &dt);
     t_us = dt.tv_usec+dt.tv_sec*1000000;
@@ -130,6 +125,8 @@ diskio_write_rnd_test(char     *instr,
 
     retval = 0;
  done:
+    if (fd != -1)
+	close(fd);
     if (buf)
 	free(buf);
     return retval;
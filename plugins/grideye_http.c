@@ -14,65 +14,80 @@
 #include <string.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 
-#include "grideye_plugin_v2.h"
+#include "grideye_plugin_v3.h"
 
 #define _PROGRAM "/usr/lib/nagios/plugins/check_http"
 
+/* Kill check_http if it has not finished after this many ms */
+#define HTTP_TIMEOUT_MS 30000
+
+/* A running test, see http_start */
+struct http_state{
+    int            hs_pid;
+    int            hs_fd;          /* stdout of check_http */
+    struct timeval hs_deadline;
+    char           hs_buf[1024];
+    int            hs_len;
+};
+
 /* Forward */
-int http_test(char *instr, char **outstr);
+int http_test(char *instr, struct grideye_writer *gw);
+int http_start(char *instr, void **handle, struct grideye_wait *wt);
+int http_poll(void *handle, struct grideye_wait *wt);
+int http_collect(void *handle, struct grideye_writer *gw);
 
 /*
  * This is the API declaration
  */
-static const struct grideye_plugin_api_v2 api = {
-    2,
+static const struct grideye_plugin_api_v3 api = {
+    3,
     GRIDEYE_PLUGIN_MAGIC,
     "http",
     "str",         /* input format */
-    "xml",         /* output format */
     NULL,
-    http_test,      /* actual test */
-    NULL
+    http_test,      /* actual test, blocking */
+    NULL,
+    http_start,     /* non-blocking test */
+    http_poll,
+    http_collect,
+    5000            /* result cache ms */
 };
 
-/*! Fork and exec a process and read output from stdout
- * @param[out]  buf    Buffer to store output from process
- * @param[in]   buflen Length of buffer
- * @param[in]   ...    Variable argument list
- * @retval -1          Error. Error string in buf
- * @retval  n          Number of bytes read
- * @note Assume that the output (if any) is terminated by a LF/CR, or some other
- * non-printable character which can be replaced with \0 and yield a string
+/*! Fork and exec a process with stdout to a pipe
+ * @param[out]  fdp    Read end of stdout pipe, non-blocking
+ * @param[in]   ...    Variable argument list, NULL terminated
+ * @retval -1          Error
+ * @retval  pid        Process id of child
  */
 static int 
-fork_exec_read(char  *buf,
-	       int    buflen,
-	       ...
-	       )
-
+fork_exec(int  *fdp,
+	  ...
+	  )
 {
     int     retval = -1;
     int     stdin_pipe[2];
     int     stdout_pipe[2];
     int     pid;
-    int     status;
-    int     len;
     va_list ap;
     char   *s;
     int     argc;
-    char  **argv;
+    char  **argv = NULL;
     int     i;
 
     /* Translate from va_list to argv */
-    va_start(ap, buflen);
+    va_start(ap, fdp);
     argc = 0;
     while ((s = va_arg(ap, char *)) != NULL)
 	argc++;
     va_end(ap);
-    va_start(ap, buflen);
+    va_start(ap, fdp);
     if ((argv = calloc(argc+1, sizeof(char*))) == NULL){
 	perror("calloc");
 	goto done;
@@ -97,14 +112,14 @@ fork_exec_read(char  *buf,
 	close(0);
 	if (dup(stdin_pipe[0]) < 0){
 	    perror("dup");
-	    return  -1;
+	    exit(1);
 	}
 	close(stdin_pipe[0]); 
 	close(stdin_pipe[1]); 
 	close(1); 
 	if (dup(stdout_pipe[1]) < 0){
 	    perror("dup");
-	    return  -1;
+	    exit(1);
 	}
 	close(stdout_pipe[1]);  
 	close(stdout_pipe[0]);
@@ -114,89 +129,152 @@ fork_exec_read(char  *buf,
 	}
 	exit(0); /* Not reached */
     }
+    close(stdin_pipe[1]);
     if (pid < 0){
 	perror("fork");
+	close(stdout_pipe[0]);
 	goto done;
     }
-    close(stdin_pipe[1]);
-    if ((len = read(stdout_pipe[0], buf, buflen)) < 0){
-	perror("read");
-	goto done;
-    }
-    if (len>0)
-	buf[len-1] = '\0';
-    close(stdout_pipe[0]);
-    if (waitpid(pid, &status, 0) < 0){
-	perror("waitpid");
-	goto done;
-    }
-    if (status != 0)
-	goto done;
-    retval = len;
+    fcntl(stdout_pipe[0], F_SETFL, O_NONBLOCK);
+    *fdp = stdout_pipe[0];
+    retval = pid;
  done:
+    if (argv)
+	free(argv);
     return retval;
 }
 
+/*! Start Nagios check_http without waiting for it
+ * The agent polls when its output is readable, see http_poll
+ */
+int
+http_start(char                *instr,
+	   void               **handle,
+	   struct grideye_wait *wt)
+{
+    struct http_state *hs;
+    struct timeval     t;
+
+    if (instr == NULL)
+	return -1;
+    if ((hs = calloc(1, sizeof(*hs))) == NULL)
+	return -1;
+    if ((hs->hs_pid = fork_exec(&hs->hs_fd, _PROGRAM, "--ssl", "-H", instr, NULL)) < 0){
+	free(hs);
+	return -1;
+    }
+    gettimeofday(&hs->hs_deadline, NULL);
+    t.tv_sec = HTTP_TIMEOUT_MS/1000;
+    t.tv_usec = (HTTP_TIMEOUT_MS%1000)*1000;
+    timeradd(&hs->hs_deadline, &t, &hs->hs_deadline);
+    wt->wt_fd = hs->hs_fd;
+    wt->wt_ms = HTTP_TIMEOUT_MS;
+    *handle = hs;
+    return 0;
+}
+
+/*! Read output of check_http until it closes stdout, or the time is up
+ */
+int
+http_poll(void                *handle,
+	  struct grideye_wait *wt)
+{
+    struct http_state *hs = handle;
+    struct timeval     t;
+    int                len;
+    int                status;
+
+    while ((len = read(hs->hs_fd, hs->hs_buf+hs->hs_len, 
+		       sizeof(hs->hs_buf)-1-hs->hs_len)) > 0)
+	hs->hs_len += len;
+    if (len < 0 && errno == EAGAIN){
+	gettimeofday(&t, NULL);
+	if (timercmp(&t, &hs->hs_deadline, >=))
+	    return -1;
+	timersub(&hs->hs_deadline, &t, &t);
+	wt->wt_ms = t.tv_sec*1000 + t.tv_usec/1000 + 1;
+	return 0;
+    }
+    /* EOF, error or buffer full */
+    if (waitpid(hs->hs_pid, &status, 0) < 0){
+	perror("waitpid");
+	return -1;
+    }
+    hs->hs_pid = 0;
+    if (len < 0 || status != 0)
+	return -1;
+    if (hs->hs_len > 0)
+	hs->hs_buf[hs->hs_len-1] = '\0';
+    return 1;
+}
 
-/*! Run Nagios check_http plugin
- * @param[out]  outstr  XML string with three parameters described below
+/*! Write the metrics of check_http output and free the test
+ * @param[in]  gw  Writer of the three parameters described below
 
 HTTP OK: HTTP/1.1 200 OK - 518853 bytes in 1.418 second response time |time=1.417916s;;;0.000000 size=518853B;;;0
 
  */
-int  
-http_test(char      *instr,
-	  char     **outstr)
+int
+http_collect(void                  *handle,
+	     struct grideye_writer *gw)
 {
-    int    retval = -1;
-    char   buf[1024] = {0,};
-    int    buflen = sizeof(buf);
-    char   code0[64], code1[64];
-    int    size;
-    double time;
-    char  *str = NULL;
-    size_t slen;
-    char   *host = instr;
-
-    if (fork_exec_read(buf, buflen, _PROGRAM, "--ssl", "-H", host, NULL) < 0){
-	if (strlen(buf))
-	    fprintf(stderr, "%s\n", buf);
-	goto done;
+    struct http_state *hs = handle;
+    int                retval = -1;
+    char               code0[64], code1[64];
+    char               status[70];
+    int                size;
+    double             time;
+
+    if (hs->hs_pid > 0){ /* Aborted */
+	kill(hs->hs_pid, SIGKILL);
+	waitpid(hs->hs_pid, NULL, 0);
     }
-    sscanf(buf, "%*s %*s %*s %s %s %*s %d %*s %*s %lf\n",
-	   code0, code1, &size, &time);
-    if ((slen = snprintf(NULL, 0, 
-			 "<hstatus>\"%s\"</hstatus>"
-			 "<htime>%d</htime>"
-			 "<hsize>%d</hsize>",
-			 code0,
-			 (int)(time*1000),
-			 size)) <= 0)
+    if (gw == NULL)
 	goto done;
-    if ((str = malloc(slen+1)) == NULL)
+    if (sscanf(hs->hs_buf, "%*s %*s %*s %63s %63s %*s %d %*s %*s %lf\n",
+	       code0, code1, &size, &time) != 4)
 	goto done;
-    if ((slen = snprintf(str, slen+1, 
-			 "<hstatus>\"%s\"</hstatus>"
-			 "<htime>%d</htime>"
-			 "<hsize>%d</hsize>",
-			 code0,
-			 (int)(time*1000),
-			 size)) <= 0)
+    snprintf(status, sizeof(status), "\"%s\"", code0);
+    if (gw->gw_str(gw, "hstatus", status) < 0 ||
+	gw->gw_u64(gw, "htime", (uint64_t)(time*1000)) < 0 ||
+	gw->gw_u64(gw, "hsize", size) < 0)
 	goto done;
-    *outstr = str;
     retval = 0;
  done:
+    close(hs->hs_fd);
+    free(hs);
     return retval;
 }
 
+/*! Run Nagios check_http plugin and wait for it
+ */
+int  
+http_test(char                  *instr,
+	  struct grideye_writer *gw)
+{
+    void               *h;
+    struct grideye_wait wt;
+    struct pollfd       pfd;
+    int                 ret;
+
+    if (http_start(instr, &h, &wt) < 0)
+	return -1;
+    do {
+	pfd.fd = wt.wt_fd;
+	pfd.events = POLLIN;
+	poll(&pfd, 1, wt.wt_ms);
+    } while ((ret = http_poll(h, &wt)) == 0);
+    return http_collect(h, ret>0 ? gw : NULL);
+}
+
 /* Grideye agent plugin init function must be called grideye_plugin_init 
  */
 void *
-grideye_plugin_init_v2(int version)
+grideye_plugin_init_v3(int version)
 {
     struct stat st;
 
-    if (version != GRIDEYE_PLUGIN_VERSION)
+    if (version != GRIDEYE_PLUGIN_VERSION_V3)
 	return NULL;
     if (stat(_PROGRAM, &st) < 0){ /* Nagios check program exists? */
 	fprintf(stderr, "stat(%s): %s\n", _PROGRAM, strerror(errno));
@@ -207,23 +285,38 @@ grideye_plugin_init_v2(int version)
 
 
 #ifndef _NOMAIN
+static int
+main_write_u64(struct grideye_writer *gw,
+	       const char            *key,
+	       uint64_t               val)
+{
+    fprintf(stdout, "<%s>%" PRIu64 "</%s>", key, val, key);
+    return 0;
+}
+
+static int
+main_write_str(struct grideye_writer *gw,
+	       const char            *key,
+	       const char            *val)
+{
+    fprintf(stdout, "<%s>%s</%s>", key, val, key);
+    return 0;
+}
+
 int main(int   argc, 
 	 char *argv[]) 
 {
-    char   *str = NULL;
+    struct grideye_writer gw = {main_write_u64, NULL, main_write_str, NULL};
 
     if (argc != 2){
 	fprintf(stderr, "usage %s <host>\n", argv[0]);
 	return -1;
     }
-    if (grideye_plugin_init_v2(2) == NULL)
+    if (grideye_plugin_init_v3(3) == NULL)
 	return -1;
-    if (http_test(argv[1], &str) < 0)
+    if (http_test(argv[1], &gw) < 0)
 	return -1;
-    if (str){
-	fprintf(stdout, "%s\n", str);
-	free(str);
-    }
+    fprintf(stdout, "\n");
     return 0;
 }
 #endif
@@ -30,27 +30,32 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 
-#include "grideye_plugin_v2.h"
+#include "grideye_plugin_v3.h"
 
 static const char *_iwgetprog = "/sbin/iwgetid";
 static char *_device = NULL;
 
 /* Forward */
 int iwget_exit(void);
-int iwget_test(char *instr, char **outstr);
+int iwget_test(char *instr, struct grideye_writer *gw);
 int iwget_setopt(const char *optname, char *value);
 /*
  * This is the API declaration
+ * A test forks iwgetid five times, and the association rarely changes, so
+ * the result is reused for ten seconds.
  */
-static const struct grideye_plugin_api_v2 api = {
-    2,
+static const struct grideye_plugin_api_v3 api = {
+    3,
     GRIDEYE_PLUGIN_MAGIC,
     "iwget",
     NULL,            /* input format */
-    "xml",            /* output format */
     iwget_setopt,
     iwget_test,
-    iwget_exit
+    iwget_exit,
+    NULL,            /* non-blocking test */
+    NULL,
+    NULL,
+    10000            /* result cache ms */
 };
 
 int 
@@ -165,17 +170,17 @@ fork_exec_read(char  *buf,
 /*!
  * @param[in]  p      The string to use (+ offset)
  * @param[in]  offset Added offset on string
+ * @param[in]  keyword Name of parameter
+ * @param[in]  gw     Writer
  * XXX: Why remove and then add double quotes?
  */
 static int
-stringadd(char  *p,
-	  int    offset,
-	  char  *keyword,
-	  char **s0,
-	  int   *s0len)
+stringadd(char                  *p,
+	  int                    offset,
+	  char                  *keyword,
+	  struct grideye_writer *gw)
 {
-    int retval = -1;
-    int slen;
+    char val[256+2];
 
     if (p==NULL)
 	return 0;
@@ -185,22 +190,15 @@ stringadd(char  *p,
     /* Strip optional " if they exists and add them (again) below */
     if (p[strlen(p)-1] == '\"')
 	p[strlen(p)-1] = '\0';
-    slen = strlen(p)+2*strlen(keyword)+5+2; /* 7 is <>""</>  */
-    if ((*s0 = realloc(*s0, *s0len+slen+1)) == NULL){
-	perror("realloc");
-	goto done;
-    }	
     /* Always add double quotes (may have been removed above) */
-    snprintf(*s0+*s0len, slen+1, "<%s>\"%s\"</%s>", keyword, p, keyword);
-    *s0len += slen;
-    retval = 0;
- done:
-    return retval;
+    snprintf(val, sizeof(val), "\"%s\"", p);
+    return gw->gw_str(gw, keyword, val);
 }
 
 /*! Poll /proc wireless file for device status 
- * @param[out]  outstr  XML string with three parameters described below
- * The string contains the following parameters (or possibly a subset):
+ * @param[in]  instr  Not used
+ * @param[in]  gw     Writer of the parameters described below
+ * The parameters (or possibly a subset):
  * iwessid
  * iwaddr
  * iwchan
@@ -208,15 +206,13 @@ stringadd(char  *p,
  * iwproto
  */
 int  
-iwget_test(char  *instr,
-	   char **outstr)
+iwget_test(char                  *instr,
+	   struct grideye_writer *gw)
 {
     int             retval = -1;
     char            buf[256] = {0,};
     int             buflen = sizeof(buf);
     int             len;
-    char           *s0=NULL; /* whole string */
-    int             s0len=0; /* length of whole string */
     char           *p;
 
     /* 
@@ -228,21 +224,21 @@ iwget_test(char  *instr,
 	    fprintf(stderr, "%s\n",buf);
 	goto done;
     }
-    if (len && stringadd(buf, 0, "iwessid", &s0, &s0len) < 0)
+    if (len && stringadd(buf, 0, "iwessid", gw) < 0)
 	goto done;
 
     if ((len = fork_exec_read(buf, buflen, _iwgetprog, _device, "-a", NULL)) < 0){
 	fprintf(stderr, "%s\n", buf);
 	goto done;
     }
-    if (len && stringadd(rindex(buf, ' '), 1, "iwaddr", &s0, &s0len) < 0)
+    if (len && stringadd(rindex(buf, ' '), 1, "iwaddr", gw) < 0)
 	goto done;
 
     if ((len = fork_exec_read(buf, buflen, _iwgetprog, _device, "-c", NULL)) < 0){
 	fprintf(stderr, "%s\n", buf);
 	goto done;
     }
-    if (len && stringadd(rindex(buf, ':'), 1, "iwchan", &s0, &s0len) < 0)
+    if (len && stringadd(rindex(buf, ':'), 1, "iwchan", gw) < 0)
 	goto done;
     
     if ((len = fork_exec_read(buf, buflen, _iwgetprog, _device, "-f", NULL)) < 0){
@@ -252,15 +248,14 @@ iwget_test(char  *instr,
     /* Strange: sometimes ':', sometimes '=' */
     if ((p = rindex(buf, ':')) == NULL)
 	p = rindex(buf, '=');
-    if (len && stringadd(p, 1, "iwfreq", &s0, &s0len) < 0)
+    if (len && stringadd(p, 1, "iwfreq", gw) < 0)
 	goto done;
     if ((len =  fork_exec_read(buf, buflen, _iwgetprog, _device, "-p", NULL)) < 0){
 	fprintf(stderr, "%s\n", buf);
 	goto done;
     }
-    if (len && stringadd(rindex(buf, ':'), 1, "iwproto", &s0, &s0len) < 0)
+    if (len && stringadd(rindex(buf, ':'), 1, "iwproto", gw) < 0)
 	goto done;
-    *outstr = s0;
     retval = 0;
  done:
     return retval;
@@ -290,11 +285,11 @@ iwget_setopt(const char *optname,
 
 /* Grideye agent plugin init function must be called grideye_plugin_init */
 void *
-grideye_plugin_init_v2(int version)
+grideye_plugin_init_v3(int version)
 {
     struct stat st;
 
-    if (version != GRIDEYE_PLUGIN_VERSION)
+    if (version != GRIDEYE_PLUGIN_VERSION_V3)
 	return NULL;
     if (stat(_iwgetprog, &st) < 0)
 	return NULL;
@@ -302,20 +297,26 @@ grideye_plugin_init_v2(int version)
 }
 
 #ifndef _NOMAIN
+static int
+main_write_str(struct grideye_writer *gw,
+	       const char            *key,
+	       const char            *val)
+{
+    fprintf(stdout, "<%s>%s</%s>", key, val, key);
+    return 0;
+}
+
 int main() 
 {
-    char   *str = NULL;
+    struct grideye_writer gw = {NULL, NULL, main_write_str, NULL};
 
-    if (grideye_plugin_init_v2(2) == NULL)
+    if (grideye_plugin_init_v3(3) == NULL)
 	return -1;
     if (iwget_setopt("device", "wlan0") < 0)
 	return -1;
-    if (iwget_test(NULL, &str) < 0)
+    if (iwget_test(NULL, &gw) < 0)
 	return -1;
-    if (str){
-	fprintf(stdout, "%s\n", str);
-	free(str);
-    }
+    fprintf(stdout, "\n");
     iwget_exit();
     return 0;
 }
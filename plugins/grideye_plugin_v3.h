@@ -0,0 +1,168 @@
+/*
+  Copyright (C) 2015-2017 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+
+  This include file defines the v3 API of a GRIDEYE plugin.
+  The grideye_agent dynamically links and loads any plugin that is found
+  in the plugin directory (typically /usr/local/lib/grideye).
+  In v3 the test function does not return a string. Instead the agent
+  passes a writer and the plugin emits its metrics as typed fields, which
+  the agent encodes directly into the reply. v2 plugins are still loaded.
+
+  The copyright of a plugin is the author's own.
+  The author may set any license he/she wishes.
+  The act of loading a plugin with grideye_agent does not affect the
+  copyright of the plugin, nor its license
+  Likewise, the loading of a plugin does not affect the ownership or license
+  of the grideye_agent which is stated at the top of thsi file.
+*/
+#ifndef _GRIDEYE_PLUGIN_V3_H_
+#define _GRIDEYE_PLUGIN_V3_H_
+
+#include <stdint.h>
+
+/* Version of grideye plugin. */
+#define GRIDEYE_PLUGIN_VERSION_V3 3
+
+/* Name of plugin init function (must be called this) */
+#define PLUGIN_INIT_FN_V3 "grideye_plugin_init_v3"
+
+#ifndef GRIDEYE_PLUGIN_MAGIC /* Same as v2, see grideye_plugin_v2.h */
+/* Version of grideye plugin. */
+#define GRIDEYE_PLUGIN_MAGIC 0x3f687f03
+
+/* Type of plugin init function */
+typedef void * (grideye_plugin_init_t)(int version);
+
+/* Type of plugin exit function */
+typedef int (grideye_plugin_exit_t)(void);
+
+/* Type of plugin generic setopt function */
+typedef int (grideye_plugin_setopt_t)(const char *optname, char *value);
+#endif
+
+/* Output writer, passed by the agent to the test function.
+ * Keys are names of metrics in the grideye YANG model, eg "tior".
+ * A write function returns -1 on error, then the test function should
+ * return -1. Nothing written is then sent.
+ * Example:
+ *    gw->gw_u64(gw, "tior", t_us);
+ *    gw->gw_dec(gw, "load", 153, 2);   gives 1.53
+ *    gw->gw_str(gw, "hstatus", "200 OK");
+ */
+struct grideye_writer;
+
+/* Write an unsigned integer */
+typedef int (grideye_write_u64_t)(struct grideye_writer *gw, const char *key,
+				  uint64_t val);
+/* Write a decimal number val * 10^-fd, cf YANG decimal64 fraction-digits */
+typedef int (grideye_write_dec_t)(struct grideye_writer *gw, const char *key,
+				  int64_t val, int fd);
+/* Write a string, it is escaped by the agent */
+typedef int (grideye_write_str_t)(struct grideye_writer *gw, const char *key,
+				  const char *val);
+
+struct grideye_writer{
+    grideye_write_u64_t *gw_u64;
+    grideye_write_dec_t *gw_dec;
+    grideye_write_str_t *gw_str;
+    void                *gw_arg;   /* Agent state, not for plugin */
+};
+
+/* Type of plugin test function
+ * @param[in]  instr  Input parameter, or NULL
+ * @param[in]  gw     Writer of output fields
+ * @retval  0  OK
+ * @retval -1  Test failed
+ */
+typedef int (grideye_plugin_test_v3_t)(char *instr, struct grideye_writer *gw);
+
+/* What a started test waits for, see gp_start_fn. The agent polls the test
+ * when wt_fd is readable or wt_ms milliseconds have passed, whichever is
+ * first. Set wt_fd to -1 to only wait for the time, and wt_ms to 0 to only
+ * wait for the fd. If neither is set, the test is polled at once.
+ * The fd must stay open until collect.
+ */
+struct grideye_wait{
+    int wt_fd;
+    int wt_ms;
+};
+
+/* Type of plugin start function: start a test without waiting for it
+ * @param[in]  instr   Input parameter, or NULL
+ * @param[out] handle  State of the test, passed to poll and collect
+ * @param[out] wt      What to wait for before polling
+ * @retval  0  Started, collect will be called
+ * @retval -1  Test failed
+ */
+typedef int (grideye_plugin_start_t)(char *instr, void **handle,
+				     struct grideye_wait *wt);
+
+/* Type of plugin poll function: continue a started test, do not block
+ * @param[in]     handle  State of the test
+ * @param[in,out] wt      What to wait for before polling again
+ * @retval  1  Done, collect the result
+ * @retval  0  Not done, poll again as given by wt
+ * @retval -1  Test failed
+ */
+typedef int (grideye_plugin_poll_t)(void *handle, struct grideye_wait *wt);
+
+/* Type of plugin collect function: write the result and free the test
+ * Called once for each started test, with gw NULL if it failed or was
+ * aborted by the agent.
+ * @param[in]  handle  State of the test
+ * @param[in]  gw      Writer of output fields, or NULL
+ * @retval  0  OK
+ * @retval -1  Error
+ */
+typedef int (grideye_plugin_collect_t)(void *handle, struct grideye_writer *gw);
+
+/* grideye agent plugin init struct for the api
+ * Note: Implicit init function, see PLUGIN_INIT_FN_V3
+ * A plugin with long running tests sets gp_start_fn, gp_poll_fn and
+ * gp_collect_fn. The agent then starts the test when a data packet requests
+ * it and polls it from its event loop, so that many tests can be in flight
+ * at once. Start may be called from any reflector thread, poll and collect
+ * are called from the main thread. gp_test_fn is then not used by the agent.
+ * A plugin whose result changes slowly, eg a sample of system state, sets
+ * gp_cache_ms. The agent then keeps the result of a test per input parameter
+ * and gives it to requests within gp_cache_ms of the test instead of running
+ * it again. The sample time is sent with the result as <name>_tsample.
+ */
+struct grideye_plugin_api_v3{
+    /* Version. Should be 3 */
+    int                       gp_version;
+    int                       gp_magic;
+    /* Plugin name */
+    char                     *gp_name;
+    /* test input format: str, xml, json */
+    char                     *gp_input_format;
+    /* Generic setopt function */
+    grideye_plugin_setopt_t  *gp_setopt_fn;
+    /* Test function, output written with gw */
+    grideye_plugin_test_v3_t *gp_test_fn;
+    grideye_plugin_exit_t    *gp_exit_fn;
+    /* Non-blocking test, optional */
+    grideye_plugin_start_t   *gp_start_fn;
+    grideye_plugin_poll_t    *gp_poll_fn;
+    grideye_plugin_collect_t *gp_collect_fn;
+    /* Result may be reused for this many ms, 0: run the test every time */
+    int                       gp_cache_ms;
+};
+
+#endif /* _GRIDEYE_PLUGIN_V3_H_ */
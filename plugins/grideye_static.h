@@ -0,0 +1,44 @@
+/*
+  Copyright (C) 2015-2016 Olof Hagsand
+
+  This file is part of GRIDEYE.
+
+  GRIDEYE is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 3 of the License, or
+  (at your option) any later version.
+
+  GRIDEYE is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with GRIDEYE; see the file LICENSE.  If not, see
+  <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Plugins linked into grideye_agent_static instead of loaded with dlopen.
+ * The table is generated by make static in this directory, where the init
+ * function of each plugin is renamed grideye_plugin_init_v<version>_<name>.
+ */
+#ifndef _GRIDEYE_STATIC_H_
+#define _GRIDEYE_STATIC_H_
+
+/*
+ * Types
+ */
+struct grideye_static_plugin{
+    char  *gs_name;           /* As its .so.1 file, eg grideye_sysinfo */
+    int    gs_version;        /* Of init function, 2 or 3 */
+    void *(*gs_init)(int version); /* Init function */
+};
+
+/*
+ * Variables
+ */
+/* Null-terminated, generated in grideye_static.c */
+extern struct grideye_static_plugin grideye_static_plugins[];
+
+#endif  /* _GRIDEYE_STATIC_H_ */
@@ -16,108 +16,68 @@
 #include <errno.h>
 #include <sys/sysinfo.h>
 
-#include "grideye_plugin_v2.h"
+#include "grideye_plugin_v3.h"
 
 #define LINUX_SYSINFO_LOADS_SCALE (65536)
 #define PERCENT (100)
 #define DEC_3 (1000)
 
 /* Forward */
-int  sysinfo_test(char *instr, char **outstr);
+int  sysinfo_test(char *instr, struct grideye_writer *gw);
 
 /*
  * This is the API declaration
+ * System state changes slowly, a sample is reused for a second.
  */
-static const struct grideye_plugin_api_v2 api = {
-    2,
+static const struct grideye_plugin_api_v3 api = {
+    3,
     GRIDEYE_PLUGIN_MAGIC,
     "sysinfo",
-    NULL,         /* input format */
-    "xml",         /* output format */
+    NULL,          /* input format */
     NULL,
     sysinfo_test,  /* actual test */
-    NULL
+    NULL,
+    NULL,          /* non-blocking test */
+    NULL,
+    NULL,
+    1000           /* result cache ms */
 };
 
 /*! Poll sysinfo command for system status
- * @param[out]  outstr  XML string with three parameters described below
- * The string contains the following parameters (or possibly a subset):
- * iwessid
- * iwaddr
- * iwchan
- * iwfreq
- * iwproto
+ * @param[in]  instr  Not used
+ * @param[in]  gw     Writer of the following parameters:
+ * uptime
+ * loads     1 minute load average, decimal with 3 fraction-digits
+ * freeram
+ * usedram
+ * bufferram
+ * procs
+ * freeswap
+ * usedswap
  */
 int  
-sysinfo_test(char      *instr,
-	     char     **outstr)
+sysinfo_test(char                  *instr,
+	     struct grideye_writer *gw)
 {
     int             retval = -1;
     struct sysinfo  info;
-    unsigned long   uptime;
-    unsigned long   loads;
-    unsigned long   freeram;
-    unsigned long   usedram;
-    unsigned long   bufferram;
-    unsigned long   procs;
-    unsigned long   freeswap;
-    unsigned long   usedswap;
-    int             memunit;
-    char           *str = NULL;
-    size_t          slen;
+    uint64_t        memunit;
 
     if (sysinfo(&info) < 0){
 	perror("sysinfo");
 	goto done;
     }
     memunit = info.mem_unit;
-    uptime = info.uptime;
-    loads = ((info.loads[0]*PERCENT*DEC_3)/LINUX_SYSINFO_LOADS_SCALE);
-    freeram = info.freeram*memunit;
-    usedram = info.totalram*memunit - info.freeram*memunit;
-    bufferram = info.bufferram*memunit;
-    procs = info.procs;
-    freeswap = info.freeswap*memunit;
-    usedswap = info.totalswap*memunit - info.freeswap*memunit;
-    
-    if ((slen = snprintf(NULL, 0,
-			 "<uptime>%lu</uptime>"
-			 "<loads>%lu.%lu</loads>"
-			 "<freeram>%lu</freeram>"
-			 "<usedram>%lu</usedram>"
-			 "<bufferram>%lu</bufferram>"
-			 "<procs>%lu</procs>"
-			 "<freeswap>%lu</freeswap>"
-			 "<usedswap>%lu</usedswap>", 
-			 uptime,
-			 loads/DEC_3, loads%DEC_3,
-			 freeram,
-			 usedram,
-			 bufferram,
-			 procs,
-			 freeswap,
-			 usedswap)) <= 0)
-	goto done;
-    if ((str = malloc(slen+1)) == NULL)
+    if (gw->gw_u64(gw, "uptime", info.uptime) < 0 ||
+	gw->gw_dec(gw, "loads",
+		   (info.loads[0]*PERCENT*DEC_3)/LINUX_SYSINFO_LOADS_SCALE, 3) < 0 ||
+	gw->gw_u64(gw, "freeram", info.freeram*memunit) < 0 ||
+	gw->gw_u64(gw, "usedram", (info.totalram-info.freeram)*memunit) < 0 ||
+	gw->gw_u64(gw, "bufferram", info.bufferram*memunit) < 0 ||
+	gw->gw_u64(gw, "procs", info.procs) < 0 ||
+	gw->gw_u64(gw, "freeswap", info.freeswap*memunit) < 0 ||
+	gw->gw_u64(gw, "usedswap", (info.totalswap-info.freeswap)*memunit) < 0)
 	goto done;
-    snprintf(str, slen+1, 
-	     "<uptime>%lu</uptime>"
-	     "<loads>%lu.%lu</loads>"
-	     "<freeram>%lu</freeram>"
-	     "<usedram>%lu</usedram>"
-	     "<bufferram>%lu</bufferram>"
-	     "<procs>%lu</procs>"
-	     "<freeswap>%lu</freeswap>"
-	     "<usedswap>%lu</usedswap>", 
-	     uptime,
-	     loads/DEC_3, loads%DEC_3,
-	     freeram,
-	     usedram,
-	     bufferram,
-	     procs,
-	     freeswap,
-	     usedswap);
-    *outstr = str;
     retval = 0;
  done:
     return retval;
@@ -125,9 +85,9 @@ sysinfo_test(char      *instr,
 
 /* Grideye agent plugin init function must be called grideye_plugin_init */
 void *
-grideye_plugin_init_v2(int version)
+grideye_plugin_init_v3(int version)
 {
-    if (version != GRIDEYE_PLUGIN_VERSION)
+    if (version != GRIDEYE_PLUGIN_VERSION_V3)
 	return NULL;
     return (void*)&api;
 }
@@ -135,18 +95,40 @@ grideye_plugin_init_v2(int version)
 
 
 #ifndef _NOMAIN
+static int
+main_write_u64(struct grideye_writer *gw,
+	       const char            *key,
+	       uint64_t               val)
+{
+    fprintf(stdout, "<%s>%" PRIu64 "</%s>", key, val, key);
+    return 0;
+}
+
+static int
+main_write_dec(struct grideye_writer *gw,
+	       const char            *key,
+	       int64_t                val,
+	       int                    fd)
+{
+    int64_t scale = 1;
+    int     i;
+
+    for (i=0; i<fd; i++)
+	scale *= 10;
+    fprintf(stdout, "<%s>%" PRId64 ".%0*" PRId64 "</%s>", 
+	    key, val/scale, fd, val%scale, key);
+    return 0;
+}
+
 int main() 
 {
-    char   *str = NULL;
+    struct grideye_writer gw = {main_write_u64, main_write_dec, NULL, NULL};
 
-    if (grideye_plugin_init_v2(2) == NULL)
+    if (grideye_plugin_init_v3(3) == NULL)
 	return -1;
-    if (sysinfo_test(0, &str) < 0)
+    if (sysinfo_test(NULL, &gw) < 0)
 	return -1;
-    if (str){
-	fprintf(stdout, "%s\n", str);
-	free(str);
-    }
+    fprintf(stdout, "\n");
     return 0;
 }
 #endif
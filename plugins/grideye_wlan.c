@@ -20,28 +20,32 @@
 #include <math.h>
 #include <sys/stat.h>
 
-#include "grideye_plugin_v2.h"
+#include "grideye_plugin_v3.h"
 
 static const char *_filename = "/proc/net/wireless";
 static char *_device = NULL;
 
 /* Forward */
 int wlan_exit(void);
-int wlan_test(char *instr, char **outstr);
+int wlan_test(char *instr, struct grideye_writer *gw);
 int wlan_setopt(const char *optname, char *value);
 
 /*
  * This is the API declaration
+ * The kernel updates link quality about once a second, so is the result.
  */
-static const struct grideye_plugin_api_v2 api = {
-    2,
+static const struct grideye_plugin_api_v3 api = {
+    3,
     GRIDEYE_PLUGIN_MAGIC,
     "wlan",
     NULL,            /* input format */
-    "xml",            /* output format */
     wlan_setopt,
     wlan_test,
-    wlan_exit
+    wlan_exit,
+    NULL,            /* non-blocking test */
+    NULL,
+    NULL,
+    1000             /* result cache ms */
 };
 
 int 
@@ -55,15 +59,17 @@ wlan_exit(void)
 }
 
 /*! Poll /proc wireless file for device status 
- * @param[out]  outstr  XML string with three parameters described below
- * The three parameters:
- *  q_link  Wireless link quality decimal64 with three decimals (3 fraction-digits)
- *  q_level Wireless signal level
- *  q_noise Wireless noise level
+ * @param[in]  instr  Not used
+ * @param[in]  gw     Writer of the parameters described below
+ * The parameters:
+ *  wlink   Wireless link quality decimal64 with three decimals (3 fraction-digits)
+ *  wlevel  Wireless signal level
+ *  wnoise  Wireless noise level
+ *  wretry  Wireless retries, decimal64 with 1 fraction-digit
  */
 int  
-wlan_test(char     *instr,
-	  char    **outstr)
+wlan_test(char                  *instr,
+	  struct grideye_writer *gw)
 {
     int             retval = -1;
     FILE           *f = NULL;
@@ -72,11 +78,6 @@ wlan_test(char     *instr,
     char           *s;
     double          qlk, qlv, qn;
     uint32_t        qrt;
-    int64_t         q0;
-    int64_t         q1;
-    int64_t         q2;
-    char           *str = NULL;
-    size_t          slen;
 
     if ((f = fopen(_filename, "r")) == NULL)
 	goto done;
@@ -87,31 +88,11 @@ wlan_test(char     *instr,
         if (sscanf(s, "%*d %lf %lf %lf %*d %*d %*d %u", 
 		   &qlk, &qlv, &qn, &qrt) != 4)
 	    break;
-	q0 = (uint64_t)round(qlk*1000);
-	q1 = (uint64_t)round(qlv*1000);
-	q2 = (uint64_t)round(qn*1000);
-	if ((slen = snprintf(NULL, 0, 
-			       "<wlink>%" PRId64 ".%" PRId64 "</wlink>"
-			       "<wlevel>%" PRId64 ".%" PRId64 "</wlevel>"
-			       "<wnoise>%" PRId64 ".%" PRId64 "</wnoise>"
-			       "<wretry>%u.0</wretry>",
-			       q0/1000, q0%1000,
-			       q1/1000, q1%1000,
-			       q2/1000, q2%1000,
-			       qrt)) <= 0)
+	if (gw->gw_dec(gw, "wlink", (int64_t)round(qlk*1000), 3) < 0 ||
+	    gw->gw_dec(gw, "wlevel", (int64_t)round(qlv*1000), 3) < 0 ||
+	    gw->gw_dec(gw, "wnoise", (int64_t)round(qn*1000), 3) < 0 ||
+	    gw->gw_dec(gw, "wretry", (int64_t)qrt*10, 1) < 0)
 	    goto done;
-	if ((str = malloc(slen+1)) == NULL)
-	    goto done;
-	snprintf(str, slen+1, 
-		 "<wlink>%" PRId64 ".%" PRId64 "</wlink>"
-		 "<wlevel>%" PRId64 ".%" PRId64 "</wlevel>"
-		 "<wnoise>%" PRId64 ".%" PRId64 "</wnoise>"
-		 "<wretry>%u.0</wretry>",
-		 q0/1000, q0%1000,
-		 q1/1000, q1%1000,
-		 q2/1000, q2%1000,
-		 qrt);
-	*outstr = str;
 	break;
     }
     retval = 0;
@@ -146,11 +127,11 @@ wlan_setopt(const char *optname,
 
 /* Grideye agent plugin init function must be called grideye_plugin_init */
 void *
-grideye_plugin_init_v2(int version)
+grideye_plugin_init_v3(int version)
 {
     struct stat st;
 
-    if (version != GRIDEYE_PLUGIN_VERSION)
+    if (version != GRIDEYE_PLUGIN_VERSION_V3)
 	return NULL;
     if (stat(_filename, &st) < 0)
 	return NULL;
@@ -158,20 +139,33 @@ grideye_plugin_init_v2(int version)
 }
 
 #ifndef _NOMAIN
+static int
+main_write_dec(struct grideye_writer *gw,
+	       const char            *key,
+	       int64_t                val,
+	       int                    fd)
+{
+    int64_t scale = 1;
+    int     i;
+
+    for (i=0; i<fd; i++)
+	scale *= 10;
+    fprintf(stdout, "<%s>%" PRId64 ".%0*" PRId64 "</%s>", 
+	    key, val/scale, fd, (int64_t)llabs(val%scale), key);
+    return 0;
+}
+
 int main() 
 {
-    char   *str = NULL;
+    struct grideye_writer gw = {NULL, main_write_dec, NULL, NULL};
 
-    if (grideye_plugin_init_v2(2) == NULL)
+    if (grideye_plugin_init_v3(3) == NULL)
 	return -1;
-    if (wlan_file(NULL, NULL, "wlan0") < 0)
+    if (wlan_setopt("device", "wlan0") < 0)
 	return -1;
-    if (wlan_test(0, &str) < 0)
+    if (wlan_test(NULL, &gw) < 0)
 	return -1;
-    if (str){
-	fprintf(stdout, "%s\n", str);
-	free(str);
-    }
+    fprintf(stdout, "\n");
     wlan_exit();
     return 0;
 }
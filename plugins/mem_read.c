@@ -122,8 +122,6 @@ int main()
 	return -1;
     fprintf(stdout, "%s\n", str);
     free(str);
-    if (mem_read_exit() < 0)
-	return -1;
     return 0;
 }
 #endif